@@ -243,6 +243,35 @@ void display_op(OpCode op, std::ostream &o) {
     case OpCode::Pop:
       o << "pop";
       break;
+    case OpCode::VLd1:
+      o << "vld1";
+      break;
+    case OpCode::VSt1:
+      o << "vst1";
+      break;
+    case OpCode::VAdd:
+      o << "vadd";
+      break;
+    case OpCode::VSub:
+      o << "vsub";
+      break;
+    case OpCode::VMul:
+      o << "vmul";
+      break;
+    case OpCode::VMla:
+      o << "vmla";
+      break;
+    case OpCode::VPAdd:
+      o << "vpadd";
+      break;
+    case OpCode::VDup:
+      o << "vdup";
+      break;
+    case OpCode::VMov:
+    case OpCode::VMovImm:
+    case OpCode::VMovLane:
+      o << "vmov";
+      break;
     case OpCode::_Label:
       // Labels are pseudo-instructions
       break;
@@ -575,6 +604,58 @@ void PushPopInst::display(std::ostream &o) const {
   o << "}";
 }
 
+void NeonInst::display(std::ostream &o) const {
+  display_op(op, o);
+  switch (op) {
+    case OpCode::VLd1:
+    case OpCode::VSt1:
+    case OpCode::VDup:
+    case OpCode::VMovLane:
+      o << ".32";
+      break;
+    case OpCode::VMov:
+      break;
+    default:
+      o << ".i32";
+      break;
+  }
+  display_cond(cond, o);
+  o << " ";
+  switch (op) {
+    case OpCode::VLd1:
+    case OpCode::VSt1: {
+      // Quad register qN is the double register pair d2N, d2N+1
+      auto d = 2 * register_num(rd);
+      o << "{d" << d << "-d" << d + 1 << "}, [";
+      display_reg_name(o, r1);
+      o << "]";
+    } break;
+    case OpCode::VDup:
+    case OpCode::VMov:
+      display_reg_name(o, rd);
+      o << ", ";
+      display_reg_name(o, r1);
+      break;
+    case OpCode::VMovImm:
+      display_reg_name(o, rd);
+      o << ", #" << imm;
+      break;
+    case OpCode::VMovLane:
+      display_reg_name(o, rd);
+      o << ", ";
+      display_reg_name(o, r1);
+      o << "[" << imm << "]";
+      break;
+    default:
+      display_reg_name(o, rd);
+      o << ", ";
+      display_reg_name(o, r1);
+      o << ", ";
+      display_reg_name(o, r2);
+      break;
+  }
+}
+
 void LabelInst::display(std::ostream &o) const { o << label << ":"; }
 
 #define ctrl_inst_display_type(v, ty)              \
@@ -622,7 +703,7 @@ void Function::display(std::ostream &o) const {
     if (i == nullptr) {
       o << "!!!nullptr!!!" << std::endl;
       continue;
-    } else if (dynamic_cast<LabelInst *>(&*i) == nullptr) {
+    } else if (i->kind != InstKind::Label) {
       o << "\t";
     }
     o << *i << std::endl;
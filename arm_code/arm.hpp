@@ -51,6 +51,11 @@ const uint32_t REG_V_QUAD_START = 3 << 30;
 
 const std::vector<Reg> TEMP_REGS = {0, 1, 2, 3, 12, REG_LR};
 const std::vector<Reg> GLOB_REGS = {4, 5, 6, 7, 8, 9, 10};
+/// Quad registers handed out to vector variables; q4-q7 are callee-saved and
+/// q15 is kept as scratch
+const std::vector<Reg> VECTOR_REGS = {48, 49, 50, 51, 56, 57,
+                                      58, 59, 60, 61, 62};
+const Reg REG_VECTOR_SCRATCH = 63;
 
 inline bool is_virtual_register(Reg r) { return r >= 64; }
 RegisterKind register_type(Reg r);
@@ -296,6 +301,31 @@ enum class OpCode {
   // Pop
   Pop,
 
+  // NEON, on 32-bit integer lanes
+
+  // Load a quad register
+  VLd1,
+  // Store a quad register
+  VSt1,
+  // Vector add
+  VAdd,
+  // Vector subtract
+  VSub,
+  // Vector multiply
+  VMul,
+  // Vector multiply and accumulate
+  VMla,
+  // Pairwise add of double registers
+  VPAdd,
+  // Duplicate a core register into every lane
+  VDup,
+  // Move vector register
+  VMov,
+  // Move immediate into every lane
+  VMovImm,
+  // Move a lane to a core register
+  VMovLane,
+
   // Label (pseudo-instruction)
   _Label,
   // Control Comment (pseudo-instruction)
@@ -332,10 +362,27 @@ ConditionCode invert_cond(ConditionCode cond);
 // Reverse Consition code (a cond b -> b result a)
 ConditionCode reverse_cond(ConditionCode cond);
 
+/// Concrete class of an `Inst`, so passes can dispatch with a `switch` and
+/// `inst_cast` instead of a chain of `dynamic_cast`s
+enum class InstKind : uint8_t {
+  Pure,
+  Arith4,
+  Arith3,
+  Arith2,
+  Br,
+  LoadStore,
+  MultLoadStore,
+  PushPop,
+  Label,
+  Ctrl,
+  Neon,
+};
+
 struct Inst : public prelude::Displayable {
-  Inst(OpCode op, ConditionCode cond = ConditionCode::Always)
-      : op(op), cond(cond){};
+  Inst(InstKind kind, OpCode op, ConditionCode cond = ConditionCode::Always)
+      : kind(kind), op(op), cond(cond){};
 
+  InstKind kind;
   OpCode op;
   ConditionCode cond;
 
@@ -347,8 +394,10 @@ struct Inst : public prelude::Displayable {
 ///
 /// Valid opcode: Nop, Bx
 struct PureInst final : public Inst {
+  static constexpr InstKind KIND = InstKind::Pure;
+
   PureInst(OpCode op, ConditionCode cond = ConditionCode::Always)
-      : Inst(op, cond) {}
+      : Inst(KIND, op, cond) {}
 
   virtual void display(std::ostream& o) const;
   virtual ~PureInst() {}
@@ -358,9 +407,11 @@ struct PureInst final : public Inst {
 ///
 /// Valid opcode: Mla, SMMla
 struct Arith4Inst final : public Inst {
+  static constexpr InstKind KIND = InstKind::Arith4;
+
   Arith4Inst(OpCode op, Reg rd, Reg r1, Reg r2, Reg r3,
              ConditionCode cond = ConditionCode::Always)
-      : Inst(op, cond), rd(rd), r1(r1), r2(r2), r3(r3) {}
+      : Inst(KIND, op, cond), rd(rd), r1(r1), r2(r2), r3(r3) {}
 
   Reg rd;
   Reg r1;
@@ -375,9 +426,11 @@ struct Arith4Inst final : public Inst {
 ///
 /// Valid opcode: Add, Sub, Rsb, Mul, SDiv, And, Orr, Eor, Lsl, Lsr, Asr
 struct Arith3Inst final : public Inst {
+  static constexpr InstKind KIND = InstKind::Arith3;
+
   Arith3Inst(OpCode op, Reg rd, Reg r1, Operand2 r2,
              ConditionCode cond = ConditionCode::Always)
-      : Inst(op, cond), rd(rd), r1(r1), r2(r2) {}
+      : Inst(KIND, op, cond), rd(rd), r1(r1), r2(r2) {}
 
   Reg rd;
   Reg r1;
@@ -391,9 +444,11 @@ struct Arith3Inst final : public Inst {
 ///
 /// Valid Opcode: Mov, Cmp, Cmn
 struct Arith2Inst final : public Inst {
+  static constexpr InstKind KIND = InstKind::Arith2;
+
   Arith2Inst(OpCode op, Reg r1, Operand2 r2,
              ConditionCode cond = ConditionCode::Always)
-      : Inst(op, cond), r1(r1), r2(r2) {}
+      : Inst(KIND, op, cond), r1(r1), r2(r2) {}
 
   Reg r1;
   Operand2 r2;
@@ -406,11 +461,13 @@ struct Arith2Inst final : public Inst {
 ///
 /// Valid opcode: B, Bl
 struct BrInst final : public Inst {
+  static constexpr InstKind KIND = InstKind::Br;
+
   BrInst(OpCode op, Label l, ConditionCode c = ConditionCode::Always)
-      : l(l), Inst(op, c) {}
+      : l(l), Inst(KIND, op, c) {}
   BrInst(OpCode op, Label l, int param_size,
          ConditionCode c = ConditionCode::Always)
-      : l(l), param_cnt(param_size), Inst(op, c) {}
+      : l(l), param_cnt(param_size), Inst(KIND, op, c) {}
   Label l;
   int param_cnt = 0;
 
@@ -422,12 +479,14 @@ struct BrInst final : public Inst {
 ///
 /// Valid opcode: LdR, StR
 struct LoadStoreInst final : public Inst {
+  static constexpr InstKind KIND = InstKind::LoadStore;
+
   LoadStoreInst(OpCode op, Reg rd, MemoryOperand mem,
                 ConditionCode cond = ConditionCode::Always)
-      : Inst(op, cond), rd(rd), mem(mem) {}
+      : Inst(KIND, op, cond), rd(rd), mem(mem) {}
   LoadStoreInst(OpCode op, Reg rd, std::string mem,
                 ConditionCode cond = ConditionCode::Always)
-      : Inst(op, cond), rd(rd), mem(mem) {}
+      : Inst(KIND, op, cond), rd(rd), mem(mem) {}
 
   Reg rd;
   std::variant<std::string, MemoryOperand> mem;
@@ -440,9 +499,11 @@ struct LoadStoreInst final : public Inst {
 ///
 /// Valid opcode: LdM, StM
 struct MultLoadStoreInst final : public Inst {
+  static constexpr InstKind KIND = InstKind::MultLoadStore;
+
   MultLoadStoreInst(OpCode op, Reg rn, std::set<Reg> rd,
                     ConditionCode cond = ConditionCode::Always)
-      : rd(std::move(rd)), rn(rn), Inst(op, cond) {}
+      : rd(std::move(rd)), rn(rn), Inst(KIND, op, cond) {}
   std::set<Reg> rd;
   Reg rn;
 
@@ -454,9 +515,11 @@ struct MultLoadStoreInst final : public Inst {
 ///
 /// Valid opcode: Push, Pop
 struct PushPopInst final : public Inst {
+  static constexpr InstKind KIND = InstKind::PushPop;
+
   PushPopInst(OpCode op, std::set<Reg> regs,
               ConditionCode cond = ConditionCode::Always)
-      : Inst(op, cond), regs(regs) {}
+      : Inst(KIND, op, cond), regs(regs) {}
 
   std::set<Reg> regs;
 
@@ -464,12 +527,36 @@ struct PushPopInst final : public Inst {
   virtual ~PushPopInst() {}
 };
 
+/// NEON instruction. Vector operands are quad registers holding four 32-bit
+/// integers, except for the double registers of `VPAdd` and `VMovLane`.
+///
+/// Valid opcode: VLd1, VSt1 (`rd` from or to `[r1]`), VAdd, VSub, VMul, VMla,
+/// VPAdd (`rd, r1, r2`), VDup (`rd, r1`), VMov (`rd, r1`), VMovImm
+/// (`rd, #imm`), VMovLane (`rd, r1[imm]`)
+struct NeonInst final : public Inst {
+  static constexpr InstKind KIND = InstKind::Neon;
+
+  NeonInst(OpCode op, Reg rd, Reg r1, Reg r2 = 0, int32_t imm = 0,
+           ConditionCode cond = ConditionCode::Always)
+      : Inst(KIND, op, cond), rd(rd), r1(r1), r2(r2), imm(imm) {}
+
+  Reg rd;
+  Reg r1;
+  Reg r2;
+  int32_t imm;
+
+  virtual void display(std::ostream& o) const;
+  virtual ~NeonInst() {}
+};
+
 /// Label pseudo-instruction
 ///
 /// Valid opcode: _Label
 struct LabelInst final : public Inst {
+  static constexpr InstKind KIND = InstKind::Label;
+
   LabelInst(Label label)
-      : Inst(OpCode::_Label, ConditionCode::Always), label(label) {}
+      : Inst(KIND, OpCode::_Label, ConditionCode::Always), label(label) {}
 
   Label label;
 
@@ -481,8 +568,10 @@ struct LabelInst final : public Inst {
 ///
 /// Valid opcode: _Ctrl
 struct CtrlInst final : public Inst {
+  static constexpr InstKind KIND = InstKind::Ctrl;
+
   CtrlInst(std::string key, std::any val, bool is_asm_option = false)
-      : Inst(OpCode::_Ctrl, ConditionCode::Always),
+      : Inst(KIND, OpCode::_Ctrl, ConditionCode::Always),
         key(std::move(key)),
         val(std::move(val)),
         is_asm_option(is_asm_option) {}
@@ -495,6 +584,19 @@ struct CtrlInst final : public Inst {
   virtual ~CtrlInst() {}
 };
 
+/// `dynamic_cast` replacement for instructions: `inst` as a `T`, or null if
+/// it is of another class
+template <typename T>
+T* inst_cast(Inst* inst) {
+  return inst && inst->kind == T::KIND ? static_cast<T*>(inst) : nullptr;
+}
+
+template <typename T>
+const T* inst_cast(const Inst* inst) {
+  return inst && inst->kind == T::KIND ? static_cast<const T*>(inst)
+                                        : nullptr;
+}
+
 const std::string STACK_OFFSET_CTRL = "offset_stack";
 using StackOffsetTy = int32_t;
 
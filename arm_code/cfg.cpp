@@ -0,0 +1,315 @@
+#include "cfg.hpp"
+
+#include <cassert>
+
+namespace arm {
+
+namespace {
+
+void add_mem_regs(const MemoryOperand& mem, std::vector<Reg>& defs,
+                  std::vector<Reg>& uses) {
+  uses.push_back(mem.r1);
+  if (auto x = std::get_if<RegisterOperand>(&mem.offset)) {
+    uses.push_back(x->reg);
+  }
+  if (mem.kind != MemoryAccessKind::None) defs.push_back(mem.r1);
+}
+
+void add_operand2_regs(const Operand2& op, std::vector<Reg>& uses) {
+  if (auto x = std::get_if<RegisterOperand>(&op)) uses.push_back(x->reg);
+}
+
+bool ends_block(const Inst& inst) {
+  switch (inst.op) {
+    case OpCode::B:
+    case OpCode::Bx:
+      return true;
+    case OpCode::Pop: {
+      auto& regs = static_cast<const PushPopInst&>(inst).regs;
+      return regs.find(REG_PC) != regs.end();
+    }
+    default:
+      return false;
+  }
+}
+
+}  // namespace
+
+void collect_def_use(const Inst& inst, std::vector<Reg>& defs,
+                     std::vector<Reg>& uses) {
+  switch (inst.op) {
+    case OpCode::Nop:
+    case OpCode::_Label:
+    case OpCode::_Ctrl:
+    case OpCode::B:
+      break;
+    case OpCode::Bx:
+      uses.insert(uses.end(), {0, REG_SP, REG_LR});
+      break;
+    case OpCode::Bl:
+      uses.insert(uses.end(), {0, 1, 2, 3, REG_SP});
+      defs.insert(defs.end(), {0, 1, 2, 3, 12, REG_LR});
+      break;
+    case OpCode::Cbz:
+    case OpCode::Cbnz:
+      // Never generated, and the register operand is not kept anywhere
+      break;
+    case OpCode::Mov:
+    case OpCode::Mvn: {
+      auto& x = static_cast<const Arith2Inst&>(inst);
+      defs.push_back(x.r1);
+      add_operand2_regs(x.r2, uses);
+    } break;
+    case OpCode::MovT: {
+      // Only writes the upper half of r1
+      auto& x = static_cast<const Arith2Inst&>(inst);
+      defs.push_back(x.r1);
+      uses.push_back(x.r1);
+    } break;
+    case OpCode::Cmp:
+    case OpCode::Cmn: {
+      auto& x = static_cast<const Arith2Inst&>(inst);
+      uses.push_back(x.r1);
+      add_operand2_regs(x.r2, uses);
+    } break;
+    case OpCode::Mla:
+    case OpCode::SMMla: {
+      auto& x = static_cast<const Arith4Inst&>(inst);
+      defs.push_back(x.rd);
+      uses.insert(uses.end(), {x.r1, x.r2, x.r3});
+    } break;
+    case OpCode::LdR:
+    case OpCode::StR: {
+      auto& x = static_cast<const LoadStoreInst&>(inst);
+      if (inst.op == OpCode::LdR) {
+        defs.push_back(x.rd);
+      } else {
+        uses.push_back(x.rd);
+      }
+      if (auto mem = std::get_if<MemoryOperand>(&x.mem)) {
+        add_mem_regs(*mem, defs, uses);
+      }
+    } break;
+    case OpCode::LdM:
+    case OpCode::StM: {
+      auto& x = static_cast<const MultLoadStoreInst&>(inst);
+      auto& regs = inst.op == OpCode::LdM ? defs : uses;
+      regs.insert(regs.end(), x.rd.begin(), x.rd.end());
+      uses.push_back(x.rn);
+    } break;
+    case OpCode::Push:
+    case OpCode::Pop: {
+      auto& x = static_cast<const PushPopInst&>(inst);
+      auto& regs = inst.op == OpCode::Pop ? defs : uses;
+      regs.insert(regs.end(), x.regs.begin(), x.regs.end());
+      uses.push_back(REG_SP);
+      defs.push_back(REG_SP);
+    } break;
+    case OpCode::VLd1:
+    case OpCode::VSt1:
+    case OpCode::VDup:
+      // Only core registers are tracked
+      uses.push_back(static_cast<const NeonInst&>(inst).r1);
+      break;
+    case OpCode::VMovLane:
+      defs.push_back(static_cast<const NeonInst&>(inst).rd);
+      break;
+    case OpCode::VAdd:
+    case OpCode::VSub:
+    case OpCode::VMul:
+    case OpCode::VMla:
+    case OpCode::VPAdd:
+    case OpCode::VMov:
+    case OpCode::VMovImm:
+      break;
+    default: {
+      // Add, Sub, Rsb, Mul, SMMul, SDiv, And, Orr, Eor, Bic, Lsl, Lsr, Asr,
+      // _Mod
+      auto& x = static_cast<const Arith3Inst&>(inst);
+      defs.push_back(x.rd);
+      uses.push_back(x.r1);
+      add_operand2_regs(x.r2, uses);
+    } break;
+  }
+}
+
+uint32_t LabelTable::intern(const Label& label) {
+  auto [it, inserted] = ids.insert({label, names.size()});
+  if (inserted) names.push_back(label);
+  return it->second;
+}
+
+std::optional<uint32_t> LabelTable::find(const Label& label) const {
+  auto it = ids.find(label);
+  if (it == ids.end()) return {};
+  return it->second;
+}
+
+MachineCFG::MachineCFG(const Function& f) : f(f) {
+  collect_regs();
+  split_blocks();
+  link_blocks();
+}
+
+std::optional<uint32_t> MachineCFG::block_with_label(uint32_t label) const {
+  auto it = label_blk.find(label);
+  if (it == label_blk.end()) return {};
+  return it->second;
+}
+
+void MachineCFG::collect_regs() {
+  std::vector<Reg> defs, uses;
+  def_start.reserve(f.inst.size() + 1);
+  use_start.reserve(f.inst.size());
+  for (auto& inst : f.inst) {
+    defs.clear();
+    uses.clear();
+    collect_def_use(*inst, defs, uses);
+    def_start.push_back(regs.size());
+    regs.insert(regs.end(), defs.begin(), defs.end());
+    use_start.push_back(regs.size());
+    regs.insert(regs.end(), uses.begin(), uses.end());
+  }
+  def_start.push_back(regs.size());
+  // Keeps `&regs[...]` valid for the trailing empty ranges
+  regs.push_back(0);
+}
+
+void MachineCFG::split_blocks() {
+  inst_blk.resize(f.inst.size());
+  bool block_open = false;
+  for (uint32_t i = 0; i < f.inst.size(); i++) {
+    auto& inst = *f.inst[i];
+    if (inst.op == OpCode::_Label || !block_open) {
+      if (block_open) blks.back().end = i;
+      MachineBlock blk;
+      blk.id = blks.size();
+      blk.begin = i;
+      if (inst.op == OpCode::_Label) {
+        auto label = label_table.intern(static_cast<LabelInst&>(inst).label);
+        blk.label = label;
+        label_blk.insert({label, blk.id});
+      }
+      blks.push_back(std::move(blk));
+      block_open = true;
+    }
+    inst_blk[i] = blks.back().id;
+    if (ends_block(inst)) {
+      blks.back().end = i + 1;
+      block_open = false;
+    }
+  }
+  if (block_open) blks.back().end = f.inst.size();
+}
+
+void MachineCFG::link_blocks() {
+  auto add_edge = [&](uint32_t from, uint32_t to) {
+    blks[from].succs.push_back(to);
+    blks[to].preds.push_back(from);
+  };
+  for (auto& blk : blks) {
+    auto& last = *f.inst[blk.end - 1];
+    bool falls_through = last.cond != ConditionCode::Always;
+    if (last.op == OpCode::B) {
+      auto& br = static_cast<const BrInst&>(last);
+      auto label = label_table.find(br.l);
+      if (label && label_blk.count(*label)) {
+        add_edge(blk.id, label_blk.at(*label));
+      } else {
+        blk.jumps_out = true;
+      }
+    } else if (ends_block(last)) {
+      blk.is_exit = true;
+    } else {
+      falls_through = true;
+    }
+    if (falls_through) {
+      if (blk.id + 1 < blks.size()) {
+        add_edge(blk.id, blk.id + 1);
+      } else {
+        blk.is_exit = true;
+      }
+    }
+  }
+}
+
+bool RegSet::merge(const RegSet& other) {
+  bool changed = false;
+  for (size_t i = 0; i < words.size(); i++) {
+    auto w = words[i] | other.words[i];
+    changed |= w != words[i];
+    words[i] = w;
+  }
+  return changed;
+}
+
+bool RegSet::merge_except(const RegSet& other, const RegSet& except) {
+  bool changed = false;
+  for (size_t i = 0; i < words.size(); i++) {
+    auto w = words[i] | (other.words[i] & ~except.words[i]);
+    changed |= w != words[i];
+    words[i] = w;
+  }
+  return changed;
+}
+
+Liveness::Liveness(const MachineCFG& cfg) : cfg(cfg) {
+  auto& f = cfg.function();
+  reg_count = REG_V_GP_START;
+  for (uint32_t i = 0; i < f.inst.size(); i++) {
+    for (auto range : {cfg.defs(i), cfg.uses(i)}) {
+      for (auto r : range) {
+        if (is_virtual_register(r) && vreg_index.insert({r, reg_count}).second)
+          reg_count++;
+      }
+    }
+  }
+
+  auto& blks = cfg.blocks();
+  std::vector<RegSet> gen(blks.size(), RegSet(reg_count));
+  std::vector<RegSet> kill(blks.size(), RegSet(reg_count));
+  ins.assign(blks.size(), RegSet(reg_count));
+  outs.assign(blks.size(), RegSet(reg_count));
+
+  RegSet exit_live(reg_count);
+  for (auto r : {0, 1, 4, 5, 6, 7, 8, 9, 10}) exit_live.set(r);
+  for (auto r : {REG_FP, REG_SP, REG_LR}) exit_live.set(r);
+
+  for (auto& blk : blks) {
+    for (auto i = blk.end; i-- > blk.begin;) {
+      if (f.inst[i]->cond == ConditionCode::Always) {
+        for (auto r : cfg.defs(i)) {
+          gen[blk.id].reset(index_of(r));
+          kill[blk.id].set(index_of(r));
+        }
+      }
+      for (auto r : cfg.uses(i)) gen[blk.id].set(index_of(r));
+    }
+    if (blk.jumps_out) {
+      outs[blk.id].set_all();
+    } else if (blk.is_exit) {
+      outs[blk.id].merge(exit_live);
+    }
+  }
+
+  // Blocks are mostly laid out in program order, so walking them backwards
+  // converges in a few rounds
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (auto b = blks.size(); b-- > 0;) {
+      for (auto succ : blks[b].succs) outs[b].merge(ins[succ]);
+      changed |= ins[b].merge(gen[b]);
+      changed |= ins[b].merge_except(outs[b], kill[b]);
+    }
+  }
+}
+
+void Liveness::step_backward(uint32_t inst, RegSet& live) const {
+  if (cfg.function().inst[inst]->cond == ConditionCode::Always) {
+    for (auto r : cfg.defs(inst)) live.reset(index_of(r));
+  }
+  for (auto r : cfg.uses(inst)) live.set(index_of(r));
+}
+
+}  // namespace arm
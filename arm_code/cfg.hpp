@@ -0,0 +1,168 @@
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "arm.hpp"
+
+namespace arm {
+
+/// Appends the registers written (`defs`) and read (`uses`) by `inst`.
+///
+/// Calls follow the AAPCS: `bl` reads r0-r3 and sp, and clobbers r0-r3, r12
+/// and lr. The parameter count of a call is not trusted, since helper calls
+/// like `__aeabi_idivmod` are emitted without one. Returns (`bx`) read r0 and
+/// lr. Condition flags are not modelled.
+void collect_def_use(const Inst& inst, std::vector<Reg>& defs,
+                     std::vector<Reg>& uses);
+
+/// Interns label names into dense numeric ids
+class LabelTable {
+ public:
+  uint32_t intern(const Label& label);
+  std::optional<uint32_t> find(const Label& label) const;
+  const Label& name(uint32_t id) const { return names[id]; }
+  size_t size() const { return names.size(); }
+
+ private:
+  std::unordered_map<Label, uint32_t> ids;
+  std::vector<Label> names;
+};
+
+/// A contiguous range of registers owned by a `MachineCFG`
+struct RegRange {
+  const Reg* first;
+  const Reg* last;
+
+  const Reg* begin() const { return first; }
+  const Reg* end() const { return last; }
+  size_t size() const { return last - first; }
+  bool empty() const { return first == last; }
+};
+
+/// A maximal straight-line run of instructions `[begin, end)` of a function.
+/// Blocks start at labels and end after branches and returns.
+struct MachineBlock {
+  uint32_t id;
+  /// Id of the label starting this block, if any
+  std::optional<uint32_t> label;
+  uint32_t begin;
+  uint32_t end;
+  std::vector<uint32_t> succs;
+  std::vector<uint32_t> preds;
+  /// This block leaves the function by returning
+  bool is_exit = false;
+  /// This block branches to a label that is not inside the function
+  bool jumps_out = false;
+};
+
+/// Control flow graph of an `arm::Function`, plus the def/use registers of
+/// every instruction.
+///
+/// The graph refers to instructions by index, so it is invalidated by any
+/// insertion or removal in `Function::inst`.
+class MachineCFG {
+ public:
+  MachineCFG(const Function& f);
+
+  const Function& function() const { return f; }
+  const std::vector<MachineBlock>& blocks() const { return blks; }
+  const MachineBlock& block(uint32_t id) const { return blks[id]; }
+  /// Index of the block containing instruction `inst`
+  uint32_t block_of(uint32_t inst) const { return inst_blk[inst]; }
+  std::optional<uint32_t> block_with_label(uint32_t label) const;
+  const LabelTable& labels() const { return label_table; }
+
+  RegRange defs(uint32_t inst) const {
+    return {&regs[def_start[inst]], &regs[use_start[inst]]};
+  }
+  RegRange uses(uint32_t inst) const {
+    return {&regs[use_start[inst]], &regs[def_start[inst + 1]]};
+  }
+
+ private:
+  void collect_regs();
+  void split_blocks();
+  void link_blocks();
+
+  const Function& f;
+  LabelTable label_table;
+  std::vector<MachineBlock> blks;
+  std::vector<uint32_t> inst_blk;
+  std::unordered_map<uint32_t, uint32_t> label_blk;
+
+  // Defs of instruction i are regs[def_start[i], use_start[i]), uses are
+  // regs[use_start[i], def_start[i + 1])
+  std::vector<Reg> regs;
+  std::vector<uint32_t> def_start;
+  std::vector<uint32_t> use_start;
+};
+
+/// Fixed-size bit vector indexed by dense register numbers
+class RegSet {
+ public:
+  RegSet(size_t size = 0) : words((size + 63) / 64, 0) {}
+
+  bool test(uint32_t i) const { return (words[i / 64] >> (i % 64)) & 1; }
+  void set(uint32_t i) { words[i / 64] |= uint64_t(1) << (i % 64); }
+  void reset(uint32_t i) { words[i / 64] &= ~(uint64_t(1) << (i % 64)); }
+  void set_all() {
+    for (auto& w : words) w = ~uint64_t(0);
+  }
+  /// `this |= other`, returns whether anything changed
+  bool merge(const RegSet& other);
+  /// `this |= other & ~except`, returns whether anything changed
+  bool merge_except(const RegSet& other, const RegSet& except);
+  bool operator==(const RegSet& other) const { return words == other.words; }
+  bool operator!=(const RegSet& other) const { return words != other.words; }
+
+ private:
+  std::vector<uint64_t> words;
+};
+
+/// Backward liveness of physical and virtual registers over a `MachineCFG`.
+///
+/// Physical registers use their own number as index; virtual registers are
+/// numbered from 64 onwards in order of appearance. An instruction with a
+/// condition code other than `Always` does not kill what it writes.
+class Liveness {
+ public:
+  Liveness(const MachineCFG& cfg);
+
+  uint32_t index_of(Reg r) const {
+    return is_virtual_register(r) ? vreg_index.at(r) : r;
+  }
+  size_t size() const { return reg_count; }
+
+  const RegSet& live_in(uint32_t blk) const { return ins[blk]; }
+  const RegSet& live_out(uint32_t blk) const { return outs[blk]; }
+
+  /// Turns `live` (registers live after `inst`) into the registers live
+  /// before it
+  void step_backward(uint32_t inst, RegSet& live) const;
+
+  /// Calls `f(inst, live)` for every instruction of `blk` from the last to the
+  /// first, where `live` holds the registers live right after `inst`. `f` may
+  /// return false to tell that `inst` is going to be deleted, in which case
+  /// its operands are not made live.
+  template <typename F>
+  void walk_backward(uint32_t blk, F f) const {
+    auto& b = cfg.block(blk);
+    RegSet live = outs[blk];
+    for (auto i = b.end; i-- > b.begin;) {
+      if (f(i, static_cast<const RegSet&>(live))) step_backward(i, live);
+    }
+  }
+
+ private:
+  const MachineCFG& cfg;
+  std::unordered_map<Reg, uint32_t> vreg_index;
+  size_t reg_count;
+  std::vector<RegSet> ins;
+  std::vector<RegSet> outs;
+};
+
+}  // namespace arm
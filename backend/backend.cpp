@@ -1,5 +1,6 @@
 #include "backend.hpp"
 
+#include <algorithm>
 #include <climits>
 #include <iostream>
 #include <iterator>
@@ -8,6 +9,7 @@
 #include <vector>
 
 #include "../include/aixlog.hpp"
+#include "../mir/serialize.hpp"
 #include "codegen/codegen.hpp"
 
 namespace backend {
@@ -30,8 +32,41 @@ bool Backend::should_run_pass(std::string& pass_name) {
   }
 }
 
+void report_statistic(std::map<std::string, std::any>& extra_data_repo,
+                      const std::string& pass, std::string remark) {
+  auto it = extra_data_repo.find(PASS_STATISTICS_DATA_NAME);
+  if (it == extra_data_repo.end()) {
+    it = extra_data_repo.insert({PASS_STATISTICS_DATA_NAME,
+                                 PassStatisticsType()})
+             .first;
+  }
+  std::any_cast<PassStatisticsType&>(it->second)
+      .push_back({pass, std::move(remark)});
+}
+
+void Backend::show_pass_statistics(std::ostream& o) {
+  auto it = extra_data.find(PASS_STATISTICS_DATA_NAME);
+  if (it == extra_data.end()) return;
+  for (auto& [pass, remark] :
+       std::any_cast<PassStatisticsType&>(it->second)) {
+    o << pass << ": " << remark << std::endl;
+  }
+}
+
+void Backend::dump_mir_if_requested(size_t pass_idx) {
+  // Indices past the last pass mean after all of them
+  auto dump_at = std::min(options.dump_mir_at, mir_passes.size());
+  if (!options.dump_mir || dump_at != pass_idx) return;
+  LOG(INFO) << "Dumping MIR to " << options.dump_mir.value() << "\n";
+  mir::serial::save_package(package, options.dump_mir.value(),
+                            options.dump_mir_text);
+}
+
 void Backend::do_mir_optimization() {
-  for (auto& pass : mir_passes) {
+  for (size_t i = 0; i < mir_passes.size(); i++) {
+    auto& pass = mir_passes[i];
+    if (i < options.resume_mir_at) continue;
+    dump_mir_if_requested(i);
     if (!should_run_pass(pass->pass_name())) {
       LOG(INFO) << "Skipping MIR pass: " << pass->pass_name() << "\n";
       continue;
@@ -39,11 +74,19 @@ void Backend::do_mir_optimization() {
 
     LOG(INFO) << "Running MIR pass: " << pass->pass_name() << "\n";
     pass->optimize_mir(package, extra_data);
+    // Other passes are free to edit instructions directly
+    if (!pass->preserves_def_use()) {
+      for (auto& f : package.functions) {
+        f.second.invalidate_def_use();
+      }
+    }
     if (options.show_code_after_each_pass) {
       LOG(INFO) << "Code after pass: " << pass->pass_name() << "\n";
       std::cout << package << std::endl;
     }
   }
+  dump_mir_if_requested(mir_passes.size());
+  if (options.show_pass_statistics) show_pass_statistics(std::cerr);
 }
 
 void Backend::do_arm_optimization() {
@@ -83,11 +126,13 @@ void Backend::do_mir_to_arm_transform() {
 }
 
 void Backend::show_passes(std::ostream& o) {
-  for (auto& pass : mir_passes) {
-    if (!should_run_pass(pass->pass_name())) {
-      o << "Skip: " << pass->pass_name() << std::endl;
+  // Indices are what --dump-mir-at and --resume-mir-at refer to
+  for (size_t i = 0; i < mir_passes.size(); i++) {
+    auto& pass = mir_passes[i];
+    if (i < options.resume_mir_at || !should_run_pass(pass->pass_name())) {
+      o << "Skip: " << i << " " << pass->pass_name() << std::endl;
     } else {
-      o << " Run: " << pass->pass_name() << std::endl;
+      o << " Run: " << i << " " << pass->pass_name() << std::endl;
     }
   }
   o << " Run: mir_to_arm" << std::endl;
@@ -2,6 +2,9 @@
 #include <any>
 #include <map>
 #include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
 
 #include "../arm_code/arm.hpp"
 #include "../mir/mir.hpp"
@@ -12,6 +15,16 @@ namespace backend {
 class MirOptimizePass;
 class ArmOptimizePass;
 
+const std::string PASS_STATISTICS_DATA_NAME = "pass_statistics";
+
+/// `(pass name, remark)` pairs, in the order they were reported
+using PassStatisticsType = std::vector<std::pair<std::string, std::string>>;
+
+/// Records a remark on what `pass` did, e.g. to one loop. Remarks are printed
+/// after the MIR passes when `--pass-stats` is given.
+void report_statistic(std::map<std::string, std::any>& extra_data_repo,
+                      const std::string& pass, std::string remark);
+
 class Backend {
  public:
   Backend(mir::inst::MirPackage& package, Options& options)
@@ -56,6 +69,11 @@ class Backend {
 
   bool should_run_pass(std::string& pass_name);
   bool should_run_pass(std::string&& pass_name);
+  /// Write MIR to `options.dump_mir` if it was requested before pass
+  /// `pass_idx`
+  void dump_mir_if_requested(size_t pass_idx);
+  /// Print the remarks collected by `report_statistic`
+  void show_pass_statistics(std::ostream& o);
 };
 
 /// Base class for all optimize passes that work on MIR
@@ -65,6 +83,9 @@ class MirOptimizePass {
   virtual void optimize_mir(
       mir::inst::MirPackage& package,
       std::map<std::string, std::any>& extra_data_repo) = 0;
+  /// Whether the pass keeps every def-use index it touches up to date (see
+  /// mir/def_use.hpp), so the backend need not drop them once it is done
+  virtual bool preserves_def_use() const { return false; }
 
   virtual ~MirOptimizePass(){};
 };
@@ -30,7 +30,7 @@ void CodeAlignOptimization::optimize_func(
   std::vector<std::unique_ptr<arm::Inst>> inst_new;
   for (size_t index = 0; index < f.inst.size(); index++) {
     auto i = f.inst.begin() + index;
-    if (auto x = dynamic_cast<arm::LabelInst *>(i->get())) {
+    if (auto x = arm::inst_cast<arm::LabelInst>(i->get())) {
       if (x->label.find(".bb_") == 0) {
         uint32_t cmpuInstNum;
         uint32_t totalInstNum;
@@ -9,49 +9,6 @@
 
 namespace backend::codegen {
 
-struct CycleSolver {
-  CycleSolver(mir::inst::MirFunction& f) : f(f) {}
-  mir::inst::MirFunction& f;
-
-  std::map<int, int> counter;
-  std::set<int> visited;
-  std::set<int> path;
-
-  std::map<int, int> solve() {
-    dfs(f.basic_blks.begin()->first);
-    return std::move(counter);
-  }
-  void dfs(int id);
-};
-
-void CycleSolver::dfs(int id) {
-  if (path.find(id) != path.end()) {
-    if (counter.find(id) == counter.end()) {
-      counter.insert({id, 1});
-    } else {
-      counter[id]++;
-    }
-  } else if (visited.find(id) != visited.end()) {
-    return;
-  } else {
-    path.insert(id);
-    visited.insert(id);
-    auto& bb = f.basic_blks.at(id);
-    switch (bb.jump.kind) {
-      case mir::inst::JumpInstructionKind::Br:
-        dfs(bb.jump.bb_true);
-        break;
-      case mir::inst::JumpInstructionKind::BrCond:
-        dfs(bb.jump.bb_true);
-        dfs(bb.jump.bb_false);
-        break;
-      default:
-        break;
-    }
-    path.erase(id);
-  }
-}
-
 void BasicBlkRearrange::optimize_mir(
     mir::inst::MirPackage& mir,
     std::map<std::string, std::any>& extra_data_repo) {
@@ -60,7 +17,8 @@ void BasicBlkRearrange::optimize_mir(
   optimization::InlineBlksType inline_map;
   for (auto& f : mir.functions) {
     if (f.second.type->is_extern) continue;
-    auto res = optimize_func(f.second);
+    auto res = optimize_func(
+        f.second, optimization::get_loop_forest(extra_data_repo, f.second));
     auto arrange = std::move(std::get<0>(res));
     auto cycle = std::move(std::get<1>(res));
     auto inline_ = std::move(std::get<2>(res));
@@ -160,7 +118,7 @@ std::map<uint32_t, arm::ConditionCode> gen_func_inline_hints(
           break;
         }
         if (x->op == mir::inst::Op::Gt || x->op == mir::inst::Op::Lt ||
-            x->op == mir::inst::Op::Gte || x->op == mir::inst::Op::Lt ||
+            x->op == mir::inst::Op::Gte || x->op == mir::inst::Op::Lte ||
             x->op == mir::inst::Op::Eq || x->op == mir::inst::Op::Neq) {
           if (it != bb.second.inst.end() - 1 ||
               bb.second.jump.kind == mir::inst::JumpInstructionKind::BrCond) {
@@ -239,8 +197,16 @@ void filter_inline_blks(mir::inst::MirFunction& f,
 
 std::tuple<std::vector<uint32_t>, std::set<uint32_t>,
            std::map<uint32_t, arm::ConditionCode>>
-BasicBlkRearrange::optimize_func(mir::inst::MirFunction& f) {
-  auto cycles = CycleSolver(f).solve();
+BasicBlkRearrange::optimize_func(mir::inst::MirFunction& f,
+                                 const mir::inst::LoopForest& loops) {
+  // Number of incoming edges closing a cycle, which are not waited for
+  // before placing a block
+  std::map<int, int> cycles;
+  for (auto blk : loops.dom_tree().reverse_postorder()) {
+    for (auto p : loops.dom_tree().preds(blk)) {
+      if (loops.is_cycle_edge(p, blk)) cycles[blk]++;
+    }
+  }
   std::set<int> visited;
   std::deque<int> bfs;
   std::map<int, int> input_count;
@@ -1,5 +1,6 @@
 #pragma once
 
+#include "../../mir/loop.hpp"
 #include "../backend.hpp"
 namespace backend::codegen {
 class BasicBlkRearrange final : public backend::MirOptimizePass {
@@ -11,6 +12,7 @@ class BasicBlkRearrange final : public backend::MirOptimizePass {
  private:
   std::tuple<std::vector<uint32_t>, std::set<uint32_t>,
              std::map<uint32_t, arm::ConditionCode>>
-  optimize_func(mir::inst::MirFunction &f);
+  optimize_func(mir::inst::MirFunction &f,
+                const mir::inst::LoopForest &loops);
 };
 }  // namespace backend::codegen
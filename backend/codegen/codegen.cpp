@@ -38,6 +38,14 @@ arm::Function Codegen::translate_function() {
         enable_cond_exec && hint != inline_hint.end()) {
       LOG(TRACE) << "Found inline hint for " << bb_id << std::endl;
       bool can_inline = last_jump.has_value();
+      for (auto& i : inst) {
+        // NEON instructions cannot be made conditional in ARM state
+        if (i->kind == arm::InstKind::Neon) {
+          can_inline = false;
+          LOG(TRACE) << "Inline ruined by a NEON instruction" << std::endl;
+          break;
+        }
+      }
 
       if (can_inline) {
         // for (auto& i : inst) {
@@ -316,16 +324,9 @@ arm::Reg Codegen::get_or_alloc_vd(mir::inst::VarId v_) {
   }
 }
 
-arm::Reg Codegen::get_or_alloc_vq(mir::inst::VarId v_) {
-  auto v = get_collapsed_var(v_);
-  auto found = reg_map.find(v);
-  if (found != reg_map.end()) {
-    assert(arm::register_type(found->second) ==
-           arm::RegisterKind::VirtualQuadVector);
-    return found->second;
-  } else {
-    return alloc_vq();
-  }
+arm::Reg Codegen::get_or_alloc_vq(mir::inst::VarId v) {
+  // Vector variables are colored into physical registers before codegen
+  return arm::VECTOR_REGS.at(vector_color.at(v));
 }
 
 void Codegen::add_collapsed_var(mir::inst::VarId tgt, mir::inst::VarId item) {
@@ -453,6 +454,31 @@ arm::Reg Codegen::translate_var_reg(mir::inst::VarId v) {
   return r;
 }
 
+bool Codegen::is_vector(mir::inst::VarId v) {
+  // Variables read but never defined have no type
+  auto var = func.variables.find(v.id);
+  return var != func.variables.end() && var->second.ty &&
+         var->second.ty->kind() == mir::types::TyKind::Vector;
+}
+
+bool Codegen::is_vector(mir::inst::Value& v) {
+  auto x = v.get_if<mir::inst::VarId>();
+  return x && is_vector(*x);
+}
+
+arm::Reg Codegen::translate_vector_address(mir::inst::Value& base,
+                                           mir::inst::Value& offset) {
+  // vld1 and vst1 only take a bare register as address
+  auto reg = translate_value_to_reg(base);
+  if (auto o = offset.get_if<int32_t>(); o && *o == 0) {
+    return reg;
+  }
+  auto addr = alloc_vgp();
+  inst.push_back(std::make_unique<Arith3Inst>(
+      OpCode::Add, addr, reg, translate_value_to_operand2(offset)));
+  return addr;
+}
+
 arm::MemoryOperand Codegen::translate_var_to_memory_arg(mir::inst::Value& v_) {
   if (auto x = v_.get_if<int32_t>()) {
     throw new prelude::NotImplementedException();
@@ -551,7 +577,9 @@ void Codegen::make_number(Reg reg, uint32_t num) {
 }
 
 void Codegen::translate_inst(mir::inst::AssignInst& i) {
-  if (i.src.is_immediate()) {
+  if (is_vector(i.dest)) {
+    translate_vector_inst(i);
+  } else if (i.src.is_immediate()) {
     auto imm = *i.src.get_if<int32_t>();
     uint32_t imm_u = imm;
     make_number(translate_var_reg(i.dest), imm_u);
@@ -646,6 +674,10 @@ void Codegen::translate_inst(mir::inst::LoadInst& i) {
 }
 
 void Codegen::translate_inst(mir::inst::StoreOffsetInst& i) {
+  if (is_vector(i.val)) {
+    translate_vector_inst(i);
+    return;
+  }
   auto ins = std::make_unique<LoadStoreInst>(
       arm::OpCode::StR, translate_value_to_reg(i.val),
       translate_var_to_memory_arg(i.dest, i.offset));
@@ -653,6 +685,10 @@ void Codegen::translate_inst(mir::inst::StoreOffsetInst& i) {
 }
 
 void Codegen::translate_inst(mir::inst::LoadOffsetInst& i) {
+  if (is_vector(i.dest)) {
+    translate_vector_inst(i);
+    return;
+  }
   auto ins = std::make_unique<LoadStoreInst>(
       arm::OpCode::LdR, translate_var_reg(i.dest),
       translate_var_to_memory_arg(i.src, i.offset));
@@ -733,6 +769,10 @@ inline bool can_reverse_param(mir::inst::Op op) {
 }
 
 void Codegen::translate_inst(mir::inst::OpInst& i) {
+  if (is_vector(i.lhs)) {
+    translate_vector_inst(i);
+    return;
+  }
   // Reverse when:
   //  - lhs is immediate
   //  - lhs is variable with shift and rhs is regular variable
@@ -855,6 +895,10 @@ void Codegen::translate_inst(mir::inst::OpInst& i) {
 }
 
 void Codegen::translate_inst(mir::inst::OpAccInst& i) {
+  if (is_vector(i.dest)) {
+    translate_vector_inst(i);
+    return;
+  }
   switch (i.op) {
     case mir::inst::OpAcc::MulAdd:
       inst.push_back(std::make_unique<Arith4Inst>(
@@ -871,6 +915,98 @@ void Codegen::translate_inst(mir::inst::OpAccInst& i) {
   }
 }
 
+void Codegen::translate_vector_inst(mir::inst::AssignInst& i) {
+  auto rd = get_or_alloc_vq(i.dest);
+  if (auto x = i.src.get_if<int32_t>(); x && *x >= 0 && *x <= 0xff) {
+    inst.push_back(std::make_unique<NeonInst>(OpCode::VMovImm, rd, 0, 0, *x));
+  } else if (is_vector(i.src)) {
+    auto r1 = get_or_alloc_vq(*i.src.get_if<mir::inst::VarId>());
+    if (rd != r1) {
+      inst.push_back(std::make_unique<NeonInst>(OpCode::VMov, rd, r1));
+    }
+  } else {
+    inst.push_back(std::make_unique<NeonInst>(OpCode::VDup, rd,
+                                              translate_value_to_reg(i.src)));
+  }
+}
+
+void Codegen::translate_vector_inst(mir::inst::StoreOffsetInst& i) {
+  auto dest = mir::inst::Value(i.dest);
+  auto addr = translate_vector_address(dest, i.offset);
+  inst.push_back(std::make_unique<NeonInst>(
+      OpCode::VSt1, get_or_alloc_vq(*i.val.get_if<mir::inst::VarId>()), addr));
+}
+
+void Codegen::translate_vector_inst(mir::inst::LoadOffsetInst& i) {
+  auto addr = translate_vector_address(i.src, i.offset);
+  inst.push_back(
+      std::make_unique<NeonInst>(OpCode::VLd1, get_or_alloc_vq(i.dest), addr));
+}
+
+void Codegen::translate_vector_inst(mir::inst::OpInst& i) {
+  auto r1 = get_or_alloc_vq(*i.lhs.get_if<mir::inst::VarId>());
+  if (!is_vector(i.dest)) {
+    // A scalar result is the sum of the lanes plus `rhs`
+    if (i.op != mir::inst::Op::Add) throw new prelude::UnreachableException();
+    auto rhs = translate_value_to_operand2(i.rhs);
+    auto rd = translate_var_reg(i.dest);
+    auto lo = make_register(RegisterKind::DoubleVector, 2 * register_num(r1));
+    auto hi = lo + 1;
+    auto scratch = make_register(RegisterKind::DoubleVector,
+                                 2 * register_num(REG_VECTOR_SCRATCH));
+    inst.push_back(std::make_unique<NeonInst>(OpCode::VPAdd, scratch, lo, hi));
+    inst.push_back(
+        std::make_unique<NeonInst>(OpCode::VPAdd, scratch, scratch, scratch));
+    // r12 is only held until the add right after
+    inst.push_back(
+        std::make_unique<NeonInst>(OpCode::VMovLane, Reg(12), scratch, 0, 0));
+    inst.push_back(
+        std::make_unique<Arith3Inst>(OpCode::Add, rd, Reg(12), rhs));
+    return;
+  }
+  OpCode op;
+  switch (i.op) {
+    case mir::inst::Op::Add:
+      op = OpCode::VAdd;
+      break;
+    case mir::inst::Op::Sub:
+      op = OpCode::VSub;
+      break;
+    case mir::inst::Op::Mul:
+      op = OpCode::VMul;
+      break;
+    default:
+      throw new prelude::UnreachableException();
+  }
+  inst.push_back(std::make_unique<NeonInst>(
+      op, get_or_alloc_vq(i.dest), r1,
+      get_or_alloc_vq(*i.rhs.get_if<mir::inst::VarId>())));
+}
+
+void Codegen::translate_vector_inst(mir::inst::OpAccInst& i) {
+  if (i.op != mir::inst::OpAcc::MulAdd) {
+    throw new prelude::UnreachableException();
+  }
+  auto rd = get_or_alloc_vq(i.dest);
+  auto acc = get_or_alloc_vq(i.acc);
+  auto r1 = get_or_alloc_vq(*i.lhs.get_if<mir::inst::VarId>());
+  auto r2 = get_or_alloc_vq(*i.rhs.get_if<mir::inst::VarId>());
+  // vmla accumulates into its destination
+  if (rd == acc) {
+    inst.push_back(std::make_unique<NeonInst>(OpCode::VMla, rd, r1, r2));
+  } else if (rd != r1 && rd != r2) {
+    inst.push_back(std::make_unique<NeonInst>(OpCode::VMov, rd, acc));
+    inst.push_back(std::make_unique<NeonInst>(OpCode::VMla, rd, r1, r2));
+  } else {
+    inst.push_back(
+        std::make_unique<NeonInst>(OpCode::VMov, REG_VECTOR_SCRATCH, acc));
+    inst.push_back(
+        std::make_unique<NeonInst>(OpCode::VMla, REG_VECTOR_SCRATCH, r1, r2));
+    inst.push_back(
+        std::make_unique<NeonInst>(OpCode::VMov, rd, REG_VECTOR_SCRATCH));
+  }
+}
+
 void Codegen::emit_compare(mir::inst::VarId& dest, mir::inst::Value& lhs,
                            mir::inst::Value& rhs, arm::ConditionCode cond,
                            bool reversed) {
@@ -890,7 +1026,8 @@ void Codegen::emit_compare(mir::inst::VarId& dest, mir::inst::Value& lhs,
 void Codegen::emit_phi_move(std::unordered_set<mir::inst::VarId>& i) {
   for (auto id : i) {
     auto collapsed = get_collapsed_var(id);
-    if (collapsed == id) {
+    // A vector phi web shares one register already
+    if (collapsed == id || is_vector(id)) {
       continue;
     }
     auto src_reg = get_or_alloc_vgp(id);
@@ -923,8 +1060,8 @@ void Codegen::translate_branch(mir::inst::JumpInstruction& j) {
         auto b1 = back->get();
         auto b2 = (back + 1)->get();
         if (b1->op == arm::OpCode::Mov && b2->op == arm::OpCode::Mov) {
-          auto b1m = dynamic_cast<Arith2Inst*>(b1);
-          auto b2m = dynamic_cast<Arith2Inst*>(b2);
+          auto b1m = static_cast<Arith2Inst*>(b1);
+          auto b2m = static_cast<Arith2Inst*>(b2);
           if (b1m->r1 == b2m->r1 && b1m->r2 == 0 && b2m->r2 == 1 &&
               b1m->cond == arm::ConditionCode::Always &&
               b2m->cond != arm::ConditionCode::Always) {
@@ -102,6 +102,13 @@ class Codegen final {
       for (auto i : this->inline_hint) LOG(TRACE) << i.first << " ";
       LOG(TRACE) << std::endl;
     }
+    auto vector_color = extra_data.find(optimization::VECTOR_COLOR_DATA_NAME);
+    if (vector_color != extra_data.end()) {
+      auto& colors = std::any_cast<optimization::VectorColorType&>(
+          vector_color->second);
+      auto c = colors.find(func.name);
+      if (c != colors.end()) this->vector_color = c->second;
+    }
     param_size = func.type->params.size();
   }
 
@@ -127,6 +134,7 @@ class Codegen final {
 
   std::vector<uint32_t> bb_ordering;
   std::map<uint32_t, arm::ConditionCode> inline_hint;
+  std::map<mir::inst::VarId, int> vector_color;
 
   std::optional<arm::ConditionCode> second_last_condition_code;
   std::optional<LastJump> last_jump;
@@ -152,6 +160,11 @@ class Codegen final {
   arm::Reg translate_value_to_reg(mir::inst::Value& v);
   arm::Reg translate_var_reg(mir::inst::VarId v);
 
+  bool is_vector(mir::inst::VarId v);
+  bool is_vector(mir::inst::Value& v);
+  arm::Reg translate_vector_address(mir::inst::Value& base,
+                                    mir::inst::Value& offset);
+
   void make_number(arm::Reg reg, uint32_t num);
 
   arm::MemoryOperand translate_var_to_memory_arg(mir::inst::VarId v);
@@ -185,6 +198,12 @@ class Codegen final {
   void translate_inst(mir::inst::OpInst& i);
   void translate_inst(mir::inst::OpAccInst& i);
 
+  void translate_vector_inst(mir::inst::AssignInst& i);
+  void translate_vector_inst(mir::inst::StoreOffsetInst& i);
+  void translate_vector_inst(mir::inst::LoadOffsetInst& i);
+  void translate_vector_inst(mir::inst::OpInst& i);
+  void translate_vector_inst(mir::inst::OpAccInst& i);
+
   void emit_phi_move(std::unordered_set<mir::inst::VarId>& i);
   void emit_compare(mir::inst::VarId& dest, mir::inst::Value& lhs,
                     mir::inst::Value& rhs, arm::ConditionCode cond,
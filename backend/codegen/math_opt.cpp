@@ -45,7 +45,7 @@ void MathOptimization::optimize_func(arm::Function &f) {
       //   break;
       // }
       case arm::OpCode::_Mod: {
-        auto i_ = dynamic_cast<arm::Arith3Inst *>(i.get());
+        auto i_ = arm::inst_cast<arm::Arith3Inst>(i.get());
         assert(i_ && "instruction must be Arith3Inst");
         // if (auto n = std::get_if<int32_t>(&i_->r2)) {
         // } else {
@@ -13,13 +13,21 @@
 #include <unordered_set>
 #include <vector>
 
+#include "../../arm_code/cfg.hpp"
 #include "../../include/aixlog.hpp"
+#include "../../opt.hpp"
 #include "../optimization/graph_color.hpp"
 #include "../optimization/optimization.hpp"
 
 namespace backend::codegen {
 using namespace arm;
 
+/// The allocator traces almost every step it takes. Formatting those messages
+/// costs several times more than the allocation itself, so they are only
+/// produced in verbose mode.
+static std::ostream null_log(nullptr);
+#define RA_LOG(...) (global_options.verbose ? LOG(__VA_ARGS__) : null_log)
+
 const std::set<Reg> GP_REGS = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10};
 
 /// An interval represented by this struct is a semi-open interval
@@ -187,7 +195,7 @@ class RegAllocator {
   void add_reg_use_in_bb_at_point(Reg reg, unsigned int point) {
     auto r_mapped = reg_map.find(reg);
     if (r_mapped != reg_map.end()) {
-      auto bb_iter = point_bb_map.lower_bound(point);
+      auto bb_iter = point_bb_map.upper_bound(point);
       bb_iter--;
       auto &reg_set = bb_used_regs.insert({bb_iter->second, {}}).first->second;
       reg_set.insert(r_mapped->second);
@@ -197,7 +205,7 @@ class RegAllocator {
 
 #pragma endregion
   void display_active_regs() {
-    auto &trace = LOG(TRACE);
+    auto &trace = RA_LOG(TRACE);
     trace << "active: ";
     for (auto x : active) {
       trace << x.first << "->[" << x.second.start << "," << x.second.end << "]"
@@ -228,7 +236,7 @@ class RegAllocator {
   void replace_read(MemoryOperand &r, int i);
 
   void invalidate_read(int pos) {
-    LOG(DEBUG) << "Invalidating: ";
+    RA_LOG(DEBUG) << "Invalidating: ";
     auto it = active.begin();
     while (it != active.end()) {
       if (it->second.end <= pos) {
@@ -243,13 +251,13 @@ class RegAllocator {
             ait++;
           }
         }
-        LOG(DEBUG) << it->first << " ";
+        RA_LOG(DEBUG) << it->first << " ";
         it = active.erase(it);
       } else {
         it++;
       }
     }
-    LOG(DEBUG) << std::endl;
+    RA_LOG(DEBUG) << std::endl;
   }
   Reg alloc_transient_reg(Interval i, std::optional<Reg> orig);
   Reg make_space(Reg r, Interval i);
@@ -281,19 +289,19 @@ void RegAllocator::alloc_regs() {
   construct_reg_map();
   calc_live_intervals();
 
-  LOG(TRACE, "bb_reg_use") << "BB starting point" << std::endl;
+  RA_LOG(TRACE, "bb_reg_use") << "BB starting point" << std::endl;
   for (auto x : point_bb_map) {
-    LOG(TRACE, "bb_reg_use") << x.first << " -> " << x.second << std::endl;
+    RA_LOG(TRACE, "bb_reg_use") << x.first << " -> " << x.second << std::endl;
   }
 
-  // LOG(TRACE, "bb_reg_use") << "BB Reg use:" << std::endl;
+  // RA_LOG(TRACE, "bb_reg_use") << "BB Reg use:" << std::endl;
   // for (auto x : bb_used_regs) {
-  //   LOG(TRACE, "bb_reg_use") << x.first << " -> ";
+  //   RA_LOG(TRACE, "bb_reg_use") << x.first << " -> ";
   //   for (auto r : x.second) {
-  //     display_reg_name(LOG(TRACE, "color_map"), r);
-  //     LOG(TRACE, "bb_reg_use") << " ";
+  //     display_reg_name(RA_LOG(TRACE, "color_map"), r);
+  //     RA_LOG(TRACE, "bb_reg_use") << " ";
   //   }
-  //   LOG(TRACE, "bb_reg_use") << std::endl;
+  //   RA_LOG(TRACE, "bb_reg_use") << std::endl;
   // }
   calc_reg_affinity();
 
@@ -366,76 +374,39 @@ void RegAllocator::alloc_regs() {
 }
 
 void RegAllocator::calc_live_intervals() {
-  int curr_bb = 0;
+  MachineCFG cfg(f);
+  for (auto &blk : cfg.blocks()) point_bb_map.insert({blk.begin, blk.id});
+
   for (int i = 0; i < f.inst.size(); i++) {
     auto inst_ = &*f.inst[i];
-    if (auto x = dynamic_cast<PureInst *>(inst_)) {
-      //   noop
-    } else if (auto x = dynamic_cast<Arith4Inst *>(inst_)) {
-      add_reg_read(x->r1, i);
-      add_reg_read(x->r2, i);
-      add_reg_read(x->r3, i);
-      add_reg_write(x->rd, i);
-    } else if (auto x = dynamic_cast<Arith3Inst *>(inst_)) {
-      add_reg_read(x->r1, i);
-      add_reg_read(x->r2, i);
-      add_reg_write(x->rd, i);
-    } else if (auto x = dynamic_cast<Arith2Inst *>(inst_)) {
-      if (x->op == arm::OpCode::Mov || x->op == arm::OpCode::MovT ||
-          x->op == arm::OpCode::Mvn) {
-        add_reg_write(x->r1, i);
-        if (auto r2 = std::get_if<RegisterOperand>(&x->r2);
-            x->op == arm::OpCode::Mov && r2 && r2->shift_amount == 0) {
-          if (!is_virtual_register(x->r1) &&
-              !is_virtual_register(x->r2.get_reg()))
-            reg_affine.insert({x->r1, x->r2.get_reg()});
-        }
-      } else {
-        add_reg_read(x->r1, i);
-      }
-      add_reg_read(x->r2, i);
-    } else if (auto x = dynamic_cast<BrInst *>(inst_)) {
-      if (x->op == arm::OpCode::Bl) {
+    switch (inst_->op) {
+      case OpCode::Push:
+        // The prologue saves registers; treat them as written here
+        for (auto rd : static_cast<PushPopInst *>(inst_)->regs)
+          add_reg_write(rd, i);
+        break;
+      case OpCode::Pop:
+        for (auto rd : static_cast<PushPopInst *>(inst_)->regs)
+          add_reg_read(rd, i);
+        break;
+      case OpCode::Bl:
         bl_points.insert(i);
+        break;
+      case OpCode::Bx:
+        break;
+      case OpCode::Mov: {
+        auto x = static_cast<Arith2Inst *>(inst_);
+        if (auto r2 = std::get_if<RegisterOperand>(&x->r2);
+            r2 && r2->shift_amount == 0 && !is_virtual_register(x->r1) &&
+            !is_virtual_register(r2->reg))
+          reg_affine.insert({x->r1, r2->reg});
       }
-    } else if (auto x = dynamic_cast<LoadStoreInst *>(inst_)) {
-      if (x->op == arm::OpCode::LdR) {
-        add_reg_write(x->rd, i);
-      } else {
-        // StR
-        add_reg_read(x->rd, i);
-      }
-      if (auto mem = std::get_if<MemoryOperand>(&x->mem)) add_reg_read(*mem, i);
-    } else if (auto x = dynamic_cast<MultLoadStoreInst *>(inst_)) {
-      if (x->op == arm::OpCode::LdM) {
-        for (auto rd : x->rd) add_reg_write(rd, i);
-      } else {
-        // StM
-        for (auto rd : x->rd) add_reg_read(rd, i);
-      }
-      add_reg_read(x->rn, i);
-    } else if (auto x = dynamic_cast<PushPopInst *>(inst_)) {
-      if (x->op == arm::OpCode::Push) {
-        for (auto rd : x->regs) add_reg_write(rd, i);
-      } else {
-        // pop
-        for (auto rd : x->regs) add_reg_read(rd, i);
-      }
-    } else if (auto x = dynamic_cast<LabelInst *>(inst_)) {
-      if (x->label.find(".bb_") == 0) {
-        try {
-          auto bb_id_idx = x->label.find_last_of("$");
-          auto id_str = x->label.substr(bb_id_idx + 1);
-          auto bb_id = std::stoi(id_str);
-          point_bb_map.insert({i, bb_id});
-          curr_bb = bb_id;
-        } catch (std::exception &i) {
-          LOG(WARNING) << typeid(i).name() << ": " << i.what() << std::endl;
-        }
-      }
-    } else
-      //   noop
-      ;
+        [[fallthrough]];
+      default:
+        for (auto r : cfg.uses(i)) add_reg_read(r, i);
+        for (auto r : cfg.defs(i)) add_reg_write(r, i);
+        break;
+    }
   }
 }
 
@@ -452,7 +423,7 @@ void RegAllocator::construct_reg_map() {
         reg_reverse_map.insert({reg, vreg_id});
         used_regs.insert(reg);
         {
-          auto &trace = LOG(TRACE);
+          auto &trace = RA_LOG(TRACE);
           trace << var_id << " <- ";
           display_reg_name(trace, vreg_id);
           trace << " <- ";
@@ -462,7 +433,7 @@ void RegAllocator::construct_reg_map() {
       } else {
         spill_positions.insert({vreg_id, stack_size});
         {
-          auto &trace = LOG(TRACE);
+          auto &trace = RA_LOG(TRACE);
           trace << "$" << var_id << " <- ";
           display_reg_name(trace, vreg_id);
           trace << " <- sp + " << stack_size << std::endl;
@@ -473,7 +444,7 @@ void RegAllocator::construct_reg_map() {
     } else {
       // local variable
       {
-        auto &trace = LOG(TRACE);
+        auto &trace = RA_LOG(TRACE);
         trace << "$" << var_id << " <- ";
         display_reg_name(trace, vreg_id);
         trace << " <- local ";
@@ -499,9 +470,9 @@ void RegAllocator::replace_read(MemoryOperand &r, int i) {
 Reg RegAllocator::alloc_transient_reg(Interval i, std::optional<Reg> orig) {
   Reg r = -1;
   if (orig) {
-    LOG(TRACE) << "orig ";
-    display_reg_name(LOG(TRACE), orig.value());
-    LOG(TRACE) << " ";
+    RA_LOG(TRACE) << "orig ";
+    display_reg_name(RA_LOG(TRACE), orig.value());
+    RA_LOG(TRACE) << " ";
     auto it = active_reg_map.begin();
     while (it != active_reg_map.end()) {
       if (it->first == orig)
@@ -510,7 +481,7 @@ Reg RegAllocator::alloc_transient_reg(Interval i, std::optional<Reg> orig) {
         it++;
     }
     if (it != active_reg_map.end()) {
-      LOG(TRACE) << "r-> " << it->second << std::endl;
+      RA_LOG(TRACE) << "r-> " << it->second << std::endl;
       auto r = it->second;
       auto x = *it;
       active_reg_map.erase(it);
@@ -580,7 +551,7 @@ Reg RegAllocator::alloc_transient_reg(Interval i, std::optional<Reg> orig) {
         OpCode::StR, spill_phys,
         MemoryOperand(REG_SP, spill_pos + stack_offset), cur_cond));
 
-    auto &trace = LOG(TRACE);
+    auto &trace = RA_LOG(TRACE);
     trace << "Spilling: ";
     display_reg_name(trace, spill_phys);
     trace << " -> ";
@@ -605,7 +576,7 @@ Reg RegAllocator::alloc_transient_reg(Interval i, std::optional<Reg> orig) {
   if (orig) {
     this->active_reg_map.push_back({orig.value(), r});
   }
-  LOG(TRACE) << "-> " << r << std::endl;
+  RA_LOG(TRACE) << "-> " << r << std::endl;
   display_active_regs();
   return r;
 }
@@ -614,18 +585,18 @@ Reg RegAllocator::alloc_transient_reg(Interval i, std::optional<Reg> orig) {
 void RegAllocator::replace_read(Reg &r, int i,
                                 std::optional<Reg> pre_alloc_transient) {
   auto disp_reg = [r, i]() {
-    display_reg_name(LOG(TRACE), r);
-    LOG(TRACE) << " at: " << i << " ";
+    display_reg_name(RA_LOG(TRACE), r);
+    RA_LOG(TRACE) << " at: " << i << " ";
   };
   r = get_collapse_reg(r);
   if (!is_virtual_register(r)) {
     disp_reg();
-    LOG(TRACE) << "phys" << std::endl;
+    RA_LOG(TRACE) << "phys" << std::endl;
     return;
   } else if (auto reg_map_r = reg_map.find(r); reg_map_r != reg_map.end()) {
     // This register is allocated with graph-coloring
     disp_reg();
-    LOG(TRACE) << "graph " << reg_map_r->second << std::endl;
+    RA_LOG(TRACE) << "graph " << reg_map_r->second << std::endl;
     r = reg_map_r->second;
     return;
   } else if (auto spill_r = spilled_regs.find(r);
@@ -646,7 +617,7 @@ void RegAllocator::replace_read(Reg &r, int i,
 
     if (inst_sink.size() > 0) {
       auto &x = inst_sink.back();
-      if (auto x_ = dynamic_cast<LoadStoreInst *>(&*x)) {
+      if (auto x_ = inst_cast<LoadStoreInst>(&*x)) {
         if (auto x__ = std::get_if<MemoryOperand>(&x_->mem);
             x_->op == arm::OpCode::StR && x_->rd == rd &&
             (*x__) == MemoryOperand(REG_SP, spill_pos + stack_offset) &&
@@ -664,7 +635,7 @@ void RegAllocator::replace_read(Reg &r, int i,
           cur_cond));
     }
     disp_reg();
-    LOG(TRACE) << "spill " << spill_pos << "with rd=" << rd << std::endl;
+    RA_LOG(TRACE) << "spill " << spill_pos << "with rd=" << rd << std::endl;
     r = rd;
     return;
   } else {
@@ -672,9 +643,9 @@ void RegAllocator::replace_read(Reg &r, int i,
     auto live_interval = live_intervals.at(r);
     r = alloc_transient_reg(live_interval, r);
     disp_reg();
-    LOG(TRACE) << "transient ";
-    display_reg_name(LOG(TRACE), r);
-    LOG(TRACE) << std::endl;
+    RA_LOG(TRACE) << "transient ";
+    display_reg_name(RA_LOG(TRACE), r);
+    RA_LOG(TRACE) << std::endl;
     return;
   }
 }
@@ -716,8 +687,8 @@ ReplaceWriteAction RegAllocator::pre_replace_write(
     }
 
     r = rd;
-    display_reg_name(LOG(TRACE), r_);
-    LOG(TRACE) << " at: " << i << " to be spilled" << std::endl;
+    display_reg_name(RA_LOG(TRACE), r_);
+    RA_LOG(TRACE) << " at: " << i << " to be spilled" << std::endl;
     return {r_, rd, ReplaceWriteKind::Spill};
   } else if (auto spill_r = spilled_regs.find(r);
              spill_r != spilled_regs.end()) {
@@ -733,9 +704,9 @@ ReplaceWriteAction RegAllocator::pre_replace_write(
     }
 
     r = rd;
-    display_reg_name(LOG(TRACE), r_);
-    LOG(TRACE) << " at: " << i << " ";
-    LOG(TRACE) << "spill " << pos << std::endl;
+    display_reg_name(RA_LOG(TRACE), r_);
+    RA_LOG(TRACE) << " at: " << i << " ";
+    RA_LOG(TRACE) << "spill " << pos << std::endl;
     return {r_, rd, ReplaceWriteKind::Spill};
   } else {
     // Is temporary register
@@ -750,19 +721,19 @@ ReplaceWriteAction RegAllocator::pre_replace_write(
 
 void RegAllocator::replace_write(ReplaceWriteAction r, int i) {
   auto disp_reg = [&]() {
-    display_reg_name(LOG(TRACE), r.from);
-    LOG(TRACE) << " at: " << i << " ";
+    display_reg_name(RA_LOG(TRACE), r.from);
+    RA_LOG(TRACE) << " at: " << i << " ";
   };
   if (r.kind == ReplaceWriteKind::Phys) {
     // is physical register; mark as occupied
     active.insert({r.replace_with, Interval(i, UINT32_MAX)});
     disp_reg();
-    LOG(TRACE) << "phys " << r.replace_with << std::endl;
+    RA_LOG(TRACE) << "phys " << r.replace_with << std::endl;
     return;
   } else if (r.kind == ReplaceWriteKind::Graph) {
     // This register is allocated with graph-coloring
     disp_reg();
-    LOG(TRACE) << "graph" << std::endl;
+    RA_LOG(TRACE) << "graph" << std::endl;
   } else if (r.kind == ReplaceWriteKind::Spill) {
     // this register is allocated in stack
     Reg rd = r.replace_with;
@@ -771,7 +742,7 @@ void RegAllocator::replace_write(ReplaceWriteAction r, int i) {
     bool del = false;
     if (inst_sink.size() > 0) {
       auto &x = inst_sink.back();
-      if (auto x_ = dynamic_cast<LoadStoreInst *>(&*x)) {
+      if (auto x_ = inst_cast<LoadStoreInst>(&*x)) {
         if (auto x__ = std::get_if<MemoryOperand>(&x_->mem);
             x_->op == arm::OpCode::StR && x__->r1 == rd &&
             x_->cond == cur_cond &&
@@ -787,10 +758,10 @@ void RegAllocator::replace_write(ReplaceWriteAction r, int i) {
     }
     wrote_to.erase(r.from);
     disp_reg();
-    LOG(TRACE) << "spill " << pos << " " << del << std::endl;
+    RA_LOG(TRACE) << "spill " << pos << " " << del << std::endl;
   } else {
     disp_reg();
-    LOG(TRACE) << "temp" << std::endl;
+    RA_LOG(TRACE) << "temp" << std::endl;
     // Is temporary register
     // the register should already be written to or read from
 
@@ -799,7 +770,7 @@ void RegAllocator::replace_write(ReplaceWriteAction r, int i) {
 }
 
 void RegAllocator::force_free(Reg r, bool also_erase_map, bool write_back) {
-  auto &trace = LOG(TRACE);
+  auto &trace = RA_LOG(TRACE);
   display_reg_name(trace, r);
   if (auto x = active.find(r); x != active.end()) {
     for (auto y : active_reg_map) {
@@ -919,9 +890,9 @@ void RegAllocator::calc_reg_affinity() {
 void RegAllocator::perform_load_stores() {
   for (int i = 0; i < f.inst.size(); i++) {
     auto inst_ = &*f.inst[i];
-    LOG(TRACE) << " " << std::endl << *inst_ << std::endl;
+    RA_LOG(TRACE) << " " << std::endl << *inst_ << std::endl;
     cur_cond = inst_->cond;
-    if (auto x = dynamic_cast<Arith3Inst *>(inst_)) {
+    if (auto x = inst_cast<Arith3Inst>(inst_)) {
       replace_read(x->r1, i);
       replace_read(x->r2, i);
       invalidate_read(i);
@@ -929,7 +900,7 @@ void RegAllocator::perform_load_stores() {
       auto prw = pre_replace_write(x->rd, i);
       inst_sink.push_back(std::move(f.inst[i]));
       replace_write(prw, i);
-    } else if (auto x = dynamic_cast<Arith4Inst *>(inst_)) {
+    } else if (auto x = inst_cast<Arith4Inst>(inst_)) {
       replace_read(x->r1, i);
       replace_read(x->r2, i);
       replace_read(x->r3, i);
@@ -938,7 +909,7 @@ void RegAllocator::perform_load_stores() {
       auto prw = pre_replace_write(x->rd, i);
       inst_sink.push_back(std::move(f.inst[i]));
       replace_write(prw, i);
-    } else if (auto x = dynamic_cast<Arith2Inst *>(inst_)) {
+    } else if (auto x = inst_cast<Arith2Inst>(inst_)) {
       if (x->op == arm::OpCode::Mov || x->op == arm::OpCode::Mvn) {
         replace_read(x->r2, i);
         invalidate_read(i);
@@ -960,7 +931,7 @@ void RegAllocator::perform_load_stores() {
         invalidate_read(i);
         inst_sink.push_back(std::move(f.inst[i]));
       }
-    } else if (auto x = dynamic_cast<LoadStoreInst *>(inst_)) {
+    } else if (auto x = inst_cast<LoadStoreInst>(inst_)) {
       if (auto mem = std::get_if<MemoryOperand>(&x->mem)) {
         replace_read(*mem, i);
       }
@@ -976,7 +947,7 @@ void RegAllocator::perform_load_stores() {
         invalidate_read(i);
         inst_sink.push_back(std::move(f.inst[i]));
       }
-    } else if (auto x = dynamic_cast<MultLoadStoreInst *>(inst_)) {
+    } else if (auto x = inst_cast<MultLoadStoreInst>(inst_)) {
       throw prelude::NotImplementedException();
       if (x->op == arm::OpCode::LdM) {
         for (auto rd : x->rd) add_reg_write(rd, i);
@@ -986,23 +957,23 @@ void RegAllocator::perform_load_stores() {
       }
       invalidate_read(i);
       add_reg_read(x->rn, i);
-    } else if (auto x = dynamic_cast<PushPopInst *>(inst_)) {
+    } else if (auto x = inst_cast<PushPopInst>(inst_)) {
       // push pop only use gpr
       invalidate_read(i);
       inst_sink.push_back(std::move(f.inst[i]));
-    } else if (auto x = dynamic_cast<LabelInst *>(inst_)) {
+    } else if (auto x = inst_cast<LabelInst>(inst_)) {
       invalidate_read(i);
 
       inst_sink.push_back(std::move(f.inst[i]));
       if (x->label.find(".ld_pc") == 0 && inst_sink.size() >= 2 &&
-          dynamic_cast<LoadStoreInst *>(&**(inst_sink.end() - 2))) {
+          inst_cast<LoadStoreInst>(&**(inst_sink.end() - 2))) {
         // HACK: If it's load_pc label, delay store once more
         std::swap(*(inst_sink.end() - 2), *(inst_sink.end() - 1));
       }
       if (x->label.find(".bb" == 0)) {
         bb_reset = true;
       }
-    } else if (auto x = dynamic_cast<BrInst *>(inst_)) {
+    } else if (auto x = inst_cast<BrInst>(inst_)) {
       if (delayed_store) {
         // TODO: check if this is right
         auto [r, rd] = delayed_store.value();
@@ -1049,7 +1020,28 @@ void RegAllocator::perform_load_stores() {
       } else {
         inst_sink.push_back(std::move(f.inst[i]));
       }
-    } else if (auto x = dynamic_cast<CtrlInst *>(inst_)) {
+    } else if (auto x = inst_cast<NeonInst>(inst_)) {
+      // Vector registers are colored before codegen; only the core registers
+      // need allocating
+      if (x->op == arm::OpCode::VLd1 || x->op == arm::OpCode::VSt1 ||
+          x->op == arm::OpCode::VDup) {
+        replace_read(x->r1, i);
+      }
+      invalidate_read(i);
+      if (x->op == arm::OpCode::VMovLane) {
+        wrote_to.insert(x->rd);
+        auto prw = pre_replace_write(x->rd, i);
+        inst_sink.push_back(std::move(f.inst[i]));
+        replace_write(prw, i);
+        if (prw.kind == ReplaceWriteKind::Phys) {
+          // The lane is read right by the next instruction, so the physical
+          // register is free again after it
+          active.at(prw.replace_with).end = i + 1;
+        }
+      } else {
+        inst_sink.push_back(std::move(f.inst[i]));
+      }
+    } else if (auto x = inst_cast<CtrlInst>(inst_)) {
       if (x->key == "offset_stack") {
         int offset = std::any_cast<int>(x->val);
         stack_offset += offset;
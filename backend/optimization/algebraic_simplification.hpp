@@ -1,17 +1,102 @@
 #pragma once
 
+#include <set>
 #include <string>
+#include <unordered_map>
+#include <vector>
 
+#include "../../mir/value_range.hpp"
 #include "../backend.hpp"
+#include "optimization.hpp"
 
 namespace optimization::algebraic_simplification {
+
+/// Strength reduction of multiplications, divisions and remainders by
+/// constants, and folding of comparisons known from value ranges.
+///
+/// Division and remainder by a power of two are a plain shift and mask where
+/// the dividend is known to be non-negative. Elsewhere the dividend is first
+/// biased by `2^k - 1` when negative, so the quotient rounds towards zero
+/// like `sdiv` does; a remainder only compared against zero needs no bias.
+/// Other divisors use a multiplication by a magic number, with the same sign
+/// correction left out for non-negative dividends.
+///
+/// Comparisons whose outcome follows from the ranges of their operands, or
+/// from the branches guarding them, become constants, and so do the branches
+/// testing them. Branches marked `JumpKind::Loop` are kept together with the
+/// comparisons they test, as with SCCP.
 class AlgebraicSimplification : public backend::MirOptimizePass {
  public:
   std::string name = "AlgebraicSimplification";
 
   std::string pass_name() const { return name; }
 
-  void optimize_func(std::string name, mir::inst::MirFunction& mirFunction) {
+  void optimize_func(std::string name, mir::inst::MirFunction& mirFunction,
+                     std::map<std::string, std::any>& extra_data_repo) {
+    auto& du = mirFunction.def_use();
+    uint32_t folded = 0;
+    uint32_t unsignedOps = 0;
+
+    // Everything the ranges tell is read before any instruction changes
+    std::set<mir::inst::Inst*> nonNegative;
+    std::set<mir::inst::Inst*> zeroTested;
+    std::unordered_map<mir::inst::Inst*, bool> decided;
+    {
+      mir::inst::ValueRanges ranges(mirFunction);
+      for (auto& [id, blk] : mirFunction.basic_blks) {
+        for (auto& inst : blk.inst) {
+          auto opPtr = dynamic_cast<mir::inst::OpInst*>(inst.get());
+          if (opPtr == nullptr) continue;
+          if (opPtr->op == mir::inst::Op::Div ||
+              opPtr->op == mir::inst::Op::Rem) {
+            if (ranges.info_at(opPtr->lhs, id).non_negative()) {
+              nonNegative.insert(opPtr);
+            }
+            if (opPtr->op == mir::inst::Op::Rem &&
+                isOnlyTestedAgainstZero(du, opPtr->dest)) {
+              zeroTested.insert(opPtr);
+            }
+          } else if (du.def_count(opPtr->dest) == 1 &&
+                     !testedByLoop(mirFunction, du, opPtr->dest)) {
+            auto res = ranges.compare(opPtr->op, opPtr->lhs, opPtr->rhs, id);
+            if (res) decided.insert({opPtr, *res});
+          }
+        }
+      }
+    }
+
+    std::unordered_map<mir::inst::VarId, int32_t> conds;
+    for (auto& [id, blk] : mirFunction.basic_blks) {
+      for (auto& inst : blk.inst) {
+        auto it = decided.find(inst.get());
+        if (it == decided.end()) continue;
+        auto value = int32_t(it->second);
+        decided.erase(it);
+        conds.insert({inst->dest, value});
+        inst = std::make_unique<mir::inst::AssignInst>(inst->dest,
+                                                       mir::inst::Value(value));
+        folded++;
+      }
+    }
+    for (auto& [id, blk] : mirFunction.basic_blks) {
+      auto& jump = blk.jump;
+      if (jump.kind != mir::inst::JumpInstructionKind::BrCond ||
+          !conds.count(jump.cond_or_ret.value())) {
+        continue;
+      }
+      auto taken = conds.at(jump.cond_or_ret.value());
+      auto target = taken ? jump.bb_true : jump.bb_false;
+      auto other = taken ? jump.bb_false : jump.bb_true;
+      jump = mir::inst::JumpInstruction(mir::inst::JumpInstructionKind::Br,
+                                        target, -1, std::nullopt,
+                                        jump.jump_kind);
+      if (other != target) mirFunction.basic_blks.at(other).preceding.erase(id);
+    }
+    if (!conds.empty()) {
+      mirFunction.invalidate_def_use();
+      remove_unreachable_blocks(mirFunction);
+    }
+
     for (auto blksIter = mirFunction.basic_blks.begin();
          blksIter != mirFunction.basic_blks.end(); blksIter++) {
       for (size_t i = 0; i < blksIter->second.inst.size(); i++) {
@@ -33,23 +118,17 @@ class AlgebraicSimplification : public backend::MirOptimizePass {
                       opPtr->op = mir::inst::Op::Sub;
                       opPtr->rhs = opPtr->lhs;
                       opPtr->lhs = mir::inst::Value(0);
-                    } else if ((std::abs(num) & (std::abs(num) - 1)) == 0) {
+                    } else if (num > 0 && (num & (num - 1)) == 0) {
+                      // Negative factors are left alone: negating the shift
+                      // would define `dest` twice
                       uint32_t index;
                       uint32_t mul;
 
-                      mul = std::abs(num);
+                      mul = num;
                       for (index = 0; (mul & 1) == 0; mul >>= 1, index++)
                         ;
                       opPtr->op = mir::inst::Op::Shl;
                       opPtr->rhs = mir::inst::Value(index);
-
-                      if (num < 0) {
-                        insertInst(blksIter->second.inst, i + 1,
-                                   std::make_unique<mir::inst::OpInst>(
-                                       opPtr->dest, mir::inst::Value(0),
-                                       mir::inst::Value(opPtr->dest),
-                                       mir::inst::Op::Sub));
-                      }
                     }
                   }
                 }
@@ -63,30 +142,67 @@ class AlgebraicSimplification : public backend::MirOptimizePass {
                       opPtr->op = mir::inst::Op::Sub;
                       opPtr->rhs = opPtr->lhs;
                       opPtr->lhs = mir::inst::Value(0);
-                    } else if ((std::abs(num) & (std::abs(num) - 1)) == 0) {
+                    } else if (num != INT32_MIN &&
+                               (std::abs(num) & (std::abs(num) - 1)) == 0) {
                       uint32_t index;
                       uint32_t mul;
+                      bool exact;
 
                       mul = std::abs(num);
                       for (index = 0; (mul & 1) == 0; mul >>= 1, index++)
                         ;
-                      opPtr->op = mir::inst::Op::ShrA;
-                      opPtr->rhs = mir::inst::Value(index);
+                      exact = index == 0 || nonNegative.count(opPtr);
+                      if (num > 0 && exact) {
+                        if (index > 0) unsignedOps++;
+                        opPtr->op = index > 0 ? mir::inst::Op::Shr
+                                              : mir::inst::Op::ShrA;
+                        opPtr->rhs = mir::inst::Value(index);
+                        break;
+                      }
+
+                      uint32_t offIndex;
+                      mir::inst::VarId quotient;
+                      mir::inst::VarId biased;
 
+                      offIndex = 0;
+                      quotient = num > 0 ? opPtr->dest
+                                         : mir::inst::VarId(
+                                               getNewVar(mirFunction));
+                      if (exact) {
+                        unsignedOps++;
+                        insertInst(
+                            blksIter->second.inst, i + ++offIndex,
+                            std::make_unique<mir::inst::OpInst>(
+                                quotient, opPtr->lhs, mir::inst::Value(index),
+                                mir::inst::Op::Shr));
+                      } else {
+                        biased = getNewVar(mirFunction);
+                        insertRoundingBias(biased, opPtr->lhs, index,
+                                           mirFunction, blksIter->second.inst,
+                                           i, offIndex);
+                        insertInst(
+                            blksIter->second.inst, i + ++offIndex,
+                            std::make_unique<mir::inst::OpInst>(
+                                quotient, biased, mir::inst::Value(index),
+                                mir::inst::Op::ShrA));
+                      }
                       if (num < 0) {
-                        insertInst(blksIter->second.inst, i + 1,
+                        insertInst(blksIter->second.inst, i + ++offIndex,
                                    std::make_unique<mir::inst::OpInst>(
                                        opPtr->dest, mir::inst::Value(0),
-                                       mir::inst::Value(opPtr->dest),
-                                       mir::inst::Op::Sub));
+                                       quotient, mir::inst::Op::Sub));
                       }
+                      blksIter->second.inst.erase(
+                          blksIter->second.inst.begin() + i);
+                      i--;
                     } else {
                       uint32_t offIndex;
 
                       offIndex = 0;
 
                       insertDivideInstsFromPaper(
-                          num, opPtr->dest, opPtr->lhs, mirFunction,
+                          num, opPtr->dest, opPtr->lhs,
+                          nonNegative.count(opPtr), mirFunction,
                           blksIter->second.inst, i, offIndex);
 
                       blksIter->second.inst.erase(
@@ -101,16 +217,50 @@ class AlgebraicSimplification : public backend::MirOptimizePass {
                 if (!opPtr->lhs.is_immediate() && opPtr->rhs.is_immediate()) {
                   int32_t num = *(opPtr->rhs.get_if<int32_t>());
                   if (num != 0) {
-                    if ((std::abs(num) & (std::abs(num) - 1)) == 0) {
+                    if (num != INT32_MIN &&
+                        (std::abs(num) & (std::abs(num) - 1)) == 0) {
                       uint32_t index;
                       uint32_t rem;
 
                       rem = std::abs(num);
                       for (index = 0; (rem & 1) == 0; rem >>= 1, index++)
                         ;
-                      opPtr->op = mir::inst::Op::And;
-                      opPtr->rhs = mir::inst::Value(((uint32_t)1 << index) - 1);
-                      // TODO: deal the problem of negative lhs
+                      if (index == 0 || nonNegative.count(opPtr) ||
+                          zeroTested.count(opPtr)) {
+                        if (index > 0) unsignedOps++;
+                        opPtr->op = mir::inst::Op::And;
+                        opPtr->rhs =
+                            mir::inst::Value(((uint32_t)1 << index) - 1);
+                        break;
+                      }
+
+                      // `lhs - (biased & -2^k)`, keeping the sign of `lhs`
+                      uint32_t offIndex;
+                      uint32_t biased;
+                      uint32_t rounded;
+                      uint32_t mask;
+
+                      offIndex = 0;
+                      biased = getNewVar(mirFunction);
+                      insertRoundingBias(mir::inst::VarId(biased), opPtr->lhs,
+                                         index, mirFunction,
+                                         blksIter->second.inst, i, offIndex);
+                      rounded = getNewVar(mirFunction);
+                      mask = ~(((uint32_t)1 << index) - 1);
+                      insertInst(blksIter->second.inst, i + ++offIndex,
+                                 std::make_unique<mir::inst::OpInst>(
+                                     mir::inst::VarId(rounded),
+                                     mir::inst::VarId(biased),
+                                     mir::inst::Value(int32_t(mask)),
+                                     mir::inst::Op::And));
+                      insertInst(blksIter->second.inst, i + ++offIndex,
+                                 std::make_unique<mir::inst::OpInst>(
+                                     opPtr->dest, opPtr->lhs,
+                                     mir::inst::VarId(rounded),
+                                     mir::inst::Op::Sub));
+                      blksIter->second.inst.erase(
+                          blksIter->second.inst.begin() + i);
+                      i--;
                     } else {
                       uint32_t offIndex;
 
@@ -121,7 +271,8 @@ class AlgebraicSimplification : public backend::MirOptimizePass {
 
                       tmp1 = getNewVar(mirFunction);
                       insertDivideInstsFromPaper(
-                          num, mir::inst::VarId(tmp1), opPtr->lhs, mirFunction,
+                          num, mir::inst::VarId(tmp1), opPtr->lhs,
+                          nonNegative.count(opPtr), mirFunction,
                           blksIter->second.inst, i, offIndex);
                       tmp2 = getNewVar(mirFunction);
                       insertInst(
@@ -155,18 +306,96 @@ class AlgebraicSimplification : public backend::MirOptimizePass {
         }
       }
     }
+    mirFunction.invalidate_def_use();
+
+    if (folded || unsignedOps) {
+      backend::report_statistic(
+          extra_data_repo, pass_name(),
+          name + ": " + std::to_string(folded) + " comparisons folded, " +
+              std::to_string(unsignedOps) +
+              " divisions by powers of two on non-negative values");
+    }
   }
 
   void optimize_mir(mir::inst::MirPackage& package,
                     std::map<std::string, std::any>& extra_data_repo) {
     for (auto& i : package.functions) {
       if (!i.second.type->is_extern) {
-        optimize_func(i.first, i.second);
+        optimize_func(i.first, i.second, extra_data_repo);
       }
     }
   }
 
  private:
+  /// Whether `var` only feeds `var == 0` and `var != 0`
+  bool isOnlyTestedAgainstZero(mir::inst::DefUseChain& du,
+                               mir::inst::VarId var) {
+    auto uses = du.uses_of(var);
+    if (uses.empty()) return false;
+    for (auto& use : uses) {
+      auto opPtr = dynamic_cast<mir::inst::OpInst*>(use.inst);
+      if (opPtr == nullptr || (opPtr->op != mir::inst::Op::Eq &&
+                               opPtr->op != mir::inst::Op::Neq)) {
+        return false;
+      }
+      auto isZero = [](mir::inst::Value& val) {
+        return val.is_immediate() && *val.get_if<int32_t>() == 0;
+      };
+      auto isVar = [&](mir::inst::Value& val) {
+        return !val.is_immediate() && !val.has_shift() &&
+               *val.get_if<mir::inst::VarId>() == var;
+      };
+      if (!(isVar(opPtr->lhs) && isZero(opPtr->rhs)) &&
+          !(isZero(opPtr->lhs) && isVar(opPtr->rhs))) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  bool testedByLoop(mir::inst::MirFunction& func, mir::inst::DefUseChain& du,
+                    mir::inst::VarId var) {
+    for (auto& use : du.uses_of(var)) {
+      if (use.is_jump() && func.basic_blks.at(use.blk).jump.jump_kind ==
+                               mir::inst::JumpKind::Loop) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  /// `dest = lhs + (lhs < 0 ? 2^k - 1 : 0)`, after which shifting right by
+  /// `k` rounds towards zero
+  void insertRoundingBias(
+      mir::inst::VarId dest, mir::inst::Value lhs, uint32_t k,
+      mir::inst::MirFunction& mirFunction,
+      std::vector<std::unique_ptr<mir::inst::Inst>>& insts, size_t i,
+      uint32_t& offIndex) {
+    uint32_t sign;
+    uint32_t bias;
+
+    bias = getNewVar(mirFunction);
+    if (k == 1) {
+      insertInst(insts, i + ++offIndex,
+                 std::make_unique<mir::inst::OpInst>(
+                     mir::inst::VarId(bias), lhs, mir::inst::Value(31),
+                     mir::inst::Op::Shr));
+    } else {
+      sign = getNewVar(mirFunction);
+      insertInst(insts, i + ++offIndex,
+                 std::make_unique<mir::inst::OpInst>(
+                     mir::inst::VarId(sign), lhs, mir::inst::Value(31),
+                     mir::inst::Op::ShrA));
+      insertInst(insts, i + ++offIndex,
+                 std::make_unique<mir::inst::OpInst>(
+                     mir::inst::VarId(bias), mir::inst::VarId(sign),
+                     mir::inst::Value(int32_t(32 - k)), mir::inst::Op::Shr));
+    }
+    insertInst(insts, i + ++offIndex,
+               std::make_unique<mir::inst::OpInst>(
+                   dest, lhs, mir::inst::VarId(bias), mir::inst::Op::Add));
+  }
+
   // num != 0
   uint32_t upLog2(uint32_t num) {
     uint32_t leadZero;
@@ -207,9 +436,10 @@ class AlgebraicSimplification : public backend::MirOptimizePass {
     }
   }
 
+  // A non-negative `lhs` needs no correction for its sign
   void insertDivideInstsFromPaper(
       int32_t num, mir::inst::VarId dest, mir::inst::Value lhs,
-      mir::inst::MirFunction& mirFunction,
+      bool nonNegative, mir::inst::MirFunction& mirFunction,
       std::vector<std::unique_ptr<mir::inst::Inst>>& insts, size_t i,
       uint32_t& offIndex) {
     uint32_t numAbs;
@@ -221,8 +451,10 @@ class AlgebraicSimplification : public backend::MirOptimizePass {
 
     uint32_t tmp1;
     uint32_t tmp2;
+    mir::inst::VarId quotient;
 
     numAbs = std::abs(num);
+    quotient = num >= 0 ? dest : mir::inst::VarId(getNewVar(mirFunction));
     if ((l = upLog2(numAbs)) < 1) {
       l = 1;
     }
@@ -237,20 +469,22 @@ class AlgebraicSimplification : public backend::MirOptimizePass {
                  std::unique_ptr<mir::inst::Inst>(new mir::inst::OpInst(
                      mir::inst::VarId(tmp1), mir::inst::Value(m), lhs,
                      mir::inst::Op::MulSh)));
-      tmp2 = getNewVar(mirFunction);
+      tmp2 = nonNegative ? quotient.id : getNewVar(mirFunction);
       insertInst(insts, i + ++offIndex,
                  std::unique_ptr<mir::inst::Inst>(new mir::inst::OpInst(
                      mir::inst::VarId(tmp2), mir::inst::VarId(tmp1),
                      mir::inst::Value(shPost), mir::inst::Op::ShrA)));
-      tmp1 = getNewVar(mirFunction);
-      insertInst(insts, i + ++offIndex,
-                 std::unique_ptr<mir::inst::Inst>(new mir::inst::OpInst(
-                     mir::inst::VarId(tmp1), lhs, mir::inst::Value(31),
-                     mir::inst::Op::ShrA)));
-      insertInst(insts, i + ++offIndex,
-                 std::unique_ptr<mir::inst::Inst>(new mir::inst::OpInst(
-                     dest, mir::inst::VarId(tmp2), mir::inst::VarId(tmp1),
-                     mir::inst::Op::Sub)));
+      if (!nonNegative) {
+        tmp1 = getNewVar(mirFunction);
+        insertInst(insts, i + ++offIndex,
+                   std::unique_ptr<mir::inst::Inst>(new mir::inst::OpInst(
+                       mir::inst::VarId(tmp1), lhs, mir::inst::Value(31),
+                       mir::inst::Op::ShrA)));
+        insertInst(insts, i + ++offIndex,
+                   std::unique_ptr<mir::inst::Inst>(new mir::inst::OpInst(
+                       quotient, mir::inst::VarId(tmp2),
+                       mir::inst::VarId(tmp1), mir::inst::Op::Sub)));
+      }
     } else {
       tmp1 = getNewVar(mirFunction);
       insertInst(insts, i + ++offIndex,
@@ -262,25 +496,28 @@ class AlgebraicSimplification : public backend::MirOptimizePass {
                  std::unique_ptr<mir::inst::Inst>(new mir::inst::OpInst(
                      mir::inst::VarId(tmp2), mir::inst::VarId(tmp1), lhs,
                      mir::inst::Op::Add)));
-      tmp1 = getNewVar(mirFunction);
+      tmp1 = nonNegative ? quotient.id : getNewVar(mirFunction);
       insertInst(insts, i + ++offIndex,
                  std::unique_ptr<mir::inst::Inst>(new mir::inst::OpInst(
                      mir::inst::VarId(tmp1), mir::inst::VarId(tmp2),
                      mir::inst::Value(shPost), mir::inst::Op::ShrA)));
-      tmp2 = getNewVar(mirFunction);
-      insertInst(insts, i + ++offIndex,
-                 std::unique_ptr<mir::inst::Inst>(new mir::inst::OpInst(
-                     mir::inst::VarId(tmp2), lhs, mir::inst::Value(31),
-                     mir::inst::Op::ShrA)));
-      insertInst(insts, i + ++offIndex,
-                 std::unique_ptr<mir::inst::Inst>(new mir::inst::OpInst(
-                     dest, mir::inst::VarId(tmp1), mir::inst::VarId(tmp2),
-                     mir::inst::Op::Sub)));
+      if (!nonNegative) {
+        tmp2 = getNewVar(mirFunction);
+        insertInst(insts, i + ++offIndex,
+                   std::unique_ptr<mir::inst::Inst>(new mir::inst::OpInst(
+                       mir::inst::VarId(tmp2), lhs, mir::inst::Value(31),
+                       mir::inst::Op::ShrA)));
+        insertInst(insts, i + ++offIndex,
+                   std::unique_ptr<mir::inst::Inst>(new mir::inst::OpInst(
+                       quotient, mir::inst::VarId(tmp1),
+                       mir::inst::VarId(tmp2), mir::inst::Op::Sub)));
+      }
     }
     if (num < 0) {
       insertInst(insts, i + ++offIndex,
                  std::unique_ptr<mir::inst::Inst>(new mir::inst::OpInst(
-                     dest, mir::inst::Value(0), dest, mir::inst::Op::Sub)));
+                     dest, mir::inst::Value(0), quotient,
+                     mir::inst::Op::Sub)));
     }
   }
 
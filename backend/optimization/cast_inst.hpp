@@ -14,6 +14,7 @@
 #include <variant>
 #include <vector>
 
+#include "../../mir/def_use.hpp"
 #include "../../mir/mir.hpp"
 #include "../backend.hpp"
 
@@ -57,11 +58,12 @@ class Cast_Inst : public backend::MirOptimizePass {
         iter++;
       }
     }
+    auto& du = func.def_use();
     for (auto& blkpair : func.basic_blks) {
       auto& insts = blkpair.second.inst;
-      for (auto& inst : insts) {
-        auto& i = *inst;
-        if (inst->inst_kind() == mir::inst::InstKind::Load) {
+      for (auto iter = insts.begin(); iter != insts.end(); iter++) {
+        auto& i = **iter;
+        if (i.inst_kind() == mir::inst::InstKind::Load) {
           auto loadInst = dynamic_cast<mir::inst::LoadInst*>(&i);
 
           mir::inst::Value offset = 0;
@@ -72,9 +74,10 @@ class Cast_Inst : public backend::MirOptimizePass {
             offset = pair.second;
             addr = pair.first;
           }
-          inst = std::make_unique<mir::inst::LoadOffsetInst>(
-              addr, loadInst->dest, offset);
-        } else if (inst->inst_kind() == mir::inst::InstKind::Store) {
+          du.replace_inst(blkpair.second, iter,
+                          std::make_unique<mir::inst::LoadOffsetInst>(
+                              addr, loadInst->dest, offset));
+        } else if (i.inst_kind() == mir::inst::InstKind::Store) {
           auto storeInst = dynamic_cast<mir::inst::StoreInst*>(&i);
 
           mir::inst::Value offset = 0;
@@ -84,13 +87,17 @@ class Cast_Inst : public backend::MirOptimizePass {
             offset = pair.second;
             addr = pair.first;
           }
-          inst = std::make_unique<mir::inst::StoreOffsetInst>(
-              storeInst->val, std::get<mir::inst::VarId>(addr), offset);
+          du.replace_inst(blkpair.second, iter,
+                          std::make_unique<mir::inst::StoreOffsetInst>(
+                              storeInst->val, std::get<mir::inst::VarId>(addr),
+                              offset));
         }
       }
     }
   }
 
+  bool preserves_def_use() const { return true; }
+
   void optimize_mir(mir::inst::MirPackage& package,
                     std::map<std::string, std::any>& extra_data_repo) {
     for (auto iter = package.functions.begin(); iter != package.functions.end();
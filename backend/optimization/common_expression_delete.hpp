@@ -15,9 +15,9 @@
 #include <vector>
 
 #include "../../include/aixlog.hpp"
+#include "../../mir/def_use.hpp"
 #include "../../mir/mir.hpp"
 #include "../backend.hpp"
-#include "./var_replace.hpp"
 #include "livevar_analyse.hpp"
 
 namespace optimization::common_expr_del {
@@ -517,7 +517,8 @@ class BlockNodes {
     }
 
     // replace
-    var_replace::Var_Replace vp(env->func);
+    auto& du = env->func.def_use();
+    du.rescan_block(block);
     for (auto idx : exportQueue) {
       auto& node = nodes[idx];
       if (node->live_vars.size()) {
@@ -541,7 +542,7 @@ class BlockNodes {
           for (auto var : node->live_vars) {
             if (!env->func.variables.at(var.id).is_phi_var &&
                 var != not_phi_var.value()) {
-              vp.replace(var, not_phi_var.value());
+              du.replace_all_uses(var, not_phi_var.value());
             }
           }
         }
@@ -796,6 +797,16 @@ class Common_Expr_Del : public backend::MirOptimizePass {
     livevar_analyse::Livevar_Analyse lva(func);
     lva.build();
 
+    for (auto& blkpair : func.basic_blks) {
+      for (auto& inst : blkpair.second.inst) {
+        if (inst->inst_kind() == mir::inst::InstKind::Phi) {
+          func.variables.at(inst->dest.id).is_phi_var = true;
+          for (auto var : inst->useVars()) {
+            func.variables.at(var.id).is_phi_var = true;
+          }
+        }
+      }
+    }
     env = std::make_shared<Env>(func);
     for (auto iter = func.basic_blks.begin(); iter != func.basic_blks.end();
          ++iter) {
@@ -202,6 +202,9 @@ void ComplexDceRunner::scan_dependant_vars() {
       } else if (auto x = dynamic_cast<mir::inst::CallInst*>(&i)) {
         for (auto v : x->params) add_dependance(x->dest, v);
         do_not_delete.insert(x->dest);
+        // Memory from `malloc` is as live as any array passed in
+        if (f.variables.at(x->dest.id).ty->kind() == mir::types::TyKind::Ptr)
+          add_ref_var(x->dest);
       } else if (auto x = dynamic_cast<mir::inst::AssignInst*>(&i)) {
         add_dependance(x->dest, x->src);
       } else if (auto x = dynamic_cast<mir::inst::LoadInst*>(&i)) {
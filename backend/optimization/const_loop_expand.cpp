@@ -11,11 +11,13 @@
 #include <map>
 #include <memory>
 #include <optional>
+#include <set>
 #include <stack>
 #include <string>
 #include <vector>
 
 #include "../../include/aixlog.hpp"
+#include "optimization.hpp"
 
 namespace optimization::loop_expand {
 
@@ -178,19 +180,29 @@ void Const_Loop_Expand::optimize_mir(
     std::map<std::string, std::any>& extra_data_repo) {
   for (auto& f : mir.functions) {
     if (f.second.type->is_extern || f.first == "$$5_main") continue;
-    optimize_func(f.second);
+    optimize_func(f.second, extra_data_repo);
   }
 }
 
-std::optional<loop_info> find_loop_start(mir::inst::MirFunction& func) {
+std::optional<loop_info> find_loop_start(mir::inst::MirFunction& func,
+                                         const mir::inst::LoopForest& loops) {
   std::optional<loop_info> res;
   for (auto& blkpair : func.basic_blks) {
     auto& blk = blkpair.second;
     if (blk.jump.jump_kind == mir::inst::JumpKind::Loop) {
       auto bb_true = blk.jump.bb_true;
       auto bb_false = blk.jump.bb_false;
-      if (bb_true == func.basic_blks.at(bb_true).jump.bb_true &&
-          bb_false == func.basic_blks.at(bb_true).jump.bb_false) {
+      auto loop = loops.loop_with_header(bb_true);
+      // A single block loop only entered through `blk`, both leaving to an
+      // exit block nothing else jumps to
+      auto exit_only_from_loop = [&]() {
+        auto& preds = func.basic_blks.at(bb_false).preceding;
+        return bb_false == func.basic_blks.at(bb_true).jump.bb_false &&
+               preds.size() == 2 && preds.count(bb_true);
+      };
+      if (loop && loop->guard == blk.id && loop->blocks.size() == 1 &&
+          bb_true == func.basic_blks.at(bb_true).jump.bb_true &&
+          exit_only_from_loop()) {
         auto cond = blk.jump.cond_or_ret.value();
         auto iter = blk.inst.begin();
         for (; iter != blk.inst.end(); iter++) {
@@ -311,7 +323,8 @@ std::optional<loop_info> find_loop_start(mir::inst::MirFunction& func) {
           }
         }
 
-        if (!flag) {
+        // The initial value has to be a constant assigned in `blk`
+        if (!flag || !const_map.count(init_var.first)) {
           continue;
         }
         return loop_info(blk.id, init_var, in_op, in_value, change_op,
@@ -343,6 +356,12 @@ void expand_loop(mir::inst::MirFunction& func, mir::inst::BasicBlk& blk,
   int times = info.get_times();
   mir::inst::VarId new_change_var;
   auto insts = rwt.get_insts(times, new_change_var);
+  std::set<mir::inst::VarId> loop_defs;
+  for (auto& inst : blk.inst) {
+    if (inst->inst_kind() != mir::inst::InstKind::Store) {
+      loop_defs.insert(inst->dest);
+    }
+  }
   blk.inst.clear();
   for (auto& inst : insts) {
     loop_start.inst.push_back(std::move(inst));
@@ -361,24 +380,33 @@ void expand_loop(mir::inst::MirFunction& func, mir::inst::BasicBlk& blk,
     auto& inst = *iter;
     auto& i = *inst;
     auto phiInst = dynamic_cast<mir::inst::PhiInst*>(&i);
-    if (phiInst->useVars().count(info.change_var)) {
-      phiInst->vars.erase(std::find(phiInst->vars.begin(), phiInst->vars.end(),
-                                    info.change_var));
+    // Operands from the loop come from its last copy, or from nowhere when
+    // it never ran. The others flowed in from the guard, which now only
+    // reaches the exit through the copies.
+    std::vector<mir::inst::VarId> from_loop;
+    for (auto var : phiInst->vars) {
+      if (loop_defs.count(var)) from_loop.push_back(var);
     }
+    if (from_loop.empty()) continue;
+    auto& vars = phiInst->vars;
     if (times) {
-      if (phiInst->useVars().count(info.init_var.first)) {
-        phiInst->vars.erase(std::find(
-            phiInst->vars.begin(), phiInst->vars.end(), info.init_var.first));
-        phiInst->vars.push_back(new_change_var);
-      }
+      vars.clear();
+      for (auto var : from_loop) vars.push_back(rwt.var_map.at(var));
+    } else {
+      vars.erase(std::remove_if(vars.begin(), vars.end(),
+                                [&](auto var) { return loop_defs.count(var); }),
+                 vars.end());
     }
   }
 }
 
-void Const_Loop_Expand::optimize_func(mir::inst::MirFunction& func) {
+void Const_Loop_Expand::optimize_func(
+    mir::inst::MirFunction& func,
+    std::map<std::string, std::any>& extra_data_repo) {
   auto& startblk = func.basic_blks.begin()->second;
   while (true) {
-    auto info = find_loop_start(func);
+    auto info =
+        find_loop_start(func, get_loop_forest(extra_data_repo, func));
     if (!info.has_value()) {
       break;
     }
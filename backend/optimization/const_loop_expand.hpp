@@ -11,7 +11,8 @@ class Const_Loop_Expand final : public backend::MirOptimizePass {
                     std::map<std::string, std::any> &extra_data_repo) override;
 
  private:
-  void optimize_func(mir::inst::MirFunction &func);
+  void optimize_func(mir::inst::MirFunction &func,
+                     std::map<std::string, std::any> &extra_data_repo);
 };
 
 }  // namespace optimization::loop_expand
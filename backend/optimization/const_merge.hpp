@@ -13,96 +13,55 @@
 #include <vector>
 
 #include "../../include/aixlog.hpp"
+#include "../../mir/def_use.hpp"
 #include "../backend.hpp"
 #include "livevar_analyse.hpp"
 
 namespace optimization::const_merge {
 typedef mir::inst::Op Op;
 
-class Env {
- public:
-  mir::inst::MirFunction& func;
-  std::map<mir::inst::VarId, std::vector<std::pair<mir::types::LabelId, int>>>
-      usepoints;
-  Env(mir::inst::MirFunction& func) : func(func) {
-    for (auto& blkpair : func.basic_blks) {
-      for (int i = 0; i < blkpair.second.inst.size(); i++) {
-        auto& inst = blkpair.second.inst[i];
-        auto& is = *inst;
-        if (inst->inst_kind() == mir::inst::InstKind::Assign) {
-          auto assignInst = dynamic_cast<mir::inst::AssignInst*>(&is);
-          if (assignInst->src.index() == 1) {
-            auto srcid = std::get<mir::inst::VarId>(assignInst->src);
-            add_usepoint(srcid, blkpair.first, i);
-          }
-        } else if (inst->inst_kind() == mir::inst::InstKind::Op) {
-          auto opInst = dynamic_cast<mir::inst::OpInst*>(&is);
-          if (opInst->lhs.index() == 1) {
-            auto var = std::get<mir::inst::VarId>(opInst->lhs);
-            add_usepoint(var, blkpair.first, i);
-          }
-          if (opInst->rhs.index() == 1) {
-            auto var = std::get<mir::inst::VarId>(opInst->rhs);
-            add_usepoint(var, blkpair.first, i);
-          }
-        }
-      }
-    }
-  }
-
-  void add_usepoint(mir::inst::VarId var, mir::types::LabelId labelId,
-                    int idx) {
-    if (!usepoints.count(var)) {
-      usepoints.insert(
-          {var, std::vector<std::pair<mir::types::LabelId, int>>()});
-    }
-    usepoints.at(var).push_back({labelId, idx});
-  }
-
-  std::unique_ptr<mir::inst::Inst>& get_inst(
-      std::pair<mir::types::LabelId, int> pair) {
-    return func.basic_blks.at(pair.first).inst.at(pair.second);
-  }
-};
-std::shared_ptr<Env> env;
 class Merge_Const : public backend::MirOptimizePass {
  public:
   std::map<mir::inst::VarId, int> const_var_map;
   std::string name = "MergeConst";
   std::string pass_name() const { return name; }
-  void spread_var(mir::inst::VarId var, int val) {
-    if (!env->usepoints.count(var)) {
-      return;
-    }
-    for (auto& usepoint : env->usepoints.at(var)) {
-      auto& inst = env->get_inst(usepoint);
-      auto& is = *inst;
-      if (inst->inst_kind() == mir::inst::InstKind::Assign) {
-        auto assignInst = dynamic_cast<mir::inst::AssignInst*>(&is);
-        assignInst->src = val;
+  void spread_var(mir::inst::DefUseChain& du, mir::inst::VarId var, int val) {
+    for (auto& usepoint : du.uses_of(var)) {
+      if (usepoint.is_jump() || !du.block_of(usepoint.inst).has_value()) {
+        // jumps keep the variable; the use may also have been folded away
+        // by an earlier recursive call
+        continue;
+      }
+      auto& is = *usepoint.inst;
+      if (auto assignInst = dynamic_cast<mir::inst::AssignInst*>(&is)) {
+        if (assignInst->src.is_immediate() ||
+            !(std::get<mir::inst::VarId>(assignInst->src) == var)) {
+          continue;
+        }
+        du.replace_value(&is, assignInst->src, val);
         const_var_map.insert({assignInst->dest, val});
-        spread_var(assignInst->dest, val);
-      } else {
-        auto opInst = dynamic_cast<mir::inst::OpInst*>(&is);
+        spread_var(du, assignInst->dest, val);
+      } else if (auto opInst = dynamic_cast<mir::inst::OpInst*>(&is)) {
         if (opInst->lhs.index() == 1) {
           auto lhs = std::get<mir::inst::VarId>(opInst->lhs);
           if (lhs.id == var.id) {
-            opInst->lhs = val;
+            du.replace_value(&is, opInst->lhs, val);
           }
         }
         if (opInst->rhs.index() == 1) {
           auto rhs = std::get<mir::inst::VarId>(opInst->rhs);
           if (rhs.id == var.id) {
-            opInst->rhs = val;
+            du.replace_value(&is, opInst->rhs, val);
           }
         }
         if (opInst->lhs.index() == 0 && opInst->rhs.index() == 0) {
-          optimize_inst(inst);
+          optimize_inst(du, du.slot_of(&is));
         }
       }
     }
   }
-  bool optimize_inst(std::unique_ptr<mir::inst::Inst>& inst) {
+  bool optimize_inst(mir::inst::DefUseChain& du,
+                     std::unique_ptr<mir::inst::Inst>& inst) {
     if (inst->inst_kind() == mir::inst::InstKind::Op) {
       auto& i = *inst;
       auto opInst = dynamic_cast<mir::inst::OpInst*>(&i);
@@ -172,9 +131,11 @@ class Merge_Const : public backend::MirOptimizePass {
           default:
             return false;
         }
-        inst = std::make_unique<mir::inst::AssignInst>(opInst->dest, res);
-        const_var_map.insert({opInst->dest, res});
-        spread_var(opInst->dest, res);
+        auto dest = opInst->dest;
+        du.replace_inst(inst.get(),
+                        std::make_unique<mir::inst::AssignInst>(dest, res));
+        const_var_map.insert({dest, res});
+        spread_var(du, dest, res);
         return true;
       }
     } else if (inst->inst_kind() == mir::inst::InstKind::PtrOffset) {
@@ -183,8 +144,9 @@ class Merge_Const : public backend::MirOptimizePass {
       if (ptrOffsetInst->offset.index() == 0) {
         int offset = std::get<int>(ptrOffsetInst->offset);
         if (offset == 0) {
-          inst = std::make_unique<mir::inst::AssignInst>(ptrOffsetInst->dest,
-                                                         ptrOffsetInst->ptr);
+          du.replace_inst(inst.get(), std::make_unique<mir::inst::AssignInst>(
+                                          ptrOffsetInst->dest,
+                                          ptrOffsetInst->ptr));
         }
       }
     }
@@ -192,10 +154,10 @@ class Merge_Const : public backend::MirOptimizePass {
   }
 
   void optimize_func(mir::inst::MirFunction& func) {
+    auto& du = func.def_use();
     for (auto& blkpair : func.basic_blks) {
-      env = std::make_shared<Env>(func);
       for (auto& inst : blkpair.second.inst) {
-        optimize_inst(inst);
+        optimize_inst(du, inst);
       }
     }
   }
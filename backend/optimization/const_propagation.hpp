@@ -4,9 +4,11 @@
 #include <map>
 #include <memory>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include "../../arm_code/arm.hpp"
+#include "../../mir/def_use.hpp"
 #include "../../mir/mir.hpp"
 #include "../backend.hpp"
 
@@ -23,90 +25,26 @@ class Const_Propagation : public backend::MirOptimizePass {
     if src of assign is constant
     all the dest can be replaced by the src of assign
     */
-    std::map<mir::inst::VarId, int32_t> const_assign;
-    std::map<mir::types::LabelId, mir::inst::BasicBlk>::iterator bit;
-    for (bit = func.basic_blks.begin(); bit != func.basic_blks.end(); bit++) {
-      auto& bb = bit->second;
-      for (auto& inst : bb.inst) {
-        auto& i = *inst;
-        if (auto x = dynamic_cast<mir::inst::AssignInst*>(&i)) {
-          if (x->src.index() == 0) {
-            int src = std::get<0>(x->src);
-            if (src != 0) 
-            const_assign.insert(std::map<mir::inst::VarId, int32_t>::value_type(
-                x->dest, std::get<0>(x->src)));
-          }
+    auto& du = func.def_use();
+    std::vector<std::pair<mir::inst::VarId, int32_t>> const_assign;
+    for (auto& blkpair : func.basic_blks) {
+      for (auto& inst : blkpair.second.inst) {
+        auto x = dynamic_cast<mir::inst::AssignInst*>(inst.get());
+        if (x == nullptr || !x->src.is_immediate()) continue;
+        int32_t src = std::get<int32_t>(x->src);
+        if (src != 0 && du.def_count(x->dest) == 1) {
+          const_assign.push_back({x->dest, src});
         }
       }
     }
-    for (bit = func.basic_blks.begin(); bit != func.basic_blks.end(); bit++) {
-      auto& bb = bit->second;
-      std::map<int, std::unique_ptr<mir::inst::Inst>> replace;
-      std::vector<int> del;
-      for (auto& inst : bb.inst) {
-        auto& i = *inst;
-        if (auto x = dynamic_cast<mir::inst::AssignInst*>(&i)) {
-          if (x->src.index() == 1) {
-            std::map<mir::inst::VarId, int32_t>::iterator it =
-                const_assign.find(std::get<1>(x->src));
-            if (it != const_assign.end()) {
-              x->src.emplace<0>(it->second);
-            }
-          }
-        } else if (auto x = dynamic_cast<mir::inst::CallInst*>(&i)) {
-          for (int j = 0; j < x->params.size(); j++) {
-            if (x->params[j].index() == 1) {
-              std::map<mir::inst::VarId, int32_t>::iterator it =
-                  const_assign.find(std::get<1>(x->params[j]));
-              if (it != const_assign.end()) {
-                x->params[j].emplace<0>(it->second);
-              }
-            }
-          }
-        } else if (auto x = dynamic_cast<mir::inst::OpInst*>(&i)) {
-          if (x->lhs.index() == 1) {
-            std::map<mir::inst::VarId, int32_t>::iterator it =
-                const_assign.find(std::get<1>(x->lhs));
-            if (it != const_assign.end()) {
-              x->lhs.emplace<0>(it->second);
-            }
-          }
-          if (x->rhs.index() == 1) {
-            std::map<mir::inst::VarId, int32_t>::iterator it =
-                const_assign.find(std::get<1>(x->rhs));
-            if (it != const_assign.end()) {
-              x->rhs.emplace<0>(it->second);
-            }
-          }
-        } else if (auto x = dynamic_cast<mir::inst::LoadInst*>(&i)) {
-          if (x->src.index() == 1) {
-            std::map<mir::inst::VarId, int32_t>::iterator it =
-                const_assign.find(std::get<1>(x->src));
-            if (it != const_assign.end()) {
-              x->src.emplace<0>(it->second);
-            }
-          }
-        } else if (auto x = dynamic_cast<mir::inst::StoreInst*>(&i)) {
-          if (x->val.index() == 1) {
-            std::map<mir::inst::VarId, int32_t>::iterator it =
-                const_assign.find(std::get<1>(x->val));
-            if (it != const_assign.end()) {
-              x->val.emplace<0>(it->second);
-            }
-          }
-        } else if (auto x = dynamic_cast<mir::inst::PtrOffsetInst*>(&i)) {
-          if (x->offset.index() == 1) {
-            std::map<mir::inst::VarId, int32_t>::iterator it =
-                const_assign.find(std::get<1>(x->offset));
-            if (it != const_assign.end()) {
-              x->offset.emplace<0>(it->second);
-            }
-          }
-        } 
-      }
+    // Only the users of each constant are visited
+    for (auto [var, val] : const_assign) {
+      du.replace_all_uses(var, val);
     }
   }
 
+  bool preserves_def_use() const { return true; }
+
   void optimize_mir(mir::inst::MirPackage& package,
                     std::map<std::string, std::any>& extra_data_repo) {
     for (auto iter = package.functions.begin(); iter != package.functions.end();
@@ -0,0 +1,264 @@
+#include "./dependence.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+#include <functional>
+#include <map>
+#include <numeric>
+
+#include "../../mir/def_use.hpp"
+#include "optimization.hpp"
+
+namespace optimization::dependence {
+
+namespace {
+
+/// Most combinations of distances `feasible` tries one by one
+const int64_t MAX_ENUMERATED = 1 << 16;
+
+/// Walks address computations inside a loop back to its leaves
+struct AddressWalker {
+  mir::inst::MirFunction& func;
+  const mir::inst::Loop& loop;
+  const std::set<mir::inst::VarId>& ivs;
+  std::map<mir::inst::VarId, std::optional<Affine>> memo;
+
+  std::optional<Affine> affine_of(const mir::inst::Value& val) {
+    if (auto imm = std::get_if<int32_t>(&val)) {
+      return Affine{{}, uint32_t(*imm)};
+    }
+    auto base = affine_of(std::get<mir::inst::VarId>(val));
+    if (!base || !val.has_shift()) return base;
+    if (val.shift != arm::RegisterShiftKind::Lsl) return std::nullopt;
+    return base->scale(uint32_t(1) << val.shift_amount);
+  }
+
+  std::optional<Affine> affine_of(mir::inst::VarId var) {
+    if (auto it = memo.find(var); it != memo.end()) return it->second;
+    std::optional<Affine> result;
+    auto& du = func.def_use();
+    auto blk = du.def_block(var);
+    if (ivs.count(var) || !blk || !loop.contains(*blk)) {
+      result = Affine{{{var, 1}}, 0};
+    } else if (auto x = dynamic_cast<mir::inst::AssignInst*>(du.def_of(var))) {
+      result = affine_of(x->src);
+    } else if (auto x = dynamic_cast<mir::inst::OpInst*>(du.def_of(var))) {
+      auto lhs = affine_of(x->lhs);
+      auto rhs = affine_of(x->rhs);
+      if (!lhs || !rhs) {
+        // Not an address computation
+      } else if (x->op == mir::inst::Op::Add) {
+        result = lhs->add(*rhs);
+      } else if (x->op == mir::inst::Op::Sub) {
+        result = lhs->add(*rhs, uint32_t(-1));
+      } else if (x->op == mir::inst::Op::Mul && rhs->terms.empty()) {
+        result = lhs->scale(rhs->constant);
+      } else if (x->op == mir::inst::Op::Mul && lhs->terms.empty()) {
+        result = rhs->scale(lhs->constant);
+      } else if (x->op == mir::inst::Op::Shl && rhs->terms.empty() &&
+                 rhs->constant < 32) {
+        result = lhs->scale(uint32_t(1) << rhs->constant);
+      }
+    }
+    memo.insert({var, result});
+    return result;
+  }
+
+  std::optional<Affine> with_offset(std::optional<Affine> base,
+                                    const mir::inst::Value& offset) {
+    if (!base) return std::nullopt;
+    auto off = affine_of(offset);
+    if (!off) return std::nullopt;
+    return base->add(*off);
+  }
+};
+
+/// Whether `sum(coefs[l] * d[l]) == delta` has an integer solution with
+/// every `d[l]` of the sign `dir[l]` asks for and at most `limits[l]` in
+/// size, if that is known
+bool feasible(const std::vector<int64_t>& coefs, int64_t delta,
+              const DirectionVector& dir,
+              const std::vector<std::optional<int64_t>>& limits) {
+  int64_t g = 0;
+  // Bounds of the sum, each only while `has_lo` / `has_hi` holds
+  int64_t lo = 0, hi = 0;
+  bool has_lo = true, has_hi = true;
+  for (size_t l = 0; l < coefs.size(); l++) {
+    if (dir[l] == Direction::Eq || coefs[l] == 0) continue;
+    g = std::gcd(g, std::abs(coefs[l]));
+    // Range of `coefs[l] * d[l]`, where `d[l]` runs over `[1, limit]` or
+    // `[-limit, -1]`
+    auto c = dir[l] == Direction::Lt ? coefs[l] : -coefs[l];
+    bool bounded = limits[l].has_value();
+    int64_t far = bounded ? c * *limits[l] : 0;
+    if (c > 0) {
+      lo += c;
+      hi += far;
+      has_hi = has_hi && bounded;
+    } else {
+      hi += c;
+      lo += far;
+      has_lo = has_lo && bounded;
+    }
+  }
+  if (g == 0) return delta == 0;
+  if (delta % g != 0) return false;
+  if ((has_lo && delta < lo) || (has_hi && delta > hi)) return false;
+
+  // The bounds treat the distances as reals. When few enough integer
+  // choices are left, try them all, solving for at most one unbounded loop.
+  std::vector<size_t> bounded;
+  std::optional<size_t> unbounded;
+  int64_t choices = 1;
+  for (size_t l = 0; l < coefs.size(); l++) {
+    if (dir[l] == Direction::Eq || coefs[l] == 0) continue;
+    if (!limits[l]) {
+      if (unbounded) return true;
+      unbounded = l;
+    } else {
+      choices *= std::max(*limits[l], int64_t(1));
+      if (choices > MAX_ENUMERATED) return true;
+      bounded.push_back(l);
+    }
+  }
+  std::function<bool(size_t, int64_t)> solve = [&](size_t k, int64_t left) {
+    if (k == bounded.size()) {
+      if (!unbounded) return left == 0;
+      auto c = coefs[*unbounded];
+      if (left % c != 0) return false;
+      return dir[*unbounded] == Direction::Lt ? left / c > 0 : left / c < 0;
+    }
+    auto l = bounded[k];
+    for (int64_t d = 1; d <= *limits[l]; d++) {
+      auto step = dir[l] == Direction::Lt ? d : -d;
+      if (solve(k + 1, left - coefs[l] * step)) return true;
+    }
+    return false;
+  };
+  return solve(0, delta);
+}
+
+/// Largest distance in iterations between two accesses, per loop, if the
+/// trip count bounds it. Arrays are flattened by the time they get here, and
+/// `a[i * 4 + j]` may index a single row for any `j`, so the shape of an
+/// address says nothing about how far `j` goes.
+std::vector<std::optional<int64_t>> distance_limits(
+    const std::vector<Level>& nest) {
+  std::vector<std::optional<int64_t>> limits;
+  for (auto& level : nest) {
+    std::optional<int64_t> limit;
+    if (level.count) limit = std::max(*level.count - 1, int64_t(0));
+    limits.push_back(limit);
+  }
+  return limits;
+}
+
+}  // namespace
+
+std::optional<mir::inst::VarId> pointer_of(mir::inst::MirFunction& func,
+                                           const Affine& addr) {
+  for (auto [var, coef] : addr.terms) {
+    auto& ty = func.variables.at(var.id).ty;
+    if (coef == 1 && ty && ty->kind() == mir::types::TyKind::Ptr) return var;
+  }
+  return std::nullopt;
+}
+
+std::optional<Affine> address_in_loop(mir::inst::MirFunction& func,
+                                      const mir::inst::Loop& loop,
+                                      const std::set<mir::inst::VarId>& ivs,
+                                      mir::inst::Inst* inst) {
+  AddressWalker walker{func, loop, ivs, {}};
+  if (auto x = dynamic_cast<mir::inst::LoadInst*>(inst)) {
+    return walker.affine_of(x->src);
+  } else if (auto x = dynamic_cast<mir::inst::LoadOffsetInst*>(inst)) {
+    return walker.with_offset(walker.affine_of(x->src), x->offset);
+  } else if (auto x = dynamic_cast<mir::inst::StoreInst*>(inst)) {
+    return walker.affine_of(x->dest);
+  } else if (auto x = dynamic_cast<mir::inst::StoreOffsetInst*>(inst)) {
+    return walker.with_offset(walker.affine_of(x->dest), x->offset);
+  }
+  return std::nullopt;
+}
+
+bool may_share_object(mir::inst::MirFunction& func, mir::inst::VarId a,
+                      mir::inst::VarId b) {
+  auto root_a = object_of(func, a);
+  auto root_b = object_of(func, b);
+  if (root_a.index() != 0 && root_b.index() != 0) return root_a == root_b;
+  // Parameters cannot point into the arrays local to the function
+  auto local_and_parameter = [&](MemObject& root, mir::inst::VarId other) {
+    return std::holds_alternative<mir::inst::VarId>(root) &&
+           is_parameter(func, base_pointer(func, other));
+  };
+  return !local_and_parameter(root_a, b) && !local_and_parameter(root_b, a);
+}
+
+std::vector<DirectionVector> test(mir::inst::MirFunction& func,
+                                  const MemAccess& a, const MemAccess& b,
+                                  const std::vector<Level>& nest) {
+  // Split the addresses into the induction variables and the rest
+  auto split = [&](const Affine& addr) {
+    auto rest = addr;
+    // Bytes moved per unit of each induction variable
+    std::vector<int64_t> coefs;
+    for (auto& level : nest) {
+      auto it = rest.terms.find(level.iv);
+      coefs.push_back(it == rest.terms.end() ? 0 : int32_t(it->second));
+      if (it != rest.terms.end()) rest.terms.erase(it);
+    }
+    return std::pair(coefs, rest);
+  };
+  auto [coefs_a, rest_a] = split(a.addr);
+  auto [coefs_b, rest_b] = split(b.addr);
+
+  std::vector<DirectionVector> all;
+  DirectionVector dir(nest.size(), Direction::Lt);
+  while (true) {
+    all.push_back(dir);
+    size_t l = 0;
+    while (l < dir.size() && dir[l] == Direction::Gt) dir[l++] = Direction::Lt;
+    if (l == dir.size()) break;
+    dir[l] = dir[l] == Direction::Lt ? Direction::Eq : Direction::Gt;
+  }
+
+  if (rest_a.terms != rest_b.terms) {
+    auto ptr_a = pointer_of(func, rest_a);
+    auto ptr_b = pointer_of(func, rest_b);
+    if (ptr_a && ptr_b && !may_share_object(func, *ptr_a, *ptr_b)) return {};
+    return all;
+  }
+  // Accesses moving differently would need the full integer program solved
+  if (coefs_a != coefs_b) return all;
+  // Bytes moved per iteration of each loop
+  std::vector<int64_t> per_iteration;
+  for (size_t l = 0; l < nest.size(); l++) {
+    per_iteration.push_back(coefs_a[l] * nest[l].step);
+  }
+  // a at iteration x meets b at iteration y when
+  // sum(per_iteration * (y - x)) == a.constant - b.constant
+  auto delta = int64_t(int32_t(rest_a.constant - rest_b.constant));
+  auto limits = distance_limits(nest);
+  std::vector<DirectionVector> res;
+  for (auto& d : all) {
+    if (feasible(per_iteration, delta, d, limits)) res.push_back(d);
+  }
+  return res;
+}
+
+DirectionVector normalize(DirectionVector dir) {
+  for (auto d : dir) {
+    if (d == Direction::Lt) return dir;
+    if (d == Direction::Gt) {
+      for (auto& x : dir) {
+        if (x != Direction::Eq) {
+          x = x == Direction::Lt ? Direction::Gt : Direction::Lt;
+        }
+      }
+      return dir;
+    }
+  }
+  return dir;
+}
+
+}  // namespace optimization::dependence
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <set>
+#include <vector>
+
+#include "../../mir/loop.hpp"
+#include "../../mir/mir.hpp"
+#include "strength_reduction.hpp"
+
+/// Dependence testing between the loads and stores of a loop nest.
+///
+/// Addresses are taken apart into affine functions of the induction
+/// variables of the nest. Two accesses through the same invariant base are
+/// then compared with the GCD test and Banerjee's bounds, once for every
+/// direction vector, giving the orders of iterations in which both may touch
+/// the same word. Accesses whose bases differ are independent when those
+/// bases point into different objects; anything else is assumed to depend
+/// on everything. How far apart the iterations may be comes from the trip
+/// counts of the nest alone.
+namespace optimization::dependence {
+
+using strength_reduction::Affine;
+
+/// Bytes a load or a store moves
+const int64_t WORD_SIZE = 4;
+
+/// Sign of the distance, in iterations of one loop, from the first access of
+/// a pair to the second
+enum class Direction { Lt, Eq, Gt };
+
+/// One direction per loop of the nest, outermost first
+using DirectionVector = std::vector<Direction>;
+
+/// A loop of the nest the accesses are in
+struct Level {
+  mir::inst::VarId iv;
+  int32_t step;
+  /// Number of iterations, if known
+  std::optional<int64_t> count;
+};
+
+/// A load or a store of one aligned word
+struct MemAccess {
+  mir::inst::Inst* inst;
+  bool is_store;
+  Affine addr;
+};
+
+/// Address `inst` loads from or stores to, as an affine function of `ivs`
+/// and of variables defined outside `loop`, if it is one
+std::optional<Affine> address_in_loop(mir::inst::MirFunction& func,
+                                      const mir::inst::Loop& loop,
+                                      const std::set<mir::inst::VarId>& ivs,
+                                      mir::inst::Inst* inst);
+
+/// The pointer among the terms of `addr`, if one has coefficient 1
+std::optional<mir::inst::VarId> pointer_of(mir::inst::MirFunction& func,
+                                           const Affine& addr);
+
+/// Whether the pointers `a` and `b` may point into the same object
+bool may_share_object(mir::inst::MirFunction& func, mir::inst::VarId a,
+                      mir::inst::VarId b);
+
+/// Direction vectors along which `a` and `b` may access the same word, if
+/// at most one of them runs per iteration of `nest`. Empty if they never do.
+std::vector<DirectionVector> test(mir::inst::MirFunction& func,
+                                  const MemAccess& a, const MemAccess& b,
+                                  const std::vector<Level>& nest);
+
+/// `dir` with every direction reversed if its first one other than `Eq` is
+/// `Gt`, so that it runs from the earlier access to the later one
+DirectionVector normalize(DirectionVector dir);
+
+}  // namespace optimization::dependence
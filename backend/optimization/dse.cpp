@@ -0,0 +1,256 @@
+#include "./dse.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <map>
+#include <optional>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "../../include/aixlog.hpp"
+#include "../../mir/def_use.hpp"
+#include "../../mir/loop.hpp"
+#include "dependence.hpp"
+#include "memory_ssa.hpp"
+#include "optimization.hpp"
+
+namespace optimization::dse {
+
+void DSE::optimize_mir(mir::inst::MirPackage& mir,
+                       std::map<std::string, std::any>& extra_data_repo) {
+  auto summaries = side_effects::summarize(mir);
+  for (auto& f : mir.functions) {
+    if (f.second.type->is_extern) continue;
+    optimize_func(f.second, summaries, extra_data_repo);
+  }
+}
+
+namespace {
+
+/// Blocks followed from each store before giving up on it
+const uint32_t BLOCK_BUDGET = 64;
+/// Words of a `memset` checked one by one
+const int64_t MAX_WORDS = 4096;
+
+class Liveness {
+ public:
+  Liveness(mir::inst::MirFunction& func, memory_ssa::AliasAnalysis& aa)
+      : func(func), aa(aa), dom(func) {}
+
+  const mir::inst::DominatorTree& dom_tree() const { return dom; }
+
+  /// Whether the `i`th instruction of `blk`, writing `loc`, may be read
+  /// before it is overwritten. A single store is overwritten by a store of
+  /// the same words; the words of `uncovered` by stores later in `blk`
+  bool is_live(mir::types::LabelId blk, size_t i, memory_ssa::Location loc,
+               bool single, std::set<int64_t> uncovered) {
+    vars = {loc.base};
+    for (auto& term : loc.terms) vars.insert(mir::inst::VarId(term.var));
+
+    auto end = scan(func.basic_blks.at(blk), i + 1, loc, single,
+                    uncovered.empty() ? nullptr : &uncovered);
+    if (end != End::Open) return end == End::Read;
+
+    std::vector<std::pair<mir::types::LabelId, bool>> stack;
+    std::set<std::pair<mir::types::LabelId, bool>> seen;
+    // Whether the words may be read once the path leaves `id`
+    auto leave = [&](mir::types::LabelId id, bool exact) {
+      if (func.basic_blks.at(id).jump.kind ==
+          mir::inst::JumpInstructionKind::Return) {
+        return !aa.is_local(loc);
+      }
+      for (auto succ : dom.succs(id)) {
+        if (seen.insert({succ, exact}).second) stack.push_back({succ, exact});
+      }
+      return false;
+    };
+    if (leave(blk, loc.exact)) return true;
+    uint32_t visited = 0;
+    while (!stack.empty()) {
+      auto [id, exact] = stack.back();
+      stack.pop_back();
+      if (++visited > BLOCK_BUDGET) return true;
+      auto path = loc;
+      path.exact = exact;
+      auto end = scan(func.basic_blks.at(id), 0, path, single, nullptr);
+      if (end == End::Read) return true;
+      if (end == End::Open && leave(id, path.exact)) return true;
+    }
+    return false;
+  }
+
+ private:
+  enum class End { Read, Overwritten, Open };
+
+  End scan(mir::inst::BasicBlk& blk, size_t from, memory_ssa::Location& loc,
+           bool single, std::set<int64_t>* uncovered) {
+    for (size_t j = from; j < blk.inst.size(); j++) {
+      auto inst = blk.inst[j].get();
+      if (aa.may_read(inst, loc)) return End::Read;
+      if (inst->inst_kind() != mir::inst::InstKind::Store) {
+        // The same variables now give another address
+        if (vars.count(inst->dest)) loc.exact = false;
+        continue;
+      }
+      auto other = aa.location_of(inst);
+      if (!loc.exact || !other) continue;
+      if (single && aa.alias(*other, loc) == memory_ssa::AliasResult::Must) {
+        return End::Overwritten;
+      }
+      if (uncovered && other->exact && other->base == loc.base &&
+          other->terms == loc.terms) {
+        for (int64_t word = other->offset;
+             word < other->offset + other->size; word += 4) {
+          uncovered->erase(word);
+        }
+        if (uncovered->empty()) return End::Overwritten;
+      }
+    }
+    return End::Open;
+  }
+
+  mir::inst::MirFunction& func;
+  memory_ssa::AliasAnalysis& aa;
+  mir::inst::DominatorTree dom;
+  /// Variables the address being followed is computed from
+  std::set<mir::inst::VarId> vars;
+};
+
+/// Whether `lhs cmp rhs` holds, for the comparisons a trip count tests
+bool holds(mir::inst::Op cmp, int64_t lhs, int64_t rhs) {
+  switch (cmp) {
+    case mir::inst::Op::Lt:
+      return lhs < rhs;
+    case mir::inst::Op::Lte:
+      return lhs <= rhs;
+    case mir::inst::Op::Gt:
+      return lhs > rhs;
+    case mir::inst::Op::Gte:
+      return lhs >= rhs;
+    case mir::inst::Op::Neq:
+      return lhs != rhs;
+    default:
+      return false;
+  }
+}
+
+/// Whether the `memset` of `range` at the `i`th instruction of `blk` is
+/// followed by a counted loop storing to every word of it before anything
+/// may read one, the way an array initialized with `{}` and then filled
+/// element by element is. The loop has to be entered right after `blk`, and
+/// the stores have to sit in the block running the exit test, so that each
+/// runs once per iteration.
+bool filled_by_loop(mir::inst::MirFunction& func,
+                    memory_ssa::AliasAnalysis& aa,
+                    const mir::inst::LoopForest& forest,
+                    mir::types::LabelId blk, size_t i,
+                    const memory_ssa::Location& range) {
+  if (!range.exact || !range.terms.empty()) return false;
+  auto& insts = func.basic_blks.at(blk).inst;
+  for (size_t j = i + 1; j < insts.size(); j++) {
+    if (aa.may_read(insts[j].get(), range)) return false;
+  }
+
+  for (auto& loop : forest.loops()) {
+    if (loop.preheader != blk && loop.guard != blk) continue;
+    auto trip = forest.trip_count(loop, func);
+    if (!trip || !trip->count || *trip->count > MAX_WORDS) return false;
+    auto init = trip->init.get_if<int32_t>();
+    auto bound = trip->bound.get_if<int32_t>();
+    if (!init || !bound) return false;
+    if (loop.guard == blk &&
+        (!tests_first_iteration(func, blk, loop.header, *trip) ||
+         !holds(trip->cmp, *init, *bound))) {
+      return false;
+    }
+    for (auto id : loop.blocks) {
+      for (auto& inst : func.basic_blks.at(id).inst) {
+        if (aa.may_read(inst.get(), range)) return false;
+      }
+    }
+
+    std::set<int64_t> uncovered;
+    for (int64_t word = 0; word < range.size; word += 4) {
+      uncovered.insert(range.offset + word);
+    }
+    for (auto& inst : func.basic_blks.at(trip->exiting).inst) {
+      if (inst->inst_kind() != mir::inst::InstKind::Store) continue;
+      auto loc = aa.location_of(inst.get());
+      auto addr =
+          dependence::address_in_loop(func, loop, {trip->iv}, inst.get());
+      if (!loc || loc->size != 4 || !addr) continue;
+      auto ptr = dependence::pointer_of(func, *addr);
+      if (!ptr) continue;
+      // Where the pointer the loop starts from points, as a part of `range`
+      auto start = aa.address_of(*ptr, 4);
+      if (!start.exact || start.base != range.base || !start.terms.empty()) {
+        continue;
+      }
+      auto terms = addr->terms;
+      terms.erase(*ptr);
+      int64_t coef = int32_t(terms[trip->iv]);
+      terms.erase(trip->iv);
+      if (!terms.empty()) continue;
+      auto offset = start.offset + int32_t(addr->constant);
+      for (int64_t k = 0; k < *trip->count; k++) {
+        uncovered.erase(offset + coef * (*init + k * trip->step));
+      }
+    }
+    return uncovered.empty();
+  }
+  return false;
+}
+
+}  // namespace
+
+void DSE::optimize_func(mir::inst::MirFunction& func,
+                        const side_effects::Summaries& summaries,
+                        std::map<std::string, std::any>& extra_data_repo) {
+  memory_ssa::AliasAnalysis aa(func, &summaries);
+  Liveness liveness(func, aa);
+  std::set<mir::inst::Inst*> dead;
+  for (auto id : liveness.dom_tree().reverse_postorder()) {
+    auto& blk = func.basic_blks.at(id);
+    for (size_t i = 0; i < blk.inst.size(); i++) {
+      auto inst = blk.inst[i].get();
+      if (inst->inst_kind() == mir::inst::InstKind::Store) {
+        auto loc = aa.location_of(inst);
+        if (!loc || (!loc->exact && !aa.is_local(*loc))) continue;
+        if (!liveness.is_live(id, i, *loc, true, {})) dead.insert(inst);
+      } else if (auto range = aa.range_of(inst)) {
+        auto call = dynamic_cast<mir::inst::CallInst*>(inst);
+        if (call->func != "memset" || range->size % 4 != 0 ||
+            range->size / 4 > MAX_WORDS) {
+          continue;
+        }
+        std::set<int64_t> uncovered;
+        for (int64_t word = 0; word < range->size; word += 4) {
+          uncovered.insert(range->offset + word);
+        }
+        if (!liveness.is_live(id, i, *range, false, uncovered) ||
+            filled_by_loop(func, aa, get_loop_forest(extra_data_repo, func),
+                           id, i, *range)) {
+          dead.insert(inst);
+        }
+      }
+    }
+  }
+  if (dead.empty()) return;
+
+  for (auto& [id, blk] : func.basic_blks) {
+    blk.inst.erase(std::remove_if(blk.inst.begin(), blk.inst.end(),
+                                  [&](auto& inst) {
+                                    return dead.count(inst.get()) > 0;
+                                  }),
+                   blk.inst.end());
+  }
+  func.invalidate_def_use();
+
+  auto remark = func.name + ": " + std::to_string(dead.size()) + " dead";
+  LOG(TRACE) << "dse: " << remark << std::endl;
+  backend::report_statistic(extra_data_repo, pass_name(), remark);
+}
+
+}  // namespace optimization::dse
@@ -0,0 +1,37 @@
+#pragma once
+
+#include "../../mir/mir.hpp"
+#include "../backend.hpp"
+#include "side_effects.hpp"
+
+namespace optimization::dse {
+
+/// Dead store elimination.
+///
+/// A store is dead when no path from it reads the words it writes before
+/// they are written again, or before the function returns if they lie in a
+/// local array. Paths are followed forward through the blocks after the
+/// store, so the store overwriting it has to come on every one of them,
+/// which is what post-dominance would give for a single one. Once a path
+/// redefines a variable the address is computed from, it is no longer the
+/// same address and only the return still ends the path.
+///
+/// A `memset` of a known number of bytes, as local arrays with initializers
+/// start with, is dead when stores later in its block, or the stores of a
+/// counted loop entered right after it, write every word of it before
+/// anything may read one, or, for a local array, when nothing reads it
+/// before the return. Every function changed gets a remark in the pass
+/// statistics.
+class DSE final : public backend::MirOptimizePass {
+ public:
+  std::string pass_name() const override { return "DSE"; }
+  void optimize_mir(mir::inst::MirPackage &mir,
+                    std::map<std::string, std::any> &extra_data_repo) override;
+
+ private:
+  void optimize_func(mir::inst::MirFunction &func,
+                     const side_effects::Summaries &summaries,
+                     std::map<std::string, std::any> &extra_data_repo);
+};
+
+}  // namespace optimization::dse
@@ -3,9 +3,46 @@
 #include <memory>
 
 #include "../../arm_code/arm.hpp"
+#include "../../arm_code/cfg.hpp"
 
 namespace backend::optimization {
 using namespace arm;
+
+namespace {
+
+/// Instructions that only compute a value into their destination register
+bool is_pure_def(const Inst &inst) {
+  switch (inst.op) {
+    case OpCode::Mov:
+    case OpCode::MovT:
+    case OpCode::Mvn:
+    case OpCode::Add:
+    case OpCode::Sub:
+    case OpCode::Rsb:
+    case OpCode::Mul:
+    case OpCode::SMMul:
+    case OpCode::Mla:
+    case OpCode::SMMla:
+    case OpCode::SDiv:
+    case OpCode::And:
+    case OpCode::Orr:
+    case OpCode::Eor:
+    case OpCode::Bic:
+    case OpCode::Lsl:
+    case OpCode::Lsr:
+    case OpCode::Asr:
+    case OpCode::LdR:
+      return true;
+    default:
+      return false;
+  }
+}
+
+/// Registers whose dead writes can be dropped; sp, fp, lr and pc are left
+/// alone
+bool is_scratch_reg(Reg r) { return r <= 10 || r == 12; }
+
+}  // namespace
 void ExcessRegDelete::optimize_arm(
     arm::ArmCode &arm_code, std::map<std::string, std::any> &extra_data_repo) {
   for (auto &f : arm_code.functions) {
@@ -15,23 +52,23 @@ void ExcessRegDelete::optimize_arm(
     for (int i = 0; i < f->inst.size(); i++) {
       auto inst_ = &*f->inst[i];
       bool del = false;
-      if (auto x = dynamic_cast<Arith2Inst *>(inst_)) {
+      if (auto x = inst_cast<Arith2Inst>(inst_)) {
         if (x->op == arm::OpCode::Mov && (x->r1 == x->r2)) {
           // Delete `mov rA, rA`
           del = true;
         } else if (x->op == arm::OpCode::Mov && new_inst.size() > 0) {
           // Delete `mov rA, rB; mov rA, rB;`
-          if (auto x1 = dynamic_cast<Arith2Inst *>(&*new_inst.back())) {
+          if (auto x1 = inst_cast<Arith2Inst>(&*new_inst.back())) {
             if (x1->op == arm::OpCode::Mov && x->r1 == x1->r1 &&
                 x->r2 == x1->r2 && x->cond == x1->cond) {
               del = true;
             }
           }
         }
-      } else if (auto x = dynamic_cast<BrInst *>(inst_)) {
+      } else if (auto x = inst_cast<BrInst>(inst_)) {
         // thether the branch is always or not, it has no effect
         if (i < f->inst.size() - 1) {
-          if (auto x_ = dynamic_cast<LabelInst *>(&*f->inst[i + 1])) {
+          if (auto x_ = inst_cast<LabelInst>(&*f->inst[i + 1])) {
             if (x->l == x_->label) {
               // delete `b label1;` before `label1:`
               del = true;
@@ -40,8 +77,8 @@ void ExcessRegDelete::optimize_arm(
         }
         if (x->cond != arm::ConditionCode::Always && i < f->inst.size() - 2) {
           // simplify `bA label1; b label2; label1:` to `b~A label2; label1:`
-          auto x1 = dynamic_cast<BrInst *>(&*f->inst[i + 1]);
-          auto x2 = dynamic_cast<LabelInst *>(&*f->inst[i + 2]);
+          auto x1 = inst_cast<BrInst>(&*f->inst[i + 1]);
+          auto x2 = inst_cast<LabelInst>(&*f->inst[i + 2]);
           if (x1 && x2) {
             if (x->l == x2->label && (x1->cond == arm::ConditionCode::Always ||
                                       x1->cond == invert_cond(x->cond))) {
@@ -50,10 +87,10 @@ void ExcessRegDelete::optimize_arm(
             }
           }
         }
-      } else if (auto x = dynamic_cast<LoadStoreInst *>(inst_);
+      } else if (auto x = inst_cast<LoadStoreInst>(inst_);
                  x && new_inst.size() >= 1) {
         // Simplify `ldr xA, memA; str xA, memA`
-        if (auto x1 = dynamic_cast<LoadStoreInst *>(&*new_inst.back())) {
+        if (auto x1 = inst_cast<LoadStoreInst>(&*new_inst.back())) {
           if (x1->op == arm::OpCode::LdR && x->op == arm::OpCode::StR &&
               x->mem == x1->mem && x->cond == x1->cond && x->rd == x1->rd) {
             del = true;
@@ -85,7 +122,36 @@ void ExcessRegDelete::optimize_arm(
     }
 
     f->inst = std::move(new_inst);
+    while (delete_dead_defs(*f)) {
+    }
+  }
+}
+
+bool ExcessRegDelete::delete_dead_defs(arm::Function &f) {
+  MachineCFG cfg(f);
+  Liveness liveness(cfg);
+  std::vector<bool> dead(f.inst.size(), false);
+  bool changed = false;
+  for (auto &blk : cfg.blocks()) {
+    liveness.walk_backward(blk.id, [&](uint32_t i, const RegSet &live) {
+      if (!is_pure_def(*f.inst[i])) return true;
+      for (auto r : cfg.defs(i)) {
+        if (!is_scratch_reg(r) || live.test(liveness.index_of(r))) return true;
+      }
+      dead[i] = true;
+      changed = true;
+      return false;
+    });
+  }
+  if (!changed) return false;
+
+  auto new_inst = std::vector<std::unique_ptr<arm::Inst>>();
+  new_inst.reserve(f.inst.size());
+  for (int i = 0; i < f.inst.size(); i++) {
+    if (!dead[i]) new_inst.push_back(std::move(f.inst[i]));
   }
+  f.inst = std::move(new_inst);
+  return true;
 }
 
 }  // namespace backend::optimization
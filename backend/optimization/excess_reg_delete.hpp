@@ -8,6 +8,11 @@ class ExcessRegDelete final : public ArmOptimizePass {
   std::string pass_name() const override { return "ExcessRegDelete"; }
   void optimize_arm(arm::ArmCode &arm_code,
                     std::map<std::string, std::any> &extra_data_repo) override;
+
+ private:
+  /// Removes instructions whose results are never read on any path, using a
+  /// function-wide liveness analysis. Returns whether anything was removed.
+  bool delete_dead_defs(arm::Function &f);
 };
 
 }  // namespace backend::optimization
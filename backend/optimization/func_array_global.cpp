@@ -6,6 +6,7 @@
 #include <vector>
 
 #include "../../include/aixlog.hpp"
+#include "../../mir/def_use.hpp"
 #include "../../mir/mir.hpp"
 #include "../optimization/optimization.hpp"
 #include "./var_replace.hpp"
@@ -119,17 +120,20 @@ void Func_Array_Global::optimize_func(mir::inst::MirFunction& func,
       }
     }
     init_blk.inst.clear();
+    if (&init_func == &func) {
+      vp.du.rescan_block(init_blk);
+    }
     for (auto var : ref_results) {
-      var_replace::Var_Replace vp(func);
-      auto def_point = vp.defpoint.at(var);
-      auto& inst =
-          func.basic_blks.at(def_point.first).inst.at(def_point.second);
-      auto ref_var = *inst->useVars().begin();
+      auto def = vp.du.def_of(var);
+      if (def == nullptr) {
+        continue;
+      }
+      auto ref_var = *def->useVars().begin();
       std::vector<uint32_t> val(func.variables.at(ref_var.id).size() / 4, 0);
       auto name = gvm.add_global_var(func.name, ref_var, val);
       LOG(TRACE) << "convert array " << ref_var << "in " << func.name
                  << " to global array " << name << "" << std::endl;
-      inst = std::make_unique<mir::inst::RefInst>(var, name);
+      vp.du.replace_inst(def, std::make_unique<mir::inst::RefInst>(var, name));
       auto init_var = gvm.get_new_init_id(func.variables.at(var.id));
       init_insts.push_back(
           std::make_unique<mir::inst::RefInst>(init_var, name));
@@ -142,7 +146,7 @@ void Func_Array_Global::optimize_func(mir::inst::MirFunction& func,
           auto ptr = std::unique_ptr<mir::inst::Inst>(inst->deep_copy());
           ptr->replace(var, init_var);
           init_insts.push_back(std::move(ptr));
-          iter = startBlk.inst.erase(iter);
+          iter = vp.du.erase_inst(startBlk, iter);
         } else if (inst->useVars().count(var) &&
                    inst->inst_kind() == mir::inst::InstKind::Call) {
           auto& inst = *iter;
@@ -153,7 +157,7 @@ void Func_Array_Global::optimize_func(mir::inst::MirFunction& func,
             ptr->replace(var, init_var);
             ptr->dest = gvm.get_new_init_id(func.variables.at(inst->dest.id));
             init_insts.push_back(std::move(ptr));
-            iter = startBlk.inst.erase(iter);
+            iter = vp.du.erase_inst(startBlk, iter);
           }
         } else {
           iter++;
@@ -21,6 +21,7 @@
 #include "../backend.hpp"
 #include "./var_replace.hpp"
 #include "livevar_analyse.hpp"
+#include "optimization.hpp"
 
 namespace optimization::global_expr_move {
 
@@ -61,13 +62,51 @@ struct hasher {
   }
 };
 
+/// Objects the pointers loaded from and stored to point into, found before
+/// the pass starts moving instructions around
+typedef std::map<mir::inst::VarId, MemObject> Objects;
+
+/// Stores and calls in a stretch of code, which may change the words loaded
+/// before them
+class Clobbers {
+ public:
+  bool calls = false;
+  std::vector<MemObject> stores;
+
+  void add(const Objects& objects, mir::inst::Inst& inst) {
+    if (auto x = dynamic_cast<mir::inst::CallInst*>(&inst)) {
+      calls |= !NO_MEMORY_CALLS.count(x->func);
+    } else if (inst.inst_kind() == mir::inst::InstKind::Store) {
+      auto it = objects.find(inst.dest);
+      stores.push_back(it == objects.end() ? MemObject() : it->second);
+    }
+  }
+  bool hits(const MemObject& obj) const {
+    if (calls) {
+      return true;
+    }
+    return std::any_of(stores.begin(), stores.end(), [&](auto& s) {
+      return s.index() == 0 || obj.index() == 0 || s == obj;
+    });
+  }
+};
+
+inline MemObject object_in(const Objects& objects, mir::inst::VarId ptr) {
+  auto it = objects.find(ptr);
+  return it == objects.end() ? MemObject() : it->second;
+}
+
 class BlockOps {
  public:
   std::unordered_map<Op, mir::inst::VarId, hasher> ops;
+  // loads still valid at the end of the block
   std::map<std::pair<mir::inst::VarId, mir::inst::Value>, mir::inst::VarId>
       loads;
-  std::set<mir::inst::VarId> stores;
-  BlockOps(mir::inst::BasicBlk& blk, bool offset = false) {
+  Clobbers clobbers;
+  const Objects& objects;
+  BlockOps(mir::inst::BasicBlk& blk, const Objects& objects,
+           bool offset = false)
+      : objects(objects) {
     for (auto& inst : blk.inst) {
       auto& i = *inst;
       if (inst->inst_kind() == mir::inst::InstKind::Op) {
@@ -77,13 +116,19 @@ class BlockOps {
         if (inst->inst_kind() == mir::inst::InstKind::Load) {
           auto loadInst = dynamic_cast<mir::inst::LoadOffsetInst*>(&i);
           auto addr = std::get<mir::inst::VarId>(loadInst->src);
-          if (stores.count(addr)) {
-            continue;
-          }
           loads.insert({{addr, loadInst->offset}, loadInst->dest});
-        } else if (inst->inst_kind() == mir::inst::InstKind::Store) {
-          auto storeInst = dynamic_cast<mir::inst::StoreOffsetInst*>(&i);
-          stores.insert(storeInst->dest);
+        } else if (inst->inst_kind() == mir::inst::InstKind::Store ||
+                   inst->inst_kind() == mir::inst::InstKind::Call) {
+          Clobbers one;
+          one.add(objects, i);
+          for (auto it = loads.begin(); it != loads.end();) {
+            if (one.hits(object_in(objects, it->first.first))) {
+              it = loads.erase(it);
+            } else {
+              it++;
+            }
+          }
+          clobbers.add(objects, i);
         }
       }
     }
@@ -95,9 +140,6 @@ class BlockOps {
     //       mir::inst::OpInst(mir::inst::VarId(0), op.lhs, op.rhs, op.op);
     //   std::cout << opInst << std::endl;
     // }
-    if (disable_op(op)) {
-      return false;
-    }
     if (op.index() == 0) {
       return ops.find(std::get<Op>(op)) != ops.end();
     } else {
@@ -105,12 +147,13 @@ class BlockOps {
       return loads.count(load.first);
     }
   }
+  // whether the block may change what `op` loads
   bool disable_op(std::variant<Op, LoadOp> op) {
     if (op.index() == 0) {
       return false;
     } else {
       auto load = std::get<LoadOp>(op);
-      return stores.count(load.first.first);
+      return clobbers.hits(object_in(objects, load.first.first));
     }
   }
 };  // namespace optimization::global_expr_move
@@ -119,13 +162,31 @@ class Env {
  public:
   mir::inst::MirFunction& func;
   livevar_analyse::Livevar_Analyse& lva;
+  Objects objects;
   std::map<mir::types::LabelId, BlockOps> blk_op_map;
   var_replace::Var_Replace& vp;
   Env(mir::inst::MirFunction& func, livevar_analyse::Livevar_Analyse& lva,
       var_replace::Var_Replace& vp, bool offset)
       : func(func), lva(lva), vp(vp) {
+    if (offset) {
+      for (auto& blkpair : func.basic_blks) {
+        for (auto& inst : blkpair.second.inst) {
+          std::optional<mir::inst::VarId> ptr;
+          auto x = dynamic_cast<mir::inst::LoadOffsetInst*>(inst.get());
+          if (x && x->src.get_if<mir::inst::VarId>()) {
+            ptr = *x->src.get_if<mir::inst::VarId>();
+          } else if (inst->inst_kind() == mir::inst::InstKind::Store) {
+            ptr = inst->dest;
+          }
+          if (ptr && !objects.count(*ptr)) {
+            objects.insert({*ptr, object_of(func, *ptr)});
+          }
+        }
+      }
+    }
     for (auto& blkpair : func.basic_blks) {
-      blk_op_map.insert({blkpair.first, BlockOps(blkpair.second, offset)});
+      blk_op_map.insert(
+          {blkpair.first, BlockOps(blkpair.second, objects, offset)});
     }
   }
 };
@@ -137,17 +198,6 @@ class Global_Expr_Mov : public backend::MirOptimizePass {
   const std::string name = "Global expression mov";
   std::string pass_name() const { return name; }
   Global_Expr_Mov(bool offset = false) : offset(offset){};
-  mir::types::LabelId find_common_live_blk(mir::inst::VarId lhs,
-                                           mir::inst::VarId rhs) {
-    auto lstart = env->vp.defpoint.at(lhs).first;
-    auto rstart = env->vp.defpoint.at(lhs).first;
-    auto lblv = env->lva.livevars.at(lstart);
-    if (env->lva.livevars.at(lstart)->live_vars_out->count(rhs)) {
-      return rstart;
-    }
-    return lstart;
-  }
-
   std::unique_ptr<mir::inst::OpInst> copy_opinst(
       std::unique_ptr<mir::inst::OpInst>& inst) {
     return std::make_unique<mir::inst::OpInst>(inst->dest, inst->lhs, inst->rhs,
@@ -187,6 +237,30 @@ class Global_Expr_Mov : public backend::MirOptimizePass {
     return res;
   }
 
+  // whether a block on some path from `from` to `to`, besides the two, may
+  // change what `op` loads
+  bool path_clobbers(mir::types::LabelId from, mir::types::LabelId to,
+                     const LoadOp& op) {
+    std::set<mir::types::LabelId> visited{from, to};
+    std::list<mir::types::LabelId> queue(
+        env->func.basic_blks.at(to).preceding.begin(),
+        env->func.basic_blks.at(to).preceding.end());
+    while (!queue.empty()) {
+      auto f = queue.front();
+      queue.pop_front();
+      if (!visited.insert(f).second) {
+        continue;
+      }
+      if (env->blk_op_map.at(f).disable_op(op)) {
+        return true;
+      }
+      for (auto p : env->func.basic_blks.at(f).preceding) {
+        queue.push_back(p);
+      }
+    }
+    return false;
+  }
+
   mir::types::LabelId bfs(int start, std::variant<Op, LoadOp> op) {
     auto prec = env->func.basic_blks.at(start).preceding;
     if (prec.size() == 0) {
@@ -264,6 +338,8 @@ class Global_Expr_Mov : public backend::MirOptimizePass {
         }
       }
     }
+    // Refs were moved to the entry behind the back of the def-use index
+    func.invalidate_def_use();
     int cnt = 0;
     while (true) {
       bool modify = false;
@@ -288,8 +364,11 @@ class Global_Expr_Mov : public backend::MirOptimizePass {
           auto& block = blk;
           auto& blv = lva.livevars[start];
           auto& variables = func.variables;
+          // stores and calls before the instruction visited
+          Clobbers clobbers;
           for (auto iter = block.inst.begin(); iter != block.inst.end();) {
             auto& inst = *iter;
+            clobbers.add(env->objects, *inst);
             if (func.variables.at(inst->dest.id).is_phi_var) {
               iter++;
               continue;
@@ -332,30 +411,21 @@ class Global_Expr_Mov : public backend::MirOptimizePass {
                 }
                 auto var = env->blk_op_map.at(id).ops.at(op);
                 if (func.variables.at(var.id).is_phi_var) {
-                  vp.setdefpoint(inst->dest, id,
-                                 func.basic_blks.at(id).inst.size());
-                  for (auto var : inst->useVars()) {
-                    auto& usepoints = vp.usepoints.at(var);
-                    std::pair<mir::types::LabelId, int> point = {
-                        blk.id, iter - block.inst.begin()};
-                    auto find_iter =
-                        std::find(usepoints.begin(), usepoints.end(), point);
-                    if (find_iter != usepoints.end()) {
-                      usepoints.erase(find_iter);
-                      usepoints.push_back(
-                          {id, func.basic_blks.at(id).inst.size()});
-                    }
-                  }
-                  func.basic_blks.at(id).inst.push_back(std::move(inst));
+                  auto& target = func.basic_blks.at(id);
+                  target.inst.push_back(std::move(inst));
                   inst = std::make_unique<mir::inst::AssignInst>(
                       mir::inst::VarId(-1), -1);
+                  vp.du.rescan_block(block);
+                  vp.du.rescan_block(target);
                 } else {
                   LOG(TRACE)
                       << inst->dest << " is replaced to " << var << std::endl;
                   vp.replace(inst->dest, var);
                   // useless inst
-                  inst =
-                      std::make_unique<mir::inst::AssignInst>(inst->dest, -999);
+                  vp.du.replace_inst(
+                      block, iter,
+                      std::make_unique<mir::inst::AssignInst>(inst->dest,
+                                                              -999));
                 }
                 func.variables.at(var).is_temp_var = false;
                 modify = true;
@@ -369,16 +439,21 @@ class Global_Expr_Mov : public backend::MirOptimizePass {
                 LoadOp op = {{std::get<mir::inst::VarId>(loadInst->src),
                               loadInst->offset},
                              loadInst->dest};
+                if (clobbers.hits(object_in(env->objects, op.first.first))) {
+                  break;
+                }
                 auto id = bfs(start, op);
-                if (id == start) {
+                if (id == start || path_clobbers(id, start, op)) {
                   break;
                 }
                 auto var = env->blk_op_map.at(id).loads.at(op.first);
                 if (!func.variables.at(var.id).is_phi_var) {
                   vp.replace(inst->dest, var);
                   // useless inst
-                  inst =
-                      std::make_unique<mir::inst::AssignInst>(inst->dest, -999);
+                  vp.du.replace_inst(
+                      block, iter,
+                      std::make_unique<mir::inst::AssignInst>(inst->dest,
+                                                              -999));
                   func.variables.at(var).is_temp_var = false;
                   modify = true;
                   continue;
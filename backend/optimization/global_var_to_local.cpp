@@ -6,6 +6,7 @@
 #include <vector>
 
 #include "../../include/aixlog.hpp"
+#include "../../mir/def_use.hpp"
 #include "../../mir/mir.hpp"
 #include "../optimization/optimization.hpp"
 #include "./var_replace.hpp"
@@ -84,38 +85,39 @@ void Global_Var_to_Local::optimize_mir(
     auto var = get_new_id(f, mir::inst::Variable(mir::types::new_int_ty()));
     LOG(TRACE) << "convert global var  " << s << " to local var " << var
                << " in " << f.name << std::endl;
-    startblk.inst.insert(startblk.inst.begin() + idx + 1,
-                         std::make_unique<mir::inst::LoadInst>(dest, var));
     var_replace::Var_Replace vp(f);
-    for (auto& usepoint : vp.usepoints.at(dest)) {
-      if (usepoint.first == startblk.id && usepoint.second == idx + 1) {
+    auto pos = vp.du.insert_inst(
+        startblk, startblk.inst.begin() + idx + 1,
+        std::make_unique<mir::inst::LoadInst>(dest, var));
+    auto load = pos->get();
+    for (auto usepoint : vp.du.uses_of(dest)) {
+      if (usepoint.is_jump() || usepoint.inst == load) {
         continue;
       }
-      auto& inst = vp.get_usepoint(usepoint);
+      auto inst = usepoint.inst;
       if (inst->inst_kind() == mir::inst::InstKind::Store) {
-        auto& i = *inst;
-        auto ist = dynamic_cast<mir::inst::StoreOffsetInst*>(&i);
-        if (!ist->val.is_immediate() &&
-            !f.variables.at(std::get<mir::inst::VarId>(ist->val).id)
-                 .is_phi_var) {
-          auto val = std::get<mir::inst::VarId>(ist->val);
-          vp.replace(val, var);
-          inst = std::make_unique<mir::inst::AssignInst>(var, var);
-          auto& def = vp.get_usepoint(vp.defpoint.at(val));
+        auto ist = dynamic_cast<mir::inst::StoreOffsetInst*>(inst);
+        auto val = ist->val.get_if<mir::inst::VarId>();
+        auto def = val ? vp.du.def_of(*val) : nullptr;
+        if (def && !f.variables.at(val->id).is_phi_var) {
+          vp.replace(*val, var);
+          vp.du.replace_inst(
+              inst, std::make_unique<mir::inst::AssignInst>(var, var));
           def->dest = var;
+          vp.du.refresh(def);
         } else {
-          inst = std::make_unique<mir::inst::AssignInst>(var, ist->val);
+          vp.du.replace_inst(
+              inst, std::make_unique<mir::inst::AssignInst>(var, ist->val));
         }
       } else {
-        auto& i = *inst;
-        auto ist = dynamic_cast<mir::inst::LoadOffsetInst*>(&i);
+        auto ist = dynamic_cast<mir::inst::LoadOffsetInst*>(inst);
         if (!f.variables.at(ist->dest.id).is_phi_var) {
           vp.replace(ist->dest, var);
-          inst = std::make_unique<mir::inst::AssignInst>(var, var);
-          auto& def = vp.get_usepoint(vp.defpoint.at(ist->dest));
-          def->dest = var;
+          vp.du.replace_inst(
+              inst, std::make_unique<mir::inst::AssignInst>(var, var));
         } else {
-          inst = std::make_unique<mir::inst::AssignInst>(ist->dest, var);
+          vp.du.replace_inst(
+              inst, std::make_unique<mir::inst::AssignInst>(ist->dest, var));
         }
       }
     }
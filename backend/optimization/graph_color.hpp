@@ -8,33 +8,94 @@
 #include <list>
 #include <map>
 #include <memory>
-#include <stack>
+#include <set>
 #include <string>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 
 #include "../../include/aixlog.hpp"
 #include "../backend.hpp"
 #include "livevar_analyse.hpp"
+#include "optimization.hpp"
 
 namespace optimization::graph_color {
 
 typedef int color;  //
 typedef std::map<mir::inst::VarId, color> Color_Map;
+
+/// Disjoint sets over variables, used to merge the variables connected by
+/// phi instructions into a single web which shares one color.
+class Phi_Webs {
+ public:
+  /// Index of `var`, allocating a singleton set for unseen variables
+  uint32_t index_of(mir::inst::VarId var) {
+    auto iter = index.find(var);
+    if (iter != index.end()) {
+      return iter->second;
+    }
+    uint32_t idx = parent.size();
+    index.insert({var, idx});
+    vars.push_back(var);
+    parent.push_back(idx);
+    rank.push_back(0);
+    return idx;
+  }
+
+  uint32_t find(uint32_t idx) {
+    while (parent[idx] != idx) {
+      parent[idx] = parent[parent[idx]];
+      idx = parent[idx];
+    }
+    return idx;
+  }
+
+  void unite(mir::inst::VarId var1, mir::inst::VarId var2) {
+    auto a = find(index_of(var1));
+    auto b = find(index_of(var2));
+    if (a == b) {
+      return;
+    }
+    if (rank[a] < rank[b]) {
+      std::swap(a, b);
+    }
+    parent[b] = a;
+    if (rank[a] == rank[b]) {
+      rank[a]++;
+    }
+  }
+
+  size_t size() const { return vars.size(); }
+
+  std::unordered_map<mir::inst::VarId, uint32_t> index;
+  std::vector<mir::inst::VarId> vars;
+
+ private:
+  std::vector<uint32_t> parent;
+  std::vector<uint8_t> rank;
+};
+
 class Conflict_Map {
  public:
-  std::map<mir::inst::VarId, std::set<mir::inst::VarId>> static_Map;
-  std::map<mir::inst::VarId, std::set<mir::inst::VarId>> dynamic_Map;
-  std::map<mir::inst::VarId, mir::inst::VarId> merged_var_Map;
-  std::map<mir::inst::VarId, std::set<mir::inst::VarId>> merged_Map;
-  std::map<u_int, std::set<mir::inst::VarId>> edge_vars;
-  std::stack<mir::inst::VarId> remove_Nodes;
+  typedef uint32_t Node;
+  static constexpr Node NO_NODE = UINT32_MAX;
+
+  Phi_Webs webs;
+  /// web root -> graph node
+  std::unordered_map<uint32_t, Node> web_node;
+  /// graph node -> variables it stands for
+  std::vector<std::vector<mir::inst::VarId>> node_vars;
+  std::vector<int> node_priority;
+  std::vector<std::vector<Node>> adj_list;
+  /// Strictly lower triangle of the adjacency matrix, one bit per pair
+  std::vector<uint64_t> adj_matrix;
   std::shared_ptr<Color_Map> color_map;
   std::shared_ptr<std::set<int>> unused_colors;
-  std::map<mir::inst::VarId, int> priority_map;
   mir::inst::MirFunction& func;
-  int varId;
   u_int color_num = 8;
+  /// Variables with an index below this are connected by some phi
+  size_t merged_count = 0;
+
   Conflict_Map(std::shared_ptr<Color_Map> color_map,
                mir::inst::MirFunction& func, u_int color_num = 8)
       : color_num(color_num), color_map(color_map), func(func) {
@@ -42,274 +103,193 @@ class Conflict_Map {
     for (int i = 0; i < color_num; i++) {
       unused_colors->insert(i);
     }
-    if (func.variables.size()) {
-      auto end_iter = func.variables.end();
-      end_iter--;
-      varId = end_iter->first;
-    } else {
-      varId = mir::inst::VarId(65535);
-    }
     for (auto& blkiter : func.basic_blks) {
       for (auto& inst : blkiter.second.inst) {
         if (inst->inst_kind() == mir::inst::InstKind::Phi) {
-          mir::inst::VarId new_VarId(0);
           for (auto var : inst->useVars()) {
-            if (merged_var_Map.count(var)) {
-              new_VarId = merged_var_Map.at(var);
-              break;
-            }
+            webs.unite(inst->dest, var);
           }
-          if (new_VarId.id == 0) {
-            if (merged_var_Map.count(inst->dest)) {
-              new_VarId = merged_var_Map.at(inst->dest);
-            } else {
-              new_VarId = get_new_VarId();
-            }
-          }
-          merge(inst->dest, new_VarId);
-          for (auto var : inst->useVars()) {
-            merge(var, new_VarId);
-          }
-          // LOG(TRACE) << new_VarId << " : ";
-          // for (auto var : inst->useVars()) {
-          //   LOG(TRACE) << var << ", ";
-          // }
-          // LOG(TRACE) << std::endl;
         }
       }
     }
-    for (auto& pair : merged_Map) {
-      LOG(TRACE) << pair.first << " representes these vars : ";
-      for (auto var : pair.second) {
-        LOG(TRACE) << var << ", ";
-      }
-      LOG(TRACE) << std::endl;
-    }
+    merged_count = webs.size();
+  }
+
+  bool is_merged(mir::inst::VarId var) {
+    auto iter = webs.index.find(var);
+    return iter != webs.index.end() && iter->second < merged_count;
   }
 
   int get_priority(mir::inst::VarId var) {
-    int pri;
-    if (func.variables.count(var.id)) {
-      pri = func.variables.at(var.id).priority;
-    } else {
-      pri = priority_map.at(var);
-    }
-    // assert(pri == 0);
-    return pri;
+    auto iter = func.variables.find(var.id);
+    return iter == func.variables.end() ? 0 : iter->second.priority;
   }
 
-  void merge(mir::inst::VarId var1, mir::inst::VarId var2) {
-    if (!merged_Map.count(var2)) {
-      merged_Map[var2] = std::set<mir::inst::VarId>();
-    }
-    int priority = func.variables.at(var1.id).priority;
-    if (merged_var_Map.count(var1)) {
-      auto old_merged_var = merged_var_Map.at(var1);
-      if (old_merged_var == var2) {
-        return;
-      }
-      for (auto& var : merged_Map.at(old_merged_var)) {
-        merged_var_Map[var] = var2;
-        merged_Map[var2].insert(var);
-        priority += func.variables.at(var.id).priority;
-      }
-      priority_map.insert({var2, priority});
-      merged_Map.erase(old_merged_var);
-    } else {
-      merged_var_Map[var1] = var2;
-      merged_Map[var2].insert(var1);
-      priority_map.insert({var2, priority});
-    }
+  /// Graph node of `var`, creating it when `create` is set
+  Node node_of(mir::inst::VarId var, bool create = false) {
+    uint32_t root = webs.find(webs.index_of(var));
+    auto iter = web_node.find(root);
+    if (iter != web_node.end()) {
+      return iter->second;
+    }
+    if (!create) {
+      return NO_NODE;
+    }
+    assert(adj_matrix.empty() && "nodes must be added before any conflict");
+    Node node = node_vars.size();
+    web_node.insert({root, node});
+    node_vars.emplace_back();
+    node_priority.push_back(0);
+    return node;
   }
 
-  mir::inst::VarId get_new_VarId() { return mir::inst::VarId(++varId); }
-  void add_conflict(mir::inst::VarId defVar,
-                    std::set<mir::inst::VarId> useVars) {
-    if (merged_var_Map.count(defVar)) {
-      defVar = merged_var_Map.at(defVar);
-    }
-    if (!static_Map.count(defVar)) {
-      static_Map[defVar] = std::set<mir::inst::VarId>();
-      dynamic_Map[defVar] = std::set<mir::inst::VarId>();
-    }
-    for (auto useVar : useVars) {
-      if (merged_var_Map.count(useVar)) {
-        useVar = merged_var_Map.at(useVar);
-      }
-      if (defVar.id == 66059 && useVar.id == 66061 ||
-          useVar.id == 66059 && defVar.id == 66061) {
-        std::cout << "find it " << std::endl;
-      }
-      if (defVar == useVar) {
-        continue;
-      }
-      if (!static_Map.count(useVar)) {
-        static_Map[useVar] = std::set<mir::inst::VarId>();
-        dynamic_Map[useVar] = std::set<mir::inst::VarId>();
+  void add_var(mir::inst::VarId var) { node_of(var, true); }
+
+  bool has_var(mir::inst::VarId var) { return node_of(var) != NO_NODE; }
+
+  /// Allocate the graph once every node is known
+  void init_graph() {
+    for (uint32_t i = 0; i < webs.size(); i++) {
+      auto iter = web_node.find(webs.find(i));
+      if (iter != web_node.end()) {
+        node_vars[iter->second].push_back(webs.vars[i]);
+        node_priority[iter->second] += get_priority(webs.vars[i]);
       }
-      static_Map[defVar].insert(useVar);
-      static_Map[useVar].insert(defVar);
-      dynamic_Map[defVar].insert(useVar);
-      dynamic_Map[useVar].insert(defVar);
     }
+    size_t n = node_vars.size();
+    adj_list.resize(n);
+    adj_matrix.assign((n * (n - 1) / 2 + 63) / 64 + 1, 0);
   }
 
-  void init_edge_vars() {
-    for (auto iter = static_Map.begin(); iter != static_Map.end(); ++iter) {
-      auto size = iter->second.size();
-      if (!edge_vars.count(size)) {
-        edge_vars[size] = std::set<mir::inst::VarId>();
-      }
-      edge_vars[size].insert(iter->first);
+  size_t bit_index(Node a, Node b) const {
+    if (a < b) {
+      std::swap(a, b);
     }
+    return (size_t)a * (a - 1) / 2 + b;
   }
 
-  bool has_var(mir::inst::VarId var) { return static_Map.count(var); }
-
-  void delete_edge(mir::inst::VarId var1, mir::inst::VarId var2) {
-    assert(dynamic_Map.count(var1) && dynamic_Map.count(var2));
-    auto size1 = dynamic_Map[var1].size();
-    auto size2 = dynamic_Map[var2].size();
-    edge_vars[size1].erase(var1);
-    edge_vars[size2].erase(var2);
-    if (!edge_vars[size1].size()) {
-      edge_vars.erase(size1);
-    }
-    if (edge_vars.count(size2) && !edge_vars[size2].size()) {
-      edge_vars.erase(size2);
-    }
-    dynamic_Map[var1].erase(var2);
-    dynamic_Map[var2].erase(var1);
-    if (size1 >= 1) {
-      if (!edge_vars.count(size1 - 1)) {
-        edge_vars[size1 - 1] = std::set<mir::inst::VarId>();
-      }
-      edge_vars[size1 - 1].insert(var1);
-    }
-    if (size2 >= 1) {
-      if (!edge_vars.count(size2 - 1)) {
-        edge_vars[size2 - 1] = std::set<mir::inst::VarId>();
-      }
-      edge_vars[size2 - 1].insert(var2);
-    }
+  bool interferes(Node a, Node b) const {
+    auto bit = bit_index(a, b);
+    return adj_matrix[bit / 64] >> (bit % 64) & 1;
   }
 
-  void remove_node(mir::inst::VarId var, bool temporarily = true) {
-    auto neighbors = dynamic_Map[var];
-    for (auto iter = neighbors.begin(); iter != neighbors.end(); ++iter) {
-      delete_edge(*iter, var);
-    }
-    dynamic_Map.erase(var);
-    if (edge_vars[0].size() == 1) {
-      edge_vars.erase(0);
-    } else {
-      edge_vars[0].erase(var);
-    }
-    if (temporarily) {
-      remove_Nodes.push(var);
-    } else {
-      for (auto iter = static_Map[var].begin(); iter != static_Map[var].end();
-           ++iter) {
-        static_Map[*iter].erase(var);
-      }
-      static_Map.erase(var);
+  void add_edge(Node a, Node b) {
+    if (a == b || interferes(a, b)) {
+      return;
     }
+    auto bit = bit_index(a, b);
+    adj_matrix[bit / 64] |= (uint64_t)1 << (bit % 64);
+    adj_list[a].push_back(b);
+    adj_list[b].push_back(a);
   }
 
-  void remove_edge_less_colors() {
-    while (true) {
-      if (!edge_vars.size()) {
-        return;
-      }
-      auto min_edge_iter = edge_vars.begin();
-      auto min_edge = min_edge_iter->first;
-      std::set<mir::inst::VarId> vars_to_remove;
-      if (min_edge >= color_num) {
-        return;
-      }
-      for (auto iter = edge_vars.begin();
-           iter != edge_vars.end() && iter->first < color_num; ++iter) {
-        vars_to_remove.insert(iter->second.begin(), iter->second.end());
-      }
-      for (auto var : vars_to_remove) {
-        remove_node(var);
-      }
+  void add_conflict(mir::inst::VarId defVar,
+                    const std::set<mir::inst::VarId>& useVars) {
+    auto def = node_of(defVar);
+    assert(def != NO_NODE);
+    for (auto useVar : useVars) {
+      auto use = node_of(useVar);
+      assert(use != NO_NODE);
+      add_edge(def, use);
     }
   }
-  void remove_edge_larger_colors() {
-    if (!edge_vars.size()) {
-      return;
-    }
-    int priority = 9999999;
-    // mir::inst::VarId var;
-    // for (auto& pair : dynamic_Map) {
-    //   if (get_priority(pair.first) < priority) {
-    //     var = pair.first;
-    //   }
-    // }
-    mir::inst::VarId var;
-    for (auto& edgepair : edge_vars) {
-      for (auto var1 : edgepair.second) {
-        auto pri1 = get_priority(var1);
-        if (pri1 < priority) {
-          priority = pri1;
-          var = var1;
+
+  /// Chaitin-style simplify/select. Nodes with fewer than `color_num`
+  /// neighbours are taken from the lowest degree bucket and stacked; when
+  /// none is left the cheapest node is spilled (colored -1).
+  void simplify_and_select() {
+    size_t n = node_vars.size();
+    std::vector<uint32_t> degree(n);
+    std::vector<bool> removed(n, false);
+    // buckets[d] holds the nodes of degree d for d < color_num, the last
+    // bucket holds everything of higher degree
+    std::vector<std::vector<Node>> buckets(color_num + 1);
+    std::vector<uint32_t> bucket_pos(n);
+    auto bucket_of = [&](Node v) {
+      return std::min<uint32_t>(degree[v], color_num);
+    };
+    auto bucket_insert = [&](Node v) {
+      auto& bucket = buckets[bucket_of(v)];
+      bucket_pos[v] = bucket.size();
+      bucket.push_back(v);
+    };
+    auto bucket_erase = [&](Node v) {
+      auto& bucket = buckets[bucket_of(v)];
+      auto last = bucket.back();
+      bucket[bucket_pos[v]] = last;
+      bucket_pos[last] = bucket_pos[v];
+      bucket.pop_back();
+    };
+    // remaining nodes ordered by spill cost
+    std::set<std::pair<int, Node>> spill_candidates;
+    for (Node v = 0; v < n; v++) {
+      degree[v] = adj_list[v].size();
+      bucket_insert(v);
+      spill_candidates.insert({node_priority[v], v});
+    }
+    auto remove = [&](Node v) {
+      bucket_erase(v);
+      spill_candidates.erase({node_priority[v], v});
+      removed[v] = true;
+      for (auto u : adj_list[v]) {
+        if (removed[u]) {
+          continue;
         }
+        bucket_erase(u);
+        degree[u]--;
+        bucket_insert(u);
       }
-    }
-    remove_node(var, false);
-  }
-
-  bool empty() { return dynamic_Map.empty(); }
+    };
 
-  color available_color(std::set<mir::inst::VarId>& neighbors) {
-    std::vector<bool> colors(color_num, true);
-    for (auto var : neighbors) {
-      colors[color_map->at(var)] = false;
-    }
-    for (int i = 0; i < color_num; i++) {
-      if (colors[i]) {
-        if (unused_colors->count(i)) {
-          unused_colors->erase(i);
+    std::vector<Node> stack;
+    std::vector<color> node_color(n, -1);
+    size_t left = n;
+    while (left) {
+      bool simplified = false;
+      for (uint32_t d = 0; d < color_num; d++) {
+        if (!buckets[d].empty()) {
+          auto v = buckets[d].back();
+          remove(v);
+          stack.push_back(v);
+          simplified = true;
+          break;
         }
-        return i;
       }
+      if (!simplified) {
+        auto v = spill_candidates.begin()->second;
+        remove(v);
+      }
+      left--;
     }
-    // errors
-    assert(false);
-    return 0;
-  }
 
-  void add_edge(mir::inst::VarId var1, mir::inst::VarId var2) {
-    assert(dynamic_Map.count(var1) && dynamic_Map.count(var2));
-    dynamic_Map[var1].insert(var2);
-    dynamic_Map[var2].insert(var1);
-  }
+    std::vector<bool> used(color_num);
+    while (!stack.empty()) {
+      auto v = stack.back();
+      stack.pop_back();
+      std::fill(used.begin(), used.end(), false);
+      for (auto u : adj_list[v]) {
+        if (node_color[u] >= 0) {
+          used[node_color[u]] = true;
+        }
+      }
+      auto c = std::find(used.begin(), used.end(), false) - used.begin();
+      assert(c < color_num);
+      node_color[v] = c;
+      unused_colors->erase(c);
+    }
 
-  void add_node(mir::inst::VarId var) {
-    dynamic_Map[var] = std::set<mir::inst::VarId>();
-    for (auto neighbor : static_Map[var]) {
-      if (dynamic_Map.count(neighbor)) {
-        add_edge(var, neighbor);
+    for (Node v = 0; v < n; v++) {
+      for (auto var : node_vars[v]) {
+        color_map->insert({var, node_color[v]});
       }
     }
-    (*color_map)[var] = available_color(dynamic_Map[var]);
   }
 
-  void rebuild() {
-    while (remove_Nodes.size()) {
-      add_node(remove_Nodes.top());
-      remove_Nodes.pop();
-    }
-    for (auto& pair : merged_Map) {
-      if (!color_map->count(pair.first)) {
-        color_map->insert(std::make_pair(pair.first, -1));
-      }
-      auto color = color_map->at(pair.first);
-      for (auto var : pair.second) {
-        color_map->insert(std::make_pair(var, color));
-      }
-      color_map->erase(pair.first);
+  /// Every variable merged through phis gets an entry, even if its web never
+  /// made it into the graph
+  void color_unplaced_webs() {
+    for (uint32_t i = 0; i < merged_count; i++) {
+      color_map->insert({webs.vars[i], -1});
     }
   }
 };
@@ -326,7 +306,7 @@ class Graph_Color : public backend::MirOptimizePass {
   std::unordered_map<std::string, std::shared_ptr<Color_Map>> func_color_map;
   std::unordered_map<std::string, std::shared_ptr<std::set<int>>>
       func_unused_colors;
-  std::map<std::string, std::shared_ptr<Conflict_Map>> func_conflict_map;
+  VectorColorType func_vector_color_map;
   Graph_Color(u_int color_num, bool enable = true)
       : color_num(color_num), enable(enable) {}
   std::string pass_name() const { return name; }
@@ -337,8 +317,35 @@ class Graph_Color : public backend::MirOptimizePass {
   // define point is allowed for each var
   void init_cross_blk_vars(livevar_analyse::sharedPtrBlkLivevar blv,
                            std::set<mir::inst::VarId>& cross_blk_vars) {
-    cross_blk_vars.insert(blv->live_vars_out_ignoring_jump->begin(),
-                          blv->live_vars_out_ignoring_jump->end());
+    for (auto var : *blv->live_vars_out_ignoring_jump) {
+      if (blv->queryTy(var) != mir::types::TyKind::Vector) {
+        cross_blk_vars.insert(var);
+      }
+    }
+  }
+
+  bool needs_node(std::shared_ptr<livevar_analyse::Block_Live_Var> blv,
+                  std::shared_ptr<Conflict_Map>& conflict_map,
+                  std::set<mir::inst::VarId>& cross_blk_vars,
+                  mir::inst::Inst& inst) {
+    if (inst.inst_kind() == mir::inst::InstKind::Phi) {
+      return false;
+    }
+    auto defVar = inst.dest;
+    auto ty = blv->queryTy(defVar);
+    return ty != mir::types::TyKind::Void &&
+           ty != mir::types::TyKind::Vector &&
+           (cross_blk_vars.count(defVar) || conflict_map->is_merged(defVar));
+  }
+
+  void init_conflict_nodes(std::shared_ptr<livevar_analyse::Block_Live_Var> blv,
+                           std::shared_ptr<Conflict_Map>& conflict_map,
+                           std::set<mir::inst::VarId>& cross_blk_vars) {
+    for (auto& inst : blv->block.inst) {
+      if (needs_node(blv, conflict_map, cross_blk_vars, *inst)) {
+        conflict_map->add_var(inst->dest);
+      }
+    }
   }
 
   void init_conflict_map(std::shared_ptr<livevar_analyse::Block_Live_Var> blv,
@@ -346,13 +353,7 @@ class Graph_Color : public backend::MirOptimizePass {
                          std::set<mir::inst::VarId>& cross_blk_vars) {
     auto& block = blv->block;
     for (auto iter = block.inst.begin(); iter != block.inst.end(); ++iter) {
-      if (iter->get()->inst_kind() == mir::inst::InstKind::Phi) {
-        continue;
-      }
-      auto defVar = iter->get()->dest;
-      if (blv->queryTy(defVar) == mir::types::TyKind::Void ||
-          !cross_blk_vars.count(defVar) &&
-              !conflict_map->merged_var_Map.count(defVar)) {
+      if (!needs_node(blv, conflict_map, cross_blk_vars, **iter)) {
         continue;
       }
       int idx = iter - block.inst.begin();
@@ -361,21 +362,60 @@ class Graph_Color : public backend::MirOptimizePass {
           blv->instLiveVars[idx]->begin(), blv->instLiveVars[idx]->end(),
           cross_blk_vars.begin(), cross_blk_vars.end(),
           std::inserter(cross_use_vars, cross_use_vars.begin()));
-      conflict_map->add_conflict(defVar, cross_use_vars);
+      conflict_map->add_conflict(iter->get()->dest, cross_use_vars);
     }
-    for (auto var : cross_blk_vars) {
-      if (!conflict_map->has_var(var)) {
-        conflict_map->add_conflict(var, std::set<mir::inst::VarId>());
+  }
+
+  /// Vector variables live in quad registers, which they share with nothing
+  /// else, so they are colored on a graph of their own. Every one of them
+  /// gets a color: the vectorizer keeps few enough of them live at once.
+  void color_vectors(std::string funcId, mir::inst::MirFunction& func,
+                     livevar_analyse::Livevar_Analyse& lva) {
+    std::set<mir::inst::VarId> vector_vars;
+    for (auto& [id, var] : func.variables) {
+      if (var.ty && var.ty->kind() == mir::types::TyKind::Vector) {
+        vector_vars.insert(mir::inst::VarId(id));
+      }
+    }
+    if (vector_vars.empty()) {
+      return;
+    }
+    auto map = std::make_shared<Color_Map>();
+    Conflict_Map conflict_map(map, func, arm::VECTOR_REGS.size());
+    auto is_vector_def = [&](mir::inst::Inst& inst) {
+      return inst.inst_kind() != mir::inst::InstKind::Phi &&
+             vector_vars.count(inst.dest);
+    };
+    for (auto& [id, blv] : lva.livevars) {
+      for (auto& inst : blv->block.inst) {
+        if (is_vector_def(*inst)) {
+          conflict_map.add_var(inst->dest);
+        }
       }
     }
-    // LOG(TRACE) << "conflict map : " << std::endl;
-    // for (auto pair : conflict_map->dynamic_Map) {
-    //   LOG(TRACE) << pair.first << " : ";
-    //   for (auto var : pair.second) {
-    //     LOG(TRACE) << var << ", ";
-    //   }
-    //   LOG(TRACE) << std::endl;
-    // }
+    conflict_map.init_graph();
+    for (auto& [id, blv] : lva.livevars) {
+      auto& block = blv->block;
+      for (int idx = 0; idx < block.inst.size(); idx++) {
+        if (!is_vector_def(*block.inst[idx])) {
+          continue;
+        }
+        std::set<mir::inst::VarId> live;
+        std::set_intersection(
+            blv->instLiveVars[idx]->begin(), blv->instLiveVars[idx]->end(),
+            vector_vars.begin(), vector_vars.end(),
+            std::inserter(live, live.begin()));
+        conflict_map.add_conflict(block.inst[idx]->dest, live);
+      }
+    }
+    conflict_map.simplify_and_select();
+    for (auto [var, c] : *map) {
+      if (c < 0) {
+        throw std::logic_error("vector variables of " + func.name +
+                               " need more registers than there are");
+      }
+    }
+    func_vector_color_map[funcId] = *map;
   }
 
   void optimize_func(std::string funcId, mir::inst::MirFunction& func) {
@@ -386,36 +426,34 @@ class Graph_Color : public backend::MirOptimizePass {
     std::set<mir::inst::VarId> cross_blk_vars;
     auto map = std::make_shared<Color_Map>(std::map<mir::inst::VarId, color>());
     func_color_map.insert({funcId, map});
-    func_conflict_map[funcId] = std::make_shared<Conflict_Map>(
-        Conflict_Map(func_color_map[funcId], func, color_num));
-    auto conflict_map = func_conflict_map[funcId];
+    auto conflict_map =
+        std::make_shared<Conflict_Map>(func_color_map[funcId], func, color_num);
     func_unused_colors.insert({funcId, conflict_map->unused_colors});
     livevar_analyse::Livevar_Analyse lva(func, true);
     lva.build();
     for (auto iter = lva.livevars.begin(); iter != lva.livevars.end(); ++iter) {
       init_cross_blk_vars(iter->second, cross_blk_vars);
     }
-    LOG(TRACE) << " Conflict map :" << std::endl;
 
     if (enable) {
       for (auto iter = func.basic_blks.begin(); iter != func.basic_blks.end();
            ++iter) {
-        init_conflict_map(lva.livevars[iter->first], conflict_map,
-                          cross_blk_vars);
+        init_conflict_nodes(lva.livevars[iter->first], conflict_map,
+                            cross_blk_vars);
       }
-      conflict_map->init_edge_vars();
-      for (auto& pair : conflict_map->dynamic_Map) {
-        LOG(TRACE) << pair.first << " conflicts with : ";
-        for (auto var : pair.second) {
-          LOG(TRACE) << var << ", ";
-        }
-        LOG(TRACE) << std::endl;
+      for (auto var : cross_blk_vars) {
+        conflict_map->add_var(var);
       }
-      while (!conflict_map->dynamic_Map.empty()) {
-        conflict_map->remove_edge_less_colors();
-        conflict_map->remove_edge_larger_colors();
+      conflict_map->init_graph();
+      for (auto iter = func.basic_blks.begin(); iter != func.basic_blks.end();
+           ++iter) {
+        init_conflict_map(lva.livevars[iter->first], conflict_map,
+                          cross_blk_vars);
       }
-      conflict_map->rebuild();
+      LOG(TRACE) << " Conflict map : " << conflict_map->node_vars.size()
+                 << " nodes" << std::endl;
+      conflict_map->simplify_and_select();
+      conflict_map->color_unplaced_webs();
     }
 
     for (auto& var : cross_blk_vars) {
@@ -423,6 +461,7 @@ class Graph_Color : public backend::MirOptimizePass {
         conflict_map->color_map->insert(std::make_pair(var, -1));
       }
     }
+    color_vectors(funcId, func, lva);
     LOG(TRACE) << func.name << " coloring result : " << std::endl;
     LOG(TRACE) << "unused colors : ";
     for (auto c : *conflict_map->unused_colors) {
@@ -445,6 +484,7 @@ class Graph_Color : public backend::MirOptimizePass {
     }
     extra_data_repo[name] = func_color_map;
     extra_data_repo["unused_colors"] = func_unused_colors;
+    extra_data_repo[VECTOR_COLOR_DATA_NAME] = func_vector_color_map;
   }
 };
 
@@ -0,0 +1,292 @@
+#include "./gvn.hpp"
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <optional>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "../../include/aixlog.hpp"
+#include "../../mir/def_use.hpp"
+#include "optimization.hpp"
+
+namespace optimization::gvn {
+
+void GVN::optimize_mir(mir::inst::MirPackage& mir,
+                       std::map<std::string, std::any>& extra_data_repo) {
+  auto summaries = side_effects::summarize(mir);
+  for (auto& f : mir.functions) {
+    if (f.second.type->is_extern) continue;
+    optimize_func(f.second, summaries, extra_data_repo);
+  }
+}
+
+namespace {
+
+/// An expression with its operands numbered, plus the object it names
+using Key = std::pair<std::vector<int64_t>, std::string>;
+
+enum class ExprKind { Op, PtrOffset, Ref, Load, Call };
+
+/// What memory holds at some point, as generation numbers: one for all of
+/// it, one for each object stored to since, and one for any store
+struct Memory {
+  uint32_t all = 0;
+  uint32_t any_store = 0;
+  std::map<MemObject, uint32_t> objects;
+};
+
+class Numbering {
+ public:
+  Numbering(mir::inst::MirFunction& func, const mir::inst::DominatorTree& dom,
+            const side_effects::Summaries& summaries)
+      : func(func), du(func.def_use()), dom(dom), summaries(summaries) {}
+
+  /// Numbers the function and drops what it finds redundant. Returns the
+  /// number of instructions dropped
+  size_t run() {
+    // Children are visited after their parent, whose memory state at its
+    // end is what a child with a single predecessor starts from
+    std::vector<mir::types::LabelId> stack{dom.entry()};
+    while (!stack.empty()) {
+      auto id = stack.back();
+      stack.pop_back();
+      auto idom = dom.idom(id);
+      while (!scopes.empty() && scopes.back().blk != idom) close_scope();
+      scopes.push_back({id, {}});
+      if (dom.preds(id).size() == 1 && idom && exit_memory.count(*idom)) {
+        memory = exit_memory.at(*idom);
+      } else {
+        memory = Memory{++epoch, 0, {}};
+      }
+      visit(func.basic_blks.at(id));
+      exit_memory[id] = memory;
+      auto& children = dom.children(id);
+      stack.insert(stack.end(), children.rbegin(), children.rend());
+    }
+    func.invalidate_def_use();
+    return dropped;
+  }
+
+ private:
+  struct Scope {
+    mir::types::LabelId blk;
+    std::vector<Key> keys;
+  };
+
+  void close_scope() {
+    for (auto& key : scopes.back().keys) table.erase(key);
+    scopes.pop_back();
+  }
+
+  /// Variables of phi webs, or defined more than once, hold different
+  /// values at different points
+  bool is_stable(mir::inst::VarId var) {
+    auto it = func.variables.find(var.id);
+    return it != func.variables.end() && !it->second.is_phi_var &&
+           du.def_count(var) == 1;
+  }
+
+  /// Whether a branch tests `var`. Code generation folds the comparison
+  /// into the branch without keeping its result, and the loop passes read
+  /// the guards of loops from it, so it stays where it is
+  bool is_condition(mir::inst::VarId var) {
+    for (auto& use : du.uses_of(var)) {
+      if (use.is_jump()) return true;
+    }
+    return false;
+  }
+
+  mir::inst::VarId number_of(mir::inst::VarId var) {
+    auto it = numbers.find(var);
+    return it == numbers.end() ? var : it->second;
+  }
+
+  void push_value(std::vector<int64_t>& key, mir::inst::Value& val) {
+    if (auto imm = val.get_if<int32_t>()) {
+      key.insert(key.end(), {0, *imm});
+    } else {
+      auto var = number_of(*val.get_if<mir::inst::VarId>());
+      key.insert(key.end(), {1, var.id, int64_t(val.shift),
+                             val.has_shift() ? val.shift_amount : 0});
+    }
+  }
+
+  /// Generation of memory a load through `ptr` reads
+  uint32_t memory_of(mir::inst::VarId ptr) {
+    auto obj = object_of(func, ptr);
+    if (obj.index() == 0) return memory.any_store;
+    auto it = memory.objects.find(obj);
+    return it == memory.objects.end() ? 0 : it->second;
+  }
+
+  void clobber(mir::inst::Inst& inst) {
+    if (auto x = dynamic_cast<mir::inst::CallInst*>(&inst)) {
+      if (side_effects::summary_of(summaries, x->func).writes_memory()) {
+        memory = Memory{++epoch, 0, {}};
+      }
+    } else if (inst.inst_kind() == mir::inst::InstKind::Store) {
+      auto obj = object_of(func, inst.dest);
+      memory.any_store = ++epoch;
+      if (obj.index() == 0) {
+        memory.all = ++epoch;
+        memory.objects.clear();
+      } else {
+        memory.objects[obj] = ++epoch;
+      }
+    }
+  }
+
+  std::optional<Key> key_of(mir::inst::Inst& inst) {
+    std::vector<int64_t> key;
+    std::string name;
+    auto ty = func.variables.at(inst.dest.id).ty;
+    if (!ty) return std::nullopt;
+    if (auto x = dynamic_cast<mir::inst::OpInst*>(&inst)) {
+      auto op = x->op;
+      std::vector<int64_t> lhs, rhs;
+      push_value(lhs, x->lhs);
+      push_value(rhs, x->rhs);
+      if (rhs < lhs && is_commutative(op)) std::swap(lhs, rhs);
+      if (rhs < lhs && (op == mir::inst::Op::Lt || op == mir::inst::Op::Gt ||
+                        op == mir::inst::Op::Lte || op == mir::inst::Op::Gte)) {
+        std::swap(lhs, rhs);
+        op = mir::inst::swap_cmp(op);
+      }
+      key = {int64_t(ExprKind::Op), int64_t(op)};
+      key.insert(key.end(), lhs.begin(), lhs.end());
+      key.insert(key.end(), rhs.begin(), rhs.end());
+    } else if (auto x = dynamic_cast<mir::inst::PtrOffsetInst*>(&inst)) {
+      key = {int64_t(ExprKind::PtrOffset), number_of(x->ptr).id};
+      push_value(key, x->offset);
+    } else if (auto x = dynamic_cast<mir::inst::RefInst*>(&inst)) {
+      key = {int64_t(ExprKind::Ref)};
+      if (auto var = std::get_if<mir::inst::VarId>(&x->val)) {
+        key.push_back(var->id);
+      } else {
+        name = std::get<std::string>(x->val);
+      }
+    } else if (auto x = dynamic_cast<mir::inst::LoadInst*>(&inst)) {
+      auto src = x->src.get_if<mir::inst::VarId>();
+      if (!src || x->src.has_shift()) return std::nullopt;
+      key = {int64_t(ExprKind::Load), memory.all, memory_of(*src),
+             number_of(*src).id, 0, 0};
+    } else if (auto x = dynamic_cast<mir::inst::LoadOffsetInst*>(&inst)) {
+      auto src = x->src.get_if<mir::inst::VarId>();
+      if (!src || x->src.has_shift()) return std::nullopt;
+      key = {int64_t(ExprKind::Load), memory.all, memory_of(*src),
+             number_of(*src).id};
+      push_value(key, x->offset);
+    } else if (auto x = dynamic_cast<mir::inst::CallInst*>(&inst)) {
+      auto& callee = side_effects::summary_of(summaries, x->func);
+      if (!callee.is_read_only() || ty->kind() == mir::types::TyKind::Void) {
+        return std::nullopt;
+      }
+      key = {int64_t(ExprKind::Call)};
+      if (callee.reads_memory()) {
+        key.insert(key.end(), {memory.all, memory.any_store});
+      }
+      for (auto& param : x->params) push_value(key, param);
+      name = x->func;
+    } else {
+      return std::nullopt;
+    }
+    key.push_back(int64_t(ty->kind()));
+    return Key{key, name};
+  }
+
+  void visit(mir::inst::BasicBlk& blk) {
+    for (size_t i = 0; i < blk.inst.size(); i++) {
+      auto& inst = *blk.inst[i];
+      clobber(inst);
+      auto dest = inst.dest;
+      if (inst.inst_kind() == mir::inst::InstKind::Store ||
+          du.def_count(dest) != 1) {
+        continue;
+      }
+      if (auto x = dynamic_cast<mir::inst::AssignInst*>(&inst)) {
+        auto src = x->src.get_if<mir::inst::VarId>();
+        if (src && !x->src.has_shift() && is_stable(dest) &&
+            is_stable(number_of(*src))) {
+          numbers[dest] = number_of(*src);
+        }
+        continue;
+      }
+      if (is_condition(dest)) continue;
+      auto key = key_of(inst);
+      if (!key) continue;
+      auto it = table.find(*key);
+      if (it == table.end()) {
+        if (is_stable(dest)) {
+          table.insert({*key, dest});
+          scopes.back().keys.push_back(*key);
+        }
+        continue;
+      }
+      auto leader = it->second;
+      // Temporaries are folded into the copy after them, which would leave
+      // the uses elsewhere without a definition
+      func.variables.at(leader.id).is_temp_var = false;
+      if (is_stable(dest)) {
+        du.replace_all_uses(dest, leader);
+        numbers[dest] = leader;
+      }
+      dropped++;
+      if (du.has_uses(dest)) {
+        // Phi operands, and variables of phi webs, keep their definition
+        du.replace_inst(blk, blk.inst.begin() + i,
+                        std::make_unique<mir::inst::AssignInst>(
+                            dest, mir::inst::Value(leader)));
+      } else {
+        du.erase_inst(blk, blk.inst.begin() + i);
+        i--;
+      }
+    }
+  }
+
+  mir::inst::MirFunction& func;
+  mir::inst::DefUseChain& du;
+  const mir::inst::DominatorTree& dom;
+  const side_effects::Summaries& summaries;
+  std::map<Key, mir::inst::VarId> table;
+  std::vector<Scope> scopes;
+  std::map<mir::inst::VarId, mir::inst::VarId> numbers;
+  Memory memory;
+  std::map<mir::types::LabelId, Memory> exit_memory;
+  uint32_t epoch = 0;
+  size_t dropped = 0;
+};
+
+}  // namespace
+
+void GVN::optimize_func(mir::inst::MirFunction& func,
+                        const side_effects::Summaries& summaries,
+                        std::map<std::string, std::any>& extra_data_repo) {
+  // References to objects are the same everywhere, so those in loops go to
+  // the end of the entry block, which dominates every use
+  auto& loops = get_loop_forest(extra_data_repo, func);
+  auto& entry = func.basic_blks.begin()->second;
+  for (auto& [id, blk] : func.basic_blks) {
+    if (!loops.loop_of(id)) continue;
+    for (auto it = blk.inst.begin(); it != blk.inst.end();) {
+      if ((*it)->inst_kind() != mir::inst::InstKind::Ref) {
+        it++;
+        continue;
+      }
+      func.variables.at((*it)->dest.id).is_temp_var = false;
+      entry.inst.push_back(std::move(*it));
+      it = blk.inst.erase(it);
+    }
+  }
+  func.invalidate_def_use();
+
+  auto dropped = Numbering(func, loops.dom_tree(), summaries).run();
+  if (dropped == 0) return;
+  auto remark = func.name + ": " + std::to_string(dropped) + " redundant";
+  LOG(TRACE) << "gvn: " << remark << std::endl;
+  backend::report_statistic(extra_data_repo, pass_name(), remark);
+}
+
+}  // namespace optimization::gvn
@@ -0,0 +1,43 @@
+#pragma once
+
+#include "../../mir/loop.hpp"
+#include "../backend.hpp"
+#include "side_effects.hpp"
+
+namespace optimization::gvn {
+
+/// Global value numbering over the dominator tree.
+///
+/// Blocks are visited down the dominator tree with a scoped table from
+/// expressions to the variable first holding them, so an instruction
+/// computing what a dominating one already did is dropped and its uses read
+/// that variable instead. Expressions are arithmetic, pointer offsets,
+/// references to objects, loads, and calls whose callee's summary says they
+/// have no effect besides their result. Operands are numbered through copies,
+/// commutative operands are put in order, and comparisons are turned to face
+/// one way.
+///
+/// A load, or a call reading memory, also carries the state of memory it
+/// reads: every store to an
+/// object, and every call that may write memory, starts a new one for the
+/// loads it may change, and so does every block entered from more than one
+/// place. Variables of phi webs share a register that later definitions in
+/// the web overwrite, so they never stand in for other variables; an
+/// instruction defining one is turned into a copy instead. Conditions of
+/// branches stay in their blocks, as code generation and the loop passes
+/// look for them there. References to objects inside loops are first moved
+/// to the entry block. Every function changed gets a remark in the pass
+/// statistics.
+class GVN final : public backend::MirOptimizePass {
+ public:
+  std::string pass_name() const override { return "GVN"; }
+  void optimize_mir(mir::inst::MirPackage &mir,
+                    std::map<std::string, std::any> &extra_data_repo) override;
+
+ private:
+  void optimize_func(mir::inst::MirFunction &func,
+                     const side_effects::Summaries &summaries,
+                     std::map<std::string, std::any> &extra_data_repo);
+};
+
+}  // namespace optimization::gvn
@@ -0,0 +1,387 @@
+#include "./inline.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <optional>
+#include <set>
+#include <string>
+#include <utility>
+#include <variant>
+#include <vector>
+
+#include "../../include/aixlog.hpp"
+#include "../../mir/def_use.hpp"
+#include "../../mir/loop.hpp"
+#include "optimization.hpp"
+
+namespace optimization::inlineFunc {
+
+namespace {
+
+/// Bytes of arrays a caller may hold once a call is inlined into it
+const size_t MAX_FRAME_SIZE = 1024;
+/// Instructions the call, saving registers around it and returning take
+const int32_t CALL_COST = 6;
+/// Instructions moving each argument into place
+const int32_t ARG_COST = 1;
+/// Instructions saved by each constant argument folding into the callee
+const int32_t CONST_ARG_BONUS = 4;
+/// Instructions of the frame a callee without calls no longer sets up
+const int32_t LEAF_BONUS = 6;
+/// Cost a call outside loops may have and still be inlined
+const int32_t THRESHOLD = 40;
+/// Loop depth past which calls don't count as running more often
+const uint32_t MAX_DEPTH = 3;
+/// Instructions all inlining may add, relative to the size of the program,
+/// and at least
+const int32_t GROWTH_PERCENT = 100;
+const int32_t MIN_GROWTH = 1000;
+
+/// Bytes of the arrays `func` keeps in its frame; scalars mostly live in
+/// registers
+size_t array_size(const mir::inst::MirFunction& func) {
+  size_t size = 0;
+  for (auto& [id, var] : func.variables) {
+    if (var.ty->kind() == mir::types::TyKind::Array) {
+      size += var.ty->size().value_or(0);
+    }
+  }
+  return size;
+}
+
+/// Whether `func` has arrays of its own. Those stay put in a function's
+/// entry block, where constant tables become globals, but would be set up
+/// again on every run of a loop the function is inlined into.
+bool has_local_arrays(const mir::inst::MirFunction& func) {
+  for (auto& [id, blk] : func.basic_blks) {
+    for (auto& inst : blk.inst) {
+      auto ref = dynamic_cast<mir::inst::RefInst*>(inst.get());
+      if (ref && std::holds_alternative<mir::inst::VarId>(ref->val)) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+/// Whether `func` has loops of its own. Its call costs little next to them,
+/// so inlining it pays only when its loops learn something from the call.
+/// A recursive caller would hold the values of those loops in every frame.
+bool has_loops(const mir::inst::MirFunction& func) {
+  for (auto& [id, blk] : func.basic_blks) {
+    if (blk.jump.jump_kind == mir::inst::JumpKind::Loop) return true;
+  }
+  return false;
+}
+
+/// Functions each function calls
+using CallGraph = std::map<std::string, std::set<std::string>>;
+
+/// Strongly connected components of `calls`, callees before their callers
+class Components {
+ public:
+  Components(const CallGraph& calls) : calls(calls) {
+    for (auto& [name, callees] : calls) {
+      if (!index.count(name)) visit(name);
+    }
+  }
+
+  std::vector<std::vector<std::string>> order;
+
+ private:
+  uint32_t visit(const std::string& name) {
+    auto low = index[name] = next++;
+    stack.push_back(name);
+    on_stack.insert(name);
+    for (auto& callee : calls.at(name)) {
+      if (!calls.count(callee)) continue;
+      if (!index.count(callee)) {
+        low = std::min(low, visit(callee));
+      } else if (on_stack.count(callee)) {
+        low = std::min(low, index.at(callee));
+      }
+    }
+    if (low == index.at(name)) {
+      std::vector<std::string> component;
+      do {
+        component.push_back(stack.back());
+        on_stack.erase(stack.back());
+        stack.pop_back();
+      } while (component.back() != name);
+      order.push_back(component);
+    }
+    return low;
+  }
+
+  const CallGraph& calls;
+  std::map<std::string, uint32_t> index;
+  std::vector<std::string> stack;
+  std::set<std::string> on_stack;
+  uint32_t next = 0;
+};
+
+/// Copies `callee` into `func` in place of the `i`th instruction of `blk`,
+/// a call to it
+void inline_call(mir::inst::MirFunction& func, mir::inst::BasicBlk& blk,
+                 size_t i, mir::inst::MirFunction& callee) {
+  auto call = std::unique_ptr<mir::inst::CallInst>(
+      dynamic_cast<mir::inst::CallInst*>(blk.inst[i].release()));
+
+  uint32_t next_var = func.variables.rbegin()->first + 1;
+  mir::types::LabelId next_label = 0;
+  for (auto& [id, b] : func.basic_blks) {
+    if (id < MAX_BLOCK_ID) next_label = std::max(next_label, id);
+  }
+  next_label++;
+
+  // Parameters read the arguments, everything else gets a new variable
+  std::vector<std::unique_ptr<mir::inst::Inst>> before;
+  std::map<mir::inst::VarId, mir::inst::VarId> vars;
+  for (auto& [id, var] : callee.variables) {
+    if (id >= 1 && id <= call->params.size()) {
+      auto& arg = call->params[id - 1];
+      if (!arg.is_immediate() && !arg.has_shift() &&
+          callee.def_use().def_count(id) == 0) {
+        vars.insert({id, *arg.get_if<mir::inst::VarId>()});
+        continue;
+      }
+    }
+    auto copy = var;
+    copy.priority = 0;
+    func.variables.insert({next_var, copy});
+    vars.insert({id, next_var++});
+    if (id >= 1 && id <= call->params.size()) {
+      before.push_back(std::make_unique<mir::inst::AssignInst>(
+          vars.at(id), call->params[id - 1]));
+    }
+  }
+  auto var = [&](mir::inst::VarId v) {
+    auto it = vars.find(v);
+    return it == vars.end() ? v : it->second;
+  };
+  std::map<mir::types::LabelId, mir::types::LabelId> labels;
+  for (auto& [id, b] : callee.basic_blks) labels.insert({id, next_label++});
+  auto rest_id = next_label++;
+
+  std::optional<mir::inst::VarId> returned;
+  std::set<mir::types::LabelId> returning;
+  for (auto& [id, from] : callee.basic_blks) {
+    auto new_id = labels.at(id);
+    auto& to = func.basic_blks.insert({new_id, mir::inst::BasicBlk(new_id)})
+                   .first->second;
+    for (auto pred : from.preceding) to.preceding.insert(labels.at(pred));
+    for (auto& inst : from.inst) {
+      auto copy = std::unique_ptr<mir::inst::Inst>(inst->deep_copy());
+      copy->dest = var(copy->dest);
+      mir::inst::for_each_value(*copy, [&](mir::inst::Value& val) {
+        if (auto v = val.get_if<mir::inst::VarId>()) *v = var(*v);
+      });
+      if (auto x = dynamic_cast<mir::inst::PtrOffsetInst*>(copy.get())) {
+        x->ptr = var(x->ptr);
+      } else if (auto x = dynamic_cast<mir::inst::OpAccInst*>(copy.get())) {
+        x->acc = var(x->acc);
+      } else if (auto x = dynamic_cast<mir::inst::PhiInst*>(copy.get())) {
+        for (auto& v : x->vars) v = var(v);
+        x->ori_var = var(x->ori_var);
+      } else if (auto x = dynamic_cast<mir::inst::RefInst*>(copy.get())) {
+        if (auto v = std::get_if<mir::inst::VarId>(&x->val)) *v = var(*v);
+      }
+      to.inst.push_back(std::move(copy));
+    }
+
+    auto& jump = from.jump;
+    std::optional<mir::inst::VarId> cond;
+    if (jump.cond_or_ret) cond = var(*jump.cond_or_ret);
+    if (jump.kind == mir::inst::JumpInstructionKind::Return) {
+      if (cond) returned = cond;
+      returning.insert(new_id);
+      to.jump = mir::inst::JumpInstruction(
+          mir::inst::JumpInstructionKind::Br, rest_id, -1, std::nullopt,
+          mir::inst::JumpKind::Branch);
+      continue;
+    }
+    auto label = [&](int id) { return id == -1 ? id : int(labels.at(id)); };
+    to.jump = mir::inst::JumpInstruction(jump.kind, label(jump.bb_true),
+                                         label(jump.bb_false), cond,
+                                         jump.jump_kind);
+  }
+
+  // The rest of the block follows the callee
+  auto& rest = func.basic_blks.insert({rest_id, mir::inst::BasicBlk(rest_id)})
+                   .first->second;
+  rest.preceding = returning;
+  if (returned && func.variables.count(call->dest.id)) {
+    rest.inst.push_back(
+        std::make_unique<mir::inst::AssignInst>(call->dest, *returned));
+  }
+  std::move(blk.inst.begin() + i + 1, blk.inst.end(),
+            std::back_inserter(rest.inst));
+  blk.inst.resize(i);
+  std::move(before.begin(), before.end(), std::back_inserter(blk.inst));
+  rest.jump = std::move(blk.jump);
+  for (auto succ : mir::inst::successors(rest)) {
+    auto it = func.basic_blks.find(succ);
+    if (it == func.basic_blks.end()) continue;
+    it->second.preceding.erase(blk.id);
+    it->second.preceding.insert(rest_id);
+  }
+  auto entry = labels.at(callee.basic_blks.begin()->first);
+  func.basic_blks.at(entry).preceding.insert(blk.id);
+  blk.jump = mir::inst::JumpInstruction(mir::inst::JumpInstructionKind::Br,
+                                        entry, -1, std::nullopt,
+                                        mir::inst::JumpKind::Branch);
+  func.invalidate_def_use();
+}
+
+}  // namespace
+
+void Inline_Func::optimize_mir(
+    mir::inst::MirPackage& package,
+    std::map<std::string, std::any>& extra_data_repo) {
+  CallGraph calls;
+  std::map<std::string, uint32_t> call_sites;
+  int32_t program_size = 0;
+  for (auto& [name, func] : package.functions) {
+    if (func.type->is_extern) continue;
+    auto& callees = calls[name];
+    program_size += size_of(func);
+    for (auto& [id, blk] : func.basic_blks) {
+      for (auto& inst : blk.inst) {
+        if (auto x = dynamic_cast<mir::inst::CallInst*>(inst.get())) {
+          callees.insert(x->func);
+          call_sites[x->func]++;
+        }
+      }
+    }
+  }
+  int32_t budget =
+      std::max(MIN_GROWTH, program_size * GROWTH_PERCENT / 100);
+
+  for (auto& component : Components(calls).order) {
+    std::set<std::string> members(component.begin(), component.end());
+    bool recursive = component.size() > 1 ||
+                     calls.at(component.front()).count(component.front());
+    for (auto& name : component) {
+      // The program entry only calls the user's `main`, which stays
+      if (name == "main") continue;
+      auto& func = package.functions.at(name);
+      mir::inst::LoopForest forest(func);
+      auto frame = array_size(func);
+
+      struct Site {
+        mir::types::LabelId blk;
+        size_t index;
+        uint32_t depth;
+        std::string callee;
+      };
+      // The most nested calls get the budget and the frame first
+      std::vector<Site> sites;
+      for (auto& [id, blk] : func.basic_blks) {
+        for (size_t i = 0; i < blk.inst.size(); i++) {
+          auto call = dynamic_cast<mir::inst::CallInst*>(blk.inst[i].get());
+          if (call == nullptr) continue;
+          auto it = package.functions.find(call->func);
+          if (it == package.functions.end() || it->second.type->is_extern) {
+            continue;
+          }
+          sites.push_back({id, i, std::min(forest.depth(id), MAX_DEPTH),
+                           call->func});
+        }
+      }
+      std::stable_sort(sites.begin(), sites.end(),
+                       [](const Site& a, const Site& b) {
+                         return a.depth > b.depth;
+                       });
+
+      std::vector<Site> inlined;
+      for (auto& site : sites) {
+        auto call = dynamic_cast<mir::inst::CallInst*>(
+            func.basic_blks.at(site.blk).inst[site.index].get());
+        auto& callee = package.functions.at(site.callee);
+        auto remark = name + ": " + callee.name;
+        if (members.count(callee.name)) {
+          backend::report_statistic(extra_data_repo, pass_name(),
+                                    remark + " kept, recursive");
+          continue;
+        }
+
+        auto size = size_of(callee);
+        bool leaf = calls.at(callee.name).empty();
+        int32_t benefit = CALL_COST + ARG_COST * call->params.size() +
+                          (leaf ? LEAF_BONUS : 0);
+        // What the loops of a callee may learn from the caller
+        bool informs = false;
+        for (auto& arg : call->params) {
+          if (arg.is_immediate()) benefit += CONST_ARG_BONUS;
+          auto var = arg.get_if<mir::inst::VarId>();
+          informs |= arg.is_immediate() ||
+                     func.variables.at(var->id).ty->kind() ==
+                         mir::types::TyKind::Ptr;
+        }
+        // The only call takes the callee with it
+        bool only_call =
+            call_sites[callee.name] == 1 && callee.name != "f__main";
+        int32_t cost = (only_call ? 0 : size) - benefit;
+        int32_t threshold = THRESHOLD * (1 + site.depth);
+        auto numbers = " (cost " + std::to_string(cost) + ", threshold " +
+                       std::to_string(threshold) + ")";
+        int32_t growth = only_call ? 0 : size;
+
+        std::string reason;
+        if (cost > threshold) {
+          reason = " kept, too large";
+        } else if (growth > budget) {
+          reason = " kept, over the growth budget";
+        } else if (frame + array_size(callee) >= MAX_FRAME_SIZE) {
+          reason = " kept, frame too large";
+        } else if (!only_call && !informs && has_loops(callee)) {
+          reason = " kept, loops gain nothing";
+        } else if (recursive && has_loops(callee)) {
+          reason = " kept, loops in a recursive caller";
+        } else if (site.depth > 0 && has_local_arrays(callee)) {
+          reason = " kept, local arrays in a loop";
+        }
+        if (!reason.empty()) {
+          backend::report_statistic(extra_data_repo, pass_name(),
+                                    remark + reason + numbers);
+          continue;
+        }
+        budget -= growth;
+        frame += array_size(callee);
+        inlined.push_back(site);
+        LOG(TRACE) << "inline: " << remark << " inlined" << numbers
+                   << std::endl;
+        backend::report_statistic(extra_data_repo, pass_name(),
+                                  remark + " inlined" + numbers);
+      }
+
+      // Later calls of a block first, so the earlier ones keep their place
+      std::sort(inlined.begin(), inlined.end(),
+                [](const Site& a, const Site& b) {
+                  return std::make_pair(a.blk, a.index) <
+                         std::make_pair(b.blk, b.index);
+                });
+      for (auto it = inlined.rbegin(); it != inlined.rend(); it++) {
+        inline_call(func, func.basic_blks.at(it->blk), it->index,
+                    package.functions.at(it->callee));
+      }
+      if (!inlined.empty()) {
+        auto& callees = calls.at(name);
+        callees.clear();
+        for (auto& [id, blk] : func.basic_blks) {
+          for (auto& inst : blk.inst) {
+            if (auto x = dynamic_cast<mir::inst::CallInst*>(inst.get())) {
+              callees.insert(x->func);
+            }
+          }
+        }
+      }
+    }
+  }
+
+  remove_uncalled_functions(package, "inline");
+}
+
+}  // namespace optimization::inlineFunc
@@ -0,0 +1,410 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <map>
+#include <optional>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <variant>
+#include <vector>
+
+#include "../../include/aixlog.hpp"
+#include "../../mir/def_use.hpp"
+#include "../../mir/loop.hpp"
+#include "../../mir/mir.hpp"
+#include "../backend.hpp"
+#include "memory_ssa.hpp"
+#include "optimization.hpp"
+#include "side_effects.hpp"
+
+namespace optimization::licm {
+
+/// Cost of reloading a spilled value, in the units of `instruction_cost`
+const uint32_t SPILL_COST = 3;
+
+/// Loop-invariant code motion.
+///
+/// Loops are visited innermost first, so code hoisted out of an inner loop
+/// can move further out of the enclosing one. An instruction is hoisted into
+/// the preheader (created when missing) if all its operands are defined
+/// outside the loop or by instructions hoisted before it, and:
+///
+/// - it computes a value without side effects (arithmetic other than
+///   comparisons, `&`, pointer offsets), or
+/// - it is a division, a load or a call without side effects, its block
+///   runs on every iteration that leaves the loop, and for loads nothing in
+///   the loop may write the object the load reads, or Memory SSA finds
+///   nothing in the loop that may write the words it reads. Calls go by the
+///   summary of their callee, and only read memory if the loop writes none.
+///
+/// Variables taking part in a phi are left alone: codegen gives a whole phi
+/// web one register and moves into it right where each operand is defined,
+/// so moving such a definition moves the copy as well. Plain copies are left
+/// alone too; the register allocator coalesces them anyway.
+///
+/// Every hoisted value stays live across the whole loop. Cheap ones are only
+/// hoisted while the values live across the loop still fit in the registers
+/// `Graph_Color` colors with; chains saving more than a spill are always
+/// hoisted.
+class LICM final : public backend::MirOptimizePass {
+ public:
+  std::string pass_name() const override { return "LICM"; }
+
+  void optimize_mir(mir::inst::MirPackage& package,
+                    std::map<std::string, std::any>& extra_data_repo) override {
+    summaries = side_effects::summarize(package);
+    for (auto& [name, func] : package.functions) {
+      if (func.type->is_extern) continue;
+      optimize_func(func, extra_data_repo);
+    }
+  }
+
+ private:
+  void optimize_func(mir::inst::MirFunction& func,
+                     std::map<std::string, std::any>& extra_data_repo) {
+    phi_vars.clear();
+    for (auto& [id, blk] : func.basic_blks) {
+      for (auto& inst : blk.inst) {
+        if (auto x = dynamic_cast<mir::inst::PhiInst*>(inst.get())) {
+          phi_vars.insert(x->dest);
+          for (auto var : x->vars) phi_vars.insert(var);
+        }
+      }
+    }
+
+    std::vector<mir::types::LabelId> headers;
+    {
+      auto& loops = get_loop_forest(extra_data_repo, func).loops();
+      for (auto it = loops.rbegin(); it != loops.rend(); ++it) {
+        headers.push_back(it->header);
+      }
+    }
+    // Creating a preheader rebuilds the forest, so look each loop up again
+    for (auto header : headers) {
+      auto& forest = get_loop_forest(extra_data_repo, func);
+      auto loop = forest.loop_with_header(header);
+      if (loop == nullptr || loop->has_irreducible) continue;
+      hoist_loop(func, forest, *loop);
+    }
+  }
+
+  void hoist_loop(mir::inst::MirFunction& func,
+                  const mir::inst::LoopForest& forest,
+                  const mir::inst::Loop& loop) {
+    auto& du = func.def_use();
+    auto& dom = forest.dom_tree();
+
+    // What the loop may write
+    bool writes_unknown = false;
+    std::set<MemObject> written;
+    for (auto id : loop.blocks) {
+      for (auto& inst : func.basic_blks.at(id).inst) {
+        if (auto x = dynamic_cast<mir::inst::StoreInst*>(inst.get())) {
+          auto obj = object_of(func, x->dest);
+          if (obj.index() == 0) writes_unknown = true;
+          written.insert(obj);
+        } else if (auto x =
+                       dynamic_cast<mir::inst::StoreOffsetInst*>(inst.get())) {
+          auto obj = object_of(func, x->dest);
+          if (obj.index() == 0) writes_unknown = true;
+          written.insert(obj);
+        } else if (auto x = dynamic_cast<mir::inst::CallInst*>(inst.get())) {
+          auto& callee = side_effects::summary_of(summaries, x->func);
+          writes_unknown |= callee.writes_unknown;
+          written.insert(callee.writes_globals.begin(),
+                         callee.writes_globals.end());
+          for (auto param : callee.writes_params) {
+            auto ptr = param < x->params.size()
+                           ? x->params[param].get_if<mir::inst::VarId>()
+                           : nullptr;
+            auto obj = ptr ? object_of(func, *ptr) : MemObject();
+            if (obj.index() == 0) writes_unknown = true;
+            written.insert(obj);
+          }
+        }
+      }
+    }
+    auto may_be_written = [&](const mir::inst::Value& ptr) {
+      if (writes_unknown) return true;
+      if (written.empty()) return false;
+      auto var = std::get_if<mir::inst::VarId>(&ptr);
+      if (var == nullptr) return true;
+      auto obj = object_of(func, *var);
+      return obj.index() == 0 || written.count(obj) > 0;
+    };
+    // Only built for loops writing memory their loads may read
+    std::optional<memory_ssa::AliasAnalysis> aa;
+    std::optional<memory_ssa::MemorySSA> mssa;
+    auto written_before = [&](mir::inst::Inst& load, mir::inst::Value& ptr) {
+      if (!may_be_written(ptr)) return false;
+      if (!mssa) {
+        aa.emplace(func, &summaries);
+        mssa.emplace(func, *aa);
+      }
+      auto access = mssa->access_of(&load);
+      auto loc = aa->location_of(&load);
+      if (!access || !loc) return true;
+      auto clobber = mssa->clobber(access->defining, *loc);
+      return clobber->kind != memory_ssa::Access::Kind::Entry &&
+             loop.contains(clobber->blk);
+    };
+
+    // Trapping or faulting instructions may only move if their block runs
+    // whenever the loop is left
+    auto exiting = loop.exiting_blocks();
+    auto always_runs = [&](mir::types::LabelId blk) {
+      return std::all_of(exiting.begin(), exiting.end(),
+                         [&](auto e) { return dom.dominates(blk, e); });
+    };
+
+    std::unordered_set<mir::inst::VarId> hoisted;
+    auto is_invariant = [&](const mir::inst::Value& val) {
+      auto var = std::get_if<mir::inst::VarId>(&val);
+      if (var == nullptr || hoisted.count(*var)) return true;
+      auto count = du.def_count(*var);
+      if (count == 0) return true;
+      if (count > 1) return false;
+      return !loop.contains(*du.def_block(*var));
+    };
+
+    auto can_hoist = [&](mir::inst::Inst& inst, mir::types::LabelId blk) {
+      if (phi_vars.count(inst.dest) || du.def_count(inst.dest) != 1) {
+        return false;
+      }
+      if (auto x = dynamic_cast<mir::inst::OpInst*>(&inst)) {
+        if (is_comparison(x->op)) return false;
+        if ((x->op == mir::inst::Op::Div || x->op == mir::inst::Op::Rem) &&
+            !always_runs(blk)) {
+          return false;
+        }
+        return is_invariant(x->lhs) && is_invariant(x->rhs);
+      } else if (auto x = dynamic_cast<mir::inst::OpAccInst*>(&inst)) {
+        return is_invariant(x->lhs) && is_invariant(x->rhs) &&
+               is_invariant(x->acc);
+      } else if (dynamic_cast<mir::inst::RefInst*>(&inst)) {
+        return true;
+      } else if (auto x = dynamic_cast<mir::inst::PtrOffsetInst*>(&inst)) {
+        return is_invariant(x->ptr) && is_invariant(x->offset);
+      } else if (auto x = dynamic_cast<mir::inst::LoadInst*>(&inst)) {
+        return is_invariant(x->src) && always_runs(blk) &&
+               !written_before(inst, x->src);
+      } else if (auto x = dynamic_cast<mir::inst::LoadOffsetInst*>(&inst)) {
+        return is_invariant(x->src) && is_invariant(x->offset) &&
+               always_runs(blk) && !written_before(inst, x->src);
+      } else if (auto x = dynamic_cast<mir::inst::CallInst*>(&inst)) {
+        auto& callee = side_effects::summary_of(summaries, x->func);
+        if (!callee.is_read_only() || !always_runs(blk) ||
+            (callee.reads_memory() && (writes_unknown || !written.empty()))) {
+          return false;
+        }
+        return std::all_of(x->params.begin(), x->params.end(), is_invariant);
+      }
+      return false;
+    };
+
+    // Instructions are picked once all their operands are invariant, so the
+    // order they are picked in is a valid order to emit them. Picks that
+    // compute the same value as an earlier one are folded into it.
+    std::vector<std::pair<mir::types::LabelId, mir::inst::Inst*>> candidates;
+    std::unordered_set<mir::inst::Inst*> candidate_set;
+    std::unordered_map<mir::inst::VarId, mir::inst::VarId> same_as;
+    // Rough cost of the work each hoisted value saves per iteration,
+    // including the hoisted instructions it depends on
+    std::unordered_map<mir::inst::VarId, uint32_t> saved;
+    bool changed = true;
+    while (changed) {
+      changed = false;
+      for (auto id : dom.reverse_postorder()) {
+        if (!loop.contains(id)) continue;
+        for (auto& inst : func.basic_blks.at(id).inst) {
+          if (candidate_set.count(inst.get()) || !can_hoist(*inst, id)) {
+            continue;
+          }
+          if (auto same = find_same(candidates, *inst, same_as)) {
+            same_as.insert({inst->dest, *same});
+          } else {
+            auto cost = instruction_cost(*inst);
+            for (auto var : inst->useVars()) {
+              if (saved.count(var)) cost += saved.at(var);
+            }
+            saved.insert({inst->dest, cost});
+          }
+          candidates.push_back({id, inst.get()});
+          candidate_set.insert(inst.get());
+          hoisted.insert(inst->dest);
+          changed = true;
+        }
+      }
+    }
+    if (candidates.empty()) return;
+    auto resolve = [&](mir::inst::VarId var) {
+      return same_as.count(var) ? same_as.at(var) : var;
+    };
+
+    // Registers needed across the whole loop once `kept` is hoisted:
+    // loop-carried phis plus the values flowing in from outside that are
+    // still used inside
+    size_t header_phis = 0;
+    for (auto& inst : func.basic_blks.at(loop.header).inst) {
+      if (dynamic_cast<mir::inst::PhiInst*>(inst.get())) header_phis++;
+    }
+    std::unordered_set<mir::inst::VarId> kept;
+    auto is_moved = [&](mir::inst::Inst* inst) {
+      return candidate_set.count(inst) && kept.count(resolve(inst->dest));
+    };
+    auto pressure = [&]() {
+      std::unordered_set<mir::inst::VarId> live_in;
+      auto add_use = [&](mir::inst::VarId var) {
+        var = resolve(var);
+        if (kept.count(var) ||
+            (!hoisted.count(var) && is_invariant(var))) {
+          live_in.insert(var);
+        }
+      };
+      for (auto id : loop.blocks) {
+        auto& blk = func.basic_blks.at(id);
+        for (auto& inst : blk.inst) {
+          if (is_moved(inst.get()) ||
+              dynamic_cast<mir::inst::PhiInst*>(inst.get())) {
+            continue;
+          }
+          for (auto var : inst->useVars()) add_use(var);
+        }
+        if (blk.jump.kind == mir::inst::JumpInstructionKind::BrCond) {
+          add_use(*blk.jump.cond_or_ret);
+        }
+      }
+      return live_in.size() + header_phis;
+    };
+
+    // Values saving more than a spill reload costs are always hoisted, along
+    // with everything they are computed from
+    std::unordered_set<mir::inst::VarId> needed;
+    for (auto it = candidates.rbegin(); it != candidates.rend(); ++it) {
+      auto inst = it->second;
+      if (same_as.count(inst->dest)) continue;
+      if (saved.at(inst->dest) < SPILL_COST && !needed.count(inst->dest)) {
+        continue;
+      }
+      kept.insert(inst->dest);
+      for (auto var : inst->useVars()) needed.insert(resolve(var));
+    }
+    // Cheaper ones only while the allocator can keep everything in registers
+    auto current_pressure = pressure();
+    for (auto [id, inst] : candidates) {
+      if (same_as.count(inst->dest) || kept.count(inst->dest)) continue;
+      auto uses = inst->useVars();
+      if (std::any_of(uses.begin(), uses.end(), [&](auto var) {
+            var = resolve(var);
+            return hoisted.count(var) && !kept.count(var);
+          })) {
+        continue;
+      }
+      kept.insert(inst->dest);
+      auto new_pressure = pressure();
+      if (new_pressure > std::max(current_pressure, REGISTER_BUDGET)) {
+        kept.erase(inst->dest);
+      } else {
+        current_pressure = new_pressure;
+      }
+    }
+
+    std::vector<std::pair<mir::types::LabelId, mir::inst::Inst*>> picked;
+    for (auto& candidate : candidates) {
+      if (is_moved(candidate.second)) picked.push_back(candidate);
+    }
+    if (picked.empty()) return;
+
+    auto& preheader =
+        func.basic_blks.at(loop.preheader ? *loop.preheader
+                                          : make_preheader(func, loop));
+    for (auto [dup, var] : same_as) {
+      if (kept.count(var)) du.replace_all_uses(dup, var);
+    }
+    std::set<mir::types::LabelId> touched;
+    for (auto [id, inst] : picked) {
+      if (same_as.count(inst->dest)) {
+        du.slot_of(inst).reset();
+      } else {
+        preheader.inst.push_back(std::move(du.slot_of(inst)));
+      }
+      touched.insert(id);
+    }
+    for (auto id : touched) {
+      auto& insts = func.basic_blks.at(id).inst;
+      insts.erase(std::remove(insts.begin(), insts.end(), nullptr),
+                  insts.end());
+      du.rescan_block(func.basic_blks.at(id));
+    }
+    du.rescan_block(preheader);
+    LOG(TRACE) << "licm: hoisted " << picked.size() << " instructions out of "
+               << func.name << " bb" << loop.header << std::endl;
+  }
+
+  static bool is_comparison(mir::inst::Op op) {
+    switch (op) {
+      case mir::inst::Op::Gt:
+      case mir::inst::Op::Lt:
+      case mir::inst::Op::Gte:
+      case mir::inst::Op::Lte:
+      case mir::inst::Op::Eq:
+      case mir::inst::Op::Neq:
+        return true;
+      default:
+        return false;
+    }
+  }
+
+  static uint32_t instruction_cost(mir::inst::Inst& inst) {
+    if (auto x = dynamic_cast<mir::inst::OpInst*>(&inst)) {
+      if (x->op == mir::inst::Op::Div || x->op == mir::inst::Op::Rem) {
+        return 4;
+      }
+      return 1;
+    } else if (dynamic_cast<mir::inst::LoadInst*>(&inst) ||
+               dynamic_cast<mir::inst::LoadOffsetInst*>(&inst)) {
+      return 2;
+    } else if (dynamic_cast<mir::inst::CallInst*>(&inst)) {
+      return 10;
+    }
+    return 1;
+  }
+
+  /// An already picked instruction computing the same value as `inst`
+  static std::optional<mir::inst::VarId> find_same(
+      const std::vector<std::pair<mir::types::LabelId, mir::inst::Inst*>>&
+          picked,
+      mir::inst::Inst& inst,
+      const std::unordered_map<mir::inst::VarId, mir::inst::VarId>& same_as) {
+    auto x = dynamic_cast<mir::inst::OpInst*>(&inst);
+    if (x == nullptr) return std::nullopt;
+    auto same_value = [&](const mir::inst::Value& a,
+                          const mir::inst::Value& b) {
+      if (a.shift != b.shift || a.shift_amount != b.shift_amount) return false;
+      auto va = std::get_if<mir::inst::VarId>(&a);
+      auto vb = std::get_if<mir::inst::VarId>(&b);
+      if (va == nullptr || vb == nullptr) {
+        return va == vb && std::get<int32_t>(a) == std::get<int32_t>(b);
+      }
+      auto ra = same_as.count(*va) ? same_as.at(*va) : *va;
+      auto rb = same_as.count(*vb) ? same_as.at(*vb) : *vb;
+      return ra == rb;
+    };
+    for (auto [id, other] : picked) {
+      auto y = dynamic_cast<mir::inst::OpInst*>(other);
+      if (y != nullptr && y->op == x->op && same_value(x->lhs, y->lhs) &&
+          same_value(x->rhs, y->rhs)) {
+        return y->dest;
+      }
+    }
+    return std::nullopt;
+  }
+
+  std::unordered_set<mir::inst::VarId> phi_vars;
+  side_effects::Summaries summaries;
+};
+
+}  // namespace optimization::licm
@@ -73,7 +73,9 @@ class Block_Live_Var {
   }
 
   mir::types::TyKind queryTy(mir::inst::VarId var) {
-    return vartable.at(var).ty->kind();
+    // Variables read but never defined have no type
+    auto& ty = vartable.at(var).ty;
+    return ty ? ty->kind() : mir::types::TyKind::Void;
   }
 
   // TODO: remove global and ptr
@@ -247,13 +249,15 @@ class Livevar_Analyse {
         if (inst->inst_kind() == mir::inst::InstKind::Phi) {
           phi_dests.insert(inst->dest);
           for (auto var : inst->useVars()) {
-            func.basic_blks.at(vp.defpoint.at(var).first)
+            func.basic_blks.at(vp.du.def_block(var).value())
                 .inst.push_back(std::make_unique<mir::inst::AssignInst>(
                     blkpair.second.inst.at(i)->dest, var));
           }
         }
       }
     }
+    // The copies were appended behind the back of the def-use index
+    func.invalidate_def_use();
     // LOG(TRACE) << func << std::endl;
   }
 
@@ -0,0 +1,116 @@
+#include "./load_elimination.hpp"
+
+#include <map>
+#include <memory>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "../../include/aixlog.hpp"
+#include "../../mir/def_use.hpp"
+#include "memory_ssa.hpp"
+
+namespace optimization::load_elimination {
+
+void Load_Elimination::optimize_mir(
+    mir::inst::MirPackage& mir,
+    std::map<std::string, std::any>& extra_data_repo) {
+  auto summaries = side_effects::summarize(mir);
+  for (auto& f : mir.functions) {
+    if (f.second.type->is_extern) continue;
+    optimize_func(f.second, summaries, extra_data_repo);
+  }
+}
+
+namespace {
+
+/// A load whose result later loads of the same words can take over
+struct Loaded {
+  memory_ssa::Location loc;
+  memory_ssa::Access* access;
+  mir::inst::VarId dest;
+};
+
+mir::inst::Value stored_value(mir::inst::Inst& store) {
+  if (auto x = dynamic_cast<mir::inst::StoreInst*>(&store)) return x->val;
+  return dynamic_cast<mir::inst::StoreOffsetInst&>(store).val;
+}
+
+}  // namespace
+
+void Load_Elimination::optimize_func(
+    mir::inst::MirFunction& func, const side_effects::Summaries& summaries,
+    std::map<std::string, std::any>& extra_data_repo) {
+  auto& du = func.def_use();
+  auto is_stable = [&](mir::inst::VarId var) {
+    auto it = func.variables.find(var.id);
+    return it != func.variables.end() && !it->second.is_phi_var &&
+           du.def_count(var) <= 1;
+  };
+
+  memory_ssa::AliasAnalysis aa(func, &summaries);
+  memory_ssa::MemorySSA mssa(func, aa);
+  // Loads by the access last writing what they read
+  std::map<memory_ssa::Access*, std::vector<Loaded>> loaded;
+  // Each redundant load with the value it reads
+  std::vector<std::pair<mir::inst::Inst*, mir::inst::Value>> redundant;
+  for (auto id : mssa.dom_tree().reverse_postorder()) {
+    for (auto& inst : func.basic_blks.at(id).inst) {
+      if (inst->inst_kind() != mir::inst::InstKind::Load) continue;
+      auto access = mssa.access_of(inst.get());
+      auto loc = aa.location_of(inst.get());
+      // Vectors are only ever copied whole, where they are stored
+      if (!loc || !loc->exact || loc->size != 4) continue;
+      auto clobber = mssa.clobber(access->defining, *loc);
+
+      std::optional<mir::inst::Value> value;
+      if (clobber->kind == memory_ssa::Access::Kind::Def &&
+          clobber->inst->inst_kind() == mir::inst::InstKind::Store) {
+        auto stored = aa.location_of(clobber->inst);
+        auto val = stored_value(*clobber->inst);
+        auto var = val.get_if<mir::inst::VarId>();
+        auto must = stored && aa.alias(*stored, *loc) ==
+                                  memory_ssa::AliasResult::Must;
+        if (must && (!var || is_stable(*var)) &&
+            mssa.dominates(clobber, access)) {
+          value = val;
+        }
+      }
+      if (!value) {
+        for (auto& other : loaded[clobber]) {
+          if (mssa.dominates(other.access, access) &&
+              aa.alias(other.loc, *loc) == memory_ssa::AliasResult::Must) {
+            value = mir::inst::Value(other.dest);
+            break;
+          }
+        }
+      }
+      if (value) {
+        redundant.push_back({inst.get(), *value});
+      } else if (is_stable(inst->dest)) {
+        loaded[clobber].push_back({*loc, access, inst->dest});
+      }
+    }
+  }
+  if (redundant.empty()) return;
+
+  for (auto [inst, value] : redundant) {
+    auto dest = inst->dest;
+    auto var = value.get_if<mir::inst::VarId>();
+    // Temporaries are folded into the copy after them, which would leave the
+    // uses elsewhere without a definition
+    if (var) func.variables.at(var->id).is_temp_var = false;
+    if (var && !value.has_shift() && is_stable(dest)) {
+      du.replace_all_uses(dest, *var);
+    }
+    du.replace_inst(inst, std::make_unique<mir::inst::AssignInst>(dest, value));
+  }
+
+  auto remark =
+      func.name + ": " + std::to_string(redundant.size()) + " redundant";
+  LOG(TRACE) << "load elimination: " << remark << std::endl;
+  backend::report_statistic(extra_data_repo, pass_name(), remark);
+}
+
+}  // namespace optimization::load_elimination
@@ -0,0 +1,31 @@
+#pragma once
+
+#include "../../mir/mir.hpp"
+#include "../backend.hpp"
+#include "side_effects.hpp"
+
+namespace optimization::load_elimination {
+
+/// Redundant load elimination over Memory SSA.
+///
+/// A load is redundant when the words it reads were last written by a store
+/// of the same words, whose value it takes over, or when nothing may have
+/// written them since an earlier load of the same words that runs whenever
+/// it does, whose result it takes over. What may write the words in between
+/// is found by walking Memory SSA, so stores and calls in other blocks, and
+/// around loops, are looked through when alias analysis tells them apart.
+/// Every function changed gets a remark in the pass statistics.
+class Load_Elimination final : public backend::MirOptimizePass {
+ public:
+  std::string pass_name() const override { return "Load elimination"; }
+  void optimize_mir(mir::inst::MirPackage &mir,
+                    std::map<std::string, std::any> &extra_data_repo) override;
+  bool preserves_def_use() const override { return true; }
+
+ private:
+  void optimize_func(mir::inst::MirFunction &func,
+                     const side_effects::Summaries &summaries,
+                     std::map<std::string, std::any> &extra_data_repo);
+};
+
+}  // namespace optimization::load_elimination
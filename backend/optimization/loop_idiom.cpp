@@ -0,0 +1,258 @@
+#include "./loop_idiom.hpp"
+
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <optional>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "../../include/aixlog.hpp"
+#include "../../mir/def_use.hpp"
+#include "dependence.hpp"
+#include "optimization.hpp"
+#include "strength_reduction.hpp"
+
+namespace optimization::loop_idiom {
+
+using dependence::pointer_of;
+using dependence::WORD_SIZE;
+using strength_reduction::Affine;
+
+/// Fewest iterations a loop known to be short must run to be worth a call
+const int64_t MIN_TRIP_COUNT = 8;
+
+void Loop_Idiom::optimize_mir(
+    mir::inst::MirPackage& mir,
+    std::map<std::string, std::any>& extra_data_repo) {
+  for (auto& f : mir.functions) {
+    if (f.second.type->is_extern) continue;
+    optimize_func(f.second, extra_data_repo);
+  }
+}
+
+namespace {
+
+bool is_store(mir::inst::Inst* inst) {
+  return dynamic_cast<mir::inst::StoreInst*>(inst) ||
+         dynamic_cast<mir::inst::StoreOffsetInst*>(inst);
+}
+
+bool is_load(mir::inst::Inst* inst) {
+  return dynamic_cast<mir::inst::LoadInst*>(inst) ||
+         dynamic_cast<mir::inst::LoadOffsetInst*>(inst);
+}
+
+/// Instructions that only compute a value, and can go once nothing reads it
+bool is_pure(mir::inst::Inst* inst) {
+  return dynamic_cast<mir::inst::AssignInst*>(inst) ||
+         dynamic_cast<mir::inst::OpInst*>(inst) ||
+         dynamic_cast<mir::inst::PtrOffsetInst*>(inst) ||
+         dynamic_cast<mir::inst::RefInst*>(inst);
+}
+
+mir::inst::Value& stored_value(mir::inst::Inst* inst) {
+  if (auto x = dynamic_cast<mir::inst::StoreInst*>(inst)) return x->val;
+  return dynamic_cast<mir::inst::StoreOffsetInst*>(inst)->val;
+}
+
+Affine affine_of(const mir::inst::Value& val) {
+  if (auto imm = std::get_if<int32_t>(&val)) return Affine{{}, uint32_t(*imm)};
+  return Affine{{{std::get<mir::inst::VarId>(val), 1}}, 0};
+}
+
+/// A range of words the loop stores to, and what goes there
+struct Transfer {
+  Affine dest;
+  /// Where the words come from, for a copy
+  std::optional<Affine> src;
+  /// The byte every word is made of, for a fill
+  int32_t byte = 0;
+};
+
+class Idiom {
+ public:
+  Idiom(mir::inst::MirFunction& func, const mir::inst::LoopForest& forest,
+        const mir::inst::Loop& loop)
+      : func(func), forest(forest), loop(loop) {}
+
+  std::string run() {
+    if (loop.blocks.size() != 1) return "not a single block";
+    auto trip = forest.trip_count(loop, func);
+    if (!trip) return "not a counted loop";
+    if (trip->step != 1 || !trip->tests_next ||
+        (trip->cmp != mir::inst::Op::Lt && trip->cmp != mir::inst::Op::Lte)) {
+      return "not counting up by one";
+    }
+    if (!loop.guard ||
+        !tests_first_iteration(func, *loop.guard, loop.header, *trip)) {
+      return "not guarded";
+    }
+    if (trip->count && *trip->count < MIN_TRIP_COUNT) return "too short";
+
+    auto& du = func.def_use();
+    auto& blk = func.basic_blks.at(loop.header);
+    std::vector<mir::inst::Inst*> stores;
+    std::set<mir::inst::Inst*> loads;
+    for (auto& inst : blk.inst) {
+      if (auto phi = dynamic_cast<mir::inst::PhiInst*>(inst.get())) {
+        if (phi->dest != trip->iv) return "values carried across iterations";
+      } else if (is_store(inst.get())) {
+        stores.push_back(inst.get());
+        continue;
+      } else if (is_load(inst.get())) {
+        loads.insert(inst.get());
+      } else if (!is_pure(inst.get())) {
+        return "has side effects";
+      }
+      if (inst->dest == trip->next) continue;
+      for (auto& use : du.uses_of(inst->dest)) {
+        if (!loop.contains(use.blk)) return "values used after the loop";
+      }
+    }
+    if (stores.empty()) return "stores nothing";
+
+    // Every store writes the next word of its range, with a fill value or
+    // the next word of another range
+    std::set<mir::inst::VarId> ivs{trip->iv};
+    std::vector<std::pair<mir::inst::Inst*, Affine>> accesses;
+    auto contiguous = [&](mir::inst::Inst* inst) -> std::optional<Affine> {
+      auto addr = dependence::address_in_loop(func, loop, ivs, inst);
+      if (!addr || addr->terms[trip->iv] != WORD_SIZE) return std::nullopt;
+      accesses.push_back({inst, *addr});
+      return addr;
+    };
+    for (auto store : stores) {
+      Transfer transfer;
+      auto dest = contiguous(store);
+      if (!dest) return "not storing consecutive words";
+      transfer.dest = *dest;
+      auto& val = stored_value(store);
+      if (auto imm = val.get_if<int32_t>(); imm && !val.has_shift()) {
+        transfer.byte = *imm & 0xff;
+        if (uint32_t(*imm) != uint32_t(transfer.byte) * 0x01010101) {
+          return "fill value not made of equal bytes";
+        }
+      } else {
+        auto var = val.get_if<mir::inst::VarId>();
+        auto load = var && !val.has_shift() ? du.def_of(*var) : nullptr;
+        if (!loads.count(load) || du.use_count(*var) != 1) {
+          return "stored value neither a fill nor a copy";
+        }
+        loads.erase(load);
+        transfer.src = contiguous(load);
+        if (!transfer.src) return "not loading consecutive words";
+      }
+      transfers.push_back(transfer);
+    }
+    if (!loads.empty()) return "loads other than for copies";
+
+    // Calls move whole ranges one after the other, which only the loop
+    // would notice if one of them touched another
+    for (auto store : stores) {
+      auto& dest = std::find_if(accesses.begin(), accesses.end(),
+                                [&](auto& a) { return a.first == store; })
+                       ->second;
+      for (auto& [inst, addr] : accesses) {
+        if (inst == store) continue;
+        auto a = pointer_of(func, dest), b = pointer_of(func, addr);
+        if (!a || !b || dependence::may_share_object(func, *a, *b)) {
+          return "ranges may overlap";
+        }
+      }
+    }
+
+    transform(*trip);
+    auto remark = std::to_string(transfers.size()) + " call";
+    if (transfers.size() != 1) remark += "s";
+    return "replaced with " + remark;
+  }
+
+ private:
+  /// Turns the loop into code running once, calling the runtime for every
+  /// transfer
+  void transform(const mir::inst::TripCount& trip) {
+    auto& blk = func.basic_blks.at(loop.header);
+    auto uses = func.def_use().uses_of(trip.next);
+    bool next_used = std::any_of(uses.begin(), uses.end(), [&](auto& use) {
+      return !loop.contains(use.blk);
+    });
+    auto& jump = blk.jump;
+    auto exit = jump.bb_true == blk.id ? jump.bb_false : jump.bb_true;
+    blk.inst.clear();
+    blk.preceding.erase(blk.id);
+    blk.jump =
+        mir::inst::JumpInstruction(mir::inst::JumpInstructionKind::Br, exit);
+    func.invalidate_def_use();
+
+    // The loop ran once for every value from `init` up to the bound
+    auto init = affine_of(trip.init);
+    auto end = affine_of(trip.bound);
+    if (trip.cmp == mir::inst::Op::Lte) end.constant++;
+    auto int_ty = mir::types::new_int_ty();
+    auto bytes = strength_reduction::new_var(func, int_ty, false);
+    auto size = end;
+    size.add(init, uint32_t(-1)).scale(WORD_SIZE);
+    strength_reduction::emit_affine(func, blk, size, bytes, false);
+
+    // Start of the range `addr` covers
+    auto start = [&](Affine addr) {
+      auto ptr = *pointer_of(func, addr);
+      addr.terms.erase(trip.iv);
+      addr.add(init, WORD_SIZE);
+      auto dest =
+          strength_reduction::new_var(func, func.variables.at(ptr.id).ty,
+                                      false);
+      strength_reduction::emit_affine(func, blk, addr, dest, false);
+      return dest;
+    };
+    for (auto& transfer : transfers) {
+      auto dest = start(transfer.dest);
+      std::unique_ptr<mir::inst::CallInst> call;
+      auto ret = strength_reduction::new_var(func, mir::types::new_void_ty(),
+                                             false);
+      if (transfer.src) {
+        auto src = start(*transfer.src);
+        call = std::make_unique<mir::inst::CallInst>(
+            ret, "memcpy", std::vector<mir::inst::Value>{dest, src, bytes});
+      } else {
+        call = std::make_unique<mir::inst::CallInst>(
+            ret, "memset",
+            std::vector<mir::inst::Value>{dest, transfer.byte, bytes});
+      }
+      blk.inst.push_back(std::move(call));
+    }
+    if (next_used) {
+      strength_reduction::emit_affine(func, blk, end, trip.next, false);
+    }
+    func.invalidate_def_use();
+  }
+
+  mir::inst::MirFunction& func;
+  const mir::inst::LoopForest& forest;
+  const mir::inst::Loop& loop;
+  std::vector<Transfer> transfers;
+};
+
+}  // namespace
+
+void Loop_Idiom::optimize_func(
+    mir::inst::MirFunction& func,
+    std::map<std::string, std::any>& extra_data_repo) {
+  std::vector<mir::types::LabelId> headers;
+  for (auto& loop : get_loop_forest(extra_data_repo, func).loops()) {
+    if (loop.children.empty()) headers.push_back(loop.header);
+  }
+  for (auto header : headers) {
+    auto& forest = get_loop_forest(extra_data_repo, func);
+    auto loop = forest.loop_with_header(header);
+    if (loop == nullptr || loop->has_irreducible) continue;
+    auto remark = func.name + " bb" + std::to_string(header) + ": " +
+                  Idiom(func, forest, *loop).run();
+    LOG(TRACE) << "loop idiom: " << remark << std::endl;
+    backend::report_statistic(extra_data_repo, pass_name(), remark);
+  }
+}
+
+}  // namespace optimization::loop_idiom
@@ -0,0 +1,36 @@
+#pragma once
+
+#include "../../mir/loop.hpp"
+#include "../backend.hpp"
+
+namespace optimization::loop_idiom {
+
+/// Recognition of loops filling or copying arrays.
+///
+/// A counted loop of a single block, stepping its induction variable up by
+/// one, whose only effect is storing to consecutive words is replaced by
+/// calls to the runtime: `memset` when every word gets the same invariant
+/// value made of four equal bytes (zero and minus one, mostly), `memcpy`
+/// when it gets the word loaded at the same position of another array.
+/// The block then runs once, computing the start of each range and the
+/// number of bytes from the bounds of the loop, and leaves the induction
+/// variable at the value it would have ended up with.
+///
+/// Ranges written must provably not share an object with any other range
+/// the loop touches, and the loop must be guarded by its own exit test so
+/// that it runs at least once. Loops known to run only a few times are left
+/// to `Loop_Unrolling` and `Vectorization`, which store those words without
+/// the cost of a call. Every loop looked at gets a remark in the pass
+/// statistics.
+class Loop_Idiom final : public backend::MirOptimizePass {
+ public:
+  std::string pass_name() const override { return "Loop idiom recognition"; }
+  void optimize_mir(mir::inst::MirPackage &mir,
+                    std::map<std::string, std::any> &extra_data_repo) override;
+
+ private:
+  void optimize_func(mir::inst::MirFunction &func,
+                     std::map<std::string, std::any> &extra_data_repo);
+};
+
+}  // namespace optimization::loop_idiom
@@ -0,0 +1,332 @@
+#include "./loop_interchange.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+#include <memory>
+#include <optional>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "../../include/aixlog.hpp"
+#include "../../mir/def_use.hpp"
+#include "dependence.hpp"
+#include "optimization.hpp"
+#include "strength_reduction.hpp"
+
+namespace optimization::loop_interchange {
+
+using dependence::WORD_SIZE;
+
+void Loop_Interchange::optimize_mir(
+    mir::inst::MirPackage& mir,
+    std::map<std::string, std::any>& extra_data_repo) {
+  for (auto& f : mir.functions) {
+    if (f.second.type->is_extern) continue;
+    optimize_func(f.second, extra_data_repo);
+  }
+}
+
+/// Whether the value of the phi `var` reaches nothing but other phis
+bool feeds_only_phis(mir::inst::MirFunction& func, mir::inst::VarId var) {
+  std::set<mir::inst::VarId> seen;
+  std::vector<mir::inst::VarId> work{var};
+  while (!work.empty()) {
+    auto v = work.back();
+    work.pop_back();
+    if (!seen.insert(v).second) continue;
+    for (auto& use : func.def_use().uses_of(v)) {
+      auto phi = dynamic_cast<mir::inst::PhiInst*>(use.inst);
+      if (phi == nullptr) return false;
+      work.push_back(phi->dest);
+    }
+  }
+  return true;
+}
+
+/// The instructions of `blk` defining `var`
+std::unique_ptr<mir::inst::Inst>& def_in(mir::inst::BasicBlk& blk,
+                                         mir::inst::VarId var) {
+  return *std::find_if(blk.inst.begin(), blk.inst.end(),
+                       [&](auto& inst) { return inst->dest == var; });
+}
+
+/// Tries to interchange `outer` with the loop inside it, returns a remark on
+/// what happened
+std::string interchange(mir::inst::MirFunction& func,
+                        const mir::inst::LoopForest& forest,
+                        const mir::inst::Loop& outer) {
+  if (outer.children.size() != 1) return "not a nest of two loops";
+  auto& inner = forest.loops().at(outer.children[0]);
+  if (!inner.children.empty()) return "not a nest of two loops";
+  if (outer.has_irreducible) return "irreducible";
+  auto to = forest.trip_count(outer, func);
+  auto ti = forest.trip_count(inner, func);
+  if (!to || !ti) return "not counted loops";
+
+  auto head_id = outer.header;
+  auto latch_id = outer.latches[0];
+  if (to->exiting != latch_id || ti->exiting != inner.latches[0] ||
+      !to->tests_next || !ti->tests_next) {
+    return "not tested at the latches";
+  }
+  if (outer.blocks.size() != inner.blocks.size() + 2 || head_id == latch_id ||
+      inner.guard != head_id || !outer.guard ||
+      inner.exit_blocks() != std::vector{latch_id}) {
+    return "not perfectly nested";
+  }
+  auto bounded = [](const mir::inst::TripCount& trip) {
+    bool up = trip.cmp == mir::inst::Op::Lt || trip.cmp == mir::inst::Op::Lte;
+    bool down =
+        trip.cmp == mir::inst::Op::Gt || trip.cmp == mir::inst::Op::Gte;
+    return (up && trip.step > 0) || (down && trip.step < 0);
+  };
+  if (!bounded(*to) || !bounded(*ti)) {
+    return "exit test does not bound the induction variable";
+  }
+  if (!tests_first_iteration(func, *outer.guard, head_id, *to) ||
+      !tests_first_iteration(func, head_id, inner.header, *ti)) {
+    return "not guarded";
+  }
+  auto& du = func.def_use();
+  auto& head = func.basic_blks.at(head_id);
+  auto& latch = func.basic_blks.at(latch_id);
+  auto& inner_latch = func.basic_blks.at(ti->exiting);
+  for (auto blk : {&latch, &inner_latch}) {
+    auto cond = *blk->jump.cond_or_ret;
+    if (blk->jump.bb_true != (blk == &latch ? head_id : inner.header) ||
+        du.use_count(cond) != 1 || du.def_block(cond) != blk->id) {
+      return "complex exit test";
+    }
+  }
+  // The inner loop must cover the same range on every outer iteration
+  auto outside = [&](const mir::inst::Value& v) {
+    if (v.is_immediate()) return true;
+    auto blk = du.def_block(std::get<mir::inst::VarId>(v));
+    return !blk || !outer.contains(*blk);
+  };
+  if (!outside(ti->init) || !outside(ti->bound)) return "not rectangular";
+
+  mir::inst::PhiInst* outer_phi = nullptr;
+  mir::inst::PhiInst* inner_phi = nullptr;
+  for (auto id : outer.blocks) {
+    for (auto& inst : func.basic_blks.at(id).inst) {
+      if (dynamic_cast<mir::inst::CallInst*>(inst.get())) return "has calls";
+      auto phi = dynamic_cast<mir::inst::PhiInst*>(inst.get());
+      if (phi == nullptr) continue;
+      if (phi->dest == to->iv) {
+        outer_phi = phi;
+      } else if (phi->dest == ti->iv) {
+        inner_phi = phi;
+      } else if (id == head_id || id == inner.header) {
+        return "values carried across iterations";
+      } else if (id == latch_id && !feeds_only_phis(func, phi->dest)) {
+        return "values carried out of the inner loop";
+      }
+    }
+  }
+
+  // Work in the outer header depending on the outer induction variable
+  // moves into the inner loop, where the uses are
+  std::set<mir::inst::Inst*> sunk;
+  std::set<mir::inst::VarId> sunk_vars{to->iv};
+  auto is_memory = [](mir::inst::Inst* inst) {
+    return dynamic_cast<mir::inst::LoadInst*>(inst) ||
+           dynamic_cast<mir::inst::LoadOffsetInst*>(inst) ||
+           dynamic_cast<mir::inst::StoreInst*>(inst) ||
+           dynamic_cast<mir::inst::StoreOffsetInst*>(inst);
+  };
+  for (auto& inst : head.inst) {
+    if (inst.get() == outer_phi) continue;
+    if (is_memory(inst.get())) return "memory accessed between the loops";
+    auto uses = inst->useVars();
+    if (std::none_of(uses.begin(), uses.end(),
+                     [&](auto var) { return sunk_vars.count(var); })) {
+      continue;
+    }
+    sunk.insert(inst.get());
+    sunk_vars.insert(inst->dest);
+  }
+  for (auto& inst : latch.inst) {
+    if (dynamic_cast<mir::inst::PhiInst*>(inst.get())) continue;
+    if (inst->dest != to->next && inst->dest != *latch.jump.cond_or_ret) {
+      return "work between the loops";
+    }
+  }
+
+  // Every use of the induction variables must be one the swap accounts for
+  auto inner_step = du.def_of(ti->next);
+  auto inner_test = du.def_of(*inner_latch.jump.cond_or_ret);
+  auto confined = [&](mir::inst::VarId var, auto allowed) {
+    for (auto& use : du.uses_of(var)) {
+      if (use.inst == nullptr) return false;
+      if (allowed(use)) continue;
+      auto phi = dynamic_cast<mir::inst::PhiInst*>(use.inst);
+      if (phi == nullptr || use.blk == inner.header ||
+          !feeds_only_phis(func, phi->dest)) {
+        return false;
+      }
+    }
+    return true;
+  };
+  auto in_body = [&](const mir::inst::UseSite& use) {
+    return inner.contains(use.blk) || sunk.count(use.inst);
+  };
+  auto in_outer_latch = [&](const mir::inst::UseSite& use) {
+    return use.inst == outer_phi || use.blk == latch_id;
+  };
+  auto in_inner_latch = [&](const mir::inst::UseSite& use) {
+    return use.inst == inner_phi || use.inst == inner_test;
+  };
+  for (auto var : sunk_vars) {
+    if (!confined(var, [&](auto& use) {
+          return in_body(use) || (var == to->iv && use.blk == latch_id);
+        })) {
+      return "outer induction variable used between the loops";
+    }
+  }
+  if (!confined(to->next, in_outer_latch) ||
+      !confined(ti->next, in_inner_latch) || !confined(ti->iv, in_body)) {
+    return "induction variable used outside the nest";
+  }
+
+  // Addresses in terms of both induction variables
+  std::set<mir::inst::VarId> ivs{to->iv, ti->iv};
+  std::vector<dependence::MemAccess> accesses;
+  size_t strided_now = 0, strided_after = 0;
+  for (auto id : inner.blocks) {
+    for (auto& inst : func.basic_blks.at(id).inst) {
+      if (!is_memory(inst.get())) continue;
+      auto addr = dependence::address_in_loop(func, outer, ivs, inst.get());
+      if (!addr) return "unknown address";
+      auto stride = [&](const mir::inst::TripCount& trip) {
+        auto it = addr->terms.find(trip.iv);
+        if (it == addr->terms.end()) return int64_t(0);
+        return std::abs(int64_t(int32_t(it->second)) * trip.step);
+      };
+      auto unit = [](int64_t s) { return s == 0 || s == WORD_SIZE; };
+      strided_now += !unit(stride(*ti));
+      strided_after += !unit(stride(*to));
+      bool is_store = dynamic_cast<mir::inst::StoreInst*>(inst.get()) ||
+                      dynamic_cast<mir::inst::StoreOffsetInst*>(inst.get());
+      accesses.push_back({inst.get(), is_store, *addr});
+    }
+  }
+  std::stringstream remark;
+  remark << accesses.size() << " accesses, " << strided_now
+         << " strided, " << strided_after << " once interchanged";
+  if (strided_after >= strided_now) {
+    remark << ", kept";
+    return remark.str();
+  }
+  std::vector<dependence::Level> nest{{to->iv, to->step, to->count},
+                                      {ti->iv, ti->step, ti->count}};
+  for (size_t a = 0; a < accesses.size(); a++) {
+    for (size_t b = a; b < accesses.size(); b++) {
+      if (!accesses[a].is_store && !accesses[b].is_store) continue;
+      for (auto& dir :
+           dependence::test(func, accesses[a], accesses[b], nest)) {
+        if (dependence::normalize(dir) ==
+            dependence::DirectionVector{dependence::Direction::Lt,
+                                        dependence::Direction::Gt}) {
+          remark << ", dependence prevents it";
+          return remark.str();
+        }
+      }
+    }
+  }
+
+  // Trade the starts. Operands of a phi end up sharing its register, so each
+  // start gets a copy of its own, made on the edge into the loop.
+  auto start_in = [&](mir::inst::BasicBlk& blk, const mir::inst::Value& init,
+                      mir::inst::VarId like) {
+    auto var =
+        strength_reduction::new_var(func, func.variables.at(like.id).ty, true);
+    blk.inst.push_back(std::make_unique<mir::inst::AssignInst>(var, init));
+    return var;
+  };
+  auto outer_init =
+      start_in(func.basic_blks.at(*outer.guard), ti->init, ti->iv);
+  auto inner_init = start_in(head, to->init, to->iv);
+  for (auto& var : outer_phi->vars) {
+    if (!(var == to->next)) var = outer_init;
+  }
+  for (auto& var : inner_phi->vars) {
+    if (!(var == ti->next)) var = inner_init;
+  }
+  // Then the steps and the exit tests
+  auto& outer_step_blk = func.basic_blks.at(*du.def_block(to->next));
+  auto& inner_step_blk = func.basic_blks.at(*du.def_block(ti->next));
+  def_in(outer_step_blk, to->next) =
+      strength_reduction::add_imm(to->next, to->iv, ti->step);
+  def_in(inner_step_blk, ti->next) =
+      strength_reduction::add_imm(ti->next, ti->iv, to->step);
+  auto cond = *latch.jump.cond_or_ret;
+  def_in(latch, cond) =
+      std::make_unique<mir::inst::OpInst>(cond, to->next, ti->bound, ti->cmp);
+  auto inner_cond = *inner_latch.jump.cond_or_ret;
+  def_in(inner_latch, inner_cond) = std::make_unique<mir::inst::OpInst>(
+      inner_cond, ti->next, to->bound, to->cmp);
+  inner_step = def_in(inner_step_blk, ti->next).get();
+  inner_test = def_in(inner_latch, inner_cond).get();
+
+  auto& inner_header = func.basic_blks.at(inner.header);
+  auto pos = inner_header.inst.begin();
+  while (dynamic_cast<mir::inst::PhiInst*>(pos->get())) pos++;
+  for (auto it = head.inst.begin(); it != head.inst.end();) {
+    if (sunk.count(it->get())) {
+      pos = std::next(inner_header.inst.insert(pos, std::move(*it)));
+      it = head.inst.erase(it);
+    } else {
+      it++;
+    }
+  }
+
+  // Finally the body uses each induction variable in place of the other
+  mir::inst::VarId tmp(func.variables.rbegin()->first + 1);
+  for (auto id : inner.blocks) {
+    for (auto& inst : func.basic_blks.at(id).inst) {
+      if (inst.get() == inner_phi || inst.get() == inner_step ||
+          inst.get() == inner_test) {
+        continue;
+      }
+      if (auto phi = dynamic_cast<mir::inst::PhiInst*>(inst.get())) {
+        for (auto& var : phi->vars) {
+          if (var == to->iv) {
+            var = ti->iv;
+          } else if (var == ti->iv) {
+            var = to->iv;
+          }
+        }
+        continue;
+      }
+      inst->replace(to->iv, tmp);
+      inst->replace(ti->iv, to->iv);
+      inst->replace(tmp, ti->iv);
+    }
+  }
+  func.invalidate_def_use();
+  remark << ", interchanged";
+  return remark.str();
+}
+
+void Loop_Interchange::optimize_func(
+    mir::inst::MirFunction& func,
+    std::map<std::string, std::any>& extra_data_repo) {
+  std::vector<mir::types::LabelId> headers;
+  for (auto& loop : get_loop_forest(extra_data_repo, func).loops()) {
+    if (loop.children.size() == 1) headers.push_back(loop.header);
+  }
+  for (auto header : headers) {
+    auto& forest = get_loop_forest(extra_data_repo, func);
+    auto loop = forest.loop_with_header(header);
+    if (loop == nullptr) continue;
+    auto remark = func.name + " bb" + std::to_string(header) + ": " +
+                  interchange(func, forest, *loop);
+    LOG(TRACE) << "loop interchange: " << remark << std::endl;
+    backend::report_statistic(extra_data_repo, pass_name(), remark);
+  }
+}
+
+}  // namespace optimization::loop_interchange
@@ -0,0 +1,32 @@
+#pragma once
+
+#include "../../mir/loop.hpp"
+#include "../backend.hpp"
+
+namespace optimization::loop_interchange {
+
+/// Interchange of perfectly nested pairs of counted loops.
+///
+/// When the inner loop of a nest strides through memory while the outer one
+/// walks it word by word, the two loops trade places, so that consecutive
+/// iterations touch neighbouring words. This is what lets `Vectorization`
+/// pack the accesses afterwards.
+///
+/// Only rectangular nests qualify: the start, step and bound of the inner
+/// loop may not depend on the outer one, and nothing but the inner loop and
+/// the two exit tests may run in the outer one. The loops swap by trading
+/// the ranges their induction variables cover, and the inner body then
+/// uses each variable in place of the other. `dependence::test` decides
+/// whether every dependence between the loads and stores keeps its order.
+class Loop_Interchange final : public backend::MirOptimizePass {
+ public:
+  std::string pass_name() const override { return "Loop interchange"; }
+  void optimize_mir(mir::inst::MirPackage &mir,
+                    std::map<std::string, std::any> &extra_data_repo) override;
+
+ private:
+  void optimize_func(mir::inst::MirFunction &func,
+                     std::map<std::string, std::any> &extra_data_repo);
+};
+
+}  // namespace optimization::loop_interchange
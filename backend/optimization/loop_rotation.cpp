@@ -0,0 +1,236 @@
+#include "./loop_rotation.hpp"
+
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <optional>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "../../include/aixlog.hpp"
+#include "../../mir/def_use.hpp"
+#include "optimization.hpp"
+#include "strength_reduction.hpp"
+
+namespace optimization::loop_rotation {
+
+/// Most instructions besides phis a header may hold to be copied twice
+const size_t MAX_HEADER_SIZE = 8;
+
+void Loop_Rotation::optimize_mir(
+    mir::inst::MirPackage& mir,
+    std::map<std::string, std::any>& extra_data_repo) {
+  for (auto& f : mir.functions) {
+    if (f.second.type->is_extern) continue;
+    optimize_func(f.second, extra_data_repo);
+  }
+}
+
+namespace {
+
+/// Instructions of the header that may run once more, and from another
+/// block, without changing what the program does
+bool is_copyable(mir::inst::Inst* inst) {
+  return dynamic_cast<mir::inst::AssignInst*>(inst) ||
+         dynamic_cast<mir::inst::OpInst*>(inst) ||
+         dynamic_cast<mir::inst::OpAccInst*>(inst) ||
+         dynamic_cast<mir::inst::PtrOffsetInst*>(inst) ||
+         dynamic_cast<mir::inst::RefInst*>(inst) ||
+         dynamic_cast<mir::inst::LoadInst*>(inst) ||
+         dynamic_cast<mir::inst::LoadOffsetInst*>(inst);
+}
+
+bool is_phi(mir::inst::Inst* inst) {
+  return inst->inst_kind() == mir::inst::InstKind::Phi;
+}
+
+class Rotation {
+ public:
+  Rotation(mir::inst::MirFunction& func, const mir::inst::Loop& loop)
+      : func(func), loop(loop), header(func.basic_blks.at(loop.header)) {}
+
+  std::string run() {
+    auto& du = func.def_use();
+    if (loop.latches.size() != 1 || loop.latches[0] == header.id) {
+      return "not a single latch below the header";
+    }
+    auto& latch = func.basic_blks.at(loop.latches[0]);
+    if (latch.jump.kind != mir::inst::JumpInstructionKind::Br) {
+      return "already tested at the bottom";
+    }
+    auto& jump = header.jump;
+    if (jump.kind != mir::inst::JumpInstructionKind::BrCond ||
+        !loop.contains(jump.bb_true) || jump.bb_true == header.id ||
+        loop.exits.size() != 1 || loop.exits[0].first != header.id) {
+      return "header is not the only exit";
+    }
+
+    // Values the phis take coming from outside and around the loop
+    for (auto& inst : header.inst) {
+      auto phi = dynamic_cast<mir::inst::PhiInst*>(inst.get());
+      if (phi == nullptr) {
+        if (!is_copyable(inst.get())) return "header has side effects";
+        if (++size > MAX_HEADER_SIZE) return "header too large";
+        continue;
+      }
+      std::optional<mir::inst::VarId> init, next;
+      for (auto var : phi->vars) {
+        auto blk = du.def_block(var);
+        auto& slot = blk && loop.contains(*blk) ? next : init;
+        if (slot && !(*slot == var)) return "phi merging several values";
+        slot = var;
+      }
+      if (!init || !next) return "phi not carried around the loop";
+      if (du.def_block(*next) == header.id) return "phi updated in the header";
+      entry.insert({phi->dest, *init});
+      around.insert({phi->dest, *next});
+    }
+
+    // Values of the header used after the loop, and those of them read by
+    // something other than a phi
+    std::vector<std::pair<mir::inst::VarId, std::vector<mir::inst::UseSite>>>
+        live_out;
+    bool needs_merge = false;
+    for (auto& inst : header.inst) {
+      std::vector<mir::inst::UseSite> outside;
+      for (auto use : du.uses_of(inst->dest)) {
+        if (loop.contains(use.blk)) continue;
+        outside.push_back(use);
+        needs_merge |= use.is_jump() || !is_phi(use.inst);
+      }
+      if (!outside.empty()) live_out.push_back({inst->dest, outside});
+    }
+
+    // A value read after the loop gets a phi in the exit, so nothing else may
+    // reach it then
+    auto exit_id = jump.bb_false;
+    if (needs_merge && func.basic_blks.at(exit_id).preceding.size() != 1) {
+      exit_id = split_exit(exit_id);
+    }
+    auto& exit = func.basic_blks.at(exit_id);
+    auto preheader_id =
+        loop.preheader ? *loop.preheader : make_preheader(func, loop);
+    auto& preheader = func.basic_blks.at(preheader_id);
+    auto enter = copy_header(preheader, entry);
+    auto again = copy_header(latch, around);
+
+    // After the loop, values of the header come from the copy that took the
+    // exit. Phis share their operands' register, which for header phis is
+    // already the one the loop keeps them in, so phis after the loop take
+    // both copies as operands and only other reads need a phi of their own.
+    std::vector<std::unique_ptr<mir::inst::Inst>> phis;
+    for (auto& [var, uses] : live_out) {
+      auto copies = std::vector{enter.at(var), again.at(var)};
+      for (auto copy : copies) func.variables.at(copy.id).is_phi_var = true;
+      std::optional<mir::inst::VarId> merged;
+      for (auto use : uses) {
+        auto phi = use.is_jump() ? nullptr
+                                 : dynamic_cast<mir::inst::PhiInst*>(use.inst);
+        if (phi) {
+          auto end = std::remove(phi->vars.begin(), phi->vars.end(), var);
+          if (end == phi->vars.end()) continue;
+          phi->vars.erase(end, phi->vars.end());
+          phi->vars.insert(phi->vars.end(), copies.begin(), copies.end());
+          continue;
+        }
+        if (!merged) {
+          auto ty = func.variables.at(var.id).ty;
+          merged = strength_reduction::new_var(func, ty, true);
+          phis.push_back(
+              std::make_unique<mir::inst::PhiInst>(*merged, copies));
+        }
+        if (use.is_jump()) {
+          func.basic_blks.at(use.blk).jump.cond_or_ret = *merged;
+        } else {
+          use.inst->replace(var, *merged);
+        }
+      }
+    }
+    exit.inst.insert(exit.inst.begin(), std::make_move_iterator(phis.begin()),
+                     std::make_move_iterator(phis.end()));
+
+    auto body_id = jump.bb_true;
+    auto cond = *jump.cond_or_ret;
+    preheader.jump = mir::inst::JumpInstruction(
+        mir::inst::JumpInstructionKind::BrCond, header.id, exit_id,
+        enter.at(cond), mir::inst::JumpKind::Loop);
+    latch.jump = mir::inst::JumpInstruction(
+        mir::inst::JumpInstructionKind::BrCond, header.id, exit_id,
+        again.at(cond), mir::inst::JumpKind::Loop);
+    header.jump =
+        mir::inst::JumpInstruction(mir::inst::JumpInstructionKind::Br, body_id);
+    exit.preceding.erase(header.id);
+    exit.preceding.insert({preheader_id, latch.id});
+    func.invalidate_def_use();
+    return "rotated";
+  }
+
+ private:
+  /// Puts a block of its own on the edge from the header to `to`
+  mir::types::LabelId split_exit(mir::types::LabelId to) {
+    mir::types::LabelId id = 0;
+    for (auto& [blk_id, blk] : func.basic_blks) {
+      if (blk_id < MAX_BLOCK_ID) id = std::max(id, blk_id);
+    }
+    id++;
+    auto& landing =
+        func.basic_blks.insert({id, mir::inst::BasicBlk(id)}).first->second;
+    landing.jump =
+        mir::inst::JumpInstruction(mir::inst::JumpInstructionKind::Br, to);
+    landing.preceding.insert(header.id);
+    auto& exit = func.basic_blks.at(to);
+    exit.preceding.erase(header.id);
+    exit.preceding.insert(id);
+    header.jump.bb_false = id;
+    return id;
+  }
+
+  /// Appends the instructions of the header to `blk`, with the phis taking
+  /// the values in `vars`, and returns where each value of the header went
+  std::map<mir::inst::VarId, mir::inst::VarId> copy_header(
+      mir::inst::BasicBlk& blk,
+      std::map<mir::inst::VarId, mir::inst::VarId> vars) {
+    for (auto& inst : header.inst) {
+      if (is_phi(inst.get())) continue;
+      auto copy = std::unique_ptr<mir::inst::Inst>(inst->deep_copy());
+      for (auto var : copy->useVars()) {
+        if (vars.count(var)) copy->replace(var, vars.at(var));
+      }
+      auto ty = func.variables.at(inst->dest.id).ty;
+      copy->dest = strength_reduction::new_var(func, ty, false);
+      vars.insert({inst->dest, copy->dest});
+      blk.inst.push_back(std::move(copy));
+    }
+    return vars;
+  }
+
+  mir::inst::MirFunction& func;
+  const mir::inst::Loop& loop;
+  mir::inst::BasicBlk& header;
+  size_t size = 0;
+  /// Header phis to the values they take on entry, and coming around
+  std::map<mir::inst::VarId, mir::inst::VarId> entry, around;
+};
+
+}  // namespace
+
+void Loop_Rotation::optimize_func(
+    mir::inst::MirFunction& func,
+    std::map<std::string, std::any>& extra_data_repo) {
+  std::vector<mir::types::LabelId> headers;
+  for (auto& loop : get_loop_forest(extra_data_repo, func).loops()) {
+    headers.push_back(loop.header);
+  }
+  for (auto header : headers) {
+    auto& forest = get_loop_forest(extra_data_repo, func);
+    auto loop = forest.loop_with_header(header);
+    if (loop == nullptr || loop->has_irreducible) continue;
+    auto remark = func.name + " bb" + std::to_string(header) + ": " +
+                  Rotation(func, *loop).run();
+    LOG(TRACE) << "loop rotation: " << remark << std::endl;
+    backend::report_statistic(extra_data_repo, pass_name(), remark);
+  }
+}
+
+}  // namespace optimization::loop_rotation
@@ -0,0 +1,35 @@
+#pragma once
+
+#include "../../mir/loop.hpp"
+#include "../backend.hpp"
+
+namespace optimization::loop_rotation {
+
+/// Rotation of loops tested at the top.
+///
+/// `while` loops come out of the frontend already tested at the bottom, but
+/// the main loops `Loop_Unrolling` builds (and `Vectorization` packs) are
+/// tested in their header, so every iteration ends with a jump back to it.
+/// Such a loop gets a copy of the header's instructions at the end of its
+/// preheader, testing whether to enter the loop at all, and another at the
+/// end of its latch, testing whether to go around again. The header then
+/// falls through into the body, and `Merge_Block` joins the two.
+///
+/// The header may only compute values without side effects, and few of
+/// them; its copies run exactly when it used to. Values of the header used
+/// after the loop now come from either copy: phis after the loop take both
+/// as operands, and other reads go through a new phi in the exit block. The
+/// new branches are marked `JumpKind::Loop`, like the ones the frontend
+/// emits for `while` loops.
+class Loop_Rotation final : public backend::MirOptimizePass {
+ public:
+  std::string pass_name() const override { return "Loop rotation"; }
+  void optimize_mir(mir::inst::MirPackage &mir,
+                    std::map<std::string, std::any> &extra_data_repo) override;
+
+ private:
+  void optimize_func(mir::inst::MirFunction &func,
+                     std::map<std::string, std::any> &extra_data_repo);
+};
+
+}  // namespace optimization::loop_rotation
@@ -1,169 +1,254 @@
-
 #include "./loop_unrolling.hpp"
 
-#include <assert.h>
-#include <sys/types.h>
-
 #include <algorithm>
-#include <cstdlib>
-#include <iterator>
-#include <list>
+#include <climits>
 #include <map>
 #include <memory>
 #include <optional>
-#include <stack>
+#include <set>
+#include <sstream>
 #include <string>
+#include <unordered_set>
 #include <vector>
 
 #include "../../include/aixlog.hpp"
+#include "../../mir/def_use.hpp"
+#include "../../mir/value_range.hpp"
+#include "optimization.hpp"
 
 namespace optimization::loop_unrolling {
 
-struct Rewriter {
+/// Largest number of instructions the unrolled copies of a body may add up to
+const size_t MAX_UNROLLED_SIZE = 128;
+const uint32_t MAX_FACTOR = 8;
+/// Factor for loops whose trip count is only known at run time. Those often
+/// run just a few times, and then the remainder loop does most of the work.
+const uint32_t MAX_RUNTIME_FACTOR = 4;
+
+/// Header phi of the loop being unrolled
+struct Carried {
+  mir::inst::PhiInst* phi;
+  /// Operands flowing in from outside the loop
+  std::vector<mir::inst::VarId> init;
+  /// Operand computed by the previous iteration
+  mir::inst::VarId next;
+};
+
+struct Unroller {
   mir::inst::MirFunction& func;
-  mir::inst::BasicBlk& blk;
-  std::map<mir::inst::VarId, mir::inst::VarId> var_map;
-  std::pair<mir::inst::VarId, mir::inst::VarId> phi_var_pair;
-  mir::inst::VarId change_var;
-  int varId;
-  Rewriter(mir::inst::MirFunction& func, mir::inst::BasicBlk& blk,
-           std::pair<mir::inst::VarId, mir::inst::VarId> phi_var_pair,
-           mir::inst::VarId change_var)
+  const mir::inst::Loop& loop;
+  const mir::inst::TripCount& trip;
+  std::vector<Carried> carried;
+  uint32_t factor;
+  /// Whether `bound - distance` may wrap around, see `limit_in`
+  bool may_wrap;
+
+  mir::types::LabelId next_blk_id;
+
+  Unroller(mir::inst::MirFunction& func, const mir::inst::Loop& loop,
+           const mir::inst::TripCount& trip, std::vector<Carried> carried,
+           uint32_t factor, bool may_wrap)
       : func(func),
-        blk(blk),
-        phi_var_pair(phi_var_pair),
-        change_var(change_var) {
-    auto end_iter = func.variables.end();
-    end_iter--;
-    varId = end_iter->first;
+        loop(loop),
+        trip(trip),
+        carried(std::move(carried)),
+        factor(factor),
+        may_wrap(may_wrap) {
+    next_blk_id = 0;
+    for (auto& [id, blk] : func.basic_blks) {
+      if (id < MAX_BLOCK_ID) next_blk_id = std::max(next_blk_id, id);
+    }
+    next_blk_id++;
   }
 
-  std::vector<std::unique_ptr<mir::inst::Inst>> get_insts(
-      int times, mir::inst::VarId& new_change_var) {
-    std::vector<std::unique_ptr<mir::inst::Inst>> res;
-    auto cond = mir::inst::VarId(0);
-    for (int i = 0; i < times; i++) {
-      var_map.clear();
-      if (i) {
-        var_map.insert(phi_var_pair);
-      }
-      for (auto& inst : blk.inst) {
-        if (inst->inst_kind() != mir::inst::InstKind::Store) {
-          copy_var(inst->dest);
+  mir::inst::VarId copy_var(mir::inst::VarId var) {
+    auto id = func.variables.rbegin()->first + 1;
+    func.variables.insert({id, func.variables.at(var.id)});
+    return mir::inst::VarId(id);
+  }
+
+  /// Builds the main loop in front of the original one
+  void run() {
+    auto header_id = loop.header;
+    auto check_id = next_blk_id++;
+    auto start_id = next_blk_id++;
+    std::vector<std::map<mir::types::LabelId, mir::types::LabelId>> blk_maps(
+        factor);
+    for (auto& blk_map : blk_maps) {
+      for (auto id : loop.blocks) blk_map.insert({id, next_blk_id++});
+    }
+
+    // The check block carries the state between rounds of the main loop
+    func.basic_blks.insert({check_id, mir::inst::BasicBlk(check_id)});
+    // Header phi -> its value at the start of a round, and at the end of the
+    // round built so far
+    std::map<mir::inst::VarId, mir::inst::VarId> entry;
+    for (auto& c : carried) entry.insert({c.phi->dest, copy_var(c.phi->dest)});
+    auto state = entry;
+
+    for (uint32_t k = 0; k < factor; k++) {
+      std::map<mir::inst::VarId, mir::inst::VarId> var_map = state;
+      for (auto id : loop.blocks) {
+        for (auto& inst : func.basic_blks.at(id).inst) {
+          if (is_carried(inst.get()) || is_store(inst.get())) continue;
+          var_map.insert({inst->dest, copy_var(inst->dest)});
         }
       }
-      for (auto& inst : blk.inst) {
-        if (inst->inst_kind() == mir::inst::InstKind::Phi) {
-          if (i == 0) {
-            auto ptr = std::unique_ptr<mir::inst::Inst>(inst->deep_copy());
-            auto& i = *ptr;
-            auto phi = dynamic_cast<mir::inst::PhiInst*>(&i);
-            phi->vars.erase(
-                std::find(phi->vars.begin(), phi->vars.end(), change_var));
-            ptr->dest = var_map.at(ptr->dest);
-            res.push_back(std::move(ptr));
-          }
-          continue;
-        } else {
-          auto ptr = std::unique_ptr<mir::inst::Inst>(inst->deep_copy());
-          bool flag = inst->dest == change_var;
-          for (auto var : ptr->useVars()) {
-            if (var_map.count(var)) ptr->replace(var, var_map.at(var));
-          }
-          if (var_map.count(ptr->dest)) {
-            ptr->dest = var_map.at(ptr->dest);
-          }
-          if (flag) {
-            new_change_var = ptr->dest;
-            phi_var_pair.second = ptr->dest;
-          }
-          if (inst->inst_kind() == mir::inst::InstKind::Op) {
-            auto& i = *inst;
-            auto opist = dynamic_cast<mir::inst::OpInst*>(&i);
-            if (opist->op == mir::inst::Op::Lt) {
-              cond = ptr->dest;
-            }
-          }
-          res.push_back(std::move(ptr));
-        }
+      for (auto id : loop.blocks) {
+        bool last_round = k + 1 == factor;
+        copy_block(func.basic_blks.at(id), blk_maps[k], var_map,
+                   last_round ? check_id : blk_maps[k + 1].at(header_id),
+                   last_round);
+      }
+      for (auto& [phi, var] : state) {
+        auto c = std::find_if(carried.begin(), carried.end(),
+                              [&](auto& c) { return c.phi->dest == phi; });
+        var = var_map.at(c->next);
       }
     }
-    if (res.size()) {
-      auto& inst = res.front();
-      assert(inst->inst_kind() == mir::inst::InstKind::Phi);
-      auto& i = *inst;
-      auto phi = dynamic_cast<mir::inst::PhiInst*>(&i);
-      phi->vars.push_back(mir::inst::VarId(new_change_var.id));
+
+    auto& check = func.basic_blks.at(check_id);
+    for (auto& c : carried) {
+      auto vars = c.init;
+      vars.push_back(state.at(c.phi->dest));
+      auto dest = entry.at(c.phi->dest);
+      check.inst.push_back(std::make_unique<mir::inst::PhiInst>(dest, vars));
+      // The original loop now picks up where the main loop stopped
+      c.phi->vars = {dest, c.next};
+    }
+    // More than `factor` iterations are left if the exit test passes for the
+    // first `factor` of them; the tested value only moves towards the bound.
+    // `iv + distance < bound` is tested as `iv < bound - distance`, which
+    // cannot wrap around however close to the `i32` limits `iv` gets, and
+    // which the start block computes once before the main loop.
+    auto iv = entry.at(trip.iv);
+    func.basic_blks.insert({start_id, mir::inst::BasicBlk(start_id)});
+    auto& start = func.basic_blks.at(start_id);
+    auto limit = limit_in(start, iv);
+    start.jump = mir::inst::JumpInstruction(
+        mir::inst::JumpInstructionKind::Br, check_id);
+    auto cond =
+        copy_var(func.basic_blks.at(trip.exiting).jump.cond_or_ret.value());
+    auto cmp = trip.step > 0 ? mir::inst::Op::Lt : mir::inst::Op::Gt;
+    check.inst.push_back(
+        std::make_unique<mir::inst::OpInst>(cond, iv, limit, cmp));
+    check.jump = mir::inst::JumpInstruction(
+        mir::inst::JumpInstructionKind::BrCond, blk_maps[0].at(header_id),
+        header_id, cond, mir::inst::JumpKind::Loop);
+
+    for (auto pred : loop.entering) {
+      auto& jump = func.basic_blks.at(pred).jump;
+      if (jump.bb_true == header_id) jump.bb_true = start_id;
+      if (jump.bb_false == header_id) jump.bb_false = start_id;
     }
-    blk.jump.cond_or_ret = cond;
-    return res;
+    update_preceding();
   }
 
-  mir::inst::VarId get_new_VarId() {
-    auto end_iter = func.variables.end();
-    end_iter--;
-    return mir::inst::VarId(end_iter->first + 1);
+  /// `bound - distance`, computed at the end of `blk` unless it is a
+  /// constant. Where the subtraction may wrap around, a wrapped result is
+  /// replaced by the limit no value of `iv` passes.
+  mir::inst::Value limit_in(mir::inst::BasicBlk& blk, mir::inst::VarId iv) {
+    auto distance = distance_of(trip, factor);
+    if (auto bound = std::get_if<int32_t>(&trip.bound)) {
+      return int32_t(*bound - distance);
+    }
+    auto emit = [&](mir::inst::Value lhs, mir::inst::Value rhs,
+                    mir::inst::Op op) {
+      auto dest = copy_var(iv);
+      blk.inst.push_back(
+          std::make_unique<mir::inst::OpInst>(dest, lhs, rhs, op));
+      return dest;
+    };
+    auto bound = std::get<mir::inst::VarId>(trip.bound);
+    auto limit = emit(bound, int32_t(distance), mir::inst::Op::Sub);
+    if (!may_wrap) return limit;
+    // Taking a positive distance off a negative bound wrapped around if it
+    // left a limit that is not negative, and a negative distance off one
+    // that is not negative if it left a negative limit
+    auto differ = emit(bound, limit, mir::inst::Op::Xor);
+    auto wrapped =
+        emit(differ, distance > 0 ? bound : limit, mir::inst::Op::And);
+    auto mask = emit(wrapped, 31, mir::inst::Op::ShrA);
+    int32_t never = distance > 0 ? INT32_MIN : INT32_MAX;
+    auto flip = emit(limit, never, mir::inst::Op::Xor);
+    auto masked = emit(flip, mask, mir::inst::Op::And);
+    return emit(limit, masked, mir::inst::Op::Xor);
   }
 
-  mir::inst::VarId copy_var(mir::inst::VarId var) {
-    if (var_map.count(var)) {
-      return var_map.at(var);
-    }
-    auto id = get_new_VarId();
-    var_map.insert({var, id});
-    func.variables.insert({id, func.variables.at(var)});
-    return id;
+  /// How far the main loop looks ahead of `iv` before a round, one closer
+  /// for `<=` and `>=` so that the main loop can always test strictly
+  static int64_t distance_of(const mir::inst::TripCount& trip,
+                             uint32_t factor) {
+    auto distance = int64_t(trip.tests_next ? factor : factor - 1) * trip.step;
+    if (trip.cmp == mir::inst::Op::Lte) distance--;
+    if (trip.cmp == mir::inst::Op::Gte) distance++;
+    return distance;
   }
-};
 
-struct loop_info {
-  const int unrolling_times = 4;
-  mir::types::LabelId loop_start;
-  mir::inst::MirFunction& func;
-  mir::inst::VarId init_var;
-  std::pair<mir::inst::Op, mir::inst::VarId> cmp;  // op must be <
-  std::pair<mir::inst::Op, int> change;            // must be +1
-  mir::inst::VarId phi_var;
-  mir::inst::VarId change_var;
-  loop_info(mir::types::LabelId loop_start, mir::inst::VarId init_var,
-            std::pair<mir::inst::Op, mir::inst::VarId> cmp,
-            std::pair<mir::inst::Op, int> change, mir::inst::VarId phi_var,
-            mir::inst::VarId change_var, mir::inst::MirFunction& func)
-      : loop_start(loop_start),
-        init_var(init_var),
-        cmp(cmp),
-        change(change),
-        phi_var(phi_var),
-        change_var(change_var),
-        func(func) {}
-  mir::inst::VarId copy_var(mir::inst::VarId var) {
-    auto end_iter = func.variables.end();
-    end_iter--;
-    mir::inst::VarId new_var(end_iter->first + 1);
-    func.variables.insert({new_var, func.variables.at(var.id)});
-    return new_var;
+  bool is_carried(mir::inst::Inst* inst) {
+    return std::any_of(carried.begin(), carried.end(),
+                       [&](auto& c) { return c.phi == inst; });
+  }
+
+  static bool is_store(mir::inst::Inst* inst) {
+    return dynamic_cast<mir::inst::StoreInst*>(inst) ||
+           dynamic_cast<mir::inst::StoreOffsetInst*>(inst);
   }
-  int get_times() { return unrolling_times; }
 
-  void rewrite_jump_cond(mir::inst::BasicBlk& blk) {
-    auto val = blk.jump.cond_or_ret.value();
-    auto iter = blk.inst.rbegin();
-    for (; iter != blk.inst.rend(); ++iter) {
-      if (iter->get()->dest == val) {
-        break;
+  /// Copies `blk` into the block `blk_map` maps it to. The latch falls
+  /// through to `next_round`, dropping the exit test.
+  void copy_block(mir::inst::BasicBlk& blk,
+                  std::map<mir::types::LabelId, mir::types::LabelId>& blk_map,
+                  std::map<mir::inst::VarId, mir::inst::VarId>& var_map,
+                  mir::types::LabelId next_round, bool last_round) {
+    auto id = blk_map.at(blk.id);
+    auto& copy =
+        func.basic_blks.insert({id, mir::inst::BasicBlk(id)}).first->second;
+    auto map_var = [&](mir::inst::VarId var) {
+      auto it = var_map.find(var);
+      return it == var_map.end() ? var : it->second;
+    };
+    for (auto& inst : blk.inst) {
+      if (is_carried(inst.get())) continue;
+      auto ptr = std::unique_ptr<mir::inst::Inst>(inst->deep_copy());
+      if (auto phi = dynamic_cast<mir::inst::PhiInst*>(ptr.get())) {
+        // `PhiInst::replace` does nothing on purpose
+        for (auto& var : phi->vars) var = map_var(var);
+      } else {
+        for (auto var : ptr->useVars()) {
+          if (var_map.count(var)) ptr->replace(var, var_map.at(var));
+        }
+      }
+      if (!is_store(ptr.get())) ptr->dest = map_var(ptr->dest);
+      copy.inst.push_back(std::move(ptr));
+    }
+
+    auto& jump = blk.jump;
+    if (blk.id == trip.exiting) {
+      copy.jump = mir::inst::JumpInstruction(
+          mir::inst::JumpInstructionKind::Br, next_round, -1, std::nullopt,
+          last_round ? mir::inst::JumpKind::Loop
+                     : mir::inst::JumpKind::Undefined);
+      return;
+    }
+    auto map_blk = [&](int target) {
+      return loop.contains(target) ? int(blk_map.at(target)) : target;
+    };
+    std::optional<mir::inst::VarId> cond;
+    if (jump.cond_or_ret) cond = map_var(*jump.cond_or_ret);
+    copy.jump = mir::inst::JumpInstruction(jump.kind, map_blk(jump.bb_true),
+                                           map_blk(jump.bb_false), cond,
+                                           jump.jump_kind);
+  }
+
+  void update_preceding() {
+    for (auto& [id, blk] : func.basic_blks) blk.preceding.clear();
+    for (auto& [id, blk] : func.basic_blks) {
+      for (auto succ : mir::inst::successors(blk)) {
+        auto it = func.basic_blks.find(succ);
+        if (it != func.basic_blks.end()) it->second.preceding.insert(id);
       }
     }
-    auto& x = *iter;
-    auto& i = *x;
-    auto& inst = *dynamic_cast<mir::inst::OpInst*>(&i);
-    ;
-    auto multimes = copy_var(inst.dest);
-    blk.inst.push_back(std::make_unique<mir::inst::OpInst>(
-        multimes, inst.lhs, get_times(), mir::inst::Op::Add));
-    auto cond = copy_var(inst.dest);
-    blk.inst.push_back(std::make_unique<mir::inst::OpInst>(
-        cond, multimes, inst.rhs, mir::inst::Op::Lt));
-    blk.jump.cond_or_ret = cond;
   }
 };
 
@@ -172,282 +257,147 @@ void Loop_Unrolling::optimize_mir(
     std::map<std::string, std::any>& extra_data_repo) {
   for (auto& f : mir.functions) {
     if (f.second.type->is_extern) continue;
-    optimize_func(f.second);
+    optimize_func(f.second, extra_data_repo);
   }
 }
 
-std::optional<loop_info> is_loop_start(mir::inst::MirFunction& func,
-                                       mir::inst::BasicBlk& blk) {
-  std::optional<loop_info> res;
-  if (blk.jump.jump_kind == mir::inst::JumpKind::Loop) {
-    auto bb_true = blk.jump.bb_true;
-    auto bb_false = blk.jump.bb_false;
-    if (bb_true == blk.id) {
-      return res;
-    }
-    if (bb_true == func.basic_blks.at(bb_true).jump.bb_true &&
-        bb_false == func.basic_blks.at(bb_true).jump.bb_false) {
-      auto start_cond = blk.jump.cond_or_ret.value();
-      auto iter = blk.inst.begin();
-      for (; iter != blk.inst.end(); iter++) {
-        auto& inst = *iter;
-        if (inst->dest == start_cond) {
-          break;
-        }
-      }
-      if (iter == blk.inst.end() ||
-          iter->get()->inst_kind() != mir::inst::InstKind::Op) {
-        return res;
-      }
-
-      auto& i = **iter;
-      auto start_cmp_Inst = dynamic_cast<mir::inst::OpInst*>(&i);
-
-      if (start_cmp_Inst->op != mir::inst::Op::Lt ||
-          start_cmp_Inst->rhs.is_immediate()) {
-        return res;
-      }
-
-      auto& loop_blk = func.basic_blks.at(bb_true);
-      std::set<mir::inst::VarId> inst_dests;
-      for (auto& inst : loop_blk.inst) {
-        inst_dests.insert(inst->dest);
-      }
-      auto& loop_cond = loop_blk.jump.cond_or_ret.value();
-      iter = loop_blk.inst.begin();
-      for (; iter != loop_blk.inst.end(); iter++) {
-        auto& inst = *iter;
-        if (inst->dest == loop_cond) {
-          break;
-        }
-      }
-      if (iter == loop_blk.inst.end() ||
-          iter->get()->inst_kind() != mir::inst::InstKind::Op) {
-        return res;
-      }
-      auto& i1 = **iter;
-      auto loop_cmp_Inst = dynamic_cast<mir::inst::OpInst*>(&i1);
-      if (loop_cmp_Inst->op != mir::inst::Op::Lt ||
-          loop_cmp_Inst->rhs != start_cmp_Inst->rhs) {
-        return res;
-      }
-
-      auto phi_count = 0;
-      mir::inst::VarId phi_dest;
-      std::set<mir::inst::VarId> phi_vars;
-      for (auto& inst : loop_blk.inst) {
-        if (inst->inst_kind() == mir::inst::InstKind::Phi) {
-          phi_count++;
-          if (inst->useVars().size() ==
-              2) {  // one for initial val,and one for loop val
-            phi_vars = inst->useVars();
-            phi_dest = inst->dest;
-          }
-        }
-      }
-      if (phi_count != 1) {
-        return res;
-      }
-      start_cond = loop_blk.jump.cond_or_ret.value();
-      for (auto& inst : loop_blk.inst) {
-        if (inst->dest == start_cond) {
-          assert(inst->inst_kind() == mir::inst::InstKind::Op);
-          auto& i = *inst;
-          auto opInst = dynamic_cast<mir::inst::OpInst*>(&i);
-        }
+/// Values needed across the whole loop: loop-carried phis plus the values
+/// flowing in from outside
+size_t register_pressure(mir::inst::MirFunction& func,
+                         const mir::inst::Loop& loop) {
+  std::set<mir::inst::VarId> defined, used;
+  size_t phis = 0;
+  for (auto id : loop.blocks) {
+    auto& blk = func.basic_blks.at(id);
+    for (auto& inst : blk.inst) {
+      if (dynamic_cast<mir::inst::PhiInst*>(inst.get())) {
+        if (id == loop.header) phis++;
+      } else {
+        auto uses = inst->useVars();
+        used.insert(uses.begin(), uses.end());
       }
+      if (!Unroller::is_store(inst.get())) defined.insert(inst->dest);
+    }
+    if (blk.jump.kind == mir::inst::JumpInstructionKind::BrCond) {
+      used.insert(*blk.jump.cond_or_ret);
+    }
+  }
+  size_t live_in = 0;
+  for (auto var : used) live_in += !defined.count(var);
+  return live_in + phis;
+}
 
-      mir::inst::VarId init_var = mir::inst::VarId(0);
-      std::pair<mir::inst::Op, mir::inst::VarId> cmp = {
-          start_cmp_Inst->op, std::get<mir::inst::VarId>(start_cmp_Inst->rhs)};
-      std::pair<mir::inst::Op, int> change = {mir::inst::Op::Add, 1};
-      mir::inst::VarId var;
-      mir::inst::VarId change_var;
+/// Tries to unroll `loop`, returns a remark on what happened
+std::string unroll_loop(mir::inst::MirFunction& func,
+                        const mir::inst::LoopForest& forest,
+                        const mir::inst::ValueRanges& ranges,
+                        const mir::inst::Loop& loop) {
+  if (!loop.children.empty()) return "not innermost";
+  if (loop.has_irreducible) return "irreducible";
+  auto trip = forest.trip_count(loop, func);
+  if (!trip) return "not a counted loop";
+  if (trip->exiting != loop.latches[0] || loop.exits.size() != 1) {
+    return "not tested at the latch";
+  }
+  bool up = trip->cmp == mir::inst::Op::Lt || trip->cmp == mir::inst::Op::Lte;
+  bool down =
+      trip->cmp == mir::inst::Op::Gt || trip->cmp == mir::inst::Op::Gte;
+  if (!(up && trip->step > 0) && !(down && trip->step < 0)) {
+    return "exit test does not bound the induction variable";
+  }
 
-      bool flag = false;
-      for (auto var : phi_vars) {
-        if (!inst_dests.count(var)) {
-          init_var = var;
-        } else {
-          change_var = var;
-          for (auto& inst : loop_blk.inst) {
-            if (inst->dest == loop_blk.jump.cond_or_ret.value() &&
-                !inst->useVars().count(var)) {
-              return res;
-            }
-            if (inst->dest == var &&
-                inst->inst_kind() == mir::inst::InstKind::Op) {
-              mir::inst::Value val(0);
-              auto& i = *inst;
-              auto ist = dynamic_cast<mir::inst::OpInst*>(&i);
-              if (ist->op != mir::inst::Op::Add &&
-                  ist->rhs != mir::inst::Value(1)) {
-                return res;
-              }
-            }
-          }
-        }
+  std::vector<Carried> carried;
+  for (auto& inst : func.basic_blks.at(loop.header).inst) {
+    auto phi = dynamic_cast<mir::inst::PhiInst*>(inst.get());
+    if (phi == nullptr) continue;
+    Carried c{phi, {}, mir::inst::VarId()};
+    for (auto var : phi->vars) {
+      auto def = func.def_use().def_block(var);
+      if (def && loop.contains(*def)) {
+        if (c.next != mir::inst::VarId()) return "complex header phi";
+        c.next = var;
+      } else {
+        c.init.push_back(var);
       }
-
-      return loop_info(blk.id, init_var, cmp, change, phi_dest, change_var,
-                       func);
     }
+    if (c.next == mir::inst::VarId() || c.init.empty()) {
+      return "complex header phi";
+    }
+    carried.push_back(std::move(c));
   }
-  return res;
-}
 
-std::optional<loop_info> find_loop_start(
-    mir::inst::MirFunction& func, std::set<mir::types::LabelId> base_blks) {
-  std::optional<loop_info> res;
-  for (auto& blkpair : func.basic_blks) {
-    if (!base_blks.count(blkpair.first)) {
-      continue;
+  // Calls cost far more than the loop overhead unrolling saves
+  size_t size = 0;
+  for (auto id : loop.blocks) {
+    for (auto& inst : func.basic_blks.at(id).inst) {
+      if (dynamic_cast<mir::inst::CallInst*>(inst.get())) return "has calls";
+      size += !dynamic_cast<mir::inst::PhiInst*>(inst.get());
     }
-    auto& blk = blkpair.second;
-    auto res = is_loop_start(func, blk);
-    if (res.has_value()) {
-      return res;
+  }
+  auto pressure = register_pressure(func, loop);
+  uint32_t factor = MAX_FACTOR;
+  while (factor > 1 && factor * size > MAX_UNROLLED_SIZE) factor /= 2;
+  if (pressure > REGISTER_BUDGET) return "too many values live across it";
+  if (trip->count) {
+    while (factor > 1 && *trip->count <= factor) factor /= 2;
+  } else if (loop.blocks.size() > 1) {
+    // Branching between the copies costs more than the dropped exit tests
+    // save unless the main loop is sure to run
+    factor = 1;
+  } else {
+    factor = std::min(factor, MAX_RUNTIME_FACTOR);
+  }
+  // The main loop stops at `bound - distance`, which must fit in an `i32`
+  // or be replaced at run time where it does not
+  bool may_wrap = false;
+  if (factor > 1) {
+    auto distance = Unroller::distance_of(*trip, factor);
+    if (auto bound = trip->bound.get_if<int32_t>()) {
+      auto limit = *bound - distance;
+      if (limit < INT32_MIN || limit > INT32_MAX) factor = 1;
+    } else {
+      auto info = ranges.info_at(trip->bound, loop.header);
+      may_wrap = distance > 0 ? info.lo < INT32_MIN + distance
+                              : info.hi > INT32_MAX + distance;
     }
   }
-  return res;
-}
-
-void expand_loop(mir::inst::MirFunction& func, mir::inst::BasicBlk& blk,
-                 loop_info info) {
-  auto& loop_start = func.basic_blks.at(info.loop_start);
-  LOG(TRACE) << "unroll loop starts at  " << info.loop_start << std::endl;
-  LOG(TRACE) << "init_val: " << info.init_var << std::endl;
-  LOG(TRACE) << "change : "
-             << mir::inst::OpInst(info.init_var, info.init_var,
-                                  info.change.second, info.change.first)
-             << std::endl;
-  LOG(TRACE) << "continue when: "
-             << mir::inst::OpInst(mir::inst::VarId(0), info.init_var,
-                                  info.cmp.second, info.cmp.first)
-             << std::endl;
-  Rewriter rwt(func, blk, {info.phi_var, info.init_var}, info.change_var);
-  info.rewrite_jump_cond(func.basic_blks.at(info.loop_start));
 
-  auto end_iter = func.basic_blks.end();
-  end_iter--;
-  end_iter--;
-
-  // extra loop
-  auto extra_loop_start = end_iter->first + 1;
-  auto extra_loop = end_iter->first + 2;
-  func.basic_blks.insert(
-      {extra_loop_start, mir::inst::BasicBlk(extra_loop_start)});
-  func.basic_blks.insert({extra_loop, mir::inst::BasicBlk(extra_loop)});
-  auto& extra_loop_start_blk = func.basic_blks.at(extra_loop_start);
-  auto& extra_loop_blk = func.basic_blks.at(extra_loop);
-  extra_loop_start_blk.preceding =
-      std::set<mir::types::LabelId>{loop_start.id, blk.id};
-  extra_loop_blk.preceding =
-      std::set<mir::types::LabelId>{extra_loop_start_blk.id, extra_loop_blk.id};
-
-  // original loop's end
-  func.basic_blks.at(loop_start.jump.bb_false).preceding =
-      std::set<mir::types::LabelId>{extra_loop_start_blk.id, extra_loop_blk.id};
-
-  // copy original loop insts in extra loop blk
-  for (auto& inst : blk.inst) {
-    extra_loop_blk.inst.push_back(
-        std::unique_ptr<mir::inst::Inst>(inst->deep_copy()));
+  std::stringstream remark;
+  remark << size << " instructions, " << loop.blocks.size()
+         << " blocks, pressure " << pressure << ", trip count ";
+  if (trip->count) {
+    remark << *trip->count;
+  } else {
+    remark << "unknown";
   }
-  extra_loop_blk.jump = mir::inst::JumpInstruction(
-      mir::inst::JumpInstructionKind::BrCond, extra_loop_blk.id,
-      loop_start.jump.bb_false, blk.jump.cond_or_ret,
-      mir::inst::JumpKind::Loop);
-
-  // after copy then can be rewrrote
-  info.rewrite_jump_cond(blk);
-
-  // init extra loop start 's insts
-  int times = info.get_times();
-  mir::inst::VarId new_change_var;
-  auto insts = rwt.get_insts(times, new_change_var);
-  auto new_phi = info.copy_var(info.init_var);
-  extra_loop_start_blk.inst.push_back(std::make_unique<mir::inst::PhiInst>(
-      new_phi, std::vector<mir::inst::VarId>{info.init_var, new_change_var}));
-  auto cond = info.copy_var(blk.jump.cond_or_ret.value());
-  extra_loop_start_blk.inst.push_back(std::make_unique<mir::inst::OpInst>(
-      cond, new_phi, info.cmp.second, info.cmp.first));
-  extra_loop_start_blk.jump = mir::inst::JumpInstruction(
-      mir::inst::JumpInstructionKind::BrCond, extra_loop_blk.id,
-      loop_start.jump.bb_false, cond, mir::inst::JumpKind::Loop);
-
-  blk.jump = mir::inst::JumpInstruction(
-      mir::inst::JumpInstructionKind::BrCond, blk.id, extra_loop_start_blk.id,
-      blk.jump.cond_or_ret.value(), mir::inst::JumpKind::Loop);
-  auto& inst = extra_loop_blk.inst.front();
-  auto& i = *inst;
-  assert(inst->inst_kind() == mir::inst::InstKind::Phi);
-  auto phiInst = dynamic_cast<mir::inst::PhiInst*>(&i);
-  phiInst->vars.erase(
-      std::find(phiInst->vars.begin(), phiInst->vars.end(), info.init_var));
-  phiInst->vars.push_back(new_phi);
-  blk.inst.clear();
-  for (auto& inst : insts) {
-    blk.inst.push_back(std::move(inst));
+  if (factor < 2) {
+    remark << ", not unrolled";
+    return remark.str();
   }
-  func.basic_blks.at(loop_start.jump.bb_false)
-      .preceding.erase(loop_start.jump.bb_true);
-
-  loop_start.jump = mir::inst::JumpInstruction(
-      mir::inst::JumpInstructionKind::BrCond, loop_start.jump.bb_true,
-      extra_loop_start_blk.id, loop_start.jump.cond_or_ret.value());
-  // auto& end_loop_blk = func.basic_blks.at(loop_start.jump.bb_true);
-  // for (auto iter = end_loop_blk.inst.begin();
-  //      iter != end_loop_blk.inst.end() &&
-  //      iter->get()->inst_kind() == mir::inst::InstKind::Phi;
-  //      iter++) {
-  //   auto& inst = *iter;
-  //   auto& i = *inst;
-  //   auto phiInst = dynamic_cast<mir::inst::PhiInst*>(&i);
-  //   if (phiInst->useVars().count(info.change_var)) {
-  //     phiInst->vars.erase(std::find(phiInst->vars.begin(),
-  //     phiInst->vars.end(),
-  //                                   info.change_var));
-  //   }
-  //   if (times) {
-  //     if (phiInst->useVars().count(info.init_var)) {
-  //       phiInst->vars.erase(std::find(
-  //           phiInst->vars.begin(), phiInst->vars.end(),
-  //           info.init_var));
-  //       phiInst->vars.push_back(new_change_var);
-  //     }
-  //   }
-  // }
+  Unroller(func, loop, *trip, std::move(carried), factor, may_wrap).run();
+  func.invalidate_def_use();
+  remark << ", unrolled by " << factor;
+  return remark.str();
 }
 
-void Loop_Unrolling::optimize_func(mir::inst::MirFunction& func) {
-  std::set<mir::types::LabelId> base_blks;
-  for (auto& blkpair : func.basic_blks) {
-    base_blks.insert(blkpair.first);
+void Loop_Unrolling::optimize_func(
+    mir::inst::MirFunction& func,
+    std::map<std::string, std::any>& extra_data_repo) {
+  std::vector<mir::types::LabelId> headers;
+  for (auto& loop : get_loop_forest(extra_data_repo, func).loops()) {
+    headers.push_back(loop.header);
   }
-  auto& startblk = func.basic_blks.begin()->second;
-  while (true) {
-    auto info = find_loop_start(func, base_blks);
-    if (!info.has_value()) {
-      break;
-    }
-    int size = func.variable_table_size();
-    std::set<mir::inst::VarId> vars;
-    auto& blk =
-        func.basic_blks.at(func.basic_blks.at(info->loop_start).jump.bb_true);
-
-    int times = info->get_times();
-    for (auto& inst : blk.inst) {
-      if (inst->inst_kind() == mir::inst::InstKind::Phi) {
-        continue;
-      }
-      size += times * func.variables.at(inst->dest.id).size();
-    }
-
-    // if (size >= 1024) {
-    //   return;
-    // }
-    expand_loop(func, blk, info.value());
+  // Unrolling keeps every value the same, so the ranges stay true
+  mir::inst::ValueRanges ranges(func);
+  // Unrolling adds blocks and loops, so look each loop up again
+  for (auto header : headers) {
+    auto& forest = get_loop_forest(extra_data_repo, func);
+    auto loop = forest.loop_with_header(header);
+    if (loop == nullptr) continue;
+    auto remark = func.name + " bb" + std::to_string(header) + ": " +
+                  unroll_loop(func, forest, ranges, *loop);
+    LOG(TRACE) << "loop unrolling: " << remark << std::endl;
+    backend::report_statistic(extra_data_repo, pass_name(), remark);
   }
 }
 
@@ -1,9 +1,22 @@
 #pragma once
 
+#include "../../mir/loop.hpp"
 #include "../backend.hpp"
 
 namespace optimization::loop_unrolling {
 
+/// Partial unrolling of counted loops.
+///
+/// A loop tested at its only latch against a loop-invariant bound is split
+/// in two. A new main loop runs `factor` copies of the body back to back, with
+/// the exit tests in between dropped, for as long as more than `factor`
+/// iterations are left; the original loop then runs the remaining 1 to
+/// `factor` iterations. The trip count therefore needs not be known at
+/// compile time, and bodies may span several blocks.
+///
+/// The factor is picked from the size of the body and the number of values
+/// live across the loop. Every loop looked at gets a remark in the pass
+/// statistics.
 class Loop_Unrolling final : public backend::MirOptimizePass {
  public:
   std::string pass_name() const override { return "Loop unrolling"; }
@@ -11,7 +24,8 @@ class Loop_Unrolling final : public backend::MirOptimizePass {
                     std::map<std::string, std::any> &extra_data_repo) override;
 
  private:
-  void optimize_func(mir::inst::MirFunction &func);
+  void optimize_func(mir::inst::MirFunction &func,
+                     std::map<std::string, std::any> &extra_data_repo);
 };
 
 }  // namespace optimization::loop_unrolling
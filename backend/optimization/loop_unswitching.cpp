@@ -0,0 +1,330 @@
+#include "./loop_unswitching.hpp"
+
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <optional>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "../../include/aixlog.hpp"
+#include "../../mir/def_use.hpp"
+#include "optimization.hpp"
+
+namespace optimization::loop_unswitching {
+
+/// Most instructions besides phis a loop may hold to be copied
+const size_t MAX_LOOP_SIZE = 64;
+/// Most instructions the copies may add up to in a single function
+const size_t MAX_GROWTH = 256;
+/// Most instructions recomputing a condition in the preheader
+const size_t MAX_HOISTED = 4;
+
+void Loop_Unswitching::optimize_mir(
+    mir::inst::MirPackage& mir,
+    std::map<std::string, std::any>& extra_data_repo) {
+  for (auto& f : mir.functions) {
+    if (f.second.type->is_extern) continue;
+    optimize_func(f.second, extra_data_repo);
+  }
+}
+
+namespace {
+
+bool is_phi(mir::inst::Inst* inst) {
+  return inst->inst_kind() == mir::inst::InstKind::Phi;
+}
+
+bool is_store(mir::inst::Inst* inst) {
+  return dynamic_cast<mir::inst::StoreInst*>(inst) ||
+         dynamic_cast<mir::inst::StoreOffsetInst*>(inst);
+}
+
+class Unswitcher {
+ public:
+  Unswitcher(mir::inst::MirFunction& func, const mir::inst::Loop& loop)
+      : func(func), loop(loop) {}
+
+  /// Instructions besides phis the loop holds
+  size_t size() const {
+    size_t size = 0;
+    for (auto id : loop.blocks) {
+      for (auto& inst : func.basic_blks.at(id).inst) {
+        size += !is_phi(inst.get());
+      }
+    }
+    return size;
+  }
+
+  /// Finds a branch to unswitch, returns why there is none otherwise
+  std::optional<std::string> analyze() {
+    for (auto id : loop.blocks) {
+      // Guards of inner loops are marked as loop jumps, and copying the loop
+      // only to skip an inner loop that would not have run gains nothing
+      auto& jump = func.basic_blks.at(id).jump;
+      if (jump.kind != mir::inst::JumpInstructionKind::BrCond ||
+          jump.jump_kind == mir::inst::JumpKind::Loop ||
+          jump.bb_true == jump.bb_false || !loop.contains(jump.bb_true) ||
+          !loop.contains(jump.bb_false) || jump.bb_true == loop.header ||
+          jump.bb_false == loop.header) {
+        continue;
+      }
+      // Conditions made of constants only are left to constant propagation
+      hoisted.clear();
+      reads_outside = false;
+      if (!invariant(*jump.cond_or_ret) || !reads_outside) continue;
+      branch = id;
+      break;
+    }
+    if (!branch) return "no invariant condition";
+
+    // Values leaving the loop, and whether some of them are read by
+    // something other than a phi
+    auto& du = func.def_use();
+    bool needs_merge = false;
+    for (auto id : loop.blocks) {
+      for (auto& inst : func.basic_blks.at(id).inst) {
+        if (is_store(inst.get())) continue;
+        std::vector<mir::inst::UseSite> outside;
+        for (auto use : du.uses_of(inst->dest)) {
+          if (loop.contains(use.blk)) continue;
+          outside.push_back(use);
+          needs_merge |= use.is_jump() || !is_phi(use.inst);
+        }
+        if (!outside.empty()) live_out.push_back({inst->dest, outside});
+      }
+    }
+    if (needs_merge) {
+      auto exits = loop.exit_blocks();
+      if (exits.size() != 1) return "values leave through several exits";
+      merge_at = exits[0];
+      for (auto pred : func.basic_blks.at(*merge_at).preceding) {
+        if (!loop.contains(pred)) return "exit reached from elsewhere";
+      }
+    }
+    return std::nullopt;
+  }
+
+  void run() {
+    auto& header = func.basic_blks.at(loop.header);
+    auto preheader_id =
+        loop.preheader ? *loop.preheader : make_preheader(func, loop);
+    auto& preheader = func.basic_blks.at(preheader_id);
+    auto cond = *func.basic_blks.at(*branch).jump.cond_or_ret;
+
+    // The condition is recomputed in the preheader
+    std::map<mir::inst::VarId, mir::inst::VarId> hoist_map;
+    for (auto inst : hoisted) {
+      auto copy = std::unique_ptr<mir::inst::Inst>(inst->deep_copy());
+      for (auto var : copy->useVars()) {
+        if (hoist_map.count(var)) copy->replace(var, hoist_map.at(var));
+      }
+      copy->dest = copy_var(inst->dest);
+      hoist_map.insert({inst->dest, copy->dest});
+      preheader.inst.push_back(std::move(copy));
+    }
+    if (hoist_map.count(cond)) cond = hoist_map.at(cond);
+
+    next_blk_id = 0;
+    for (auto& [id, blk] : func.basic_blks) {
+      if (id < MAX_BLOCK_ID) next_blk_id = std::max(next_blk_id, id);
+    }
+    next_blk_id++;
+    for (auto id : loop.blocks) blk_map.insert({id, next_blk_id++});
+    for (auto id : loop.blocks) {
+      for (auto& inst : func.basic_blks.at(id).inst) {
+        if (!is_store(inst.get())) {
+          var_map.insert({inst->dest, copy_var(inst->dest)});
+        }
+      }
+    }
+    for (auto id : loop.blocks) copy_block(func.basic_blks.at(id));
+
+    // The original loop runs when the condition holds, the copy otherwise
+    preheader.jump = mir::inst::JumpInstruction(
+        mir::inst::JumpInstructionKind::BrCond, header.id,
+        blk_map.at(header.id), cond, mir::inst::JumpKind::Branch);
+    auto& jump = func.basic_blks.at(*branch).jump;
+    auto& copied = func.basic_blks.at(blk_map.at(*branch)).jump;
+    copied = mir::inst::JumpInstruction(mir::inst::JumpInstructionKind::Br,
+                                        blk_map.at(jump.bb_false));
+    jump = mir::inst::JumpInstruction(mir::inst::JumpInstructionKind::Br,
+                                      jump.bb_true);
+
+    // Phis after the loop take the values of both copies as operands, other
+    // reads go through a phi in the exit block
+    std::vector<std::unique_ptr<mir::inst::Inst>> phis;
+    for (auto& [var, uses] : live_out) {
+      auto copies = std::vector{var, var_map.at(var)};
+      std::optional<mir::inst::VarId> merged;
+      for (auto use : uses) {
+        auto phi = use.is_jump() ? nullptr
+                                 : dynamic_cast<mir::inst::PhiInst*>(use.inst);
+        if (phi) {
+          if (std::find(phi->vars.begin(), phi->vars.end(), copies[1]) ==
+              phi->vars.end()) {
+            phi->vars.push_back(copies[1]);
+          }
+          continue;
+        }
+        if (!merged) {
+          for (auto copy : copies) {
+            func.variables.at(copy.id).is_phi_var = true;
+          }
+          merged = copy_var(var);
+          func.variables.at(merged->id).is_phi_var = true;
+          phis.push_back(
+              std::make_unique<mir::inst::PhiInst>(*merged, copies));
+        }
+        if (use.is_jump()) {
+          func.basic_blks.at(use.blk).jump.cond_or_ret = *merged;
+        } else {
+          use.inst->replace(var, *merged);
+        }
+      }
+    }
+    if (merge_at) {
+      auto& exit = func.basic_blks.at(*merge_at);
+      exit.inst.insert(exit.inst.begin(),
+                       std::make_move_iterator(phis.begin()),
+                       std::make_move_iterator(phis.end()));
+    }
+
+    remove_unreachable_blocks(func);
+  }
+
+  std::string describe() const {
+    std::stringstream remark;
+    auto& jump = func.basic_blks.at(*branch).jump;
+    remark << "unswitched bb" << *branch << " on $" << jump.cond_or_ret->id;
+    if (!hoisted.empty()) {
+      remark << ", hoisted " << hoisted.size()
+             << (hoisted.size() == 1 ? " instruction" : " instructions");
+    }
+    return remark.str();
+  }
+
+ private:
+  /// Whether the loop leaves `var` unchanged. Values computed inside the loop
+  /// from such values are collected into `hoisted`, in order.
+  bool invariant(mir::inst::VarId var) {
+    auto& du = func.def_use();
+    auto blk = du.def_block(var);
+    if (!blk || !loop.contains(*blk)) {
+      reads_outside = true;
+      return true;
+    }
+    auto def = du.def_of(var);
+    if (std::find(hoisted.begin(), hoisted.end(), def) != hoisted.end()) {
+      return true;
+    }
+    auto op = dynamic_cast<mir::inst::OpInst*>(def);
+    if (!(op && op->op != mir::inst::Op::Div && op->op != mir::inst::Op::Rem) &&
+        !dynamic_cast<mir::inst::AssignInst*>(def)) {
+      return false;
+    }
+    for (auto use : def->useVars()) {
+      if (!invariant(use)) return false;
+    }
+    if (hoisted.size() == MAX_HOISTED) return false;
+    hoisted.push_back(def);
+    return true;
+  }
+
+  mir::inst::VarId copy_var(mir::inst::VarId var) {
+    auto id = func.variables.rbegin()->first + 1;
+    func.variables.insert({id, func.variables.at(var.id)});
+    return mir::inst::VarId(id);
+  }
+
+  /// Copies `blk` into the block `blk_map` maps it to
+  void copy_block(mir::inst::BasicBlk& blk) {
+    auto id = blk_map.at(blk.id);
+    auto& copy =
+        func.basic_blks.insert({id, mir::inst::BasicBlk(id)}).first->second;
+    auto map_var = [&](mir::inst::VarId var) {
+      auto it = var_map.find(var);
+      return it == var_map.end() ? var : it->second;
+    };
+    for (auto& inst : blk.inst) {
+      auto ptr = std::unique_ptr<mir::inst::Inst>(inst->deep_copy());
+      if (auto phi = dynamic_cast<mir::inst::PhiInst*>(ptr.get())) {
+        // `PhiInst::replace` does nothing on purpose
+        for (auto& var : phi->vars) var = map_var(var);
+      } else {
+        for (auto var : ptr->useVars()) {
+          if (var_map.count(var)) ptr->replace(var, var_map.at(var));
+        }
+      }
+      if (!is_store(ptr.get())) ptr->dest = map_var(ptr->dest);
+      copy.inst.push_back(std::move(ptr));
+    }
+    auto& jump = blk.jump;
+    auto map_blk = [&](int target) {
+      return loop.contains(target) ? int(blk_map.at(target)) : target;
+    };
+    std::optional<mir::inst::VarId> cond;
+    if (jump.cond_or_ret) cond = map_var(*jump.cond_or_ret);
+    copy.jump = mir::inst::JumpInstruction(jump.kind, map_blk(jump.bb_true),
+                                           map_blk(jump.bb_false), cond,
+                                           jump.jump_kind);
+  }
+
+  mir::inst::MirFunction& func;
+  const mir::inst::Loop& loop;
+  /// Block ending in the branch to unswitch
+  std::optional<mir::types::LabelId> branch;
+  std::vector<mir::inst::Inst*> hoisted;
+  /// Whether the condition reads some value defined outside the loop
+  bool reads_outside;
+  /// Values defined in the loop and their uses outside it
+  std::vector<std::pair<mir::inst::VarId, std::vector<mir::inst::UseSite>>>
+      live_out;
+  /// The only exit block, where values read after the loop are merged
+  std::optional<mir::types::LabelId> merge_at;
+  mir::types::LabelId next_blk_id;
+  std::map<mir::types::LabelId, mir::types::LabelId> blk_map;
+  std::map<mir::inst::VarId, mir::inst::VarId> var_map;
+};
+
+/// Tries to unswitch `loop`, returns a remark on what happened
+std::string unswitch_loop(mir::inst::MirFunction& func,
+                          const mir::inst::Loop& loop, size_t& growth) {
+  if (loop.has_irreducible) return "irreducible";
+  Unswitcher unswitcher(func, loop);
+  if (auto reason = unswitcher.analyze()) return *reason;
+  auto size = unswitcher.size();
+  if (size > MAX_LOOP_SIZE) return "too large";
+  if (growth + size > MAX_GROWTH) return "out of growth budget";
+  growth += size;
+  auto remark = unswitcher.describe();
+  unswitcher.run();
+  return remark;
+}
+
+}  // namespace
+
+void Loop_Unswitching::optimize_func(
+    mir::inst::MirFunction& func,
+    std::map<std::string, std::any>& extra_data_repo) {
+  std::vector<mir::types::LabelId> headers;
+  for (auto& loop : get_loop_forest(extra_data_repo, func).loops()) {
+    headers.push_back(loop.header);
+  }
+  // Innermost loops first; unswitching copies loops, so look each one up
+  // again
+  size_t growth = 0;
+  for (auto it = headers.rbegin(); it != headers.rend(); it++) {
+    auto& forest = get_loop_forest(extra_data_repo, func);
+    auto loop = forest.loop_with_header(*it);
+    if (loop == nullptr) continue;
+    auto remark = func.name + " bb" + std::to_string(*it) + ": " +
+                  unswitch_loop(func, *loop, growth);
+    LOG(TRACE) << "loop unswitching: " << remark << std::endl;
+    backend::report_statistic(extra_data_repo, pass_name(), remark);
+  }
+}
+
+}  // namespace optimization::loop_unswitching
@@ -0,0 +1,33 @@
+#pragma once
+
+#include "../../mir/loop.hpp"
+#include "../backend.hpp"
+
+namespace optimization::loop_unswitching {
+
+/// Unswitching of loops on loop-invariant conditions.
+///
+/// A conditional branch inside a loop whose condition the loop does not
+/// change is tested once in the preheader instead. The loop is copied, and
+/// the preheader enters the original when the condition holds and the copy
+/// otherwise; in each the branch becomes a jump to the side it always takes,
+/// and blocks no longer reached are dropped. Conditions computed inside the
+/// loop from values defined outside it are recomputed in the preheader.
+///
+/// Values of the loop used after it come from either copy: phis after the
+/// loop take both as operands, and other reads go through a new phi in the
+/// block the loop exits to. Loops are visited innermost first, and the code
+/// copied for a function is bounded. Every loop looked at gets a remark in
+/// the pass statistics.
+class Loop_Unswitching final : public backend::MirOptimizePass {
+ public:
+  std::string pass_name() const override { return "Loop unswitching"; }
+  void optimize_mir(mir::inst::MirPackage &mir,
+                    std::map<std::string, std::any> &extra_data_repo) override;
+
+ private:
+  void optimize_func(mir::inst::MirFunction &func,
+                     std::map<std::string, std::any> &extra_data_repo);
+};
+
+}  // namespace optimization::loop_unswitching
@@ -0,0 +1,403 @@
+#include "./memory_ssa.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <optional>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "../../mir/def_use.hpp"
+#include "dependence.hpp"
+
+namespace optimization::memory_ssa {
+
+namespace {
+
+/// Library functions touching nothing but the bytes their arguments give:
+/// `memset(dest, byte, size)` and `memcpy(dest, src, size)`
+const std::set<std::string> RANGE_CALLS = {"memset", "memcpy"};
+
+}  // namespace
+
+AliasAnalysis::AliasAnalysis(mir::inst::MirFunction& func,
+                             const side_effects::Summaries* summaries)
+    : func(func), summaries(summaries) {
+  auto& du = func.def_use();
+  // A local array escapes once a pointer into it is used for anything but
+  // the address of a load or store, or another pointer into it
+  auto track = [&](mir::inst::VarId start, mir::inst::VarId obj) {
+    std::vector<mir::inst::VarId> stack{start};
+    std::set<mir::inst::VarId> seen{start};
+    auto follow = [&](mir::inst::VarId var) {
+      if (seen.insert(var).second) stack.push_back(var);
+    };
+    auto is = [](mir::inst::Value& val, mir::inst::VarId var) {
+      auto x = val.get_if<mir::inst::VarId>();
+      return x && *x == var;
+    };
+    while (!stack.empty()) {
+      auto var = stack.back();
+      stack.pop_back();
+      for (auto& use : du.uses_of(var)) {
+        auto inst = use.inst;
+        if (use.is_jump()) {
+          escaped.insert(obj);
+        } else if (auto x = dynamic_cast<mir::inst::CallInst*>(inst)) {
+          if (!RANGE_CALLS.count(x->func)) escaped.insert(obj);
+        } else if (auto x = dynamic_cast<mir::inst::LoadOffsetInst*>(inst)) {
+          if (is(x->offset, var)) escaped.insert(obj);
+        } else if (auto x = dynamic_cast<mir::inst::StoreInst*>(inst)) {
+          if (is(x->val, var)) escaped.insert(obj);
+        } else if (auto x = dynamic_cast<mir::inst::StoreOffsetInst*>(inst)) {
+          if (is(x->val, var) || is(x->offset, var)) escaped.insert(obj);
+        } else if (auto x = dynamic_cast<mir::inst::PtrOffsetInst*>(inst)) {
+          if (is(x->offset, var)) escaped.insert(obj);
+          follow(x->dest);
+        } else if (auto x = dynamic_cast<mir::inst::OpInst*>(inst);
+                   x && x->op == mir::inst::Op::Add) {
+          follow(x->dest);
+        } else if (inst->inst_kind() == mir::inst::InstKind::Assign ||
+                   inst->inst_kind() == mir::inst::InstKind::Phi) {
+          follow(inst->dest);
+        } else if (!dynamic_cast<mir::inst::LoadInst*>(inst)) {
+          escaped.insert(obj);
+        }
+      }
+    }
+  };
+  for (auto& [id, blk] : func.basic_blks) {
+    for (auto& inst : blk.inst) {
+      auto x = dynamic_cast<mir::inst::RefInst*>(inst.get());
+      if (!x) continue;
+      if (auto var = std::get_if<mir::inst::VarId>(&x->val)) {
+        track(x->dest, *var);
+      }
+    }
+  }
+  for (auto& [id, var] : func.variables) {
+    if (var.is_memory_var && du.def_count(id) == 0) {
+      track(mir::inst::VarId(id), mir::inst::VarId(id));
+    }
+  }
+}
+
+bool AliasAnalysis::is_stable(mir::inst::VarId var) {
+  auto it = func.variables.find(var.id);
+  return it != func.variables.end() && !it->second.is_phi_var &&
+         func.def_use().def_count(var) <= 1;
+}
+
+std::optional<Location> AliasAnalysis::location_of(mir::inst::Inst* inst) {
+  std::optional<mir::inst::Value> ptr, offset, val;
+  if (auto x = dynamic_cast<mir::inst::LoadInst*>(inst)) {
+    ptr = x->src;
+  } else if (auto x = dynamic_cast<mir::inst::LoadOffsetInst*>(inst)) {
+    ptr = x->src;
+    offset = x->offset;
+  } else if (auto x = dynamic_cast<mir::inst::StoreInst*>(inst)) {
+    ptr = mir::inst::Value(x->dest);
+    val = x->val;
+  } else if (auto x = dynamic_cast<mir::inst::StoreOffsetInst*>(inst)) {
+    ptr = mir::inst::Value(x->dest);
+    offset = x->offset;
+    val = x->val;
+  } else {
+    return std::nullopt;
+  }
+  auto var = ptr->get_if<mir::inst::VarId>();
+  if (!var || ptr->has_shift()) return std::nullopt;
+
+  // Vectors move 16 bytes at once
+  uint32_t size = 4;
+  auto value = val ? val->get_if<mir::inst::VarId>() : &inst->dest;
+  if (value) {
+    auto it = func.variables.find(value->id);
+    if (it != func.variables.end() && it->second.ty &&
+        it->second.ty->kind() == mir::types::TyKind::Vector) {
+      size = 16;
+    }
+  }
+  auto loc = address_of(*var, size);
+  if (offset) {
+    add(loc, *offset);
+    std::sort(loc.terms.begin(), loc.terms.end());
+  }
+  return loc;
+}
+
+void AliasAnalysis::add(Location& loc, mir::inst::Value& val) {
+  if (auto imm = val.get_if<int32_t>()) {
+    loc.offset += *imm;
+    return;
+  }
+  auto term = *val.get_if<mir::inst::VarId>();
+  if (val.has_shift()) {
+    loc.terms.push_back({term.id, val.shift, val.shift_amount});
+  } else {
+    loc.terms.push_back({term.id, arm::RegisterShiftKind::Lsl, 0});
+  }
+  loc.exact &= is_stable(term);
+}
+
+Location AliasAnalysis::address_of(mir::inst::VarId ptr, uint32_t size) {
+  auto is_ptr = [&](mir::inst::Value& v) {
+    auto x = v.get_if<mir::inst::VarId>();
+    if (!x || v.has_shift()) return false;
+    auto it = func.variables.find(x->id);
+    return it != func.variables.end() &&
+           it->second.ty->kind() == mir::types::TyKind::Ptr;
+  };
+
+  // Same walk as `base_pointer`, keeping what is added on the way
+  Location loc;
+  loc.size = size;
+  auto& du = func.def_use();
+  for (int step = 0; step < 64 && is_stable(ptr); step++) {
+    auto def = du.def_of(ptr);
+    if (auto x = dynamic_cast<mir::inst::PtrOffsetInst*>(def)) {
+      add(loc, x->offset);
+      ptr = x->ptr;
+    } else if (auto x = dynamic_cast<mir::inst::AssignInst*>(def);
+               x && is_ptr(x->src)) {
+      ptr = *x->src.get_if<mir::inst::VarId>();
+    } else if (auto x = dynamic_cast<mir::inst::OpInst*>(def);
+               x && x->op == mir::inst::Op::Add && is_ptr(x->lhs)) {
+      add(loc, x->rhs);
+      ptr = *x->lhs.get_if<mir::inst::VarId>();
+    } else if (auto x = dynamic_cast<mir::inst::OpInst*>(def);
+               x && x->op == mir::inst::Op::Add && is_ptr(x->rhs)) {
+      add(loc, x->lhs);
+      ptr = *x->rhs.get_if<mir::inst::VarId>();
+    } else {
+      break;
+    }
+  }
+  loc.base = ptr;
+  loc.exact &= is_stable(ptr);
+  std::sort(loc.terms.begin(), loc.terms.end());
+  return loc;
+}
+
+std::optional<Location> AliasAnalysis::range_of(mir::inst::Inst* inst) {
+  auto x = dynamic_cast<mir::inst::CallInst*>(inst);
+  if (!x || !RANGE_CALLS.count(x->func) || x->params.size() != 3) {
+    return std::nullopt;
+  }
+  auto ptr = x->params[0].get_if<mir::inst::VarId>();
+  auto size = x->params[2].get_if<int32_t>();
+  if (!ptr || x->params[0].has_shift() || !size || *size <= 0) {
+    return std::nullopt;
+  }
+  return address_of(*ptr, *size);
+}
+
+AliasResult AliasAnalysis::alias(const Location& a, const Location& b) {
+  if (!dependence::may_share_object(func, a.base, b.base)) {
+    return AliasResult::No;
+  }
+  if (!a.exact || !b.exact || a.base != b.base || a.terms != b.terms) {
+    return AliasResult::May;
+  }
+  if (a.offset == b.offset && a.size == b.size) return AliasResult::Must;
+  if (a.offset + a.size <= b.offset || b.offset + b.size <= a.offset) {
+    return AliasResult::No;
+  }
+  return AliasResult::May;
+}
+
+bool AliasAnalysis::is_local(const Location& loc) {
+  return std::holds_alternative<mir::inst::VarId>(object_of(func, loc.base));
+}
+
+bool AliasAnalysis::reaches(const Location& loc) {
+  // Callees only reach local arrays the function hands out
+  return !is_local(loc) || escaped.count(object_of(func, loc.base));
+}
+
+bool AliasAnalysis::touches(mir::inst::CallInst& call, const Location& loc,
+                            const std::set<std::string>& globals,
+                            const std::set<uint32_t>& params, bool unknown) {
+  if (unknown) return reaches(loc);
+  for (auto param : params) {
+    if (param >= call.params.size()) continue;
+    auto ptr = call.params[param].get_if<mir::inst::VarId>();
+    if (!ptr || dependence::may_share_object(func, *ptr, loc.base)) {
+      return true;
+    }
+  }
+  // Pointers can't be stored, so callees only reach local arrays through
+  // their arguments, and only globals besides
+  auto obj = object_of(func, loc.base);
+  if (auto name = std::get_if<std::string>(&obj)) return globals.count(*name);
+  return obj.index() == 0 && !globals.empty();
+}
+
+bool AliasAnalysis::writes_memory(mir::inst::CallInst& call) {
+  if (PURE_MEMORY_CALLS.count(call.func)) return false;
+  return !summaries ||
+         side_effects::summary_of(*summaries, call.func).writes_memory();
+}
+
+bool AliasAnalysis::may_write(mir::inst::Inst* inst, const Location& loc) {
+  if (auto x = dynamic_cast<mir::inst::CallInst*>(inst)) {
+    if (!writes_memory(*x)) return false;
+    if (auto range = range_of(inst)) {
+      return alias(*range, loc) != AliasResult::No;
+    }
+    if (summaries) {
+      auto& callee = side_effects::summary_of(*summaries, x->func);
+      return touches(*x, loc, callee.writes_globals, callee.writes_params,
+                     callee.writes_unknown);
+    }
+    if (!RANGE_CALLS.count(x->func)) return reaches(loc);
+    auto ptr = x->params.empty() ? nullptr
+                                 : x->params[0].get_if<mir::inst::VarId>();
+    return !ptr || dependence::may_share_object(func, *ptr, loc.base);
+  }
+  auto other = location_of(inst);
+  return !other || alias(*other, loc) != AliasResult::No;
+}
+
+bool AliasAnalysis::may_read(mir::inst::Inst* inst, const Location& loc) {
+  if (auto x = dynamic_cast<mir::inst::CallInst*>(inst)) {
+    if (NO_MEMORY_CALLS.count(x->func) || x->func == "memset") return false;
+    if (summaries) {
+      auto& callee = side_effects::summary_of(*summaries, x->func);
+      return touches(*x, loc, callee.reads_globals, callee.reads_params,
+                     callee.reads_unknown);
+    }
+    if (x->func != "memcpy") return reaches(loc);
+    auto ptr = x->params.size() < 2 ? nullptr
+                                    : x->params[1].get_if<mir::inst::VarId>();
+    return !ptr || dependence::may_share_object(func, *ptr, loc.base);
+  }
+  if (inst->inst_kind() != mir::inst::InstKind::Load) return false;
+  auto other = location_of(inst);
+  return !other || alias(*other, loc) != AliasResult::No;
+}
+
+MemorySSA::MemorySSA(mir::inst::MirFunction& func, AliasAnalysis& aa)
+    : func(func), aa(aa), dom(func) {
+  auto entry = make(Access::Kind::Entry, dom.entry(), nullptr);
+  std::map<mir::types::LabelId, Access*> phis, exits;
+  for (auto id : dom.reverse_postorder()) {
+    if (dom.preds(id).size() >= 2 ||
+        (id == dom.entry() && !dom.preds(id).empty())) {
+      phis[id] = make(Access::Kind::Phi, id, nullptr);
+    }
+  }
+  // A block with a single predecessor comes after it in reverse postorder
+  for (auto id : dom.reverse_postorder()) {
+    Access* current;
+    if (phis.count(id)) {
+      current = phis.at(id);
+    } else if (id == dom.entry()) {
+      current = entry;
+    } else {
+      current = exits.at(dom.preds(id).front());
+    }
+    for (auto& inst : func.basic_blks.at(id).inst) {
+      auto kind = inst->inst_kind();
+      if (kind == mir::inst::InstKind::Load) {
+        auto use = make(Access::Kind::Use, id, inst.get());
+        use->defining = current;
+      } else if (kind == mir::inst::InstKind::Store ||
+                 (kind == mir::inst::InstKind::Call &&
+                  aa.writes_memory(
+                      static_cast<mir::inst::CallInst&>(*inst)))) {
+        auto def = make(Access::Kind::Def, id, inst.get());
+        def->defining = current;
+        current = def;
+      }
+    }
+    exits[id] = current;
+  }
+  for (auto [id, phi] : phis) {
+    for (auto pred : dom.preds(id)) {
+      phi->incoming.push_back({pred, exits.at(pred)});
+    }
+    if (id == dom.entry()) phi->incoming.push_back({id, entry});
+  }
+}
+
+Access* MemorySSA::make(Access::Kind kind, mir::types::LabelId blk,
+                        mir::inst::Inst* inst) {
+  accesses.push_back(std::make_unique<Access>());
+  auto access = accesses.back().get();
+  access->kind = kind;
+  access->blk = blk;
+  access->inst = inst;
+  access->order = accesses.size();
+  if (inst) by_inst[inst] = access;
+  return access;
+}
+
+Access* MemorySSA::access_of(mir::inst::Inst* inst) const {
+  auto it = by_inst.find(inst);
+  return it == by_inst.end() ? nullptr : it->second;
+}
+
+bool MemorySSA::dominates(const Access* a, const Access* b) const {
+  if (a->kind == Access::Kind::Entry) return true;
+  if (a->blk == b->blk) return a->order <= b->order;
+  return dom.dominates(a->blk, b->blk);
+}
+
+bool MemorySSA::varies_around(const Location& loc,
+                              mir::types::LabelId header) {
+  // Addresses that are not exact never tell accesses apart by their words
+  if (!loc.exact) return false;
+  auto& du = func.def_use();
+  auto inside = [&](mir::inst::VarId var) {
+    auto blk = du.def_block(var);
+    return blk && dom.dominates(header, *blk);
+  };
+  if (inside(loc.base)) return true;
+  return std::any_of(loc.terms.begin(), loc.terms.end(), [&](auto& term) {
+    return inside(mir::inst::VarId(term.var));
+  });
+}
+
+Access* MemorySSA::clobber(Access* from, const Location& loc) {
+  std::set<Access*> resolving;
+  uint32_t budget = 256;
+  auto found = walk(from, loc, resolving, budget);
+  return found ? found : from;
+}
+
+Access* MemorySSA::walk(Access* access, const Location& loc,
+                        std::set<Access*>& resolving, uint32_t& budget) {
+  while (access->kind == Access::Kind::Def) {
+    if (aa.may_write(access->inst, loc)) return access;
+    access = access->defining;
+  }
+  if (access->kind == Access::Kind::Entry) return access;
+  if (resolving.count(access)) return nullptr;
+  if (budget == 0) return access;
+  budget--;
+
+  resolving.insert(access);
+  Access* found = nullptr;
+  for (auto [pred, incoming] : access->incoming) {
+    // The previous iteration may have used the same variables for other
+    // words
+    if (dom.dominates(access->blk, pred) && varies_around(loc, access->blk)) {
+      found = access;
+      break;
+    }
+    auto res = walk(incoming, loc, resolving, budget);
+    if (!res) continue;
+    if (found && found != res) {
+      found = access;
+      break;
+    }
+    found = res;
+  }
+  resolving.erase(access);
+  return found;
+}
+
+}  // namespace optimization::memory_ssa
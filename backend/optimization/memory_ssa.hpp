@@ -0,0 +1,158 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <optional>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "../../mir/loop.hpp"
+#include "../../mir/mir.hpp"
+#include "optimization.hpp"
+#include "side_effects.hpp"
+
+/// Alias analysis and Memory SSA for the loads and stores of a function.
+///
+/// An address is taken apart into the pointer it starts from, the variables
+/// added to it and a constant number of bytes. Two accesses touch different
+/// words when they start from pointers into different objects (distinct
+/// globals, distinct local arrays, a local array and a parameter), or from
+/// the same pointer plus the same variables with constants putting them
+/// apart. Calls write what the program can reach from them: globals, memory
+/// behind parameters, and local arrays whose address gets anywhere but the
+/// loads and stores through it; `memset` and `memcpy` only touch the bytes
+/// they are given. With summaries of the functions called, a call only
+/// touches what its callee does, and what its arguments point to.
+///
+/// Memory SSA gives memory a version the way SSA gives variables one: every
+/// store and every call that may write memory defines a new version, every
+/// join gets a phi of the versions meeting there, and every load uses the
+/// version current where it runs. A query walks up from a version past the
+/// definitions that cannot write the words asked about, and through phis
+/// whose operands all lead to the same definition, or back to the phi itself
+/// around a loop.
+namespace optimization::memory_ssa {
+
+/// A variable added to an address, with the shift applied to it
+struct Term {
+  uint32_t var;
+  arm::RegisterShiftKind shift;
+  uint8_t amount;
+
+  bool operator<(const Term& other) const {
+    return std::tie(var, shift, amount) <
+           std::tie(other.var, other.shift, other.amount);
+  }
+  bool operator==(const Term& other) const {
+    return var == other.var && shift == other.shift && amount == other.amount;
+  }
+};
+
+/// The `size` bytes a load or store touches, at `base` plus `terms` plus
+/// `offset`
+struct Location {
+  mir::inst::VarId base;
+  /// Sorted
+  std::vector<Term> terms;
+  int64_t offset = 0;
+  uint32_t size = 4;
+  /// Whether the address is the same wherever the access runs: none of the
+  /// variables it is computed from belongs to a phi web or is defined more
+  /// than once
+  bool exact = true;
+};
+
+enum class AliasResult { No, May, Must };
+
+class AliasAnalysis {
+ public:
+  /// Calls are taken to do what `summaries` says, when given
+  AliasAnalysis(mir::inst::MirFunction& func,
+                const side_effects::Summaries* summaries = nullptr);
+
+  /// What `inst` reads or writes, if it is a load or a store
+  std::optional<Location> location_of(mir::inst::Inst* inst);
+  /// The `size` bytes `ptr` points to
+  Location address_of(mir::inst::VarId ptr, uint32_t size);
+  /// What the `memset` or `memcpy` call `inst` writes, if it is one writing
+  /// a known number of bytes
+  std::optional<Location> range_of(mir::inst::Inst* inst);
+  AliasResult alias(const Location& a, const Location& b);
+  /// Whether the store or call `inst` may write some word of `loc`
+  bool may_write(mir::inst::Inst* inst, const Location& loc);
+  /// Whether the load or call `inst` may read some word of `loc`
+  bool may_read(mir::inst::Inst* inst, const Location& loc);
+  /// Whether `call` may write memory the function can read
+  bool writes_memory(mir::inst::CallInst& call);
+  /// Whether `loc` lies in a local array, which is gone once the function
+  /// returns
+  bool is_local(const Location& loc);
+
+ private:
+  /// Whether `var` holds the same value wherever it is read
+  bool is_stable(mir::inst::VarId var);
+  /// Adds `val` to the address of `loc`
+  void add(Location& loc, mir::inst::Value& val);
+  /// Whether a call may reach `loc` through something other than its
+  /// arguments of `memset` and `memcpy`
+  bool reaches(const Location& loc);
+  /// Whether `call` may touch `loc`, going by the memory its summary says
+  /// the callee touches
+  bool touches(mir::inst::CallInst& call, const Location& loc,
+               const std::set<std::string>& globals,
+               const std::set<uint32_t>& params, bool unknown);
+
+  mir::inst::MirFunction& func;
+  const side_effects::Summaries* summaries;
+  /// Local arrays whose address gets anywhere but loads and stores
+  std::set<MemObject> escaped;
+};
+
+/// A version of memory, or a load reading one
+struct Access {
+  enum class Kind { Entry, Def, Phi, Use } kind;
+  mir::types::LabelId blk;
+  /// The store or call of a definition, the load of a use
+  mir::inst::Inst* inst = nullptr;
+  /// Version current right before a definition or use
+  Access* defining = nullptr;
+  /// Versions flowing into a phi, with the blocks they come from
+  std::vector<std::pair<mir::types::LabelId, Access*>> incoming;
+  /// Accesses of a block are numbered in the order they run
+  uint32_t order = 0;
+};
+
+class MemorySSA {
+ public:
+  MemorySSA(mir::inst::MirFunction& func, AliasAnalysis& aa);
+
+  const mir::inst::DominatorTree& dom_tree() const { return dom; }
+  /// Access of a load, store or call in a reachable block
+  Access* access_of(mir::inst::Inst* inst) const;
+  /// Whether every path from the entry to `b` passes `a` first
+  bool dominates(const Access* a, const Access* b) const;
+  /// The access nearest above the version `from` that may write some word
+  /// of `loc`: a definition, a phi where different ones meet, or the entry
+  Access* clobber(Access* from, const Location& loc);
+
+ private:
+  Access* make(Access::Kind kind, mir::types::LabelId blk,
+               mir::inst::Inst* inst);
+  /// Null when every path from `access` leads back to a phi in `resolving`
+  Access* walk(Access* access, const Location& loc,
+               std::set<Access*>& resolving, uint32_t& budget);
+  /// Whether the address of `loc` may change between iterations of the loop
+  /// headed by `header`
+  bool varies_around(const Location& loc, mir::types::LabelId header);
+
+  mir::inst::MirFunction& func;
+  AliasAnalysis& aa;
+  mir::inst::DominatorTree dom;
+  std::vector<std::unique_ptr<Access>> accesses;
+  std::map<mir::inst::Inst*, Access*> by_inst;
+};
+
+}  // namespace optimization::memory_ssa
@@ -8,6 +8,7 @@
 #include "../../arm_code/arm.hpp"
 #include "../../mir/mir.hpp"
 #include "../backend.hpp"
+#include "side_effects.hpp"
 
 namespace optimization::memvar_propagation {
 
@@ -383,149 +384,6 @@ class Memory_Var_Propagation : public backend::MirOptimizePass {
     }
   }
 
-  void delete_store1(mir::inst::MirFunction& func) {
-    std::map<mir::types::LabelId, mir::inst::BasicBlk>::iterator bit;
-    for (bit = func.basic_blks.begin(); bit != func.basic_blks.end(); bit++) {
-      auto& bb = bit->second;
-      int index = 0;
-      std::map<mir::inst::VarId, std::vector<int>> store;
-      std::vector<int> del;
-      bool redu = false;
-      for (auto& inst : bb.inst) {
-        auto& i = *inst;
-        if (auto x = dynamic_cast<mir::inst::StoreInst*>(&i)) {
-          auto find = store.find(x->dest);
-          if (find == store.end()) {
-            std::vector<int> ind;
-            ind.push_back(index);
-            store.insert(
-                std::map<mir::inst::VarId, std::vector<int>>::value_type(
-                    x->dest, ind));
-          } else {
-            find->second.push_back(index);
-          }
-        }
-        index++;
-      }
-
-      for (auto i = store.begin(); i != store.end(); i++) {
-        if (i->second.size() > 1) {
-          for (int j = 0; j < i->second.size() - 1; j++) {
-            index = 0;
-            bool dele = true;
-            for (auto& inst : bb.inst) {
-              auto& ii = *inst;
-              if (index >= i->second[j] && index < i->second[j + 1]) {
-                if (auto x = dynamic_cast<mir::inst::LoadInst*>(&ii)) {
-                  if (x->src.index() == 1 && std::get<1>(x->src) == i->first) {
-                    dele = false;
-                  }
-                }
-                if (auto x = dynamic_cast<mir::inst::CallInst*>(&ii)) {
-                  dele = false;
-                }
-              }
-              index++;
-            }
-            if (dele) {
-              del.push_back(i->second[j]);
-            }
-          }
-        }
-      }
-      sort(del.begin(), del.end());
-      for (int i = del.size() - 1; i >= 0; i--) {
-        bit->second.inst.erase(bit->second.inst.begin() + del[i]);
-      }
-    }
-  }
-
-  void delete_store2(mir::inst::MirFunction& func) {
-    std::map<mir::types::LabelId, mir::inst::BasicBlk>::iterator bit;
-    for (bit = func.basic_blks.begin(); bit != func.basic_blks.end(); bit++) {
-      auto& bb = bit->second;
-      int index = 0;
-      std::map<Dest, std::vector<int>> store;
-      std::vector<int> del;
-      bool redu = false;
-      for (auto& inst : bb.inst) {
-        auto& i = *inst;
-        if (auto x = dynamic_cast<mir::inst::StoreOffsetInst*>(&i)) {
-          Dest d(x->dest, x->offset);
-          auto find = store.find(d);
-          if (find == store.end()) {
-            std::vector<int> ind;
-            ind.push_back(index);
-            store.insert(std::map<Dest, std::vector<int>>::value_type(d, ind));
-          } else {
-            find->second.push_back(index);
-          }
-        }
-        index++;
-      }
-
-      for (auto i = store.begin(); i != store.end(); i++) {
-        if (i->second.size() > 1) {
-          for (int j = 0; j < i->second.size() - 1; j++) {
-            index = 0;
-            bool dele = true;
-            for (auto& inst : bb.inst) {
-              auto& ii = *inst;
-              if (index >= i->second[j] && index < i->second[j + 1]) {
-                if (auto x = dynamic_cast<mir::inst::LoadOffsetInst*>(&ii)) {
-                  if (x->src.index() == 1) {
-                    Dest d(std::get<1>(x->src), x->offset);
-                    if (d == i->first) {
-                      dele = false;
-                    }
-                  }
-                }
-                if (auto x = dynamic_cast<mir::inst::CallInst*>(&ii)) {
-                  dele = false;
-                }
-              }
-              index++;
-            }
-            if (dele) {
-              del.push_back(i->second[j]);
-            }
-          }
-        }
-      }
-      sort(del.begin(), del.end());
-      for (int i = del.size() - 1; i >= 0; i--) {
-        bit->second.inst.erase(bit->second.inst.begin() + del[i]);
-      }
-    }
-  }
-
-  bool check_effect(mir::inst::MirFunction& func) {
-    bool b = true;
-    std::map<mir::types::LabelId, mir::inst::BasicBlk>::iterator bit;
-    for (bit = func.basic_blks.begin(); bit != func.basic_blks.end(); bit++) {
-      auto& bb = bit->second;
-      for (auto& inst : bb.inst) {
-        auto& i = *inst;
-        if (auto x = dynamic_cast<mir::inst::StoreOffsetInst*>(&i)) {
-          b = false;
-        }
-        if (auto x = dynamic_cast<mir::inst::StoreInst*>(&i)) {
-          b = false;
-        }
-        if (auto x = dynamic_cast<mir::inst::LoadOffsetInst*>(&i)) {
-          b = false;
-        }
-        if (auto x = dynamic_cast<mir::inst::LoadInst*>(&i)) {
-          b = false;
-        }
-        if (auto x = dynamic_cast<mir::inst::CallInst*>(&i)) {
-          b = false;
-        }
-      }
-    }
-    return b;
-  }
-
   void optimize_func1(mir::inst::MirFunction& func,
                       mir::inst::MirPackage& package) {
     std::map<mir::types::LabelId, mir::inst::BasicBlk>::iterator bit;
@@ -609,6 +467,7 @@ class Memory_Var_Propagation : public backend::MirOptimizePass {
           index++;
         }
         std::vector<int> del_index;
+        std::map<mir::inst::VarId, mir::inst::VarId> copied;
         for (int j = 0; j < call_index.size(); j++) {
           int upper_bound = (j == (call_index.size() - 1)) ? bb.inst.size()
                                                            : call_index[j + 1];
@@ -684,6 +543,9 @@ class Memory_Var_Propagation : public backend::MirOptimizePass {
               }
             }
           }
+          for (auto& [dest, value] : load) {
+            if (value.index() == 1) copied[dest] = std::get<1>(value);
+          }
           // replace
           index = 0;
           for (auto& inst : bb.inst) {
@@ -812,10 +674,13 @@ class Memory_Var_Propagation : public backend::MirOptimizePass {
             index++;
           }
         }
-        // delete load
-        for (int i = del_index.size() - 1; i >= 0; i--) {
-          auto iter = bit->second.inst.begin() + del_index[i];
-          bit->second.inst.erase(iter);
+        // The loaded value may be used past the end of the segment, so the
+        // load becomes a copy instead of going away
+        for (auto i : del_index) {
+          auto& inst = bit->second.inst[i];
+          auto val = copied.at(inst->dest);
+          func.variables.at(val.id).is_temp_var = false;
+          inst = std::make_unique<mir::inst::AssignInst>(inst->dest, val);
         }
       }
     }
@@ -823,17 +688,17 @@ class Memory_Var_Propagation : public backend::MirOptimizePass {
 
   void optimize_mir(mir::inst::MirPackage& package,
                     std::map<std::string, std::any>& extra_data_repo) {
-    for (auto iter = package.functions.begin(); iter != package.functions.end();
-         ++iter) {
-      if (check_effect(iter->second)) {
-        unaffected_call.insert(iter->first);
+    // Calls leave memory facts alone when the callee touches no memory
+    unaffected_call.clear();
+    for (auto& [name, summary] : side_effects::summarize(package)) {
+      if (!summary.reads_memory() && !summary.writes_memory()) {
+        unaffected_call.insert(name);
       }
     }
     for (auto iter = package.functions.begin(); iter != package.functions.end();
          ++iter) {
       if (aftercast) {
         optimize_func1(iter->second, package);
-        delete_store2(iter->second);
       } else {
         optimize_func(iter->second);
       }
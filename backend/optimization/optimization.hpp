@@ -1,8 +1,18 @@
 #pragma once
 
+#include <algorithm>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <set>
 #include <string>
 #include <unordered_map>
+#include <variant>
+#include <vector>
 
+#include "../../include/aixlog.hpp"
+#include "../../mir/def_use.hpp"
+#include "../../mir/loop.hpp"
 #include "../backend.hpp"
 
 namespace optimization {
@@ -26,4 +36,336 @@ const std::string MIR_VARIABLE_TO_ARM_VREG_DATA_NAME = "mir_variable_to_vreg";
 using MirVariableToArmVRegType =
     std::unordered_map<std::string, std::map<mir::inst::VarId, arm::Reg>>;
 
+const std::string VECTOR_COLOR_DATA_NAME = "vector_color";
+
+/// Index into `arm::VECTOR_REGS` of every vector variable
+using VectorColorType =
+    std::unordered_map<std::string, std::map<mir::inst::VarId, int>>;
+
+const std::string LOOP_FOREST_DATA_NAME = "loop_forest";
+
+using LoopForestType =
+    std::unordered_map<std::string, std::shared_ptr<mir::inst::LoopForest>>;
+
+/// Loop nesting forest of `func`. The forest is cached in `extra_data_repo`
+/// and rebuilt only when the CFG of `func` changed since, so the returned
+/// reference must not be kept across CFG edits.
+inline const mir::inst::LoopForest& get_loop_forest(
+    std::map<std::string, std::any>& extra_data_repo,
+    mir::inst::MirFunction& func) {
+  auto it = extra_data_repo.find(LOOP_FOREST_DATA_NAME);
+  if (it == extra_data_repo.end()) {
+    it = extra_data_repo.insert({LOOP_FOREST_DATA_NAME, LoopForestType()})
+             .first;
+  }
+  auto& forests = std::any_cast<LoopForestType&>(it->second);
+  auto& forest = forests[func.name];
+  if (!forest || !forest->is_up_to_date(func)) {
+    forest = std::make_shared<mir::inst::LoopForest>(func);
+  }
+  return *forest;
+}
+
+/// Whether the operands of `op` can be swapped
+inline bool is_commutative(mir::inst::Op op) {
+  using mir::inst::Op;
+  return op == Op::Add || op == Op::Mul || op == Op::MulSh || op == Op::And ||
+         op == Op::Or || op == Op::Xor || op == Op::Eq || op == Op::Neq;
+}
+
+/// Library functions that neither read nor write memory the program uses
+const std::set<std::string> NO_MEMORY_CALLS = {
+    "getint",    "getch",    "putint",          "putch",
+    "starttime", "stoptime", "_sysy_starttime", "_sysy_stoptime"};
+
+/// Library functions that never write memory the program can read back
+const std::set<std::string> PURE_MEMORY_CALLS = {
+    "getint",   "getch",     "putint",   "putch",
+    "putarray", "putf",      "printf",   "starttime",
+    "stoptime", "_sysy_starttime", "_sysy_stoptime"};
+
+/// The object a pointer points into: a local array, a global, or unknown
+/// (parameters and anything computed in a way we don't follow)
+using MemObject = std::variant<std::monostate, mir::inst::VarId, std::string>;
+
+/// Follows copies, pointer offsets and pointer arithmetic back from `ptr` to
+/// the pointer they start from
+inline mir::inst::VarId base_pointer(mir::inst::MirFunction& func,
+                                     mir::inst::VarId ptr) {
+  auto is_ptr = [&](mir::inst::Value& v) {
+    auto var = v.get_if<mir::inst::VarId>();
+    if (var == nullptr || v.has_shift()) return false;
+    auto it = func.variables.find(var->id);
+    return it != func.variables.end() &&
+           it->second.ty->kind() == mir::types::TyKind::Ptr;
+  };
+  auto& du = func.def_use();
+  for (int step = 0; step < 64; step++) {
+    auto def = du.def_of(ptr);
+    if (auto x = dynamic_cast<mir::inst::PtrOffsetInst*>(def)) {
+      ptr = x->ptr;
+    } else if (auto x = dynamic_cast<mir::inst::AssignInst*>(def);
+               x && x->src.get_if<mir::inst::VarId>()) {
+      ptr = *x->src.get_if<mir::inst::VarId>();
+    } else if (auto x = dynamic_cast<mir::inst::OpInst*>(def);
+               x && x->op == mir::inst::Op::Add && is_ptr(x->lhs)) {
+      ptr = *x->lhs.get_if<mir::inst::VarId>();
+    } else if (auto x = dynamic_cast<mir::inst::OpInst*>(def);
+               x && x->op == mir::inst::Op::Add && is_ptr(x->rhs)) {
+      ptr = *x->rhs.get_if<mir::inst::VarId>();
+    } else {
+      break;
+    }
+  }
+  return ptr;
+}
+
+/// Whether `var` is one of the parameters of `func`
+inline bool is_parameter(mir::inst::MirFunction& func, mir::inst::VarId var) {
+  return var.id >= 1 && var.id <= func.type->params.size() &&
+         func.def_use().def_count(var) == 0;
+}
+
+/// Follows `base_pointer` and `&` back to the object `ptr` points into
+inline MemObject object_of(mir::inst::MirFunction& func,
+                           mir::inst::VarId ptr) {
+  auto& du = func.def_use();
+  ptr = base_pointer(func, ptr);
+  auto def = du.def_of(ptr);
+  if (def == nullptr) {
+    auto var = func.variables.find(ptr);
+    if (du.def_count(ptr) == 0 && var != func.variables.end() &&
+        var->second.is_memory_var) {
+      return ptr;
+    }
+    return std::monostate();
+  }
+  if (auto x = dynamic_cast<mir::inst::RefInst*>(def)) {
+    if (auto var = std::get_if<mir::inst::VarId>(&x->val)) return *var;
+    return std::get<std::string>(x->val);
+  }
+  return std::monostate();
+}
+
+/// Whether `guard` branches to `header` exactly when the first iteration of
+/// the loop passes the exit test, so that the loop body runs for every value
+/// the induction variable takes before failing it
+inline bool tests_first_iteration(mir::inst::MirFunction& func,
+                                  mir::types::LabelId guard,
+                                  mir::types::LabelId header,
+                                  const mir::inst::TripCount& trip) {
+  auto& jump = func.basic_blks.at(guard).jump;
+  if (jump.kind != mir::inst::JumpInstructionKind::BrCond ||
+      jump.bb_true != header) {
+    return false;
+  }
+  auto& du = func.def_use();
+  auto cmp = dynamic_cast<mir::inst::OpInst*>(du.def_of(*jump.cond_or_ret));
+  if (cmp == nullptr) return false;
+  // Looks through copies
+  auto resolve = [&](mir::inst::Value v) {
+    while (!v.is_immediate() && !v.has_shift()) {
+      auto assign = dynamic_cast<mir::inst::AssignInst*>(
+          du.def_of(std::get<mir::inst::VarId>(v)));
+      if (assign == nullptr) break;
+      v = assign->src;
+    }
+    return v;
+  };
+  auto same = [&](const mir::inst::Value& a, const mir::inst::Value& b) {
+    auto x = resolve(a), y = resolve(b);
+    if (x.has_shift() || y.has_shift()) return false;
+    return static_cast<const std::variant<int32_t, mir::inst::VarId>&>(x) ==
+           static_cast<const std::variant<int32_t, mir::inst::VarId>&>(y);
+  };
+  if (cmp->op == trip.cmp) {
+    return same(cmp->lhs, trip.init) && same(cmp->rhs, trip.bound);
+  }
+  return cmp->op == mir::inst::swap_cmp(trip.cmp) &&
+         same(cmp->rhs, trip.init) && same(cmp->lhs, trip.bound);
+}
+
+/// Block ids at and above this one are reserved for the exit block
+const mir::types::LabelId MAX_BLOCK_ID = 1048576;
+
+/// Colors `Graph_Color` hands out to variables living across blocks. Loop
+/// passes keep the values live across a loop within it, since loops needing
+/// more already spill.
+const size_t REGISTER_BUDGET = 7;
+
+/// Puts a new block between the header of `loop` and the blocks entering it,
+/// returns its id. Phis in the header are left as they are, their operands
+/// now flow in through the new block.
+inline mir::types::LabelId make_preheader(mir::inst::MirFunction& func,
+                                          const mir::inst::Loop& loop) {
+  mir::types::LabelId id = 0;
+  for (auto& [blk_id, blk] : func.basic_blks) {
+    if (blk_id < MAX_BLOCK_ID) id = std::max(id, blk_id);
+  }
+  id++;
+
+  auto& header = func.basic_blks.at(loop.header);
+  auto& blk =
+      func.basic_blks.insert({id, mir::inst::BasicBlk(id)}).first->second;
+  blk.jump = mir::inst::JumpInstruction(mir::inst::JumpInstructionKind::Br,
+                                        loop.header);
+  for (auto pred : loop.entering) {
+    auto& from = func.basic_blks.at(pred);
+    if (from.jump.bb_true == loop.header) from.jump.bb_true = id;
+    if (from.jump.bb_false == loop.header) from.jump.bb_false = id;
+    header.preceding.erase(pred);
+    blk.preceding.insert(pred);
+  }
+  header.preceding.insert(id);
+  return id;
+}
+
+/// Puts a new block on the edge from `from` to `to`, returns its id. Phis in
+/// `to` are left as they are, the operand from `from` now flows in through
+/// the new block.
+inline mir::types::LabelId split_edge(mir::inst::MirFunction& func,
+                                      mir::types::LabelId from,
+                                      mir::types::LabelId to) {
+  mir::types::LabelId id = 0;
+  for (auto& [blk_id, blk] : func.basic_blks) {
+    if (blk_id < MAX_BLOCK_ID) id = std::max(id, blk_id);
+  }
+  id++;
+
+  auto& blk =
+      func.basic_blks.insert({id, mir::inst::BasicBlk(id)}).first->second;
+  blk.jump = mir::inst::JumpInstruction(mir::inst::JumpInstructionKind::Br, to);
+  auto& pred = func.basic_blks.at(from);
+  if (pred.jump.bb_true == to) pred.jump.bb_true = id;
+  if (pred.jump.bb_false == to) pred.jump.bb_false = id;
+  blk.preceding.insert(from);
+  auto& succ = func.basic_blks.at(to);
+  succ.preceding.erase(from);
+  succ.preceding.insert(id);
+  return id;
+}
+
+/// Drops the blocks no path from the entry reaches, except the exit block,
+/// and rebuilds the predecessors of every other one. Phi operands defined in
+/// the dropped blocks go too, and a phi left with a single operand that way
+/// is replaced by it. Returns whether any block was dropped.
+inline bool remove_unreachable_blocks(mir::inst::MirFunction& func) {
+  std::set<mir::types::LabelId> reached;
+  std::vector<mir::types::LabelId> stack{func.basic_blks.begin()->first};
+  reached.insert(stack.back());
+  while (!stack.empty()) {
+    auto id = stack.back();
+    stack.pop_back();
+    for (auto succ : mir::inst::successors(func.basic_blks.at(id))) {
+      if (func.basic_blks.count(succ) && reached.insert(succ).second) {
+        stack.push_back(succ);
+      }
+    }
+  }
+  std::set<mir::inst::VarId> dropped;
+  bool erased = false;
+  for (auto it = func.basic_blks.begin(); it != func.basic_blks.end();) {
+    if (reached.count(it->first) || it->first >= MAX_BLOCK_ID) {
+      it++;
+      continue;
+    }
+    erased = true;
+    for (auto& inst : it->second.inst) {
+      if (inst->inst_kind() != mir::inst::InstKind::Store) {
+        dropped.insert(inst->dest);
+      }
+    }
+    it = func.basic_blks.erase(it);
+  }
+
+  // A phi left with a single operand is that operand
+  std::map<mir::inst::VarId, mir::inst::VarId> replaced;
+  for (auto& [id, blk] : func.basic_blks) {
+    blk.preceding.clear();
+    for (auto it = blk.inst.begin(); it != blk.inst.end();) {
+      auto phi = dynamic_cast<mir::inst::PhiInst*>(it->get());
+      if (phi == nullptr) {
+        it++;
+        continue;
+      }
+      auto end = std::remove_if(phi->vars.begin(), phi->vars.end(),
+                                [&](auto var) { return dropped.count(var); });
+      bool shrunk = end != phi->vars.end();
+      phi->vars.erase(end, phi->vars.end());
+      if (shrunk && phi->vars.size() == 1) {
+        replaced.insert({phi->dest, phi->vars[0]});
+        it = blk.inst.erase(it);
+      } else {
+        it++;
+      }
+    }
+  }
+  auto resolve = [&](mir::inst::VarId var) {
+    while (replaced.count(var)) var = replaced.at(var);
+    return var;
+  };
+  for (auto& [id, blk] : func.basic_blks) {
+    for (auto& inst : blk.inst) {
+      if (auto phi = dynamic_cast<mir::inst::PhiInst*>(inst.get())) {
+        for (auto& var : phi->vars) var = resolve(var);
+        continue;
+      }
+      for (auto var : inst->useVars()) {
+        if (replaced.count(var)) inst->replace(var, resolve(var));
+      }
+    }
+    if (blk.jump.cond_or_ret) {
+      blk.jump.cond_or_ret = resolve(*blk.jump.cond_or_ret);
+    }
+    for (auto succ : mir::inst::successors(blk)) {
+      auto it = func.basic_blks.find(succ);
+      if (it != func.basic_blks.end()) it->second.preceding.insert(id);
+    }
+  }
+  func.invalidate_def_use();
+  return erased;
+}
+
+/// Instructions of `func`, counting the jump ending each block
+inline int32_t size_of(const mir::inst::MirFunction& func) {
+  int32_t size = 0;
+  for (auto& [id, blk] : func.basic_blks) {
+    size += 1;
+    for (auto& inst : blk.inst) {
+      if (inst->inst_kind() != mir::inst::InstKind::Phi) size++;
+    }
+  }
+  return size;
+}
+
+/// Drops the functions no chain of calls from `main` reaches, except extern
+/// ones, logging each under the name of `pass`
+inline void remove_uncalled_functions(mir::inst::MirPackage& package,
+                                      const std::string& pass) {
+  std::set<std::string> reached{"main"};
+  std::vector<std::string> stack{"main"};
+  while (!stack.empty()) {
+    auto it = package.functions.find(stack.back());
+    stack.pop_back();
+    if (it == package.functions.end()) continue;
+    for (auto& [id, blk] : it->second.basic_blks) {
+      for (auto& inst : blk.inst) {
+        auto call = dynamic_cast<mir::inst::CallInst*>(inst.get());
+        if (call && reached.insert(call->func).second) {
+          stack.push_back(call->func);
+        }
+      }
+    }
+  }
+  for (auto it = package.functions.begin(); it != package.functions.end();) {
+    if (!it->second.type->is_extern && !reached.count(it->first)) {
+      LOG(TRACE) << pass << ": " << it->first << " removed, no calls left"
+                 << std::endl;
+      it = package.functions.erase(it);
+    } else {
+      it++;
+    }
+  }
+}
+
 }  // namespace optimization
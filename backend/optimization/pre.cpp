@@ -0,0 +1,297 @@
+#include "./pre.hpp"
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <optional>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "../../include/aixlog.hpp"
+#include "../../mir/def_use.hpp"
+#include "../../mir/loop.hpp"
+#include "optimization.hpp"
+#include "strength_reduction.hpp"
+
+namespace optimization::pre {
+
+void PRE::optimize_mir(mir::inst::MirPackage& mir,
+                       std::map<std::string, std::any>& extra_data_repo) {
+  for (auto& f : mir.functions) {
+    if (f.second.type->is_extern) continue;
+    optimize_func(f.second, extra_data_repo);
+  }
+}
+
+namespace {
+
+/// An expression with its operands in a fixed order
+using Key = std::vector<int64_t>;
+
+class Motion {
+ public:
+  Motion(mir::inst::MirFunction& func) : func(func), dom(func) {
+    auto& du = func.def_use();
+    for (auto& [id, blk] : func.basic_blks) {
+      for (auto& inst : blk.inst) {
+        if (auto phi = dynamic_cast<mir::inst::PhiInst*>(inst.get())) {
+          for (auto var : phi->vars) webs[web_of(var)] = web_of(phi->dest);
+        }
+        if (inst->inst_kind() == mir::inst::InstKind::Store) continue;
+        auto var = func.variables.find(inst->dest.id);
+        if (var != func.variables.end() && !var->second.is_phi_var &&
+            du.def_count(inst->dest) == 1) {
+          stable.insert(inst->dest);
+          def_blk.insert({inst->dest, id});
+        }
+      }
+      if (blk.jump.cond_or_ret) conditions.insert(*blk.jump.cond_or_ret);
+    }
+
+    for (auto& [id, blk] : func.basic_blks) {
+      // A variable of a phi web holds its value up to the next definition
+      // in the web, so expressions on one are only known at the end of the
+      // block computing them, and only if nothing redefines the web after
+      std::set<mir::inst::VarId> redefined;
+      for (auto it = blk.inst.rbegin(); it != blk.inst.rend(); it++) {
+        auto& inst = **it;
+        if (inst.inst_kind() == mir::inst::InstKind::Store) continue;
+        auto dest = inst.dest;
+        auto key = key_of(inst);
+        auto operands = operand_webs(inst);
+        bool intact = key.has_value();
+        for (auto web : operands) intact &= !redefined.count(web);
+        if (stable.count(dest) && key && operands.empty()) {
+          available[*key].push_back(dest);
+        } else if (intact && (stable.count(dest) ||
+                              (in_web(dest) && !redefined.count(web_of(dest)) &&
+                               du.def_count(dest) == 1))) {
+          at_exit[id].insert({*key, dest});
+        }
+        if (in_web(dest)) redefined.insert(web_of(dest));
+      }
+    }
+  }
+
+  /// Moves partially redundant expressions up into the blocks entering
+  /// joins. Returns the number of expressions moved
+  size_t run() {
+    for (auto id : dom.reverse_postorder()) {
+      auto& blk = func.basic_blks.at(id);
+      std::vector<mir::types::LabelId> preds(blk.preceding.begin(),
+                                             blk.preceding.end());
+      if (preds.size() < 2) continue;
+      bool is_header = false;
+      for (auto pred : preds) is_header |= dom.dominates(id, pred);
+      if (is_header) continue;
+
+      std::map<mir::types::LabelId, mir::types::LabelId> edges;
+      for (size_t i = 0; i < blk.inst.size(); i++) {
+        if (move(blk, i, preds, edges)) i++;
+      }
+    }
+    func.invalidate_def_use();
+    return moved;
+  }
+
+ private:
+  /// Whether `var` belongs to a phi web, whose register every definition in
+  /// the web overwrites
+  bool in_web(mir::inst::VarId var) {
+    auto it = func.variables.find(var.id);
+    return it != func.variables.end() && it->second.is_phi_var;
+  }
+
+  /// Values defined once, and variables of phi webs
+  bool is_operand(mir::inst::Value& val) {
+    auto var = val.get_if<mir::inst::VarId>();
+    return !var || stable.count(*var) || in_web(*var);
+  }
+
+  std::vector<mir::inst::VarId> operand_webs(mir::inst::Inst& inst) {
+    std::vector<mir::inst::VarId> operands;
+    for (auto var : inst.useVars()) {
+      if (in_web(var)) operands.push_back(web_of(var));
+    }
+    return operands;
+  }
+
+  mir::inst::VarId web_of(mir::inst::VarId var) {
+    auto it = webs.find(var);
+    if (it == webs.end() || it->second == var) return var;
+    return it->second = web_of(it->second);
+  }
+
+  void push_value(Key& key, mir::inst::Value& val) {
+    if (auto imm = val.get_if<int32_t>()) {
+      key.insert(key.end(), {0, int64_t(*imm)});
+    } else {
+      key.insert(key.end(), {1, val.get_if<mir::inst::VarId>()->id,
+                             int64_t(val.shift),
+                             val.has_shift() ? val.shift_amount : 0});
+    }
+  }
+
+  std::optional<Key> key_of(mir::inst::Inst& inst) {
+    auto x = dynamic_cast<mir::inst::OpInst*>(&inst);
+    if (!x || !is_operand(x->lhs) || !is_operand(x->rhs)) return std::nullopt;
+    auto ty = func.variables.at(inst.dest.id).ty;
+    if (!ty) return std::nullopt;
+    auto op = x->op;
+    Key lhs, rhs;
+    push_value(lhs, x->lhs);
+    push_value(rhs, x->rhs);
+    if (rhs < lhs && is_commutative(op)) std::swap(lhs, rhs);
+    if (rhs < lhs && (op == mir::inst::Op::Lt || op == mir::inst::Op::Gt ||
+                      op == mir::inst::Op::Lte || op == mir::inst::Op::Gte)) {
+      std::swap(lhs, rhs);
+      op = mir::inst::swap_cmp(op);
+    }
+    Key key = {int64_t(op)};
+    key.insert(key.end(), lhs.begin(), lhs.end());
+    key.insert(key.end(), rhs.begin(), rhs.end());
+    key.push_back(int64_t(ty->kind()));
+    return key;
+  }
+
+  /// A variable holding `key` at the end of `blk`
+  std::optional<mir::inst::VarId> available_at(const Key& key,
+                                               mir::types::LabelId blk) {
+    auto it = available.find(key);
+    if (it != available.end()) {
+      for (auto var : it->second) {
+        if (dom.dominates(def_blk.at(var), blk)) return var;
+      }
+    }
+    auto exit = at_exit.find(blk);
+    if (exit == at_exit.end()) return std::nullopt;
+    auto var = exit->second.find(key);
+    if (var == exit->second.end()) return std::nullopt;
+    return var->second;
+  }
+
+  /// Whether the operands of the `i`th instruction of `blk` hold the same
+  /// values at the end of every block entering it
+  bool operands_ready(mir::inst::BasicBlk& blk, size_t i) {
+    for (auto var : blk.inst[i]->useVars()) {
+      if (in_web(var)) {
+        auto web = web_of(var);
+        for (size_t j = 0; j < i; j++) {
+          auto& inst = *blk.inst[j];
+          if (inst.inst_kind() != mir::inst::InstKind::Store &&
+              in_web(inst.dest) && web_of(inst.dest) == web) {
+            return false;
+          }
+        }
+        continue;
+      }
+      auto it = def_blk.find(var);
+      if (it == def_blk.end()) continue;
+      if (it->second == blk.id || !dom.dominates(it->second, blk.id)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  /// The block computations on the edge from `pred` into `blk` go in
+  mir::inst::BasicBlk& edge_block(
+      mir::types::LabelId pred, mir::types::LabelId blk,
+      std::map<mir::types::LabelId, mir::types::LabelId>& edges) {
+    if (func.basic_blks.at(pred).jump.kind ==
+        mir::inst::JumpInstructionKind::Br) {
+      return func.basic_blks.at(pred);
+    }
+    auto it = edges.find(pred);
+    if (it == edges.end()) {
+      it = edges.insert({pred, split_edge(func, pred, blk)}).first;
+    }
+    return func.basic_blks.at(it->second);
+  }
+
+  /// Moves the `i`th instruction of `blk` into the blocks entering it if it
+  /// is partially redundant there. Returns whether it was moved, which puts
+  /// a phi in front of it
+  bool move(mir::inst::BasicBlk& blk, size_t i,
+            const std::vector<mir::types::LabelId>& preds,
+            std::map<mir::types::LabelId, mir::types::LabelId>& edges) {
+    auto& inst = *blk.inst[i];
+    auto dest = inst.dest;
+    if (!stable.count(dest) || conditions.count(dest)) return false;
+    auto key = key_of(inst);
+    if (!key || !operands_ready(blk, i)) return false;
+    // Fully redundant ones are left to GVN
+    if (available_at(*key, *dom.idom(blk.id))) return false;
+
+    // A copy costs about what a cheap operation does, and a block on an
+    // edge costs a jump, which only a division by a variable makes up for
+    auto op = dynamic_cast<mir::inst::OpInst&>(inst).op;
+    if (op != mir::inst::Op::Mul && op != mir::inst::Op::MulSh &&
+        op != mir::inst::Op::Div && op != mir::inst::Op::Rem) {
+      return false;
+    }
+    bool splits = (op == mir::inst::Op::Div || op == mir::inst::Op::Rem) &&
+                  !dynamic_cast<mir::inst::OpInst&>(inst).rhs.is_immediate();
+
+    std::vector<std::optional<mir::inst::VarId>> values;
+    bool redundant = false;
+    for (auto pred : preds) {
+      // Edges out of loop branches stay as the loop passes know them
+      auto& jump = func.basic_blks.at(pred).jump;
+      if (jump.kind != mir::inst::JumpInstructionKind::Br &&
+          (!splits || jump.jump_kind == mir::inst::JumpKind::Loop)) {
+        return false;
+      }
+      values.push_back(available_at(*key, pred));
+      redundant |= values.back().has_value();
+    }
+    if (!redundant) return false;
+
+    auto ty = func.variables.at(dest.id).ty;
+    std::vector<mir::inst::VarId> incoming;
+    for (size_t p = 0; p < preds.size(); p++) {
+      auto& at = edge_block(preds[p], blk.id, edges);
+      auto var = strength_reduction::new_var(func, ty, true);
+      if (values[p]) {
+        at.inst.push_back(std::make_unique<mir::inst::AssignInst>(
+            var, mir::inst::Value(*values[p])));
+      } else {
+        auto copy = std::unique_ptr<mir::inst::Inst>(inst.deep_copy());
+        copy->dest = var;
+        at.inst.push_back(std::move(copy));
+      }
+      incoming.push_back(var);
+    }
+    auto merged = strength_reduction::new_var(func, ty, true);
+    blk.inst[i] = std::make_unique<mir::inst::AssignInst>(
+        dest, mir::inst::Value(merged));
+    blk.inst.insert(blk.inst.begin(),
+                    std::make_unique<mir::inst::PhiInst>(merged, incoming));
+    moved++;
+    return true;
+  }
+
+  mir::inst::MirFunction& func;
+  mir::inst::DominatorTree dom;
+  std::set<mir::inst::VarId> stable;
+  std::set<mir::inst::VarId> conditions;
+  std::map<mir::inst::VarId, mir::types::LabelId> def_blk;
+  std::map<mir::inst::VarId, mir::inst::VarId> webs;
+  std::map<Key, std::vector<mir::inst::VarId>> available;
+  std::map<mir::types::LabelId, std::map<Key, mir::inst::VarId>> at_exit;
+  size_t moved = 0;
+};
+
+}  // namespace
+
+void PRE::optimize_func(mir::inst::MirFunction& func,
+                        std::map<std::string, std::any>& extra_data_repo) {
+  auto moved = Motion(func).run();
+  if (moved == 0) return;
+  auto remark = func.name + ": " + std::to_string(moved) + " moved";
+  LOG(TRACE) << "pre: " << remark << std::endl;
+  backend::report_statistic(extra_data_repo, pass_name(), remark);
+}
+
+}  // namespace optimization::pre
@@ -0,0 +1,40 @@
+#pragma once
+
+#include "../../mir/mir.hpp"
+#include "../backend.hpp"
+
+namespace optimization::pre {
+
+/// Partial redundancy elimination at joins.
+///
+/// An expression computed in a block entered from several places is
+/// partially redundant when some of the blocks entering it have already
+/// computed it. Those pass the value they have along, the others compute it
+/// at their end, and a phi in the join takes over from the computation
+/// there. Every block entering the join then either computes the expression
+/// or leaves it to the join, which would have computed it anyway, so no path
+/// runs it more often than before. A block entering by a branch that also
+/// goes elsewhere gets a block of its own on the edge to compute it in, so
+/// the other way stays as it was.
+///
+/// This is lazy code motion with insertions kept to the edges into the
+/// join, the latest place they can go, which keeps registers free for
+/// longest. A copy costs about what a cheap operation does and a block of
+/// its own costs a jump, so only multiplications and divisions move, and
+/// only divisions by a variable get blocks on edges. Variables of phi webs
+/// keep their value until the web is defined again, so expressions on them
+/// are only taken from the end of the block entering the join that computes
+/// them. Loop headers are left to LICM. Every function changed gets a remark
+/// in the pass statistics.
+class PRE final : public backend::MirOptimizePass {
+ public:
+  std::string pass_name() const override { return "PRE"; }
+  void optimize_mir(mir::inst::MirPackage &mir,
+                    std::map<std::string, std::any> &extra_data_repo) override;
+
+ private:
+  void optimize_func(mir::inst::MirFunction &func,
+                     std::map<std::string, std::any> &extra_data_repo);
+};
+
+}  // namespace optimization::pre
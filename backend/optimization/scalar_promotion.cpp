@@ -0,0 +1,483 @@
+#include "./scalar_promotion.hpp"
+
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <optional>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "../../include/aixlog.hpp"
+#include "../../mir/def_use.hpp"
+#include "dependence.hpp"
+#include "optimization.hpp"
+#include "strength_reduction.hpp"
+
+namespace optimization::scalar_promotion {
+
+/// Most words kept in registers across one loop
+const size_t MAX_PROMOTED = 4;
+
+void Scalar_Promotion::optimize_mir(
+    mir::inst::MirPackage& mir,
+    std::map<std::string, std::any>& extra_data_repo) {
+  for (auto& f : mir.functions) {
+    if (f.second.type->is_extern) continue;
+    optimize_func(f.second, extra_data_repo);
+  }
+}
+
+namespace {
+
+/// A word accessed through a loop-invariant address
+struct Location {
+  strength_reduction::Affine addr;
+  std::vector<mir::inst::Inst*> accesses;
+  bool stored = false;
+  /// Points at the word, computed in the preheader
+  mir::inst::VarId ptr;
+  /// Variables holding the value of the word at the start of blocks, and at
+  /// the end of the blocks storing to it
+  std::map<mir::types::LabelId, mir::inst::VarId> entry, last_def;
+  /// Position of its phi in the header among `Promotion::phis`
+  size_t header_phi;
+};
+
+/// A phi merging the values a word holds at the end of `incoming` blocks
+struct NewPhi {
+  mir::types::LabelId blk;
+  mir::inst::VarId dest;
+  std::vector<std::pair<mir::types::LabelId, mir::inst::VarId>> incoming;
+};
+
+bool same_address(const strength_reduction::Affine& a,
+                  const strength_reduction::Affine& b) {
+  return a.terms == b.terms && a.constant == b.constant;
+}
+
+class Promotion {
+ public:
+  Promotion(mir::inst::MirFunction& func, const mir::inst::LoopForest& forest,
+            const mir::inst::Loop& loop)
+      : func(func), forest(forest), loop(loop) {}
+
+  /// Picks the words to promote, returns why there are none otherwise
+  std::optional<std::string> analyze() {
+    std::vector<std::pair<mir::types::LabelId, mir::inst::Inst*>> mem;
+    std::set<mir::inst::VarId> phis;
+    for (auto id : loop.blocks) {
+      auto& blk = func.basic_blks.at(id);
+      if (blk.jump.kind != mir::inst::JumpInstructionKind::Br &&
+          blk.jump.kind != mir::inst::JumpInstructionKind::BrCond) {
+        return "leaves the function";
+      }
+      for (auto& inst : blk.inst) {
+        if (auto x = dynamic_cast<mir::inst::CallInst*>(inst.get())) {
+          if (!NO_MEMORY_CALLS.count(x->func)) return "calls " + x->func;
+        } else if (auto x = dynamic_cast<mir::inst::PhiInst*>(inst.get())) {
+          phis.insert(x->dest);
+        } else if (inst->inst_kind() == mir::inst::InstKind::Load ||
+                   inst->inst_kind() == mir::inst::InstKind::Store) {
+          mem.push_back({id, inst.get()});
+        }
+      }
+    }
+
+    // Addresses with the phis of the loop as leaves, for telling accesses
+    // apart, and those not depending on the loop at all
+    std::map<mir::inst::Inst*, dependence::MemAccess> accesses;
+    for (auto [id, inst] : mem) {
+      auto addr = dependence::address_in_loop(func, loop, phis, inst);
+      if (!addr) continue;
+      bool is_store = inst->inst_kind() == mir::inst::InstKind::Store;
+      accesses.insert({inst, {inst, is_store, *addr}});
+      auto invariant = dependence::address_in_loop(func, loop, {}, inst);
+      if (!invariant) continue;
+      auto it = std::find_if(
+          locations.begin(), locations.end(),
+          [&](auto& loc) { return same_address(loc.addr, *invariant); });
+      if (it == locations.end()) {
+        it = locations.insert(
+            locations.end(),
+            Location{*invariant, {}, false, mir::inst::VarId(), {}, {}, 0});
+      }
+      it->accesses.push_back(inst);
+      it->stored |= is_store;
+    }
+
+    // The word must be touched on every way out, and by nothing else
+    auto& dom = forest.dom_tree();
+    auto exiting = loop.exiting_blocks();
+    std::map<mir::inst::Inst*, mir::types::LabelId> block_of;
+    for (auto [id, inst] : mem) block_of.insert({inst, id});
+    auto always_accessed = [&](const Location& loc) {
+      return std::any_of(
+          loc.accesses.begin(), loc.accesses.end(), [&](auto inst) {
+            return std::all_of(exiting.begin(), exiting.end(), [&](auto e) {
+              return dom.dominates(block_of.at(inst), e);
+            });
+          });
+    };
+    auto disjoint = [&](const Location& loc) {
+      dependence::MemAccess word{nullptr, true, loc.addr};
+      for (auto [id, inst] : mem) {
+        if (std::count(loc.accesses.begin(), loc.accesses.end(), inst)) {
+          continue;
+        }
+        auto other = accesses.find(inst);
+        if (other == accesses.end() ||
+            !dependence::test(func, word, other->second, {}).empty()) {
+          return false;
+        }
+      }
+      return true;
+    };
+    auto has_pointer = [&](const Location& loc) {
+      return std::any_of(
+          loc.addr.terms.begin(), loc.addr.terms.end(), [&](auto& term) {
+            return term.second == 1 &&
+                   func.variables.at(term.first.id).ty->kind() ==
+                       mir::types::TyKind::Ptr;
+          });
+    };
+    locations.erase(
+        std::remove_if(locations.begin(), locations.end(),
+                       [&](auto& loc) {
+                         return !loc.stored || !has_pointer(loc) ||
+                                !always_accessed(loc) || !disjoint(loc);
+                       }),
+        locations.end());
+    if (locations.empty()) return "nothing to promote";
+
+    // Each promoted word takes a register across the whole loop, including
+    // the loops nested in it. Register pressure is already tight in most
+    // loops, so that register has to come from its address.
+    std::stable_sort(locations.begin(), locations.end(),
+                     [](auto& a, auto& b) {
+                       return a.accesses.size() > b.accesses.size();
+                     });
+    std::vector<Location> picked;
+    for (auto& loc : locations) {
+      if (picked.size() == MAX_PROMOTED || freed_registers(loc) == 0) {
+        continue;
+      }
+      picked.push_back(loc);
+    }
+    locations = std::move(picked);
+    if (locations.empty()) return "no registers left";
+    return std::nullopt;
+  }
+
+  void promote() {
+    phi_vars.clear();
+    for (auto& [id, blk] : func.basic_blks) {
+      for (auto& inst : blk.inst) {
+        if (auto x = dynamic_cast<mir::inst::PhiInst*>(inst.get())) {
+          phi_vars.insert(x->dest);
+          phi_vars.insert(x->vars.begin(), x->vars.end());
+        }
+      }
+    }
+    std::set<std::pair<mir::types::LabelId, mir::types::LabelId>> exits(
+        loop.exits.begin(), loop.exits.end());
+    auto preheader_id =
+        loop.preheader ? *loop.preheader : make_preheader(func, loop);
+    func.invalidate_def_use();
+
+    auto& preheader = func.basic_blks.at(preheader_id);
+    std::map<mir::inst::Inst*, Location*> location_of;
+    for (auto& loc : locations) {
+      mir::types::SharedTyPtr ptr_ty = int_ty;
+      for (auto [var, coef] : loc.addr.terms) {
+        auto ty = func.variables.at(var.id).ty;
+        if (coef == 1 && ty->kind() == mir::types::TyKind::Ptr) ptr_ty = ty;
+      }
+      loc.ptr = strength_reduction::new_var(func, ptr_ty, false);
+      strength_reduction::emit_affine(func, preheader, loc.addr, loc.ptr);
+      auto init = strength_reduction::new_var(func, int_ty, true);
+      func.def_use().insert_inst(
+          preheader, preheader.inst.end(),
+          std::make_unique<mir::inst::LoadInst>(loc.ptr, init));
+      auto value = strength_reduction::new_var(func, int_ty, true);
+      loc.entry.insert({loop.header, value});
+      loc.header_phi = phis.size();
+      phis.push_back({loop.header, value, {{preheader_id, init}}});
+      for (auto inst : loc.accesses) location_of.insert({inst, &loc});
+    }
+
+    // Loads read the value the word holds at that point, stores set it
+    struct Pending {
+      mir::inst::AssignInst* read;
+      mir::types::LabelId blk;
+      Location* loc;
+    };
+    std::vector<Pending> pending;
+    for (auto id : loop.blocks) {
+      auto& blk = func.basic_blks.at(id);
+      std::vector<std::unique_ptr<mir::inst::Inst>> code;
+      for (auto& inst : blk.inst) {
+        auto it = location_of.find(inst.get());
+        if (it == location_of.end()) {
+          code.push_back(std::move(inst));
+          continue;
+        }
+        auto loc = it->second;
+        if (inst->inst_kind() == mir::inst::InstKind::Store) {
+          auto val = stored_value(*inst);
+          auto var = std::get_if<mir::inst::VarId>(&val);
+          // Phi webs share a register, which may be overwritten before the
+          // value is read again, so those are copied out right away
+          if (var == nullptr || val.has_shift() || phi_vars.count(*var)) {
+            auto copy = strength_reduction::new_var(func, int_ty, false);
+            code.push_back(std::make_unique<mir::inst::AssignInst>(copy, val));
+            loc->last_def[id] = copy;
+          } else {
+            loc->last_def[id] = *var;
+          }
+          continue;
+        }
+        auto copy = std::make_unique<mir::inst::AssignInst>(inst->dest, 0);
+        if (auto last = loc->last_def.find(id); last != loc->last_def.end()) {
+          copy->src = last->second;
+        } else {
+          pending.push_back({copy.get(), id, loc});
+        }
+        reads.push_back(copy.get());
+        code.push_back(std::move(copy));
+      }
+      blk.inst = std::move(code);
+    }
+    for (auto [read, id, loc] : pending) {
+      read->src = value_at_entry(*loc, id);
+    }
+    for (auto& loc : locations) {
+      for (auto latch : loop.latches) {
+        auto value = value_at_end(loc, latch);
+        phis[loc.header_phi].incoming.push_back({latch, value});
+      }
+    }
+
+    // The word is stored back on every edge leaving the loop, in a block of
+    // its own unless nothing else reaches its target
+    std::vector<mir::inst::StoreInst*> write_backs;
+    for (auto [from, to] : exits) {
+      auto& exit = func.basic_blks.at(to);
+      auto store_at = std::find_if(exit.inst.begin(), exit.inst.end(),
+                                   [](auto& inst) {
+                                     return inst->inst_kind() !=
+                                            mir::inst::InstKind::Phi;
+                                   });
+      std::vector<std::unique_ptr<mir::inst::Inst>> stores;
+      for (auto& loc : locations) {
+        auto store = std::make_unique<mir::inst::StoreInst>(
+            value_at_end(loc, from), loc.ptr);
+        write_backs.push_back(store.get());
+        stores.push_back(std::move(store));
+      }
+      if (exit.preceding.size() == 1) {
+        exit.inst.insert(store_at, std::make_move_iterator(stores.begin()),
+                         std::make_move_iterator(stores.end()));
+        continue;
+      }
+      mir::types::LabelId id = 0;
+      for (auto& [blk_id, blk] : func.basic_blks) {
+        if (blk_id < MAX_BLOCK_ID) id = std::max(id, blk_id);
+      }
+      id++;
+      auto& landing =
+          func.basic_blks.insert({id, mir::inst::BasicBlk(id)}).first->second;
+      landing.jump =
+          mir::inst::JumpInstruction(mir::inst::JumpInstructionKind::Br, to);
+      landing.inst = std::move(stores);
+      landing.preceding.insert(from);
+      exit.preceding.erase(from);
+      exit.preceding.insert(id);
+      auto& exiting = func.basic_blks.at(from);
+      if (exiting.jump.bb_true == to) exiting.jump.bb_true = id;
+      if (exiting.jump.bb_false == to) exiting.jump.bb_false = id;
+    }
+
+    // Phis merging one value with themselves only are replaced with it
+    std::map<mir::inst::VarId, mir::inst::VarId> replaced;
+    auto resolve = [&](mir::inst::VarId var) {
+      for (auto it = replaced.find(var); it != replaced.end();
+           it = replaced.find(var)) {
+        var = it->second;
+      }
+      return var;
+    };
+    bool changed = true;
+    while (changed) {
+      changed = false;
+      for (auto& phi : phis) {
+        if (replaced.count(phi.dest)) continue;
+        std::set<mir::inst::VarId> values;
+        for (auto [pred, val] : phi.incoming) values.insert(resolve(val));
+        values.erase(phi.dest);
+        if (values.size() == 1) {
+          replaced.insert({phi.dest, *values.begin()});
+          changed = true;
+        }
+      }
+    }
+
+    for (auto& phi : phis) {
+      if (replaced.count(phi.dest)) continue;
+      std::vector<mir::inst::VarId> vars;
+      for (auto [pred, val] : phi.incoming) {
+        vars.push_back(copy_at_end(pred, resolve(val)));
+      }
+      auto& blk = func.basic_blks.at(phi.blk);
+      blk.inst.insert(blk.inst.begin(),
+                      std::make_unique<mir::inst::PhiInst>(phi.dest, vars));
+    }
+    for (auto read : reads) {
+      read->src = resolve(std::get<mir::inst::VarId>(read->src));
+    }
+    for (auto store : write_backs) {
+      store->val = resolve(std::get<mir::inst::VarId>(store->val));
+    }
+    func.invalidate_def_use();
+  }
+
+  size_t promoted() const { return locations.size(); }
+
+ private:
+  /// Variables the address of `loc` is computed from that are live across
+  /// the loop for its sake only
+  size_t freed_registers(const Location& loc) {
+    auto& du = func.def_use();
+    auto& dom = forest.dom_tree();
+    std::set<mir::inst::VarId> vars;
+    for (auto inst : loc.accesses) {
+      std::vector<mir::inst::Value> operands;
+      if (auto x = dynamic_cast<mir::inst::LoadInst*>(inst)) {
+        operands = {x->src};
+      } else if (auto x = dynamic_cast<mir::inst::LoadOffsetInst*>(inst)) {
+        operands = {x->src, x->offset};
+      } else if (auto x = dynamic_cast<mir::inst::StoreOffsetInst*>(inst)) {
+        operands = {x->offset};
+      }
+      if (inst->inst_kind() == mir::inst::InstKind::Store) {
+        operands.push_back(inst->dest);
+      }
+      for (auto& val : operands) {
+        if (auto var = std::get_if<mir::inst::VarId>(&val)) vars.insert(*var);
+      }
+    }
+    size_t freed = 0;
+    for (auto var : vars) {
+      auto blk = du.def_block(var);
+      if (blk && loop.contains(*blk)) continue;
+      auto uses = du.uses_of(var);
+      if (std::all_of(uses.begin(), uses.end(), [&](auto& use) {
+            if (loop.contains(use.blk)) {
+              return std::count(loc.accesses.begin(), loc.accesses.end(),
+                                use.inst) > 0;
+            }
+            return dom.dominates(use.blk, loop.header);
+          })) {
+        freed++;
+      }
+    }
+    return freed;
+  }
+
+  static mir::inst::Value stored_value(mir::inst::Inst& inst) {
+    if (auto x = dynamic_cast<mir::inst::StoreInst*>(&inst)) return x->val;
+    return static_cast<mir::inst::StoreOffsetInst&>(inst).val;
+  }
+
+  /// A fresh phi operand holding `val`, defined last in `blk`. Codegen gives
+  /// a whole phi web one register, so existing variables are never reused.
+  /// The copy goes before the comparison the block branches on, which codegen
+  /// only fuses with the branch when nothing comes between them, unless the
+  /// comparison may read the register the copy writes.
+  mir::inst::VarId copy_at_end(mir::types::LabelId blk, mir::inst::VarId val) {
+    auto copy = strength_reduction::new_var(func, int_ty, true);
+    auto& b = func.basic_blks.at(blk);
+    auto pos = b.inst.end();
+    if (b.jump.kind == mir::inst::JumpInstructionKind::BrCond &&
+        !b.inst.empty() && b.inst.back()->dest == *b.jump.cond_or_ret &&
+        !(b.inst.back()->dest == val)) {
+      auto uses = b.inst.back()->useVars();
+      if (std::none_of(reads.begin(), reads.end(),
+                       [&](auto read) { return uses.count(read->dest); })) {
+        pos = std::prev(pos);
+      }
+    }
+    b.inst.insert(pos, std::make_unique<mir::inst::AssignInst>(copy, val));
+    return copy;
+  }
+
+  mir::inst::VarId value_at_end(Location& loc, mir::types::LabelId blk) {
+    auto it = loc.last_def.find(blk);
+    if (it != loc.last_def.end()) return it->second;
+    return value_at_entry(loc, blk);
+  }
+
+  /// Builds phis on demand, at every block with more than one predecessor.
+  /// The ones turning out to merge nothing are dropped afterwards.
+  mir::inst::VarId value_at_entry(Location& loc, mir::types::LabelId blk) {
+    if (auto it = loc.entry.find(blk); it != loc.entry.end()) {
+      return it->second;
+    }
+    auto& preds = func.basic_blks.at(blk).preceding;
+    if (preds.size() == 1) {
+      auto value = value_at_end(loc, *preds.begin());
+      loc.entry.insert({blk, value});
+      return value;
+    }
+    auto value = strength_reduction::new_var(func, int_ty, true);
+    loc.entry.insert({blk, value});
+    std::vector<std::pair<mir::types::LabelId, mir::inst::VarId>> incoming;
+    for (auto pred : preds) {
+      incoming.push_back({pred, value_at_end(loc, pred)});
+    }
+    phis.push_back({blk, value, incoming});
+    return value;
+  }
+
+  mir::inst::MirFunction& func;
+  const mir::inst::LoopForest& forest;
+  const mir::inst::Loop& loop;
+  mir::types::SharedTyPtr int_ty = mir::types::new_int_ty();
+  std::vector<Location> locations;
+  std::set<mir::inst::VarId> phi_vars;
+  std::vector<NewPhi> phis;
+  /// Copies replacing the loads
+  std::vector<mir::inst::AssignInst*> reads;
+};
+
+}  // namespace
+
+void Scalar_Promotion::optimize_func(
+    mir::inst::MirFunction& func,
+    std::map<std::string, std::any>& extra_data_repo) {
+  std::vector<mir::types::LabelId> headers;
+  {
+    auto& loops = get_loop_forest(extra_data_repo, func).loops();
+    for (auto it = loops.rbegin(); it != loops.rend(); ++it) {
+      headers.push_back(it->header);
+    }
+  }
+  // Landing blocks and preheaders rebuild the forest, so look each loop up
+  // again
+  for (auto header : headers) {
+    auto& forest = get_loop_forest(extra_data_repo, func);
+    auto loop = forest.loop_with_header(header);
+    if (loop == nullptr || loop->has_irreducible) continue;
+    Promotion promotion(func, forest, *loop);
+    auto reason = promotion.analyze();
+    if (!reason) {
+      promotion.promote();
+      reason = "promoted " + std::to_string(promotion.promoted()) + " words";
+    }
+    auto remark = func.name + " bb" + std::to_string(header) + ": " + *reason;
+    LOG(TRACE) << "scalar promotion: " << remark << std::endl;
+    backend::report_statistic(extra_data_repo, pass_name(), remark);
+  }
+}
+
+}  // namespace optimization::scalar_promotion
@@ -0,0 +1,35 @@
+#pragma once
+
+#include "../../mir/loop.hpp"
+#include "../backend.hpp"
+
+namespace optimization::scalar_promotion {
+
+/// Promotion of array elements to registers inside loops.
+///
+/// A word the loop stores to through a loop-invariant address, with every
+/// other load and store of the loop provably touching different words, is
+/// loaded once in the preheader and kept in a variable instead: loads of it
+/// become copies of the current value and stores define a new one, with phis
+/// where paths meet. The final value is stored back once on each edge
+/// leaving the loop. Loops are visited innermost first, so a word promoted
+/// out of an inner loop can be promoted out of the enclosing one as well.
+///
+/// The preheader load and the exit stores may run when the loop would not
+/// have touched the word, so some access of it has to run on every
+/// iteration that leaves the loop. Loops calling functions that may touch
+/// memory, or leaving through a return, are skipped. A promoted word keeps a
+/// register busy across the loop, so it has to free one in exchange: some
+/// variable its address is computed from must be needed by nothing else.
+class Scalar_Promotion final : public backend::MirOptimizePass {
+ public:
+  std::string pass_name() const override { return "Scalar promotion"; }
+  void optimize_mir(mir::inst::MirPackage &mir,
+                    std::map<std::string, std::any> &extra_data_repo) override;
+
+ private:
+  void optimize_func(mir::inst::MirFunction &func,
+                     std::map<std::string, std::any> &extra_data_repo);
+};
+
+}  // namespace optimization::scalar_promotion
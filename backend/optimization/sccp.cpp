@@ -0,0 +1,328 @@
+#include "./sccp.hpp"
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <optional>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "../../include/aixlog.hpp"
+#include "../../mir/def_use.hpp"
+#include "optimization.hpp"
+
+namespace optimization::sccp {
+
+void SCCP::optimize_mir(mir::inst::MirPackage& mir,
+                        std::map<std::string, std::any>& extra_data_repo) {
+  for (auto& f : mir.functions) {
+    if (f.second.type->is_extern) continue;
+    optimize_func(f.second, extra_data_repo);
+  }
+}
+
+namespace {
+
+/// What a variable is known to hold
+struct Lattice {
+  enum Kind { Undefined, Constant, Varying } kind = Undefined;
+  int32_t value = 0;
+
+  bool operator==(const Lattice& other) const {
+    return kind == other.kind && (kind != Constant || value == other.value);
+  }
+  bool operator!=(const Lattice& other) const { return !(*this == other); }
+};
+
+const Lattice VARYING{Lattice::Varying};
+
+Lattice constant(int32_t value) { return Lattice{Lattice::Constant, value}; }
+
+Lattice meet(const Lattice& a, const Lattice& b) {
+  if (a.kind == Lattice::Undefined) return b;
+  if (b.kind == Lattice::Undefined || a == b) return a;
+  return VARYING;
+}
+
+/// `value` as read through the shift of `val`
+std::optional<int32_t> apply_shift(const mir::inst::Value& val,
+                                   int32_t value) {
+  if (!val.has_shift()) return value;
+  auto x = uint32_t(value);
+  auto n = val.shift_amount;
+  switch (val.shift) {
+    case arm::RegisterShiftKind::Lsl:
+      return n < 32 ? int32_t(x << n) : 0;
+    case arm::RegisterShiftKind::Lsr:
+      return n < 32 ? int32_t(x >> n) : 0;
+    case arm::RegisterShiftKind::Asr:
+      return value >> (n < 32 ? n : 31);
+    case arm::RegisterShiftKind::Ror:
+      n %= 32;
+      return n ? int32_t((x >> n) | (x << (32 - n))) : value;
+    default:
+      return std::nullopt;
+  }
+}
+
+/// The result of `op` on constants, unless it traps or is left to the target
+std::optional<int32_t> fold(mir::inst::Op op, int32_t lhs, int32_t rhs) {
+  using mir::inst::Op;
+  auto l = uint32_t(lhs), r = uint32_t(rhs);
+  switch (op) {
+    case Op::Add:
+      return int32_t(l + r);
+    case Op::Sub:
+      return int32_t(l - r);
+    case Op::Mul:
+      return int32_t(l * r);
+    case Op::MulSh:
+      return int32_t((int64_t(lhs) * int64_t(rhs)) >> 32);
+    case Op::Div:
+    case Op::Rem:
+      if (rhs == 0 || (lhs == INT32_MIN && rhs == -1)) return std::nullopt;
+      return op == Op::Div ? lhs / rhs : lhs % rhs;
+    case Op::Gt:
+      return lhs > rhs;
+    case Op::Lt:
+      return lhs < rhs;
+    case Op::Gte:
+      return lhs >= rhs;
+    case Op::Lte:
+      return lhs <= rhs;
+    case Op::Eq:
+      return lhs == rhs;
+    case Op::Neq:
+      return lhs != rhs;
+    case Op::And:
+      return int32_t(l & r);
+    case Op::Or:
+      return int32_t(l | r);
+    case Op::Xor:
+      return int32_t(l ^ r);
+    case Op::Not:
+      return int32_t(~l);
+    case Op::Shl:
+      if (r >= 32) return std::nullopt;
+      return int32_t(l << r);
+    case Op::Shr:
+      if (r >= 32) return std::nullopt;
+      return int32_t(l >> r);
+    case Op::ShrA:
+      if (r >= 32) return std::nullopt;
+      return lhs >> r;
+    default:
+      return std::nullopt;
+  }
+}
+
+class Propagation {
+ public:
+  Propagation(mir::inst::MirFunction& func)
+      : func(func), du(func.def_use()) {}
+
+  /// Finds the blocks that run and the values of variables in them
+  void solve() {
+    reach(func.basic_blks.begin()->first);
+    while (!blk_work.empty() || !var_work.empty()) {
+      if (!blk_work.empty()) {
+        auto& blk = func.basic_blks.at(blk_work.back());
+        blk_work.pop_back();
+        for (auto& inst : blk.inst) visit(inst.get());
+        visit_jump(blk);
+        continue;
+      }
+      auto var = var_work.back();
+      var_work.pop_back();
+      for (auto& use : du.uses_of(var)) {
+        if (!executable.count(use.blk)) continue;
+        if (use.is_jump()) {
+          visit_jump(func.basic_blks.at(use.blk));
+        } else {
+          visit(use.inst);
+        }
+      }
+    }
+  }
+
+  /// Rewrites the function with what `solve` found. Returns a remark on the
+  /// changes, or nothing if there were none
+  std::optional<std::string> rewrite() {
+    size_t consts = 0, branches = 0;
+    for (auto& [var, val] : values) {
+      if (val.kind != Lattice::Constant) continue;
+      auto def = du.def_of(var);
+      if (!keeps_def(var) && (dynamic_cast<mir::inst::OpInst*>(def) ||
+                              dynamic_cast<mir::inst::AssignInst*>(def))) {
+        auto assign = dynamic_cast<mir::inst::AssignInst*>(def);
+        if (!assign || !assign->src.is_immediate()) {
+          du.replace_inst(def, std::make_unique<mir::inst::AssignInst>(
+                                   var, val.value));
+          consts++;
+        }
+      }
+      auto uses = du.uses_of(var);
+      for (auto& use : uses) {
+        if (use.is_jump()) continue;
+        if (use.inst->inst_kind() == mir::inst::InstKind::Phi) continue;
+        mir::inst::for_each_value(*use.inst, [&](mir::inst::Value& slot) {
+          auto v = slot.get_if<mir::inst::VarId>();
+          if (!v || *v != var) return;
+          if (auto imm = apply_shift(slot, val.value)) {
+            du.replace_value(use.inst, slot, *imm);
+            consts++;
+          }
+        });
+      }
+    }
+
+    // Pointers offset by a known zero are the pointer itself
+    for (auto& [id, blk] : func.basic_blks) {
+      for (auto& inst : blk.inst) {
+        auto x = dynamic_cast<mir::inst::PtrOffsetInst*>(inst.get());
+        if (!x || !x->offset.is_immediate() ||
+            *x->offset.get_if<int32_t>() != 0) {
+          continue;
+        }
+        du.replace_inst(x, std::make_unique<mir::inst::AssignInst>(
+                               x->dest, mir::inst::Value(x->ptr)));
+        consts++;
+      }
+    }
+
+    for (auto id : executable) {
+      auto& jump = func.basic_blks.at(id).jump;
+      if (jump.kind != mir::inst::JumpInstructionKind::BrCond ||
+          jump.jump_kind == mir::inst::JumpKind::Loop) {
+        continue;
+      }
+      auto cond = value_of(mir::inst::Value(jump.cond_or_ret.value()));
+      if (cond.kind != Lattice::Constant) continue;
+      auto target = cond.value ? jump.bb_true : jump.bb_false;
+      auto other = cond.value ? jump.bb_false : jump.bb_true;
+      jump = mir::inst::JumpInstruction(mir::inst::JumpInstructionKind::Br,
+                                        target, -1, std::nullopt,
+                                        jump.jump_kind);
+      if (other != target) func.basic_blks.at(other).preceding.erase(id);
+      branches++;
+    }
+    func.invalidate_def_use();
+
+    auto blocks = func.basic_blks.size();
+    remove_unreachable_blocks(func);
+    blocks -= func.basic_blks.size();
+    if (!consts && !branches && !blocks) return std::nullopt;
+    return std::to_string(consts) + " constants, " + std::to_string(branches) +
+           " branches folded, " + std::to_string(blocks) + " blocks dropped";
+  }
+
+ private:
+  void reach(mir::types::LabelId id) {
+    if (executable.insert(id).second) blk_work.push_back(id);
+  }
+
+  /// Whether the definition of `var` must stay as it is
+  bool keeps_def(mir::inst::VarId var) {
+    for (auto& use : du.uses_of(var)) {
+      if (use.is_jump() && func.basic_blks.at(use.blk).jump.jump_kind ==
+                               mir::inst::JumpKind::Loop) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  bool tracked(mir::inst::VarId var) {
+    auto it = func.variables.find(var.id);
+    return it != func.variables.end() && it->second.ty &&
+           it->second.ty->kind() == mir::types::TyKind::Int &&
+           du.def_count(var) == 1;
+  }
+
+  Lattice value_of(const mir::inst::Value& val) {
+    if (auto imm = std::get_if<int32_t>(&val)) return constant(*imm);
+    auto var = std::get<mir::inst::VarId>(val);
+    if (!tracked(var)) return VARYING;
+    auto it = values.find(var);
+    if (it == values.end()) return Lattice();
+    if (it->second.kind != Lattice::Constant) return it->second;
+    if (auto x = apply_shift(val, it->second.value)) return constant(*x);
+    return VARYING;
+  }
+
+  void lower(mir::inst::VarId var, Lattice val) {
+    if (!tracked(var)) return;
+    auto& old = values[var];
+    val = meet(old, val);
+    if (val == old) return;
+    old = val;
+    var_work.push_back(var);
+  }
+
+  void visit(mir::inst::Inst* inst) {
+    if (auto x = dynamic_cast<mir::inst::AssignInst*>(inst)) {
+      lower(x->dest, value_of(x->src));
+    } else if (auto x = dynamic_cast<mir::inst::OpInst*>(inst)) {
+      auto lhs = value_of(x->lhs), rhs = value_of(x->rhs);
+      if (x->op == mir::inst::Op::Not) rhs = constant(0);
+      if (lhs.kind == Lattice::Varying || rhs.kind == Lattice::Varying) {
+        lower(x->dest, VARYING);
+      } else if (lhs.kind == Lattice::Constant &&
+                 rhs.kind == Lattice::Constant) {
+        auto res = fold(x->op, lhs.value, rhs.value);
+        lower(x->dest, res ? constant(*res) : VARYING);
+      }
+    } else if (auto x = dynamic_cast<mir::inst::PhiInst*>(inst)) {
+      // Operands defined where control never gets are not known to flow in
+      auto val = Lattice();
+      for (auto var : x->vars) {
+        auto blk = du.def_block(var);
+        if (blk && !executable.count(*blk)) continue;
+        val = meet(val, value_of(mir::inst::Value(var)));
+      }
+      lower(x->dest, val);
+    } else if (inst->inst_kind() != mir::inst::InstKind::Store) {
+      lower(inst->dest, VARYING);
+    }
+  }
+
+  void visit_jump(mir::inst::BasicBlk& blk) {
+    auto& jump = blk.jump;
+    if (jump.kind == mir::inst::JumpInstructionKind::Br) {
+      reach(jump.bb_true);
+    } else if (jump.kind == mir::inst::JumpInstructionKind::BrCond) {
+      auto cond = value_of(mir::inst::Value(jump.cond_or_ret.value()));
+      if (jump.jump_kind == mir::inst::JumpKind::Loop) cond = VARYING;
+      if (cond.kind == Lattice::Undefined) return;
+      if (cond.kind == Lattice::Varying || cond.value) reach(jump.bb_true);
+      if (cond.kind == Lattice::Varying || !cond.value) reach(jump.bb_false);
+    }
+  }
+
+  mir::inst::MirFunction& func;
+  mir::inst::DefUseChain& du;
+  std::map<mir::inst::VarId, Lattice> values;
+  std::set<mir::types::LabelId> executable;
+  std::vector<mir::types::LabelId> blk_work;
+  std::vector<mir::inst::VarId> var_work;
+};
+
+}  // namespace
+
+std::optional<std::string> propagate(mir::inst::MirFunction& func) {
+  Propagation propagation(func);
+  propagation.solve();
+  return propagation.rewrite();
+}
+
+void SCCP::optimize_func(mir::inst::MirFunction& func,
+                         std::map<std::string, std::any>& extra_data_repo) {
+  if (auto remark = propagate(func)) {
+    LOG(TRACE) << "sccp: " << func.name << ": " << *remark << std::endl;
+    backend::report_statistic(extra_data_repo, pass_name(),
+                              func.name + ": " + *remark);
+  }
+}
+
+}  // namespace optimization::sccp
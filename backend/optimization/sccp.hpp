@@ -0,0 +1,42 @@
+#pragma once
+
+#include <optional>
+#include <string>
+
+#include "../../mir/mir.hpp"
+#include "../backend.hpp"
+
+namespace optimization::sccp {
+
+/// Sparse conditional constant propagation.
+///
+/// Every integer variable starts out undefined and is lowered to a constant,
+/// then to "anything", as the blocks defining it or the values it is
+/// computed from are found to run. Blocks run when the entry reaches them
+/// through branches whose conditions are not known to go the other way, so
+/// code behind a constant condition never pollutes the values after it.
+/// Phi operands carry no block labels, so a phi meets the operands defined in
+/// blocks found to run.
+///
+/// Constant results become plain assignments and their uses immediates,
+/// branches on constant conditions become jumps, and the blocks no longer
+/// reached are dropped along with the phi operands they defined. Branches
+/// marked `JumpKind::Loop` are kept together with the comparisons they test,
+/// as the loop passes read the guards of loops from them. Every function
+/// changed gets a remark in the pass statistics.
+class SCCP final : public backend::MirOptimizePass {
+ public:
+  std::string pass_name() const override { return "SCCP"; }
+  void optimize_mir(mir::inst::MirPackage &mir,
+                    std::map<std::string, std::any> &extra_data_repo) override;
+
+ private:
+  void optimize_func(mir::inst::MirFunction &func,
+                     std::map<std::string, std::any> &extra_data_repo);
+};
+
+/// Runs the propagation over `func` alone. Returns a remark on the changes,
+/// or nothing if there were none.
+std::optional<std::string> propagate(mir::inst::MirFunction &func);
+
+}  // namespace optimization::sccp
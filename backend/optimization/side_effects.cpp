@@ -0,0 +1,173 @@
+#include "./side_effects.hpp"
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "../../mir/def_use.hpp"
+#include "optimization.hpp"
+
+namespace optimization::side_effects {
+
+bool Summary::operator==(const Summary& other) const {
+  return reads_globals == other.reads_globals &&
+         writes_globals == other.writes_globals &&
+         reads_params == other.reads_params &&
+         writes_params == other.writes_params &&
+         reads_unknown == other.reads_unknown &&
+         writes_unknown == other.writes_unknown && does_io == other.does_io;
+}
+
+namespace {
+
+Summary io() {
+  Summary summary;
+  summary.does_io = true;
+  return summary;
+}
+
+Summary everything() {
+  auto summary = io();
+  summary.reads_unknown = true;
+  summary.writes_unknown = true;
+  return summary;
+}
+
+/// Summaries of the runtime library
+Summaries library() {
+  Summaries summaries;
+  for (auto name : {"getint", "getch", "putint", "putch", "starttime",
+                    "stoptime", "_sysy_starttime", "_sysy_stoptime"}) {
+    summaries[name] = io();
+  }
+  // Memory from `malloc` counts as local; the calls stay where they are
+  summaries["malloc"] = io();
+  summaries["free"] = io();
+  summaries["getarray"] = io();
+  summaries["getarray"].writes_params = {0};
+  summaries["putarray"] = io();
+  summaries["putarray"].reads_params = {1};
+  summaries["putf"] = io();
+  summaries["putf"].reads_params = {0};
+  summaries["printf"] = summaries["putf"];
+  summaries["memset"].writes_params = {0};
+  summaries["memcpy"].writes_params = {0};
+  summaries["memcpy"].reads_params = {1};
+  return summaries;
+}
+
+class Summarizer {
+ public:
+  Summarizer(mir::inst::MirFunction& func, const Summaries& summaries)
+      : func(func), summaries(summaries) {}
+
+  Summary run() {
+    for (auto& [id, blk] : func.basic_blks) {
+      for (auto& inst : blk.inst) visit(*inst);
+    }
+    return summary;
+  }
+
+ private:
+  void visit(mir::inst::Inst& inst) {
+    if (auto x = dynamic_cast<mir::inst::LoadInst*>(&inst)) {
+      access(x->src, false);
+    } else if (auto x = dynamic_cast<mir::inst::LoadOffsetInst*>(&inst)) {
+      access(x->src, false);
+    } else if (auto x = dynamic_cast<mir::inst::StoreInst*>(&inst)) {
+      access(mir::inst::Value(x->dest), true);
+    } else if (auto x = dynamic_cast<mir::inst::StoreOffsetInst*>(&inst)) {
+      access(mir::inst::Value(x->dest), true);
+    } else if (auto x = dynamic_cast<mir::inst::CallInst*>(&inst)) {
+      auto& callee = summary_of(summaries, x->func);
+      summary.does_io |= callee.does_io;
+      summary.reads_unknown |= callee.reads_unknown;
+      summary.writes_unknown |= callee.writes_unknown;
+      summary.reads_globals.insert(callee.reads_globals.begin(),
+                                   callee.reads_globals.end());
+      summary.writes_globals.insert(callee.writes_globals.begin(),
+                                    callee.writes_globals.end());
+      for (auto param : callee.reads_params) {
+        if (param < x->params.size()) access(x->params[param], false);
+      }
+      for (auto param : callee.writes_params) {
+        if (param < x->params.size()) access(x->params[param], true);
+      }
+    }
+  }
+
+  /// Records a read or write of the memory `ptr` points to
+  void access(mir::inst::Value ptr, bool write) {
+    auto var = ptr.get_if<mir::inst::VarId>();
+    auto obj = var ? object_of(func, *var) : MemObject();
+    if (auto name = std::get_if<std::string>(&obj)) {
+      (write ? summary.writes_globals : summary.reads_globals).insert(*name);
+      return;
+    }
+    if (std::holds_alternative<mir::inst::VarId>(obj)) return;
+    if (var) {
+      auto base = base_pointer(func, *var);
+      if (is_parameter(func, base)) {
+        (write ? summary.writes_params : summary.reads_params)
+            .insert(base.id - 1);
+        return;
+      }
+      auto def = func.def_use().def_of(base);
+      auto call = dynamic_cast<mir::inst::CallInst*>(def);
+      if (call && call->func == "malloc") return;
+    }
+    (write ? summary.writes_unknown : summary.reads_unknown) = true;
+  }
+
+  mir::inst::MirFunction& func;
+  const Summaries& summaries;
+  Summary summary;
+};
+
+}  // namespace
+
+Summaries summarize(mir::inst::MirPackage& package) {
+  auto summaries = library();
+  std::map<std::string, std::set<std::string>> callers;
+  std::vector<std::string> worklist;
+  for (auto& [name, func] : package.functions) {
+    if (func.type->is_extern) {
+      if (!summaries.count(name)) summaries[name] = everything();
+      continue;
+    }
+    summaries[name] = Summary();
+    worklist.push_back(name);
+    for (auto& [id, blk] : func.basic_blks) {
+      for (auto& inst : blk.inst) {
+        if (auto x = dynamic_cast<mir::inst::CallInst*>(inst.get())) {
+          callers[x->func].insert(name);
+        }
+      }
+    }
+  }
+
+  // Summaries only grow, so this settles
+  std::set<std::string> queued(worklist.begin(), worklist.end());
+  while (!worklist.empty()) {
+    auto name = worklist.back();
+    worklist.pop_back();
+    queued.erase(name);
+    auto summary = Summarizer(package.functions.at(name), summaries).run();
+    if (summary == summaries.at(name)) continue;
+    summaries[name] = summary;
+    for (auto& caller : callers[name]) {
+      if (queued.insert(caller).second) worklist.push_back(caller);
+    }
+  }
+  return summaries;
+}
+
+const Summary& summary_of(const Summaries& summaries,
+                          const std::string& func) {
+  static const Summary unknown = everything();
+  auto it = summaries.find(func);
+  return it == summaries.end() ? unknown : it->second;
+}
+
+}  // namespace optimization::side_effects
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <set>
+#include <string>
+
+#include "../../mir/mir.hpp"
+
+/// Interprocedural side-effect summaries.
+///
+/// Every function gets a summary of the memory it may read and write when
+/// called: globals by name, the memory behind each pointer parameter, and
+/// anything else it reaches through pointers we don't follow. Local arrays,
+/// including the ones taken from `malloc`, are the callee's own and don't
+/// show. Input, output and timing calls make a function do I/O, which keeps
+/// calls to it where they are.
+///
+/// Summaries are found bottom-up over the call graph: a call takes over the
+/// summary of its callee, with the parameters replaced by what the arguments
+/// point to, and the functions calling one whose summary grows are summed up
+/// again until nothing changes, which settles recursion. Library functions
+/// have theirs written down; calls to anything else may do everything.
+namespace optimization::side_effects {
+
+struct Summary {
+  std::set<std::string> reads_globals;
+  std::set<std::string> writes_globals;
+  /// Indices of pointer parameters whose memory is read or written
+  std::set<uint32_t> reads_params;
+  std::set<uint32_t> writes_params;
+  /// Memory reached some other way
+  bool reads_unknown = false;
+  bool writes_unknown = false;
+  bool does_io = false;
+
+  bool reads_memory() const {
+    return reads_unknown || !reads_globals.empty() || !reads_params.empty();
+  }
+  bool writes_memory() const {
+    return writes_unknown || !writes_globals.empty() || !writes_params.empty();
+  }
+  /// Whether the result depends on the arguments only, and the call has no
+  /// effect besides it
+  bool is_pure() const {
+    return !does_io && !reads_memory() && !writes_memory();
+  }
+  /// Whether the call has no effect besides its result
+  bool is_read_only() const { return !does_io && !writes_memory(); }
+
+  bool operator==(const Summary& other) const;
+};
+
+using Summaries = std::map<std::string, Summary>;
+
+/// Summaries of the functions of `package`, and of the library functions
+/// it calls, by the names calls use
+Summaries summarize(mir::inst::MirPackage& package);
+
+/// The summary of a call to `func`; everything for unknown functions
+const Summary& summary_of(const Summaries& summaries, const std::string& func);
+
+}  // namespace optimization::side_effects
@@ -0,0 +1,241 @@
+#include "./specialization.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <optional>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "../../include/aixlog.hpp"
+#include "../../mir/def_use.hpp"
+#include "../../mir/loop.hpp"
+#include "optimization.hpp"
+#include "sccp.hpp"
+#include "strength_reduction.hpp"
+
+namespace optimization::specialization {
+
+namespace {
+
+/// Share of its instructions a copy has to lose to be kept, and at least
+const int32_t MIN_SAVED_PERCENT = 10;
+const int32_t MIN_SAVED = 8;
+/// Copies of any one function
+const size_t MAX_COPIES = 4;
+/// Instructions all copies may add, relative to the size of the program,
+/// and at least
+const int32_t BUDGET_PERCENT = 50;
+const int32_t MIN_BUDGET = 500;
+
+/// The constant passed for each parameter, if any
+using Constants = std::vector<std::optional<int32_t>>;
+
+/// Loops of `func` with a trip count known at compile time
+int32_t counted_loops(const mir::inst::MirFunction& func) {
+  mir::inst::LoopForest forest(func);
+  int32_t loops = 0;
+  for (auto& loop : forest.loops()) {
+    auto trip = forest.trip_count(loop, func);
+    if (trip && trip->count) loops++;
+  }
+  return loops;
+}
+
+/// A copy of `func` named `name`
+mir::inst::MirFunction copy_of(mir::inst::MirFunction& func,
+                               const std::string& name) {
+  mir::inst::MirFunction copy(name, func.type);
+  copy.variables = func.variables;
+  for (auto& [id, blk] : func.basic_blks) {
+    mir::inst::BasicBlk new_blk(id);
+    new_blk.preceding = blk.preceding;
+    new_blk.jump =
+        mir::inst::JumpInstruction(blk.jump.kind, blk.jump.bb_true,
+                                   blk.jump.bb_false, blk.jump.cond_or_ret,
+                                   blk.jump.jump_kind);
+    for (auto& inst : blk.inst) new_blk.inst.emplace_back(inst->deep_copy());
+    copy.basic_blks.emplace(id, std::move(new_blk));
+  }
+  return copy;
+}
+
+/// Has `func` read the constants in `args` instead of its parameters. They
+/// are assigned to new variables at the entry, for SCCP to carry on.
+void fix_params(mir::inst::MirFunction& func, const Constants& args) {
+  std::vector<std::unique_ptr<mir::inst::Inst>> assigns;
+  for (uint32_t i = 0; i < args.size(); i++) {
+    if (!args[i]) continue;
+    mir::inst::VarId param(i + 1);
+    auto ty = func.variables.at(param.id).ty;
+    auto is_phi = func.variables.at(param.id).is_phi_var;
+    auto value = strength_reduction::new_var(func, ty, is_phi);
+    for (auto& [id, blk] : func.basic_blks) {
+      for (auto& inst : blk.inst) {
+        inst->replace(param, value);
+        if (auto x = dynamic_cast<mir::inst::PhiInst*>(inst.get())) {
+          std::replace(x->vars.begin(), x->vars.end(), param, value);
+        }
+      }
+      blk.jump.replace(param, value);
+    }
+    assigns.push_back(
+        std::make_unique<mir::inst::AssignInst>(value, *args[i]));
+  }
+  auto& entry = func.basic_blks.begin()->second;
+  entry.inst.insert(entry.inst.begin(),
+                    std::make_move_iterator(assigns.begin()),
+                    std::make_move_iterator(assigns.end()));
+  func.invalidate_def_use();
+}
+
+/// `name(_, 10)` for the call of `name` with `args`
+std::string describe(const std::string& name, const Constants& args) {
+  auto text = name + "(";
+  for (size_t i = 0; i < args.size(); i++) {
+    if (i) text += ", ";
+    text += args[i] ? std::to_string(*args[i]) : "_";
+  }
+  return text + ")";
+}
+
+/// What SCCP leaves of a function
+struct Shape {
+  int32_t size;
+  int32_t loops;
+};
+
+Shape shape_of(mir::inst::MirFunction& func) {
+  sccp::propagate(func);
+  // The constants in place of parameters, once SCCP has read them
+  auto& du = func.def_use();
+  for (auto& [id, blk] : func.basic_blks) {
+    auto& insts = blk.inst;
+    insts.erase(std::remove_if(insts.begin(), insts.end(),
+                               [&](auto& inst) {
+                                 auto x = dynamic_cast<mir::inst::AssignInst*>(
+                                     inst.get());
+                                 return x && x->src.is_immediate() &&
+                                        du.uses_of(x->dest).empty();
+                               }),
+                insts.end());
+  }
+  func.invalidate_def_use();
+  return {size_of(func), counted_loops(func)};
+}
+
+}  // namespace
+
+void Specialization::optimize_mir(
+    mir::inst::MirPackage& package,
+    std::map<std::string, std::any>& extra_data_repo) {
+  int32_t program_size = 0;
+  std::vector<std::string> worklist;
+  for (auto& [name, func] : package.functions) {
+    if (func.type->is_extern) continue;
+    program_size += size_of(func);
+    worklist.push_back(name);
+  }
+  int32_t budget =
+      std::max(MIN_BUDGET, program_size * BUDGET_PERCENT / 100);
+
+  // Copies by the function and constants they stand for; empty where one
+  // wasn't worth it
+  std::map<std::pair<std::string, Constants>, std::string> copies;
+  std::map<std::string, Shape> generic;
+  std::map<std::string, size_t> copy_count;
+  std::set<std::string> is_copy;
+
+  auto specialize = [&](const std::string& name,
+                        const Constants& args) -> std::string {
+    auto remark = describe(name, args);
+    auto& callee = package.functions.at(name);
+    if (copy_count[name] >= MAX_COPIES) {
+      backend::report_statistic(extra_data_repo, pass_name(),
+                                remark + ": kept generic, too many copies");
+      return "";
+    }
+    if (!generic.count(name)) {
+      auto copy = copy_of(callee, name);
+      generic.insert({name, shape_of(copy)});
+    }
+    auto base = generic.at(name);
+    auto copy_name = name + "$" + std::to_string(copy_count[name] + 1);
+    auto copy = copy_of(callee, copy_name);
+    fix_params(copy, args);
+    auto shape = shape_of(copy);
+
+    auto saved = base.size - shape.size;
+    auto counted = shape.loops - base.loops;
+    auto numbers = " (size " + std::to_string(base.size) + " -> " +
+                   std::to_string(shape.size) + ", " +
+                   std::to_string(std::max(counted, 0)) + " loops counted)";
+    std::string reason;
+    if (counted <= 0 &&
+        (saved < MIN_SAVED || saved * 100 < base.size * MIN_SAVED_PERCENT)) {
+      reason = ": kept generic, little gain";
+    } else if (shape.size > budget) {
+      reason = ": kept generic, over the budget";
+    }
+    if (!reason.empty()) {
+      backend::report_statistic(extra_data_repo, pass_name(),
+                                remark + reason + numbers);
+      return "";
+    }
+
+    budget -= shape.size;
+    copy_count[name]++;
+    is_copy.insert(copy_name);
+    package.functions.emplace(copy_name, std::move(copy));
+    package.functions.at(copy_name).invalidate_def_use();
+    worklist.push_back(copy_name);
+    LOG(TRACE) << "specialization: " << remark << " as " << copy_name
+               << numbers << std::endl;
+    backend::report_statistic(extra_data_repo, pass_name(),
+                              remark + ": " + copy_name + numbers);
+    return copy_name;
+  };
+
+  // Copies get their calls redirected too, their recursive ones included
+  for (size_t i = 0; i < worklist.size(); i++) {
+    auto& func = package.functions.at(worklist[i]);
+    for (auto& [id, blk] : func.basic_blks) {
+      for (auto& inst : blk.inst) {
+        auto call = dynamic_cast<mir::inst::CallInst*>(inst.get());
+        if (call == nullptr || call->func == "f__main") continue;
+        auto it = package.functions.find(call->func);
+        if (it == package.functions.end() || it->second.type->is_extern ||
+            is_copy.count(call->func)) {
+          continue;
+        }
+        Constants args;
+        bool any = false;
+        for (auto& arg : call->params) {
+          if (auto imm = arg.get_if<int32_t>()) {
+            args.push_back(*imm);
+            any = true;
+          } else {
+            args.push_back(std::nullopt);
+          }
+        }
+        if (!any) continue;
+
+        auto key = std::make_pair(call->func, args);
+        auto found = copies.find(key);
+        if (found == copies.end()) {
+          auto copy_name = specialize(call->func, args);
+          found = copies.insert({key, copy_name}).first;
+        }
+        if (!found->second.empty()) call->func = found->second;
+      }
+    }
+  }
+
+  remove_uncalled_functions(package, "specialization");
+}
+
+}  // namespace optimization::specialization
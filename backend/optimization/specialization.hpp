@@ -0,0 +1,26 @@
+#pragma once
+
+#include "../../mir/mir.hpp"
+#include "../backend.hpp"
+
+namespace optimization::specialization {
+
+/// Function specialization for constant arguments.
+///
+/// A call passing constants to a function is tried against a copy of the
+/// callee with those parameters fixed, run through SCCP. If the copy comes
+/// out markedly smaller, or more of its loops get trip counts known at
+/// compile time for the loop passes to unroll, the copy is kept under a new
+/// name and the call goes to it instead. Calls passing the same constants to
+/// the same function share one copy, including recursive calls inside the
+/// copy itself. The copies together may only add a budget of instructions
+/// relative to the size of the program, and each function gets a few at
+/// most. Functions no longer called from `main` go away.
+class Specialization final : public backend::MirOptimizePass {
+ public:
+  std::string pass_name() const override { return "Function specialization"; }
+  void optimize_mir(mir::inst::MirPackage& package,
+                    std::map<std::string, std::any>& extra_data_repo) override;
+};
+
+}  // namespace optimization::specialization
@@ -0,0 +1,942 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <optional>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "../../include/aixlog.hpp"
+#include "../../mir/def_use.hpp"
+#include "../../mir/loop.hpp"
+#include "../../mir/mir.hpp"
+#include "../backend.hpp"
+#include "optimization.hpp"
+
+namespace optimization::strength_reduction {
+
+/// Largest immediate offset `ldr` and `str` take
+const int32_t MAX_MEMORY_OFFSET = 4095;
+
+/// `constant + sum(coef * var)`, wrapping around the way `i32` arithmetic
+/// does, so rewriting a value into this form is always exact
+struct Affine {
+  std::map<mir::inst::VarId, uint32_t> terms;
+  uint32_t constant = 0;
+
+  Affine& add(const Affine& other, uint32_t factor = 1) {
+    for (auto [var, coef] : other.terms) {
+      auto& sum = terms[var];
+      sum += coef * factor;
+      if (sum == 0) terms.erase(var);
+    }
+    constant += other.constant * factor;
+    return *this;
+  }
+  Affine& scale(uint32_t factor) {
+    for (auto it = terms.begin(); it != terms.end();) {
+      it->second *= factor;
+      it = it->second == 0 ? terms.erase(it) : std::next(it);
+    }
+    constant *= factor;
+    return *this;
+  }
+};
+
+/// `dest = val + imm`, as a subtraction if `imm` is negative: an `add` of a
+/// negative immediate takes an extra instruction to materialize it
+inline std::unique_ptr<mir::inst::OpInst> add_imm(mir::inst::VarId dest,
+                                                  mir::inst::Value val,
+                                                  uint32_t imm) {
+  if (int32_t(imm) < 0 && int32_t(imm) != INT32_MIN) {
+    return std::make_unique<mir::inst::OpInst>(dest, val, -int32_t(imm),
+                                               mir::inst::Op::Sub);
+  }
+  return std::make_unique<mir::inst::OpInst>(dest, val, int32_t(imm),
+                                             mir::inst::Op::Add);
+}
+
+inline mir::inst::VarId new_var(mir::inst::MirFunction& func,
+                                mir::types::SharedTyPtr ty, bool is_phi_var) {
+  auto id = func.variables.rbegin()->first + 1;
+  auto var = mir::inst::Variable(ty);
+  var.is_phi_var = is_phi_var;
+  func.variables.insert({id, var});
+  return mir::inst::VarId(id);
+}
+
+/// Appends instructions computing `val` into `dest` to `blk`. Terms scaled by
+/// a power of two become shifted operands unless `shifts` is false, as the
+/// passes before `ValueShiftCollapse` need.
+inline void emit_affine(mir::inst::MirFunction& func, mir::inst::BasicBlk& blk,
+                        const Affine& val, mir::inst::VarId dest,
+                        bool shifts = true) {
+  auto& du = func.def_use();
+  std::vector<std::unique_ptr<mir::inst::Inst>> code;
+  auto int_ty = mir::types::new_int_ty();
+  // Pointers first, so the sum keeps their type where it matters, and
+  // negative terms last, so they can be subtracted
+  std::vector<std::pair<mir::inst::VarId, uint32_t>> terms(
+      val.terms.begin(), val.terms.end());
+  std::stable_partition(terms.begin(), terms.end(), [&](auto& term) {
+    auto var = func.variables.find(term.first.id);
+    return term.second == 1 && var != func.variables.end() &&
+           var->second.ty->kind() == mir::types::TyKind::Ptr;
+  });
+  std::stable_partition(terms.begin(), terms.end(),
+                        [](auto& term) { return int32_t(term.second) > 0; });
+
+  std::optional<mir::inst::Value> sum;
+  for (auto [var, coef] : terms) {
+    bool negative = sum && int32_t(coef) < 0;
+    if (negative) coef = -coef;
+    mir::inst::Value term = var;
+    if (coef != 1) {
+      if ((coef & (coef - 1)) == 0 && sum && shifts) {
+        term = mir::inst::Value(var, arm::RegisterShiftKind::Lsl,
+                                __builtin_ctz(coef));
+      } else {
+        auto scaled = new_var(func, int_ty, false);
+        code.push_back(std::make_unique<mir::inst::OpInst>(
+            scaled, var, int32_t(coef), mir::inst::Op::Mul));
+        term = scaled;
+      }
+    }
+    if (!sum) {
+      sum = term;
+      continue;
+    }
+    auto partial = new_var(func, int_ty, false);
+    code.push_back(std::make_unique<mir::inst::OpInst>(
+        partial, *sum, term,
+        negative ? mir::inst::Op::Sub : mir::inst::Op::Add));
+    sum = partial;
+  }
+  if (!sum) {
+    code.push_back(std::make_unique<mir::inst::AssignInst>(
+        dest, int32_t(val.constant)));
+  } else if (val.constant != 0) {
+    code.push_back(add_imm(dest, *sum, val.constant));
+  } else if (!code.empty()) {
+    code.back()->dest = dest;
+  } else {
+    code.push_back(std::make_unique<mir::inst::AssignInst>(dest, *sum));
+  }
+  for (auto& inst : code) {
+    du.insert_inst(blk, blk.inst.end(), std::move(inst));
+  }
+}
+
+/// A header phi stepping by a constant once per iteration
+struct InductionVar {
+  mir::inst::PhiInst* phi;
+  /// Operand flowing in from the preheader
+  mir::inst::VarId init;
+  /// Operand computed by the latch
+  mir::inst::VarId next;
+  uint32_t step;
+};
+
+/// A load or store whose address moves by a constant stride per iteration
+struct Access {
+  mir::inst::Inst* inst;
+  /// Address the instruction accesses, `constant` included
+  Affine addr;
+};
+
+/// Accesses whose addresses differ only by a small constant, served by one
+/// pointer induction variable
+struct Group {
+  const InductionVar* iv;
+  uint32_t stride;
+  /// Loop-invariant part of the address, `constant` being the smallest one
+  Affine base;
+  mir::types::SharedTyPtr ptr_ty;
+  std::vector<Access> accesses;
+  /// Some access runs on every iteration, so the pointer cannot wrap around
+  /// before the loop ends
+  bool always_runs = false;
+};
+
+/// Strength reduction of induction variables.
+///
+/// Array accesses in loops compute `base + (row + i) * 4` or alike on every
+/// iteration. Every load or store whose address is an affine function of one
+/// induction variable `i` gets a pointer induction variable `p` instead,
+/// stepped by `stride * step` in the latch, and accesses `[p, #delta]`.
+/// Accesses differing only in a small constant share one pointer, so the
+/// copies of a body `Loop_Unrolling` made need a single one.
+///
+/// A pointer costs a register across the loop and an `add` per iteration, so
+/// it is only introduced if that saves more instructions than it adds, and
+/// while the values live across the loop and the loops nested in it still
+/// fit in registers.
+///
+/// If the induction variable is then only needed by the exit test, the test
+/// is rewritten to compare the pointer against its final value (linear
+/// function test replacement) and the variable goes away. Equality is all a
+/// pointer can safely be compared with, so this needs a unit step and the
+/// first exit test to be known to pass.
+class Strength_Reduction final : public backend::MirOptimizePass {
+ public:
+  std::string pass_name() const override { return "Strength reduction"; }
+
+  void optimize_mir(mir::inst::MirPackage& package,
+                    std::map<std::string, std::any>& extra_data_repo) override {
+    for (auto& [name, func] : package.functions) {
+      if (func.type->is_extern) continue;
+      std::vector<mir::types::LabelId> headers;
+      {
+        auto& loops = get_loop_forest(extra_data_repo, func).loops();
+        for (auto it = loops.rbegin(); it != loops.rend(); ++it) {
+          headers.push_back(it->header);
+        }
+      }
+      // Creating a preheader rebuilds the forest, so look each loop up again
+      for (auto header : headers) {
+        auto& forest = get_loop_forest(extra_data_repo, func);
+        auto loop = forest.loop_with_header(header);
+        if (loop == nullptr || loop->has_irreducible) continue;
+        reduce_loop(func, forest, *loop);
+      }
+    }
+  }
+
+ private:
+  mir::inst::MirFunction* func;
+  std::unordered_set<mir::types::LabelId> blocks;
+  // Blocks of the loop around the one being reduced, if any
+  std::unordered_set<mir::types::LabelId> outer_blocks;
+  std::unordered_set<mir::inst::VarId> header_phis;
+  std::unordered_set<mir::inst::VarId> live_through;
+  std::unordered_map<mir::inst::VarId, std::optional<Affine>> affine_memo;
+
+  void reduce_loop(mir::inst::MirFunction& func,
+                   const mir::inst::LoopForest& forest,
+                   const mir::inst::Loop& loop) {
+    if (loop.latches.size() != 1) return;
+    auto latch_id = loop.latches[0];
+    // The latch must run once per iteration, not once per inner iteration
+    if (forest.loop_of(latch_id) != &loop) return;
+    auto& du = func.def_use();
+    auto& latch = func.basic_blks.at(latch_id);
+
+    this->func = &func;
+    blocks = {loop.blocks.begin(), loop.blocks.end()};
+    outer_blocks.clear();
+    if (loop.parent) {
+      auto& outer = forest.loops().at(*loop.parent).blocks;
+      outer_blocks = {outer.begin(), outer.end()};
+    }
+    header_phis.clear();
+    affine_memo.clear();
+    find_live_through(func, forest, loop);
+    for (auto& inst : func.basic_blks.at(loop.header).inst) {
+      if (dynamic_cast<mir::inst::PhiInst*>(inst.get())) {
+        header_phis.insert(inst->dest);
+      }
+    }
+
+    std::map<mir::inst::VarId, InductionVar> ivs;
+    for (auto& inst : func.basic_blks.at(loop.header).inst) {
+      auto phi = dynamic_cast<mir::inst::PhiInst*>(inst.get());
+      if (phi == nullptr || phi->vars.size() != 2) continue;
+      auto [init, next] = std::pair(phi->vars[0], phi->vars[1]);
+      if (is_in_loop(init)) std::swap(init, next);
+      if (is_in_loop(init) || du.def_block(next) != latch_id) continue;
+      auto step = affine_of(next);
+      if (!step || step->terms.size() != 1 ||
+          step->terms.begin()->first != phi->dest ||
+          step->terms.begin()->second != 1 || step->constant == 0) {
+        continue;
+      }
+      ivs.insert({phi->dest, {phi, init, next, step->constant}});
+    }
+    if (ivs.empty()) return;
+
+    // A phi web lives in one register, so reading an induction variable
+    // after its step in the latch would see the next value. New pointers are
+    // stepped right before the first comparison of the latch.
+    size_t step_pos = 0, ivs_stepped = latch.inst.size();
+    for (; step_pos < latch.inst.size(); step_pos++) {
+      auto& inst = latch.inst[step_pos];
+      if (ivs_stepped == latch.inst.size() &&
+          std::any_of(ivs.begin(), ivs.end(),
+                      [&](auto& iv) { return iv.second.next == inst->dest; })) {
+        ivs_stepped = step_pos;
+      }
+      auto op = dynamic_cast<mir::inst::OpInst*>(inst.get());
+      if (op && is_comparison(op->op)) break;
+    }
+    std::unordered_set<mir::inst::Inst*> late;
+    for (size_t i = std::min(step_pos, ivs_stepped + 1); i < latch.inst.size();
+         i++) {
+      late.insert(latch.inst[i].get());
+    }
+    canonicalize(func, loop, ivs, late);
+
+    // Group accesses by what their addresses are made of
+    std::map<std::map<mir::inst::VarId, uint32_t>, Group> groups;
+    for (auto id : loop.blocks) {
+      for (auto& inst : func.basic_blks.at(id).inst) {
+        if (late.count(inst.get())) continue;
+        auto ptr = access_ptr(*inst);
+        if (!ptr) continue;
+        auto addr = access_addr(*inst);
+        if (!addr) continue;
+        const InductionVar* iv = nullptr;
+        bool ok = true;
+        for (auto [var, coef] : addr->terms) {
+          if (!header_phis.count(var)) continue;
+          auto it = ivs.find(var);
+          if (it == ivs.end() || iv != nullptr) ok = false;
+          if (it != ivs.end()) iv = &it->second;
+        }
+        auto ty = func.variables.find(ptr->id);
+        if (!ok || iv == nullptr || ty == func.variables.end()) continue;
+        bool always_runs = forest.dom_tree().dominates(id, latch_id);
+
+        auto key = addr->terms;
+        auto& group = groups[key];
+        if (group.accesses.empty()) {
+          group.iv = iv;
+          group.stride = addr->terms.at(iv->phi->dest);
+          group.base = *addr;
+          group.base.terms.erase(iv->phi->dest);
+          group.ptr_ty = ty->second.type();
+        }
+        group.always_runs |= always_runs;
+        group.accesses.push_back({inst.get(), *addr});
+      }
+    }
+    std::vector<Group> candidates;
+    for (auto& [key, group] : groups) {
+      auto& accesses = group.accesses;
+      std::sort(accesses.begin(), accesses.end(), [](auto& a, auto& b) {
+        return int32_t(a.addr.constant) < int32_t(b.addr.constant);
+      });
+      group.base.constant = accesses.front().addr.constant;
+      accesses.erase(
+          std::remove_if(accesses.begin(), accesses.end(),
+                         [&](auto& a) {
+                           return int32_t(a.addr.constant -
+                                          group.base.constant) >
+                                  MAX_MEMORY_OFFSET;
+                         }),
+          accesses.end());
+      candidates.push_back(std::move(group));
+    }
+    if (candidates.empty()) return;
+
+    // Pick the groups worth a pointer, most profitable first
+    std::vector<size_t> order;
+    std::vector<uint32_t> alone;
+    for (size_t i = 0; i < candidates.size(); i++) {
+      order.push_back(i);
+      alone.push_back(saved_by(du, candidates, {i}).second);
+    }
+    std::stable_sort(order.begin(), order.end(),
+                     [&](auto a, auto b) { return alone[a] > alone[b]; });
+    std::vector<size_t> picked;
+    auto initial_pressure = pressure(du, forest, loop, candidates, {}, {});
+    uint32_t saved = 0;
+    for (auto i : order) {
+      auto trial = picked;
+      trial.push_back(i);
+      auto [dead, trial_saved] = saved_by(du, candidates, trial);
+      // Each pointer costs an `add` per iteration
+      if (trial_saved < saved + 2) continue;
+      if (pressure(du, forest, loop, candidates, trial, dead) >
+          std::max(initial_pressure, REGISTER_BUDGET)) {
+        continue;
+      }
+      picked = std::move(trial);
+      saved = trial_saved;
+    }
+    if (picked.empty()) return;
+    auto dead = saved_by(du, candidates, picked).first;
+
+    auto trip = forest.trip_count(loop, func);
+    bool first_test_passes = trip && first_exit_test_passes(func, loop, *trip);
+    auto entering = loop.entering;
+    auto header_id = loop.header;
+    auto preheader_id =
+        loop.preheader ? *loop.preheader : make_preheader(func, loop);
+    auto& preheader = func.basic_blks.at(preheader_id);
+    auto& header = func.basic_blks.at(header_id);
+
+    std::map<mir::inst::VarId, std::pair<mir::inst::VarId, Group*>> pointers;
+    for (auto i : picked) {
+      auto& group = candidates[i];
+      auto& iv = *group.iv;
+      auto ptr = new_var(func, group.ptr_ty, true);
+      auto ptr_init = new_var(func, group.ptr_ty, true);
+      auto ptr_next = new_var(func, group.ptr_ty, true);
+
+      auto start = group.base;
+      start.add(outside_value(iv.init), group.stride);
+      emit_affine(func, preheader, start, ptr_init);
+      du.insert_inst(header, header.inst.begin(),
+                     std::make_unique<mir::inst::PhiInst>(
+                         ptr, std::vector{ptr_init, ptr_next}));
+      if (header_id == latch_id) step_pos++;
+      du.insert_inst(latch, latch.inst.begin() + step_pos,
+                     add_imm(ptr_next, ptr, group.stride * iv.step));
+
+      for (auto& access : group.accesses) {
+        int32_t delta = access.addr.constant - group.base.constant;
+        auto inst = access.inst;
+        if (auto x = dynamic_cast<mir::inst::StoreInst*>(inst)) {
+          du.replace_inst(inst, std::make_unique<mir::inst::StoreOffsetInst>(
+                                    x->val, ptr, delta));
+        } else if (auto x = dynamic_cast<mir::inst::StoreOffsetInst*>(inst)) {
+          du.replace_inst(inst, std::make_unique<mir::inst::StoreOffsetInst>(
+                                    x->val, ptr, delta));
+        } else {
+          du.replace_inst(inst, std::make_unique<mir::inst::LoadOffsetInst>(
+                                    ptr, inst->dest, delta));
+        }
+      }
+      pointers.insert({iv.phi->dest, {ptr_next, &group}});
+    }
+
+    for (auto inst : dead) erase(du, inst);
+    for (auto& [var, iv] : ivs) {
+      if (!pointers.count(var)) continue;
+      auto [ptr_next, group] = pointers.at(var);
+      if (trip && trip->iv == var && first_test_passes &&
+          group->always_runs &&
+          replace_exit_test(func, latch, iv, *trip, ptr_next, *group,
+                            preheader)) {
+        LOG(TRACE) << "strength reduction: replaced exit test of " << func.name
+                   << " bb" << header_id << std::endl;
+      }
+      remove_if_dead(du, iv);
+    }
+    du.rescan_block(preheader);
+    LOG(TRACE) << "strength reduction: " << picked.size()
+               << " pointers in " << func.name << " bb" << header_id
+               << std::endl;
+  }
+
+  bool is_in_loop(mir::inst::VarId var) {
+    auto blk = func->def_use().def_block(var);
+    return blk && blocks.count(*blk);
+  }
+
+  static bool is_comparison(mir::inst::Op op) {
+    switch (op) {
+      case mir::inst::Op::Gt:
+      case mir::inst::Op::Lt:
+      case mir::inst::Op::Gte:
+      case mir::inst::Op::Lte:
+      case mir::inst::Op::Eq:
+      case mir::inst::Op::Neq:
+        return true;
+      default:
+        return false;
+    }
+  }
+
+  /// `var` as an affine function of values not changing inside the loop and
+  /// of header phis
+  std::optional<Affine> affine_of(mir::inst::VarId var) {
+    if (auto it = affine_memo.find(var); it != affine_memo.end()) {
+      return it->second;
+    }
+    auto& du = func->def_use();
+    std::optional<Affine> res;
+    affine_memo.insert({var, res});
+    if (du.def_count(var) == 0 || header_phis.count(var) ||
+        (du.def_count(var) == 1 && !is_in_loop(var))) {
+      res = Affine{{{var, 1}}, 0};
+    } else if (auto x = dynamic_cast<mir::inst::OpInst*>(du.def_of(var))) {
+      auto lhs = affine_of(x->lhs);
+      auto rhs = affine_of(x->rhs);
+      if (lhs && rhs) {
+        switch (x->op) {
+          case mir::inst::Op::Add:
+            res = lhs->add(*rhs);
+            break;
+          case mir::inst::Op::Sub:
+            res = lhs->add(*rhs, -1);
+            break;
+          case mir::inst::Op::Mul:
+            if (rhs->terms.empty()) {
+              res = lhs->scale(rhs->constant);
+            } else if (lhs->terms.empty()) {
+              res = rhs->scale(lhs->constant);
+            }
+            break;
+          case mir::inst::Op::Shl:
+            if (rhs->terms.empty() && rhs->constant < 32) {
+              res = lhs->scale(uint32_t(1) << rhs->constant);
+            }
+            break;
+          default:
+            break;
+        }
+      }
+    } else if (auto x = dynamic_cast<mir::inst::AssignInst*>(du.def_of(var))) {
+      res = affine_of(x->src);
+    }
+    affine_memo.insert_or_assign(var, res);
+    return res;
+  }
+
+  std::optional<Affine> affine_of(const mir::inst::Value& val) {
+    if (val.is_immediate()) {
+      return Affine{{}, uint32_t(std::get<int32_t>(val))};
+    }
+    auto res = affine_of(std::get<mir::inst::VarId>(val));
+    if (!res || !val.has_shift()) return res;
+    if (val.shift != arm::RegisterShiftKind::Lsl) return {};
+    return res->scale(uint32_t(1) << val.shift_amount);
+  }
+
+  /// A value defined outside the loop, as a constant if it is one
+  Affine outside_value(mir::inst::VarId var) {
+    auto assign =
+        dynamic_cast<mir::inst::AssignInst*>(func->def_use().def_of(var));
+    if (assign && assign->src.is_immediate()) {
+      return Affine{{}, uint32_t(std::get<int32_t>(assign->src))};
+    }
+    return Affine{{{var, 1}}, 0};
+  }
+
+  /// Pointer a load or store goes through
+  static std::optional<mir::inst::VarId> access_ptr(mir::inst::Inst& inst) {
+    const mir::inst::Value* ptr = nullptr;
+    if (auto x = dynamic_cast<mir::inst::LoadInst*>(&inst)) {
+      ptr = &x->src;
+    } else if (auto x = dynamic_cast<mir::inst::LoadOffsetInst*>(&inst)) {
+      ptr = &x->src;
+    } else if (dynamic_cast<mir::inst::StoreInst*>(&inst) ||
+               dynamic_cast<mir::inst::StoreOffsetInst*>(&inst)) {
+      return inst.dest;
+    }
+    if (ptr == nullptr || ptr->is_immediate() || ptr->has_shift()) return {};
+    return std::get<mir::inst::VarId>(*ptr);
+  }
+
+  std::optional<Affine> access_addr(mir::inst::Inst& inst) {
+    std::optional<Affine> addr = affine_of(*access_ptr(inst));
+    const mir::inst::Value* offset = nullptr;
+    if (auto x = dynamic_cast<mir::inst::LoadOffsetInst*>(&inst)) {
+      offset = &x->offset;
+    } else if (auto x = dynamic_cast<mir::inst::StoreOffsetInst*>(&inst)) {
+      offset = &x->offset;
+    }
+    if (addr && offset) {
+      auto off = affine_of(*offset);
+      if (!off) return {};
+      addr->add(*off);
+    }
+    return addr;
+  }
+
+  /// Rewrites values computed as `iv + c` through a chain of additions into
+  /// a single addition, so the chain does not outlive the accesses using it
+  void canonicalize(mir::inst::MirFunction& func, const mir::inst::Loop& loop,
+                    const std::map<mir::inst::VarId, InductionVar>& ivs,
+                    const std::unordered_set<mir::inst::Inst*>& late) {
+    auto& du = func.def_use();
+    for (auto id : loop.blocks) {
+      for (auto& inst : func.basic_blks.at(id).inst) {
+        auto op = dynamic_cast<mir::inst::OpInst*>(inst.get());
+        if (op == nullptr || late.count(op)) continue;
+        if (op->op != mir::inst::Op::Add && op->op != mir::inst::Op::Sub) {
+          continue;
+        }
+        auto val = affine_of(op->dest);
+        if (!val || val->terms.size() != 1 || val->constant == 0) continue;
+        auto [var, coef] = *val->terms.begin();
+        if (coef != 1 || !ivs.count(var)) continue;
+        auto canonical = add_imm(op->dest, var, val->constant);
+        if (op->op == canonical->op && op->rhs.is_immediate() &&
+            *op->rhs.get_if<int32_t>() == *canonical->rhs.get_if<int32_t>() &&
+            !op->lhs.is_immediate() && !op->lhs.has_shift() &&
+            std::get<mir::inst::VarId>(op->lhs) == var) {
+          continue;
+        }
+        du.replace_inst(op, std::move(canonical));
+      }
+    }
+  }
+
+  /// Instructions of the loop left without uses once the accesses of
+  /// `picked` go through pointers, and how many instructions that saves per
+  /// iteration
+  std::pair<std::vector<mir::inst::Inst*>, uint32_t> saved_by(
+      mir::inst::DefUseChain& du, const std::vector<Group>& candidates,
+      const std::vector<size_t>& picked) {
+    std::unordered_map<mir::inst::VarId, size_t> uses;
+    std::vector<mir::inst::VarId> work;
+    auto drop_use = [&](mir::inst::VarId var) {
+      auto it = uses.find(var);
+      if (it == uses.end()) it = uses.insert({var, du.use_count(var)}).first;
+      if (it->second > 0 && --it->second == 0) work.push_back(var);
+    };
+    for (auto i : picked) {
+      for (auto& access : candidates[i].accesses) {
+        auto val = stored_value(*access.inst);
+        for (auto var : access.inst->useVars()) {
+          if (var != val) drop_use(var);
+        }
+      }
+    }
+    std::vector<mir::inst::Inst*> dead;
+    uint32_t saved = 0;
+    while (!work.empty()) {
+      auto var = work.back();
+      work.pop_back();
+      if (!is_in_loop(var) || du.def_count(var) != 1) continue;
+      auto def = du.def_of(var);
+      auto op = dynamic_cast<mir::inst::OpInst*>(def);
+      if (!op && !dynamic_cast<mir::inst::AssignInst*>(def)) continue;
+      dead.push_back(def);
+      if (op && !is_free_shift(*op)) saved++;
+      for (auto used : def->useVars()) drop_use(used);
+    }
+    return {dead, saved};
+  }
+
+  static std::optional<mir::inst::VarId> stored_value(mir::inst::Inst& inst) {
+    const mir::inst::Value* val = nullptr;
+    if (auto x = dynamic_cast<mir::inst::StoreInst*>(&inst)) {
+      val = &x->val;
+    } else if (auto x = dynamic_cast<mir::inst::StoreOffsetInst*>(&inst)) {
+      val = &x->val;
+    }
+    if (val == nullptr || val->is_immediate()) return {};
+    return std::get<mir::inst::VarId>(*val);
+  }
+
+  /// Scaling by a power of two, which codegen folds into the shifted operand
+  /// of the instruction using it
+  static bool is_free_shift(mir::inst::OpInst& op) {
+    if (op.op == mir::inst::Op::Shl) return op.rhs.is_immediate();
+    if (op.op != mir::inst::Op::Mul) return false;
+    for (auto val : {op.lhs, op.rhs}) {
+      if (!val.is_immediate()) continue;
+      auto imm = std::get<int32_t>(val);
+      if (imm > 0 && (imm & (imm - 1)) == 0) return true;
+    }
+    return false;
+  }
+
+  /// Values defined before the loop and used after it. They take a register
+  /// all along the loop whether it uses them or not.
+  void find_live_through(mir::inst::MirFunction& func,
+                         const mir::inst::LoopForest& forest,
+                         const mir::inst::Loop& loop) {
+    auto& du = func.def_use();
+    auto& dom = forest.dom_tree();
+    live_through.clear();
+    auto add_use = [&](mir::inst::VarId var) {
+      auto blk = du.def_block(var);
+      if (!blk || (!blocks.count(*blk) && dom.dominates(*blk, loop.header))) {
+        live_through.insert(var);
+      }
+    };
+    for (auto& [id, blk] : func.basic_blks) {
+      if (blocks.count(id) || !dom.dominates(loop.header, id)) continue;
+      for (auto& inst : blk.inst) {
+        for (auto var : inst->useVars()) add_use(var);
+      }
+      if (blk.jump.kind == mir::inst::JumpInstructionKind::BrCond ||
+          blk.jump.kind == mir::inst::JumpInstructionKind::Return) {
+        if (blk.jump.cond_or_ret) add_use(*blk.jump.cond_or_ret);
+      }
+    }
+  }
+
+  /// Values live across the loop once `picked` is applied: header phis,
+  /// pointers, values defined outside the loop used inside it and values
+  /// live through it. All of them are live across the loops nested in it
+  /// too, so those count with their own on top.
+  size_t pressure(mir::inst::DefUseChain& du,
+                  const mir::inst::LoopForest& forest,
+                  const mir::inst::Loop& loop,
+                  const std::vector<Group>& candidates,
+                  const std::vector<size_t>& picked,
+                  const std::vector<mir::inst::Inst*>& dead) {
+    std::unordered_set<mir::inst::Inst*> skipped(dead.begin(), dead.end());
+    std::unordered_set<mir::inst::Inst*> rewritten;
+    for (auto i : picked) {
+      for (auto& access : candidates[i].accesses) {
+        rewritten.insert(access.inst);
+      }
+    }
+    std::unordered_set<mir::inst::VarId> dropped;
+    auto live_in = uses_from_outside(loop, skipped, rewritten, &dropped);
+    // The preheader now uses what the loop stopped using. Inside an outer
+    // loop, values invariant to that loop then stay live across this one.
+    for (auto var : dropped) {
+      auto blk = du.def_block(var);
+      if (!outer_blocks.empty() && !(blk && outer_blocks.count(*blk))) {
+        live_in.insert(var);
+      }
+    }
+    live_in.insert(live_through.begin(), live_through.end());
+    auto own = header_phis.size() + picked.size();
+
+    size_t most = live_in.size();
+    std::vector<std::pair<uint32_t, std::unordered_set<mir::inst::VarId>>>
+        nested;
+    for (auto child : loop.children) nested.push_back({child, live_in});
+    while (!nested.empty()) {
+      auto [index, live] = std::move(nested.back());
+      nested.pop_back();
+      auto& inner = forest.loops().at(index);
+      auto uses = uses_from_outside(inner, skipped, rewritten, nullptr);
+      live.insert(uses.begin(), uses.end());
+      for (auto& inst : func->basic_blks.at(inner.header).inst) {
+        if (dynamic_cast<mir::inst::PhiInst*>(inst.get())) {
+          live.insert(inst->dest);
+        }
+      }
+      most = std::max(most, live.size());
+      for (auto child : inner.children) nested.push_back({child, live});
+    }
+    return most + own;
+  }
+
+  /// Variables defined outside `loop` it still uses once `skipped` is gone
+  /// and `rewritten` goes through pointers. Uses that go away are put in
+  /// `dropped`.
+  std::unordered_set<mir::inst::VarId> uses_from_outside(
+      const mir::inst::Loop& loop,
+      const std::unordered_set<mir::inst::Inst*>& skipped,
+      const std::unordered_set<mir::inst::Inst*>& rewritten,
+      std::unordered_set<mir::inst::VarId>* dropped) {
+    auto& du = func->def_use();
+    std::unordered_set<mir::inst::VarId> live_in;
+    auto is_outside = [&](mir::inst::VarId var) {
+      auto blk = du.def_block(var);
+      return !blk || !loop.contains(*blk);
+    };
+    auto add_use = [&](mir::inst::VarId var) {
+      if (is_outside(var)) live_in.insert(var);
+    };
+    auto drop_uses = [&](mir::inst::Inst& inst) {
+      if (dropped == nullptr) return;
+      for (auto var : inst.useVars()) {
+        if (is_outside(var)) dropped->insert(var);
+      }
+    };
+    for (auto id : loop.blocks) {
+      auto& blk = func->basic_blks.at(id);
+      for (auto& inst : blk.inst) {
+        if (dynamic_cast<mir::inst::PhiInst*>(inst.get())) continue;
+        if (skipped.count(inst.get())) {
+          drop_uses(*inst);
+          continue;
+        }
+        if (rewritten.count(inst.get())) {
+          drop_uses(*inst);
+          if (auto val = stored_value(*inst)) add_use(*val);
+          continue;
+        }
+        for (auto var : inst->useVars()) add_use(var);
+      }
+      if (blk.jump.kind == mir::inst::JumpInstructionKind::BrCond) {
+        add_use(*blk.jump.cond_or_ret);
+      }
+    }
+    return live_in;
+  }
+
+  /// Whether the loop is known to pass its first exit test, looking for a
+  /// guard in front of it testing the same condition on the initial value
+  bool first_exit_test_passes(mir::inst::MirFunction& func,
+                              const mir::inst::Loop& loop,
+                              const mir::inst::TripCount& trip) {
+    auto end = end_value(trip);
+    if (trip.init.is_immediate() && trip.bound.is_immediate()) {
+      int64_t first = int64_t(std::get<int32_t>(trip.init)) + trip.step;
+      return trip.step > 0 ? first <= end.value_or(INT64_MIN)
+                           : first >= end.value_or(INT64_MAX);
+    }
+    if (loop.entering.size() != 1) return false;
+    auto target = loop.header;
+    auto guard_id = loop.entering[0];
+    auto* guard = &func.basic_blks.at(guard_id);
+    if (guard->jump.kind == mir::inst::JumpInstructionKind::Br &&
+        guard->preceding.size() == 1) {
+      target = guard_id;
+      guard_id = *guard->preceding.begin();
+      guard = &func.basic_blks.at(guard_id);
+    }
+    auto& jump = guard->jump;
+    if (jump.kind != mir::inst::JumpInstructionKind::BrCond ||
+        jump.bb_true == jump.bb_false ||
+        (jump.bb_true != target && jump.bb_false != target)) {
+      return false;
+    }
+    mir::inst::OpInst* cmp = nullptr;
+    for (auto& inst : guard->inst) {
+      if (inst->dest == *jump.cond_or_ret) {
+        cmp = dynamic_cast<mir::inst::OpInst*>(inst.get());
+      }
+    }
+    if (cmp == nullptr) return false;
+    auto op = cmp->op;
+    if (jump.bb_false == target) {
+      auto negated = negate(op);
+      if (!negated) return false;
+      op = *negated;
+    }
+    if (op == trip.cmp && same_value(func, cmp->lhs, trip.init) &&
+        same_value(func, cmp->rhs, trip.bound)) {
+      return true;
+    }
+    auto swapped = swap(op);
+    return swapped && *swapped == trip.cmp &&
+           same_value(func, cmp->rhs, trip.init) &&
+           same_value(func, cmp->lhs, trip.bound);
+  }
+
+  /// Value of the tested variable once the loop stops, for unit steps
+  static std::optional<int64_t> end_value(const mir::inst::TripCount& trip) {
+    auto delta = end_delta(trip);
+    if (!delta || !trip.bound.is_immediate()) return {};
+    return std::get<int32_t>(trip.bound) + *delta;
+  }
+
+  static std::optional<int32_t> end_delta(const mir::inst::TripCount& trip) {
+    if (trip.step == 1) {
+      if (trip.cmp == mir::inst::Op::Lt) return 0;
+      if (trip.cmp == mir::inst::Op::Lte) return 1;
+    } else if (trip.step == -1) {
+      if (trip.cmp == mir::inst::Op::Gt) return 0;
+      if (trip.cmp == mir::inst::Op::Gte) return -1;
+    }
+    return {};
+  }
+
+  static std::optional<mir::inst::Op> negate(mir::inst::Op op) {
+    switch (op) {
+      case mir::inst::Op::Lt:
+        return mir::inst::Op::Gte;
+      case mir::inst::Op::Lte:
+        return mir::inst::Op::Gt;
+      case mir::inst::Op::Gt:
+        return mir::inst::Op::Lte;
+      case mir::inst::Op::Gte:
+        return mir::inst::Op::Lt;
+      default:
+        return {};
+    }
+  }
+
+  static std::optional<mir::inst::Op> swap(mir::inst::Op op) {
+    switch (op) {
+      case mir::inst::Op::Lt:
+        return mir::inst::Op::Gt;
+      case mir::inst::Op::Lte:
+        return mir::inst::Op::Gte;
+      case mir::inst::Op::Gt:
+        return mir::inst::Op::Lt;
+      case mir::inst::Op::Gte:
+        return mir::inst::Op::Lte;
+      default:
+        return {};
+    }
+  }
+
+  /// Whether `a` and `b` hold the same value, looking through copies of
+  /// constants
+  static bool same_value(mir::inst::MirFunction& func,
+                         const mir::inst::Value& a,
+                         const mir::inst::Value& b) {
+    auto resolve = [&](const mir::inst::Value& v) -> mir::inst::Value {
+      if (v.is_immediate() || v.has_shift()) return v;
+      auto assign = dynamic_cast<mir::inst::AssignInst*>(
+          func.def_use().def_of(std::get<mir::inst::VarId>(v)));
+      if (assign && assign->src.is_immediate()) return assign->src;
+      return v;
+    };
+    auto x = resolve(a), y = resolve(b);
+    if (x.has_shift() || y.has_shift()) return false;
+    if (x.is_immediate() != y.is_immediate()) return false;
+    if (x.is_immediate()) {
+      return std::get<int32_t>(x) == std::get<int32_t>(y);
+    }
+    return std::get<mir::inst::VarId>(x) == std::get<mir::inst::VarId>(y);
+  }
+
+  /// Makes the exit test compare `ptr_next` against its value on leaving the
+  /// loop, if the induction variable is needed for nothing else
+  bool replace_exit_test(mir::inst::MirFunction& func,
+                         mir::inst::BasicBlk& latch, const InductionVar& iv,
+                         const mir::inst::TripCount& trip,
+                         mir::inst::VarId ptr_next, const Group& group,
+                         mir::inst::BasicBlk& preheader) {
+    auto& du = func.def_use();
+    auto delta = end_delta(trip);
+    if (!delta || trip.exiting != latch.id || !trip.tests_next) return false;
+    auto cond = *latch.jump.cond_or_ret;
+    auto cmp = dynamic_cast<mir::inst::OpInst*>(du.def_of(cond));
+    if (cmp == nullptr || du.def_block(cond) != latch.id ||
+        du.use_count(cond) != 1) {
+      return false;
+    }
+    for (auto use : du.uses_of(iv.phi->dest)) {
+      if (use.is_jump() || use.inst->dest != iv.next) return false;
+    }
+    for (auto use : du.uses_of(iv.next)) {
+      if (use.is_jump() || (use.inst != iv.phi && use.inst != cmp)) {
+        return false;
+      }
+    }
+
+    // The pointer ends up at `base + stride * (bound + delta)`
+    auto end = group.base;
+    end.constant += group.stride * uint32_t(*delta);
+    if (trip.bound.is_immediate()) {
+      end.constant += group.stride * uint32_t(std::get<int32_t>(trip.bound));
+    } else {
+      end.add(Affine{{{std::get<mir::inst::VarId>(trip.bound), 1}}, 0},
+              group.stride);
+    }
+    auto ptr_end = new_var(func, func.variables.at(ptr_next.id).ty, false);
+    emit_affine(func, preheader, end, ptr_end);
+
+    auto op = blocks.count(latch.jump.bb_true) ? mir::inst::Op::Neq
+                                               : mir::inst::Op::Eq;
+    du.replace_inst(cmp, std::make_unique<mir::inst::OpInst>(cond, ptr_next,
+                                                             ptr_end, op));
+    return true;
+  }
+
+  /// Drops an induction variable only stepping itself
+  void remove_if_dead(mir::inst::DefUseChain& du, const InductionVar& iv) {
+    for (auto use : du.uses_of(iv.phi->dest)) {
+      if (use.is_jump() || use.inst->dest != iv.next) return;
+    }
+    for (auto use : du.uses_of(iv.next)) {
+      if (use.is_jump() || use.inst != iv.phi) return;
+    }
+    auto next = du.def_of(iv.next);
+    if (next == nullptr) return;
+    erase(du, next);
+    erase(du, iv.phi);
+  }
+
+  static void erase(mir::inst::DefUseChain& du, mir::inst::Inst* inst) {
+    auto blk_id = du.block_of(inst);
+    if (!blk_id) return;
+    auto& blk = du.function().basic_blks.at(*blk_id);
+    auto it = std::find_if(blk.inst.begin(), blk.inst.end(),
+                           [&](auto& i) { return i.get() == inst; });
+    du.erase_inst(blk, it);
+  }
+};
+
+}  // namespace optimization::strength_reduction
@@ -0,0 +1,360 @@
+#include "./tail_recursion.hpp"
+
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <optional>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "../../include/aixlog.hpp"
+#include "../../mir/def_use.hpp"
+#include "../../mir/loop.hpp"
+#include "optimization.hpp"
+#include "strength_reduction.hpp"
+
+namespace optimization::tail_recursion {
+
+void Tail_Recursion::optimize_mir(
+    mir::inst::MirPackage& mir,
+    std::map<std::string, std::any>& extra_data_repo) {
+  for (auto& f : mir.functions) {
+    if (f.second.type->is_extern) continue;
+    optimize_func(f.second, extra_data_repo);
+  }
+}
+
+namespace {
+
+/// A call of the function to itself in tail position
+struct Site {
+  mir::types::LabelId blk;
+  mir::inst::CallInst* call;
+  /// The `+` or `*` applied to the result before returning it, if any
+  mir::inst::OpInst* op = nullptr;
+  /// The value returned, the result of `op` or of the call
+  mir::inst::VarId result;
+};
+
+class Elimination {
+ public:
+  Elimination(mir::inst::MirFunction& func) : func(func) {}
+
+  /// Why the function is left alone, or an empty string once done
+  std::string run() {
+    auto exit = func.basic_blks.lower_bound(MAX_BLOCK_ID);
+    if (exit == func.basic_blks.end()) return "no exit block";
+    auto& entry = func.basic_blks.begin()->second;
+    if (entry.id >= MAX_BLOCK_ID || !entry.preceding.empty()) {
+      return "entry block is a loop header";
+    }
+    exit_id = exit->first;
+    auto& du = func.def_use();
+    for (auto& inst : exit->second.inst) {
+      auto kind = inst->inst_kind();
+      if (kind == mir::inst::InstKind::Phi && phi == nullptr) {
+        phi = dynamic_cast<mir::inst::PhiInst*>(inst.get());
+      } else if (kind != mir::inst::InstKind::Assign) {
+        return "exit block does more than return";
+      }
+    }
+    params = func.type->params.size();
+    for (uint32_t id = 1; id <= params; id++) {
+      if (!func.variables.count(id) || du.def_count(id) != 0) {
+        return "parameters are redefined";
+      }
+    }
+
+    for (auto& [id, blk] : func.basic_blks) {
+      if (id >= MAX_BLOCK_ID || !ends_in_exit(blk)) continue;
+      if (auto site = site_in(blk)) sites.push_back(*site);
+    }
+    if (sites.empty()) return "no tail calls";
+    for (auto& site : sites) {
+      if (!site.op) continue;
+      if (op && *op != site.op->op) return "accumulated by different ops";
+      op = site.op->op;
+    }
+    if (!returns()) return "never returns";
+
+    transform();
+    return "";
+  }
+
+  std::string remark() const {
+    auto remark = func.name + ": " + std::to_string(sites.size()) +
+                  " tail call" + (sites.size() == 1 ? "" : "s");
+    if (op) remark += ", accumulated";
+    return remark;
+  }
+
+ private:
+  /// Whether `blk` jumps to the exit block, through empty blocks at most
+  bool ends_in_exit(mir::inst::BasicBlk& blk) {
+    std::set<mir::types::LabelId> seen;
+    auto* at = &blk;
+    while (at->jump.kind == mir::inst::JumpInstructionKind::Br) {
+      auto next = at->jump.bb_true;
+      if (next == exit_id) return true;
+      auto it = func.basic_blks.find(next);
+      if (it == func.basic_blks.end() || !it->second.inst.empty() ||
+          !seen.insert(next).second) {
+        return false;
+      }
+      at = &it->second;
+    }
+    return false;
+  }
+
+  /// The tail call ending `blk`, if it is one this pass can turn around
+  std::optional<Site> site_in(mir::inst::BasicBlk& blk) {
+    auto& du = func.def_use();
+    auto& insts = blk.inst;
+    if (insts.empty()) return std::nullopt;
+    Site site{blk.id, nullptr, nullptr, mir::inst::VarId()};
+    auto last = insts.back().get();
+    site.op = dynamic_cast<mir::inst::OpInst*>(last);
+    if (site.op && insts.size() >= 2) {
+      site.call = dynamic_cast<mir::inst::CallInst*>(insts.end()[-2].get());
+    } else {
+      site.call = dynamic_cast<mir::inst::CallInst*>(last);
+      site.op = nullptr;
+    }
+    auto call = site.call;
+    if (call == nullptr || call->func != func.name ||
+        call->params.size() != params) {
+      return std::nullopt;
+    }
+    // A pointer into a local array outlives the round that made it
+    for (auto& arg : call->params) {
+      auto var = arg.get_if<mir::inst::VarId>();
+      if (var == nullptr) continue;
+      if (std::holds_alternative<mir::inst::VarId>(object_of(func, *var))) {
+        return std::nullopt;
+      }
+      auto def = du.def_of(base_pointer(func, *var));
+      auto alloc = dynamic_cast<mir::inst::CallInst*>(def);
+      if (alloc && alloc->func == "malloc") return std::nullopt;
+    }
+
+    if (func.type->ret->kind() == mir::types::TyKind::Void) {
+      return site.op ? std::nullopt : std::optional(site);
+    }
+    site.result = call->dest;
+    if (site.op) {
+      auto x = site.op;
+      if (x->op != mir::inst::Op::Add && x->op != mir::inst::Op::Mul) {
+        return std::nullopt;
+      }
+      auto is_call = [&](mir::inst::Value& val) {
+        return !val.has_shift() && val.get_if<mir::inst::VarId>() &&
+               *val.get_if<mir::inst::VarId>() == call->dest;
+      };
+      if (is_call(x->lhs) == is_call(x->rhs) || du.use_count(call->dest) != 1) {
+        return std::nullopt;
+      }
+      site.result = x->dest;
+    }
+    // The result goes straight to the exit block and nowhere else
+    auto uses = du.uses_of(site.result);
+    if (uses.size() != 1 || uses[0].blk != exit_id) return std::nullopt;
+    if (phi && uses[0].inst != phi) return std::nullopt;
+    return site;
+  }
+
+  /// Whether the exit block is reached without going through a tail call
+  bool returns() {
+    std::set<mir::types::LabelId> tail;
+    for (auto& site : sites) tail.insert(site.blk);
+    std::set<mir::types::LabelId> reached{func.basic_blks.begin()->first};
+    std::vector<mir::types::LabelId> stack{func.basic_blks.begin()->first};
+    while (!stack.empty()) {
+      auto id = stack.back();
+      stack.pop_back();
+      if (id == exit_id) return true;
+      if (tail.count(id)) continue;
+      for (auto succ : mir::inst::successors(func.basic_blks.at(id))) {
+        if (func.basic_blks.count(succ) && reached.insert(succ).second) {
+          stack.push_back(succ);
+        }
+      }
+    }
+    return false;
+  }
+
+  mir::inst::VarId new_var(mir::types::SharedTyPtr ty, bool is_phi_var) {
+    return strength_reduction::new_var(func, ty, is_phi_var);
+  }
+
+  void transform() {
+    mir::types::LabelId header_id = 0;
+    for (auto& [id, blk] : func.basic_blks) {
+      if (id < MAX_BLOCK_ID) header_id = std::max(header_id, id);
+    }
+    header_id++;
+    auto& entry = func.basic_blks.begin()->second;
+    auto& header =
+        func.basic_blks.insert({header_id, mir::inst::BasicBlk(header_id)})
+            .first->second;
+    header.inst = std::move(entry.inst);
+    header.jump = std::move(entry.jump);
+    entry.inst.clear();
+    entry.jump = mir::inst::JumpInstruction(
+        mir::inst::JumpInstructionKind::Br, header_id, -1, std::nullopt,
+        mir::inst::JumpKind::Branch);
+
+    // Parameters are read through the phis from now on
+    std::vector<mir::inst::VarId> current;
+    std::vector<std::vector<mir::inst::VarId>> incoming(params);
+    for (uint32_t i = 0; i < params; i++) {
+      auto param = mir::inst::VarId(i + 1);
+      auto ty = func.variables.at(param.id).ty;
+      current.push_back(new_var(ty, true));
+      for (auto& [id, blk] : func.basic_blks) {
+        for (auto& inst : blk.inst) inst->replace(param, current[i]);
+        blk.jump.replace(param, current[i]);
+      }
+      incoming[i].push_back(new_var(ty, true));
+      entry.inst.push_back(
+          std::make_unique<mir::inst::AssignInst>(incoming[i][0], param));
+    }
+    std::optional<mir::inst::VarId> acc;
+    std::vector<mir::inst::VarId> acc_incoming;
+    auto ret_ty = func.type->ret;
+    if (op) {
+      acc = new_var(ret_ty, true);
+      acc_incoming.push_back(new_var(ret_ty, true));
+      entry.inst.push_back(std::make_unique<mir::inst::AssignInst>(
+          acc_incoming[0], *op == mir::inst::Op::Add ? 0 : 1));
+    }
+
+    std::set<mir::inst::VarId> returned;
+    for (auto& site : sites) {
+      auto& blk = func.basic_blks.at(site.blk);
+      auto args = site.call->params;
+      std::optional<mir::inst::Value> step;
+      if (site.op) {
+        auto& lhs = site.op->lhs;
+        bool call_on_left = lhs.get_if<mir::inst::VarId>() &&
+                            *lhs.get_if<mir::inst::VarId>() ==
+                                site.call->dest;
+        step = call_on_left ? site.op->rhs : site.op->lhs;
+      }
+      returned.insert(site.result);
+      blk.inst.resize(blk.inst.size() - (site.op ? 2 : 1));
+
+      std::vector<mir::inst::Value> copies;
+      for (uint32_t i = 0; i < params; i++) {
+        if (args[i].is_immediate()) {
+          copies.push_back(args[i]);
+          continue;
+        }
+        auto copy = new_var(func.variables.at(i + 1).ty, false);
+        blk.inst.push_back(
+            std::make_unique<mir::inst::AssignInst>(copy, args[i]));
+        copies.push_back(copy);
+      }
+      if (acc) {
+        auto next = new_var(ret_ty, true);
+        if (step) {
+          blk.inst.push_back(
+              std::make_unique<mir::inst::OpInst>(next, *acc, *step, *op));
+        } else {
+          blk.inst.push_back(std::make_unique<mir::inst::AssignInst>(next,
+                                                                     *acc));
+        }
+        acc_incoming.push_back(next);
+      }
+      for (uint32_t i = 0; i < params; i++) {
+        auto next = new_var(func.variables.at(i + 1).ty, true);
+        blk.inst.push_back(
+            std::make_unique<mir::inst::AssignInst>(next, copies[i]));
+        incoming[i].push_back(next);
+      }
+      blk.jump = mir::inst::JumpInstruction(
+          mir::inst::JumpInstructionKind::Br, header_id, -1, std::nullopt,
+          mir::inst::JumpKind::Loop);
+    }
+
+    std::vector<std::unique_ptr<mir::inst::Inst>> phis;
+    for (uint32_t i = 0; i < params; i++) {
+      phis.push_back(
+          std::make_unique<mir::inst::PhiInst>(current[i], incoming[i]));
+    }
+    if (acc) {
+      phis.push_back(std::make_unique<mir::inst::PhiInst>(*acc, acc_incoming));
+    }
+    header.inst.insert(header.inst.begin(),
+                       std::make_move_iterator(phis.begin()),
+                       std::make_move_iterator(phis.end()));
+
+    auto& exit = func.basic_blks.at(exit_id);
+    if (phi) {
+      auto& vars = phi->vars;
+      vars.erase(std::remove_if(vars.begin(), vars.end(),
+                                [&](auto var) { return returned.count(var); }),
+                 vars.end());
+      // What the function returns, combined with the accumulator below
+      mir::inst::VarId value = phi->dest;
+      if (vars.size() == 1) {
+        value = vars[0];
+        auto dest = phi->dest;
+        exit.inst.erase(exit.inst.begin());
+        replace_in(exit, dest, value);
+      }
+      if (acc) {
+        auto total = new_var(ret_ty, false);
+        replace_in(exit, value, total);
+        auto pos = exit.inst.begin();
+        while (pos != exit.inst.end() &&
+               (*pos)->inst_kind() == mir::inst::InstKind::Phi) {
+          pos++;
+        }
+        exit.inst.insert(pos, std::make_unique<mir::inst::OpInst>(
+                                  total, value, *acc, *op));
+      }
+    }
+    func.invalidate_def_use();
+    remove_unreachable_blocks(func);
+  }
+
+  /// Replaces the reads of `from` outside phis of `blk` by `to`
+  void replace_in(mir::inst::BasicBlk& blk, mir::inst::VarId from,
+                  mir::inst::VarId to) {
+    for (auto& inst : blk.inst) {
+      if (inst->inst_kind() != mir::inst::InstKind::Phi) {
+        inst->replace(from, to);
+      }
+    }
+    blk.jump.replace(from, to);
+  }
+
+  mir::inst::MirFunction& func;
+  mir::types::LabelId exit_id;
+  /// The phi of the returned values in the exit block, if there is one
+  mir::inst::PhiInst* phi = nullptr;
+  uint32_t params;
+  std::vector<Site> sites;
+  /// The operation accumulating results, if any call needs one
+  std::optional<mir::inst::Op> op;
+};
+
+}  // namespace
+
+void Tail_Recursion::optimize_func(
+    mir::inst::MirFunction& func,
+    std::map<std::string, std::any>& extra_data_repo) {
+  Elimination elimination(func);
+  auto reason = elimination.run();
+  if (!reason.empty()) {
+    LOG(TRACE) << "tail recursion: " << func.name << ": " << reason
+               << std::endl;
+    return;
+  }
+  auto remark = elimination.remark();
+  LOG(TRACE) << "tail recursion: " << remark << std::endl;
+  backend::report_statistic(extra_data_repo, pass_name(), remark);
+}
+
+}  // namespace optimization::tail_recursion
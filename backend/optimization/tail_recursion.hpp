@@ -0,0 +1,39 @@
+#pragma once
+
+#include "../../mir/mir.hpp"
+#include "../backend.hpp"
+
+namespace optimization::tail_recursion {
+
+/// Tail recursion elimination.
+///
+/// A call of a function to itself whose result, if any, is returned right
+/// away becomes a jump back to the top of the function. The entry block is
+/// split: its instructions move into a new loop header, where every
+/// parameter is read through a phi taking the argument as the function was
+/// called and the arguments of each tail call. The arguments are copied
+/// aside first, so one parameter's new value doesn't overwrite another's
+/// before it is read.
+///
+/// A call whose result only gets `+` or `*` some other value before being
+/// returned, as in `return n * fact(n - 1)`, is turned around the same way
+/// with an accumulator: the other value is folded into a phi starting at 0
+/// or 1, and every value the function returns is combined with it. That is
+/// exact since both operations wrap around.
+///
+/// Calls passing a pointer into a local array are left alone, as the array
+/// would be reused by the next round while the callee still reads it.
+class Tail_Recursion final : public backend::MirOptimizePass {
+ public:
+  std::string pass_name() const override {
+    return "Tail recursion elimination";
+  }
+  void optimize_mir(mir::inst::MirPackage& mir,
+                    std::map<std::string, std::any>& extra_data_repo) override;
+
+ private:
+  void optimize_func(mir::inst::MirFunction& func,
+                     std::map<std::string, std::any>& extra_data_repo);
+};
+
+}  // namespace optimization::tail_recursion
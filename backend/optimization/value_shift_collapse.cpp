@@ -1,11 +1,13 @@
 #include "value_shift_collapse.hpp"
 
+#include <optional>
 #include <stdexcept>
 #include <unordered_map>
 #include <unordered_set>
 #include <variant>
 
 #include "../../include/aixlog.hpp"
+#include "../../mir/value_range.hpp"
 
 namespace optimization::value_shift_collapse {
 using namespace mir::inst;
@@ -31,7 +33,14 @@ arm::RegisterShiftKind mir_op_to_arm_shift(Op op) {
   }
 }
 
+bool is_right_shift(arm::RegisterShiftKind shift) {
+  return shift == arm::RegisterShiftKind::Lsr ||
+         shift == arm::RegisterShiftKind::Asr;
+}
+
 void ValueShiftCollapse::optimize_function(MirFunction &func) {
+  // Computed the first time a shift could use it
+  std::optional<ValueRanges> ranges;
   for (auto &bb : func.basic_blks) {
     auto shift_map = std::unordered_map<
         VarId, std::tuple<VarId, arm::RegisterShiftKind, uint8_t>>();
@@ -53,6 +62,16 @@ void ValueShiftCollapse::optimize_function(MirFunction &func) {
     auto map_shift = [&](Value &val, VarId &id) -> void {
       if (auto x = shift_map.find(id); x != shift_map.end()) {
         auto [var_id, shift, amount] = x->second;
+        // Both right shifts of a non-negative value are the same
+        if (val.shift_amount != 0 && val.shift != shift &&
+            is_right_shift(val.shift) && is_right_shift(shift)) {
+          if (!ranges) ranges.emplace(func);
+          if (ranges->info_at(var_id, bb.first).non_negative()) {
+            shift = val.shift;
+          }
+        }
+        // Operand shifts go up to 31
+        if (val.shift_amount + amount >= 32) return;
         if (val.shift_amount == 0 || val.shift == shift) {
           val.shift = shift;
           val.shift_amount += amount;
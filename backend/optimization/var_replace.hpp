@@ -15,57 +15,34 @@
 #include <vector>
 
 #include "../../include/aixlog.hpp"
+#include "../../mir/def_use.hpp"
 #include "../../mir/mir.hpp"
 #include "../backend.hpp"
 
 namespace optimization::var_replace {
 
+/// Renames variables through the def-use index of `func`, so only the users
+/// of the renamed variable are visited. Definitions and uses are looked up in
+/// `du`; edits made next to it have to keep it up to date.
 class Var_Replace {
  public:
   mir::inst::MirFunction& func;
-  std::map<mir::inst::VarId, std::vector<std::pair<mir::types::LabelId, int>>>
-      usepoints;
-  std::map<mir::inst::VarId, std::pair<mir::types::LabelId, int>> defpoint;
-  Var_Replace(mir::inst::MirFunction& func) : func(func) {
+  mir::inst::DefUseChain& du;
+  Var_Replace(mir::inst::MirFunction& func)
+      : func(func), du(func.def_use()) {
     for (auto& blkpair : func.basic_blks) {
-      for (int i = 0; i < blkpair.second.inst.size(); i++) {
-        auto& inst = blkpair.second.inst[i];
-        auto& is = *inst;
-        for (auto var : inst->useVars()) {
-          add_usepoint(var, blkpair.first, i);
-        }
+      for (auto& inst : blkpair.second.inst) {
         if (inst->inst_kind() == mir::inst::InstKind::Phi) {
-          auto phiInst = dynamic_cast<mir::inst::PhiInst*>(&is);
+          auto phiInst = dynamic_cast<mir::inst::PhiInst*>(inst.get());
           for (auto var : phiInst->vars) {
             func.variables.at(var.id).is_phi_var = true;
           }
           func.variables.at(phiInst->dest.id).is_phi_var = true;
         }
-        setdefpoint(inst->dest, blkpair.first, i);
-      }
-
-      if (blkpair.second.jump.cond_or_ret.has_value()) {
-        add_usepoint(blkpair.second.jump.cond_or_ret.value(), blkpair.first,
-                     -1);
       }
     }
   }
 
-  std::unique_ptr<mir::inst::Inst>& get_usepoint(
-      std::pair<mir::types::LabelId, int> pair) {  // not jump point
-    auto& inst = func.basic_blks.at(pair.first).inst.at(pair.second);
-    return inst;
-  }
-
-  void add_usepoint(mir::inst::VarId var, mir::types::LabelId labelId,
-                    int idx) {
-    if (!usepoints.count(var)) {
-      usepoints.insert(
-          {var, std::vector<std::pair<mir::types::LabelId, int>>()});
-    }
-    usepoints.at(var).push_back({labelId, idx});
-  }
-
   void replace(mir::inst::VarId from, mir::inst::VarId to) {
     if (from == to) {
       return;
@@ -74,25 +51,7 @@ class Var_Replace {
         func.variables.at(to).is_phi_var) {
       return;
     }
-    if (usepoints.count(from)) {
-      for (auto pair : usepoints.at(from)) {
-        if (pair.second == -1) {
-          func.basic_blks.at(pair.first).jump.replace(from, to);
-        } else {
-          auto& inst = func.basic_blks.at(pair.first).inst.at(pair.second);
-          inst->replace(from, to);
-        }
-        if (!usepoints.count(to)) {
-          usepoints.insert(
-              {to, std::vector<std::pair<mir::types::LabelId, int>>()});
-        }
-        usepoints.at(to).push_back(pair);
-      }
-    }
-  }
-
-  void setdefpoint(mir::inst::VarId var, mir::types::LabelId labelId, int i) {
-    defpoint.insert({var, {labelId, i}});
+    du.replace_all_uses(from, to);
   }
 };
 }  // namespace optimization::var_replace
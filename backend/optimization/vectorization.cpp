@@ -0,0 +1,1040 @@
+#include "./vectorization.hpp"
+
+#include <algorithm>
+#include <array>
+#include <map>
+#include <memory>
+#include <optional>
+#include <set>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "../../include/aixlog.hpp"
+#include "../../mir/def_use.hpp"
+#include "dependence.hpp"
+#include "optimization.hpp"
+#include "strength_reduction.hpp"
+
+namespace optimization::vectorization {
+
+using strength_reduction::Affine;
+
+/// Lanes of a quad register, each holding an `i32`
+const uint32_t LANES = 4;
+const uint32_t LANE_SIZE = 4;
+/// Pairs of address ranges the preheader may test for overlap
+const size_t MAX_CHECKS = 6;
+/// Largest number of bytes an address may move per unit of the induction
+/// variable. The range tests multiply the trip count by it and must not
+/// overflow.
+const uint32_t MAX_STRIDE = 64;
+/// Deepest operand tree packed
+const int MAX_DEPTH = 12;
+
+using Lanes = std::vector<mir::inst::Value>;
+using LaneInsts = std::array<mir::inst::Inst*, LANES>;
+
+/// Header phi moving by a constant once per round
+struct Control {
+  mir::inst::VarId init;
+  uint32_t step;
+};
+
+/// Header phi summing values over the loop. Every instruction of `chain`
+/// adds a value to the result of the one before (or subtracts it, or adds a
+/// product), starting from the phi and ending with its next value.
+struct Reduction {
+  mir::inst::PhiInst* phi;
+  mir::inst::VarId init;
+  std::vector<mir::inst::Inst*> chain;
+  /// Vector phi holding one partial sum per lane
+  mir::inst::VarId acc;
+};
+
+/// Source of an operand of a vector instruction: another pack, or a scalar
+/// copied into every lane
+struct Operand {
+  int pack = -1;
+  mir::inst::Value splat = 0;
+};
+
+/// One instruction per lane, all done by a single vector instruction at the
+/// place of the first one
+struct Pack {
+  LaneInsts lanes;
+  std::vector<Operand> operands;
+  /// Index of the reduction whose chain the instructions belong to
+  int reduction = -1;
+  mir::inst::VarId vec;
+};
+
+/// A load or a store of the body
+struct Access {
+  mir::inst::Inst* inst;
+  bool is_store;
+  Affine addr;
+};
+
+bool is_store(mir::inst::Inst* inst) {
+  return dynamic_cast<mir::inst::StoreInst*>(inst) ||
+         dynamic_cast<mir::inst::StoreOffsetInst*>(inst);
+}
+
+bool is_load(mir::inst::Inst* inst) {
+  return dynamic_cast<mir::inst::LoadInst*>(inst) ||
+         dynamic_cast<mir::inst::LoadOffsetInst*>(inst);
+}
+
+bool same_value(const mir::inst::Value& a, const mir::inst::Value& b) {
+  if (a.is_immediate() != b.is_immediate()) return false;
+  if (a.is_immediate()) return std::get<int32_t>(a) == std::get<int32_t>(b);
+  return std::get<mir::inst::VarId>(a) == std::get<mir::inst::VarId>(b) &&
+         a.shift == b.shift && a.shift_amount == b.shift_amount;
+}
+
+/// Removes the instructions of `blk` whose results are never used
+void sweep(mir::inst::DefUseChain& du, mir::inst::BasicBlk& blk) {
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (size_t i = blk.inst.size(); i-- > 0;) {
+      auto inst = blk.inst[i].get();
+      if (is_store(inst) || dynamic_cast<mir::inst::CallInst*>(inst) ||
+          du.has_uses(inst->dest)) {
+        continue;
+      }
+      du.erase_inst(blk, blk.inst.begin() + i);
+      changed = true;
+    }
+  }
+}
+
+/// Vectorizes the main loop of an unrolled loop: a header holding only its
+/// phis and the exit test `iv < limit` against a limit computed before the
+/// loop, and a single body block jumping back to it.
+struct Vectorizer {
+  mir::inst::MirFunction& func;
+  const mir::inst::Loop& loop;
+  mir::inst::BasicBlk& header;
+  mir::inst::BasicBlk& body;
+
+  std::map<mir::inst::VarId, Control> controls;
+  std::vector<Reduction> reductions;
+  /// The exit test and the induction variable it looks at
+  mir::inst::OpInst* test = nullptr;
+  mir::inst::VarId iv;
+
+  std::unordered_map<mir::inst::Inst*, size_t> index;
+  std::unordered_map<mir::inst::VarId, std::optional<Affine>> affine_memo;
+  std::vector<Access> accesses;
+  std::vector<Pack> packs;
+  /// Instruction -> its pack and lane
+  std::unordered_map<mir::inst::Inst*, std::pair<int, uint32_t>> member;
+  /// Instruction computing the same value as the first lane of a uniform
+  /// operand -> that first lane
+  std::unordered_map<mir::inst::Inst*, mir::inst::Inst*> uniform_rep;
+  /// Variable -> the replaced instructions reading it as a lane of a vector
+  std::unordered_map<mir::inst::VarId, std::unordered_set<mir::inst::Inst*>>
+      vector_users;
+  std::set<mir::inst::VarId> splat_vars;
+  /// Pairs of accesses (by the terms of their addresses) to test at run time
+  std::set<std::pair<std::map<mir::inst::VarId, uint32_t>,
+                     std::map<mir::inst::VarId, uint32_t>>>
+      checks;
+  std::string reason;
+
+  Vectorizer(mir::inst::MirFunction& func, const mir::inst::Loop& loop,
+             mir::inst::BasicBlk& header, mir::inst::BasicBlk& body)
+      : func(func), loop(loop), header(header), body(body) {}
+
+  mir::inst::DefUseChain& du() { return func.def_use(); }
+
+  bool fail(std::string why) {
+    reason = std::move(why);
+    return false;
+  }
+
+  bool in_loop(mir::inst::VarId var) {
+    auto blk = du().def_block(var);
+    return blk && (*blk == header.id || *blk == body.id);
+  }
+
+  /// The instruction of the body defining `val`, if it is an unshifted
+  /// variable defined there
+  mir::inst::Inst* body_def(const mir::inst::Value& val) {
+    auto var = std::get_if<mir::inst::VarId>(&val);
+    if (var == nullptr || val.has_shift()) return nullptr;
+    if (du().def_block(*var) != body.id) return nullptr;
+    return du().def_of(*var);
+  }
+
+  bool analyze_header() {
+    auto& jump = header.jump;
+    if (jump.kind != mir::inst::JumpInstructionKind::BrCond ||
+        jump.bb_true != body.id || !jump.cond_or_ret) {
+      return fail("unexpected shape");
+    }
+    std::vector<mir::inst::PhiInst*> phis;
+    std::vector<mir::inst::OpInst*> ops;
+    for (auto& inst : header.inst) {
+      if (auto x = dynamic_cast<mir::inst::PhiInst*>(inst.get())) {
+        phis.push_back(x);
+      } else if (auto x = dynamic_cast<mir::inst::OpInst*>(inst.get())) {
+        ops.push_back(x);
+      } else {
+        return fail("unexpected shape");
+      }
+    }
+    if (ops.size() != 1) return fail("unexpected shape");
+    test = ops[0];
+    auto iv_var = test->lhs.get_if<mir::inst::VarId>();
+    if (test->dest != *jump.cond_or_ret || test->op != mir::inst::Op::Lt ||
+        iv_var == nullptr || test->lhs.has_shift() || test->rhs.has_shift()) {
+      return fail("unexpected exit test");
+    }
+    iv = *iv_var;
+    if (auto limit = test->rhs.get_if<mir::inst::VarId>();
+        limit && in_loop(*limit)) {
+      return fail("unexpected exit test");
+    }
+
+    for (auto phi : phis) {
+      std::optional<mir::inst::VarId> init, next;
+      for (auto var : phi->vars) {
+        if (du().def_block(var) == body.id) {
+          if (next) return fail("phi with several next values");
+          next = var;
+        } else if (in_loop(var)) {
+          return fail("phi depending on the header");
+        } else {
+          if (init) return fail("phi with several initial values");
+          init = var;
+        }
+      }
+      if (!init || !next) return fail("phi with several initial values");
+      auto step = dynamic_cast<mir::inst::OpInst*>(du().def_of(*next));
+      if (step && step->op == mir::inst::Op::Add &&
+          step->lhs.get_if<mir::inst::VarId>() &&
+          *step->lhs.get_if<mir::inst::VarId>() == phi->dest &&
+          !step->lhs.has_shift() && step->rhs.is_immediate() &&
+          du().use_count(*next) == 1) {
+        auto amount = uint32_t(std::get<int32_t>(step->rhs));
+        controls.insert({phi->dest, Control{*init, amount}});
+        continue;
+      }
+      Reduction r;
+      r.phi = phi;
+      r.init = *init;
+      if (!find_chain(r, *next)) return false;
+      reductions.push_back(std::move(r));
+    }
+    auto c = controls.find(iv);
+    if (c == controls.end() || int32_t(c->second.step) <= 0) {
+      return fail("unexpected exit test");
+    }
+    return true;
+  }
+
+  /// Follows the only use of each partial sum from the phi to `next`
+  bool find_chain(Reduction& r, mir::inst::VarId next) {
+    auto cur = r.phi->dest;
+    while (cur != next) {
+      mir::inst::Inst* user = nullptr;
+      for (auto use : du().uses_of(cur)) {
+        if (use.blk != body.id && use.blk != header.id) {
+          // Uses after the loop only see the phi
+          if (cur == r.phi->dest) continue;
+          return fail("partial sum used outside the loop");
+        }
+        if (use.is_jump() || user != nullptr) {
+          return fail("partial sum used several times");
+        }
+        user = use.inst;
+      }
+      if (user == nullptr || use_of_sum(user, cur) == nullptr) {
+        return fail("phi that is neither a counter nor a sum");
+      }
+      r.chain.push_back(user);
+      cur = user->dest;
+      if (r.chain.size() > body.inst.size()) return fail("unexpected shape");
+    }
+    auto uses = du().uses_of(next);
+    if (uses.size() != 1 || uses[0].inst != r.phi) {
+      return fail("partial sum used several times");
+    }
+    if (r.chain.empty() || r.chain.size() % LANES != 0) {
+      return fail("sum of " + std::to_string(r.chain.size()) + " values");
+    }
+    return true;
+  }
+
+  /// The value `inst` adds to the partial sum `sum`, or `nullptr` if it is
+  /// not of the form `sum + x`, `x + sum`, `sum - x` or `sum + x * y`
+  mir::inst::Value* use_of_sum(mir::inst::Inst* inst, mir::inst::VarId sum) {
+    auto is_sum = [&](mir::inst::Value& v) {
+      auto var = v.get_if<mir::inst::VarId>();
+      return var && *var == sum;
+    };
+    if (auto x = dynamic_cast<mir::inst::OpInst*>(inst)) {
+      if (x->op == mir::inst::Op::Add && is_sum(x->lhs) && !is_sum(x->rhs) &&
+          !x->lhs.has_shift()) {
+        return &x->rhs;
+      }
+      if (x->op == mir::inst::Op::Add && is_sum(x->rhs) && !is_sum(x->lhs) &&
+          !x->rhs.has_shift()) {
+        return &x->lhs;
+      }
+      if (x->op == mir::inst::Op::Sub && is_sum(x->lhs) && !is_sum(x->rhs) &&
+          !x->lhs.has_shift()) {
+        return &x->rhs;
+      }
+    } else if (auto x = dynamic_cast<mir::inst::OpAccInst*>(inst)) {
+      if (x->op == mir::inst::OpAcc::MulAdd && x->acc == sum &&
+          !is_sum(x->lhs) && !is_sum(x->rhs)) {
+        return &x->lhs;
+      }
+    }
+    return nullptr;
+  }
+
+  /// `val` as a sum of counters and values from outside the loop
+  std::optional<Affine> affine_of(const mir::inst::Value& val) {
+    if (auto imm = std::get_if<int32_t>(&val)) {
+      return Affine{{}, uint32_t(*imm)};
+    }
+    auto var = std::get<mir::inst::VarId>(val);
+    auto base = affine_of(var);
+    if (!base || !val.has_shift()) return base;
+    if (val.shift != arm::RegisterShiftKind::Lsl) return std::nullopt;
+    return base->scale(uint32_t(1) << val.shift_amount);
+  }
+
+  std::optional<Affine> affine_of(mir::inst::VarId var) {
+    if (auto it = affine_memo.find(var); it != affine_memo.end()) {
+      return it->second;
+    }
+    std::optional<Affine> result;
+    auto blk = du().def_block(var);
+    if (blk == body.id) {
+      auto x = dynamic_cast<mir::inst::OpInst*>(du().def_of(var));
+      auto lhs = x ? affine_of(x->lhs) : std::nullopt;
+      auto rhs = x ? affine_of(x->rhs) : std::nullopt;
+      if (!lhs || !rhs) {
+        // Not an address computation
+      } else if (x->op == mir::inst::Op::Add) {
+        result = lhs->add(*rhs);
+      } else if (x->op == mir::inst::Op::Sub) {
+        result = lhs->add(*rhs, uint32_t(-1));
+      } else if (x->op == mir::inst::Op::Mul && rhs->terms.empty()) {
+        result = lhs->scale(rhs->constant);
+      } else if (x->op == mir::inst::Op::Mul && lhs->terms.empty()) {
+        result = rhs->scale(lhs->constant);
+      } else if (x->op == mir::inst::Op::Shl && rhs->terms.empty() &&
+                 rhs->constant < 32) {
+        result = lhs->scale(uint32_t(1) << rhs->constant);
+      }
+    } else if (blk != header.id || controls.count(var)) {
+      result = Affine{{{var, 1}}, 0};
+    }
+    affine_memo.insert({var, result});
+    return result;
+  }
+
+  bool collect_accesses() {
+    for (size_t i = 0; i < body.inst.size(); i++) {
+      auto inst = body.inst[i].get();
+      index.insert({inst, i});
+      std::optional<Affine> addr;
+      if (dynamic_cast<mir::inst::CallInst*>(inst) ||
+          dynamic_cast<mir::inst::PhiInst*>(inst)) {
+        return fail("call in the loop");
+      } else if (auto x = dynamic_cast<mir::inst::LoadInst*>(inst)) {
+        if (x->src.has_shift()) return fail("unknown address");
+        addr = affine_of(x->src);
+      } else if (auto x = dynamic_cast<mir::inst::LoadOffsetInst*>(inst)) {
+        if (x->src.has_shift()) return fail("unknown address");
+        addr = affine_of(x->src);
+        if (addr) {
+          auto offset = affine_of(x->offset);
+          addr = offset ? std::optional(addr->add(*offset)) : std::nullopt;
+        }
+      } else if (auto x = dynamic_cast<mir::inst::StoreInst*>(inst)) {
+        addr = affine_of(x->dest);
+      } else if (auto x = dynamic_cast<mir::inst::StoreOffsetInst*>(inst)) {
+        addr = affine_of(x->dest);
+        if (addr) {
+          auto offset = affine_of(x->offset);
+          addr = offset ? std::optional(addr->add(*offset)) : std::nullopt;
+        }
+      } else {
+        continue;
+      }
+      if (!addr) return fail("unknown address");
+      accesses.push_back({inst, is_store(inst), *addr});
+    }
+    return true;
+  }
+
+  Affine address_of(mir::inst::Inst* inst) {
+    for (auto& access : accesses) {
+      if (access.inst == inst) return access.addr;
+    }
+    throw std::logic_error("not a memory access");
+  }
+
+  void note_users(const Lanes& vals, const LaneInsts& users) {
+    for (uint32_t k = 0; k < LANES; k++) {
+      if (auto var = std::get_if<mir::inst::VarId>(&vals[k])) {
+        vector_users[*var].insert(users[k]);
+      }
+    }
+  }
+
+  /// The value every lane of `vals` holds, if they all compute the same one.
+  /// Instructions of the other lanes are added to `reps`, mapped to the
+  /// first lane.
+  std::optional<mir::inst::Value> uniform(
+      const Lanes& vals, const LaneInsts& users, int depth,
+      std::vector<std::pair<mir::inst::Inst*, mir::inst::Inst*>>& reps) {
+    bool same = true;
+    for (uint32_t k = 1; k < LANES; k++) same &= same_value(vals[0], vals[k]);
+    if (same) return vals[0];
+    if (depth > MAX_DEPTH) return std::nullopt;
+
+    LaneInsts defs;
+    for (uint32_t k = 0; k < LANES; k++) {
+      defs[k] = body_def(vals[k]);
+      if (defs[k] == nullptr) return std::nullopt;
+    }
+    auto first = defs[0];
+    if (is_load(first)) {
+      auto addr = address_of(first);
+      for (uint32_t k = 1; k < LANES; k++) {
+        if (!is_load(defs[k])) return std::nullopt;
+        auto other = address_of(defs[k]);
+        if (other.terms != addr.terms || other.constant != addr.constant) {
+          return std::nullopt;
+        }
+      }
+    } else if (auto x = dynamic_cast<mir::inst::OpInst*>(first)) {
+      Lanes lhs, rhs;
+      for (uint32_t k = 0; k < LANES; k++) {
+        auto y = dynamic_cast<mir::inst::OpInst*>(defs[k]);
+        if (y == nullptr || y->op != x->op) return std::nullopt;
+        lhs.push_back(y->lhs);
+        rhs.push_back(y->rhs);
+      }
+      if (!uniform(lhs, defs, depth + 1, reps) ||
+          !uniform(rhs, defs, depth + 1, reps)) {
+        return std::nullopt;
+      }
+    } else {
+      return std::nullopt;
+    }
+    for (uint32_t k = 1; k < LANES; k++) {
+      if (defs[k] != first) reps.push_back({defs[k], first});
+    }
+    note_users(vals, users);
+    return vals[0];
+  }
+
+  /// Finds how to compute the vector of `vals`, the operands `users` read
+  std::optional<Operand> build(const Lanes& vals, const LaneInsts& users,
+                               int depth) {
+    if (depth > MAX_DEPTH) return std::nullopt;
+    std::vector<std::pair<mir::inst::Inst*, mir::inst::Inst*>> reps;
+    if (auto val = uniform(vals, users, depth, reps)) {
+      if (val->has_shift()) return std::nullopt;
+      for (auto [inst, rep] : reps) uniform_rep.insert({inst, rep});
+      if (auto var = val->get_if<mir::inst::VarId>()) splat_vars.insert(*var);
+      return Operand{-1, *val};
+    }
+
+    LaneInsts defs;
+    for (uint32_t k = 0; k < LANES; k++) {
+      defs[k] = body_def(vals[k]);
+      if (defs[k] == nullptr) return std::nullopt;
+      for (uint32_t j = 0; j < k; j++) {
+        if (defs[j] == defs[k]) return std::nullopt;
+      }
+    }
+    if (auto it = member.find(defs[0]); it != member.end()) {
+      auto pack = it->second.first;
+      for (uint32_t k = 0; k < LANES; k++) {
+        auto m = member.find(defs[k]);
+        if (m == member.end() || m->second != std::make_pair(pack, k)) {
+          return std::nullopt;
+        }
+      }
+      note_users(vals, users);
+      return Operand{pack};
+    }
+    for (auto def : defs) {
+      if (member.count(def)) return std::nullopt;
+    }
+
+    Pack pack;
+    pack.lanes = defs;
+    if (is_load(defs[0])) {
+      auto addr = address_of(defs[0]);
+      for (uint32_t k = 1; k < LANES; k++) {
+        if (!is_load(defs[k])) return std::nullopt;
+        auto other = address_of(defs[k]);
+        if (other.terms != addr.terms ||
+            other.constant != addr.constant + k * LANE_SIZE) {
+          return std::nullopt;
+        }
+      }
+      if (auto x = dynamic_cast<mir::inst::LoadInst*>(defs[0]);
+          x && x->src.is_immediate()) {
+        return std::nullopt;
+      }
+    } else if (auto x = dynamic_cast<mir::inst::OpInst*>(defs[0])) {
+      if (x->op != mir::inst::Op::Add && x->op != mir::inst::Op::Sub &&
+          x->op != mir::inst::Op::Mul) {
+        return std::nullopt;
+      }
+      Lanes lhs, rhs;
+      for (uint32_t k = 0; k < LANES; k++) {
+        auto y = dynamic_cast<mir::inst::OpInst*>(defs[k]);
+        if (y == nullptr || y->op != x->op) return std::nullopt;
+        lhs.push_back(y->lhs);
+        rhs.push_back(y->rhs);
+      }
+      for (auto& lanes : {lhs, rhs}) {
+        auto op = build(lanes, defs, depth + 1);
+        if (!op) return std::nullopt;
+        pack.operands.push_back(*op);
+      }
+    } else if (auto x = dynamic_cast<mir::inst::OpAccInst*>(defs[0]);
+               x && x->op == mir::inst::OpAcc::MulAdd) {
+      Lanes lhs, rhs, acc;
+      for (uint32_t k = 0; k < LANES; k++) {
+        auto y = dynamic_cast<mir::inst::OpAccInst*>(defs[k]);
+        if (y == nullptr || y->op != x->op) return std::nullopt;
+        lhs.push_back(y->lhs);
+        rhs.push_back(y->rhs);
+        acc.push_back(y->acc);
+      }
+      for (auto& lanes : {lhs, rhs, acc}) {
+        auto op = build(lanes, defs, depth + 1);
+        if (!op) return std::nullopt;
+        pack.operands.push_back(*op);
+      }
+    } else {
+      return std::nullopt;
+    }
+    note_users(vals, users);
+    return Operand{add_pack(std::move(pack))};
+  }
+
+  int add_pack(Pack pack) {
+    int id = packs.size();
+    for (uint32_t k = 0; k < LANES; k++) {
+      member.insert({pack.lanes[k], {id, k}});
+    }
+    packs.push_back(std::move(pack));
+    return id;
+  }
+
+  bool find_packs() {
+    // Stores to consecutive words, grouped by what their address depends on
+    std::map<std::map<mir::inst::VarId, uint32_t>, std::vector<Access*>>
+        streams;
+    for (auto& access : accesses) {
+      if (access.is_store) streams[access.addr.terms].push_back(&access);
+    }
+    for (auto& [terms, stores] : streams) {
+      std::sort(stores.begin(), stores.end(), [](auto a, auto b) {
+        return int32_t(a->addr.constant) < int32_t(b->addr.constant);
+      });
+      if (stores.size() % LANES != 0) return fail("stores left over");
+      for (size_t i = 0; i < stores.size(); i += LANES) {
+        Pack pack;
+        Lanes vals;
+        for (uint32_t k = 0; k < LANES; k++) {
+          auto store = stores[i + k];
+          if (store->addr.constant !=
+              stores[i]->addr.constant + k * LANE_SIZE) {
+            return fail("stores left over");
+          }
+          pack.lanes[k] = store->inst;
+          if (auto x = dynamic_cast<mir::inst::StoreInst*>(store->inst)) {
+            vals.push_back(x->val);
+          } else if (auto x = dynamic_cast<mir::inst::StoreOffsetInst*>(
+                         store->inst)) {
+            vals.push_back(x->val);
+          }
+        }
+        auto op = build(vals, pack.lanes, 0);
+        if (!op) return fail("stored values not packed");
+        pack.operands.push_back(*op);
+        add_pack(std::move(pack));
+      }
+    }
+
+    for (size_t r = 0; r < reductions.size(); r++) {
+      auto& chain = reductions[r].chain;
+      for (size_t i = 0; i < chain.size(); i += LANES) {
+        Pack pack;
+        pack.reduction = r;
+        Lanes added, factor;
+        auto sum = reductions[r].phi->dest;
+        for (uint32_t k = 0; k < LANES; k++) {
+          auto inst = chain[i + k];
+          pack.lanes[k] = inst;
+          if (i + k > 0) sum = chain[i + k - 1]->dest;
+          auto first = chain[i];
+          auto op_of = [](mir::inst::Inst* inst) {
+            auto x = dynamic_cast<mir::inst::OpInst*>(inst);
+            return x ? int(x->op) : -1;
+          };
+          if (op_of(inst) != op_of(first)) {
+            return fail("sum mixing operations");
+          }
+          auto x = use_of_sum(inst, sum);
+          added.push_back(*x);
+          if (auto y = dynamic_cast<mir::inst::OpAccInst*>(inst)) {
+            factor.push_back(y->rhs);
+          }
+        }
+        std::vector<Lanes> operands = {added};
+        if (dynamic_cast<mir::inst::OpAccInst*>(chain[i])) {
+          operands.push_back(factor);
+        }
+        for (auto& lanes : operands) {
+          auto op = build(lanes, pack.lanes, 0);
+          if (!op) return fail("summed values not packed");
+          pack.operands.push_back(*op);
+        }
+        add_pack(std::move(pack));
+      }
+    }
+    if (packs.empty()) return fail("nothing to pack");
+
+    // Every replaced instruction must only be read by replaced instructions
+    auto replaced_only_by_vectors = [&](mir::inst::Inst* inst) {
+      auto users = vector_users.find(inst->dest);
+      for (auto use : du().uses_of(inst->dest)) {
+        if (use.is_jump() || users == vector_users.end() ||
+            !users->second.count(use.inst)) {
+          return false;
+        }
+      }
+      return true;
+    };
+    for (auto& pack : packs) {
+      if (pack.reduction >= 0 || is_store(pack.lanes[0])) continue;
+      for (auto inst : pack.lanes) {
+        if (!replaced_only_by_vectors(inst)) return fail("lane used alone");
+      }
+    }
+    for (auto [inst, rep] : uniform_rep) {
+      if (!replaced_only_by_vectors(inst)) return fail("lane used alone");
+    }
+    for (auto var : splat_vars) {
+      auto def = du().def_of(var);
+      if (member.count(def) || uniform_rep.count(def)) {
+        return fail("lane used alone");
+      }
+      for (auto& r : reductions) {
+        if (var == r.phi->dest) return fail("partial sum used alone");
+      }
+    }
+    return true;
+  }
+
+  /// The pointer among `terms`, as it is on entry to the loop
+  std::optional<mir::inst::VarId> pointer_of(
+      const std::map<mir::inst::VarId, uint32_t>& terms) {
+    for (auto [var, coef] : terms) {
+      auto ty = func.variables.at(var.id).ty;
+      if (coef != 1 || ty->kind() != mir::types::TyKind::Ptr) continue;
+      auto control = controls.find(var);
+      return control == controls.end() ? var : control->second.init;
+    }
+    return std::nullopt;
+  }
+
+  /// Whether `a` and `b` may point into the same object
+  bool may_overlap(const Access& a, const Access& b) {
+    auto ptr_a = pointer_of(a.addr.terms);
+    auto ptr_b = pointer_of(b.addr.terms);
+    if (!ptr_a || !ptr_b) return true;
+    return dependence::may_share_object(func, *ptr_a, *ptr_b);
+  }
+
+  /// Whether moving the accesses past each other may change what is read or
+  /// written. Pairs that can only be told apart at run time go to `checks`.
+  bool check_memory() {
+    std::vector<size_t> pos;
+    for (auto& access : accesses) {
+      auto inst = access.inst;
+      if (auto m = member.find(inst); m != member.end()) {
+        inst = packs[m->second.first].lanes[0];
+      } else if (auto rep = uniform_rep.find(inst); rep != uniform_rep.end()) {
+        inst = rep->second;
+      }
+      pos.push_back(index.at(inst));
+    }
+    for (size_t i = 0; i < accesses.size(); i++) {
+      for (size_t j = i + 1; j < accesses.size(); j++) {
+        auto& a = accesses[i];
+        auto& b = accesses[j];
+        if ((!a.is_store && !b.is_store) || pos[i] <= pos[j]) continue;
+        if (a.addr.terms == b.addr.terms) {
+          auto distance = int32_t(a.addr.constant - b.addr.constant);
+          if (distance < int32_t(LANE_SIZE) && distance > -int32_t(LANE_SIZE)) {
+            return fail("dependence inside the loop");
+          }
+          continue;
+        }
+        if (!may_overlap(a, b)) continue;
+        auto pair = std::minmax(a.addr.terms, b.addr.terms);
+        checks.insert({pair.first, pair.second});
+      }
+    }
+    if (checks.size() > MAX_CHECKS) return fail("too many overlap tests");
+    return true;
+  }
+
+  /// Bytes `terms` moves by per unit of the induction variable
+  std::optional<uint32_t> stride_of(
+      const std::map<mir::inst::VarId, uint32_t>& terms) {
+    uint32_t per_round = 0;
+    for (auto [var, coef] : terms) {
+      if (auto c = controls.find(var); c != controls.end()) {
+        per_round += coef * c->second.step;
+      }
+    }
+    auto step = controls.at(iv).step;
+    if (per_round % step != 0 || per_round / step > MAX_STRIDE) {
+      return std::nullopt;
+    }
+    return per_round / step;
+  }
+
+  /// `terms` at the start of the loop
+  Affine initial(const std::map<mir::inst::VarId, uint32_t>& terms) {
+    Affine result;
+    for (auto [var, coef] : terms) {
+      auto c = controls.find(var);
+      auto start = c == controls.end() ? var : c->second.init;
+      result.add(Affine{{{start, 1}}, 0}, coef);
+    }
+    return result;
+  }
+
+  bool check_strides() {
+    for (auto& [a, b] : checks) {
+      if (!stride_of(a) || !stride_of(b)) return fail("unknown stride");
+    }
+    return true;
+  }
+
+  /// Lowers the limit of the main loop to its start when two of the checked
+  /// ranges overlap
+  void emit_checks(mir::inst::BasicBlk& preheader) {
+    if (checks.empty()) return;
+    auto& du = this->du();
+    auto int_ty = mir::types::new_int_ty();
+    auto int_var = [&]() {
+      return strength_reduction::new_var(func, int_ty, false);
+    };
+    auto emit = [&](mir::inst::VarId dest, mir::inst::Value lhs,
+                    mir::inst::Value rhs, mir::inst::Op op) {
+      du.insert_inst(
+          preheader, preheader.inst.end(),
+          std::make_unique<mir::inst::OpInst>(dest, lhs, rhs, op));
+    };
+    // Constant offsets from the start of each range of addresses
+    std::map<std::map<mir::inst::VarId, uint32_t>, std::pair<int32_t, int32_t>>
+        offsets;
+    for (auto& access : accesses) {
+      int32_t c = access.addr.constant;
+      auto [it, fresh] = offsets.insert({access.addr.terms, {c, c}});
+      it->second.first = std::min(it->second.first, c);
+      it->second.second = std::max(it->second.second, c);
+    }
+
+    auto start = controls.at(iv).init;
+    auto left = int_var();
+    Affine left_val;
+    if (auto limit = test->rhs.get_if<mir::inst::VarId>()) {
+      left_val.terms.insert({*limit, 1});
+    } else {
+      left_val.constant = std::get<int32_t>(test->rhs);
+    }
+    left_val.add(Affine{{{start, 1}}, 0}, uint32_t(-1));
+    strength_reduction::emit_affine(func, preheader, left_val, left);
+    // The last round starts below the limit and runs a round's step further
+    auto span = int_var();
+    emit(span, left, int32_t(controls.at(iv).step), mir::inst::Op::Add);
+
+    // The iterations left span `span` units of the induction variable, so the
+    // range of `terms` is `initial + [min, span * stride + max + 3]`
+    auto distance = [&](const std::map<mir::inst::VarId, uint32_t>& a,
+                        const std::map<mir::inst::VarId, uint32_t>& b) {
+      auto diff = initial(a);
+      diff.add(Affine{{{span, 1}}, 0}, *stride_of(a));
+      diff.constant += offsets.at(a).second + LANE_SIZE - 1;
+      diff.add(initial(b), uint32_t(-1));
+      diff.constant -= offsets.at(b).first;
+      auto dest = int_var();
+      strength_reduction::emit_affine(func, preheader, diff, dest);
+      return dest;
+    };
+    // Negative once the ranges of some pair are apart
+    std::optional<mir::inst::VarId> all;
+    for (auto& [a, b] : checks) {
+      auto apart = int_var();
+      emit(apart, distance(a, b), distance(b, a), mir::inst::Op::Or);
+      if (all) {
+        auto both = int_var();
+        emit(both, *all, apart, mir::inst::Op::And);
+        all = both;
+      } else {
+        all = apart;
+      }
+    }
+    auto mask = int_var();
+    emit(mask, *all, 31, mir::inst::Op::ShrA);
+    auto kept = int_var();
+    emit(kept, left, mask, mir::inst::Op::And);
+    auto limit = int_var();
+    emit(limit, start, kept, mir::inst::Op::Add);
+    du.replace_value(test, test->rhs, limit);
+  }
+
+  size_t vector_count() {
+    std::set<std::pair<int, mir::inst::VarId>> splats;
+    size_t count = 0;
+    for (auto& pack : packs) {
+      if (!is_store(pack.lanes[0])) count++;
+      for (auto& op : pack.operands) {
+        if (op.pack >= 0) continue;
+        if (auto imm = op.splat.get_if<int32_t>()) {
+          splats.insert({*imm, mir::inst::VarId()});
+        } else {
+          splats.insert({0, std::get<mir::inst::VarId>(op.splat)});
+        }
+      }
+    }
+    return count + splats.size();
+  }
+
+  std::string run() {
+    sweep(du(), body);
+    if (!analyze_header() || !collect_accesses() || !find_packs() ||
+        !check_memory() || !check_strides()) {
+      return reason;
+    }
+    if (vector_count() > arm::VECTOR_REGS.size()) {
+      return "needs " + std::to_string(vector_count()) + " vectors";
+    }
+    transform();
+    std::stringstream remark;
+    remark << "vectorized " << packs.size() << " packs";
+    if (!reductions.empty()) remark << ", " << reductions.size() << " sums";
+    if (!checks.empty()) remark << ", " << checks.size() << " overlap tests";
+    return remark.str();
+  }
+
+  void transform() {
+    auto& du = this->du();
+    auto vector_ty = mir::types::new_vector_ty(mir::types::new_int_ty(), LANES);
+    auto new_vector = [&](bool is_phi_var) {
+      return strength_reduction::new_var(func, vector_ty, is_phi_var);
+    };
+    auto preheader_id =
+        loop.preheader ? *loop.preheader : make_preheader(func, loop);
+    auto& preheader = func.basic_blks.at(preheader_id);
+    emit_checks(preheader);
+
+    // Splats of values from outside the loop are made once, in the preheader
+    std::map<int32_t, mir::inst::VarId> imm_splats;
+    std::map<mir::inst::VarId, mir::inst::VarId> var_splats;
+    std::vector<std::unique_ptr<mir::inst::Inst>> code;
+    auto splat_of = [&](const mir::inst::Value& val) {
+      mir::inst::VarId* vec;
+      bool inside = false;
+      if (auto imm = std::get_if<int32_t>(&val)) {
+        vec = &imm_splats[*imm];
+      } else {
+        auto var = std::get<mir::inst::VarId>(val);
+        vec = &var_splats[var];
+        inside = in_loop(var);
+      }
+      if (vec->id == mir::inst::VarId().id) {
+        *vec = new_vector(false);
+        auto copy = std::make_unique<mir::inst::AssignInst>(*vec, val);
+        if (inside) {
+          code.push_back(std::move(copy));
+        } else {
+          du.insert_inst(preheader, preheader.inst.end(), std::move(copy));
+        }
+      }
+      return *vec;
+    };
+
+    for (auto& pack : packs) {
+      if (!is_store(pack.lanes[0])) pack.vec = new_vector(pack.reduction >= 0);
+    }
+    std::vector<mir::inst::VarId> sums;
+    for (auto& r : reductions) {
+      r.acc = new_vector(true);
+      sums.push_back(r.acc);
+    }
+
+    for (auto& inst : body.inst) {
+      auto m = member.find(inst.get());
+      if (m == member.end()) {
+        code.push_back(std::move(inst));
+        continue;
+      }
+      if (m->second.second != 0) continue;
+      auto& pack = packs[m->second.first];
+      std::vector<mir::inst::VarId> ops;
+      for (auto& op : pack.operands) {
+        ops.push_back(op.pack >= 0 ? packs[op.pack].vec : splat_of(op.splat));
+      }
+      auto first = pack.lanes[0];
+      std::unique_ptr<mir::inst::Inst> vector_inst;
+      if (pack.reduction >= 0) {
+        auto& sum = sums[pack.reduction];
+        if (auto x = dynamic_cast<mir::inst::OpInst*>(first)) {
+          vector_inst = std::make_unique<mir::inst::OpInst>(pack.vec, sum,
+                                                            ops[0], x->op);
+        } else {
+          vector_inst = std::make_unique<mir::inst::OpAccInst>(
+              pack.vec, ops[0], ops[1], sum, mir::inst::OpAcc::MulAdd);
+        }
+        sum = pack.vec;
+      } else if (auto x = dynamic_cast<mir::inst::LoadInst*>(first)) {
+        vector_inst =
+            std::make_unique<mir::inst::LoadOffsetInst>(x->src, pack.vec, 0);
+      } else if (auto x = dynamic_cast<mir::inst::LoadOffsetInst*>(first)) {
+        vector_inst = std::make_unique<mir::inst::LoadOffsetInst>(
+            x->src, pack.vec, x->offset);
+      } else if (auto x = dynamic_cast<mir::inst::StoreInst*>(first)) {
+        vector_inst =
+            std::make_unique<mir::inst::StoreOffsetInst>(ops[0], x->dest, 0);
+      } else if (auto x = dynamic_cast<mir::inst::StoreOffsetInst*>(first)) {
+        vector_inst = std::make_unique<mir::inst::StoreOffsetInst>(
+            ops[0], x->dest, x->offset);
+      } else if (auto x = dynamic_cast<mir::inst::OpInst*>(first)) {
+        vector_inst = std::make_unique<mir::inst::OpInst>(pack.vec, ops[0],
+                                                          ops[1], x->op);
+      } else {
+        auto y = dynamic_cast<mir::inst::OpAccInst*>(first);
+        vector_inst = std::make_unique<mir::inst::OpAccInst>(
+            pack.vec, ops[0], ops[1], ops[2], y->op);
+      }
+      code.push_back(std::move(vector_inst));
+    }
+    body.inst = std::move(code);
+    func.invalidate_def_use();
+
+    if (!reductions.empty()) add_up_sums(preheader, new_vector(false), sums);
+    sweep(func.def_use(), body);
+    func.invalidate_def_use();
+  }
+
+  /// Sums start from zero in every lane, and the lanes are added to the
+  /// initial value on the way out of the loop
+  void add_up_sums(mir::inst::BasicBlk& preheader, mir::inst::VarId zero,
+                   const std::vector<mir::inst::VarId>& last) {
+    auto& du = func.def_use();
+    du.insert_inst(preheader, preheader.inst.end(),
+                   std::make_unique<mir::inst::AssignInst>(zero, 0));
+
+    mir::types::LabelId id = 0;
+    for (auto& [blk_id, blk] : func.basic_blks) {
+      if (blk_id < MAX_BLOCK_ID) id = std::max(id, blk_id);
+    }
+    id++;
+    auto exit_id = header.jump.bb_false;
+    auto& exit = func.basic_blks.at(exit_id);
+    auto& landing =
+        func.basic_blks.insert({id, mir::inst::BasicBlk(id)}).first->second;
+    landing.jump =
+        mir::inst::JumpInstruction(mir::inst::JumpInstructionKind::Br, exit_id);
+    landing.preceding.insert(header.id);
+    exit.preceding.erase(header.id);
+    exit.preceding.insert(id);
+    header.jump.bb_false = id;
+    du.refresh_jump(header);
+    du.rescan_block(landing);
+
+    for (size_t i = 0; i < reductions.size(); i++) {
+      auto& r = reductions[i];
+      auto old = r.phi->dest;
+      auto result = strength_reduction::new_var(
+          func, func.variables.at(old.id).ty, false);
+      du.insert_inst(landing, landing.inst.end(),
+                     std::make_unique<mir::inst::OpInst>(
+                         result, r.acc, r.init, mir::inst::Op::Add));
+      du.insert_inst(header, header.inst.begin(),
+                     std::make_unique<mir::inst::PhiInst>(
+                         r.acc, std::vector<mir::inst::VarId>{zero, last[i]}));
+      for (auto use : du.uses_of(old)) {
+        auto phi = dynamic_cast<mir::inst::PhiInst*>(use.inst);
+        if (phi == nullptr) continue;
+        std::replace(phi->vars.begin(), phi->vars.end(), old, result);
+        du.refresh(phi);
+      }
+      du.replace_all_uses(old, result);
+      auto it = std::find_if(header.inst.begin(), header.inst.end(),
+                             [&](auto& inst) { return inst.get() == r.phi; });
+      du.erase_inst(header, it);
+    }
+  }
+};
+
+std::string vectorize_loop(mir::inst::MirFunction& func,
+                           const mir::inst::Loop& loop) {
+  if (!loop.children.empty() || loop.has_irreducible ||
+      loop.blocks.size() != 2 || loop.latches.size() != 1) {
+    return "not an innermost loop of two blocks";
+  }
+  auto& header = func.basic_blks.at(loop.header);
+  auto& body = func.basic_blks.at(loop.latches[0]);
+  if (body.id == header.id || body.preceding.size() != 1 ||
+      body.jump.kind != mir::inst::JumpInstructionKind::Br) {
+    return "not an innermost loop of two blocks";
+  }
+  return Vectorizer(func, loop, header, body).run();
+}
+
+void Vectorization::optimize_mir(
+    mir::inst::MirPackage& mir,
+    std::map<std::string, std::any>& extra_data_repo) {
+  for (auto& f : mir.functions) {
+    if (f.second.type->is_extern) continue;
+    optimize_func(f.second, extra_data_repo);
+  }
+}
+
+void Vectorization::optimize_func(
+    mir::inst::MirFunction& func,
+    std::map<std::string, std::any>& extra_data_repo) {
+  std::vector<mir::types::LabelId> headers;
+  for (auto& loop : get_loop_forest(extra_data_repo, func).loops()) {
+    headers.push_back(loop.header);
+  }
+  // Blocks are added on the way, so look each loop up again
+  for (auto header : headers) {
+    auto& forest = get_loop_forest(extra_data_repo, func);
+    auto loop = forest.loop_with_header(header);
+    if (loop == nullptr) continue;
+    auto remark = func.name + " bb" + std::to_string(header) + ": " +
+                  vectorize_loop(func, *loop);
+    LOG(TRACE) << "vectorization: " << remark << std::endl;
+    backend::report_statistic(extra_data_repo, pass_name(), remark);
+  }
+}
+
+}  // namespace optimization::vectorization
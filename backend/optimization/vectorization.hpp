@@ -0,0 +1,32 @@
+#pragma once
+
+#include "../../mir/loop.hpp"
+#include "../backend.hpp"
+
+namespace optimization::vectorization {
+
+/// Vectorization of the main loops built by `Loop_Unrolling`.
+///
+/// The body of such a loop holds four (or more) copies of the original body.
+/// Stores to consecutive words, and the loads and arithmetic feeding them, are
+/// packed four at a time into NEON instructions working on `<i32 x 4>`
+/// vectors. Sums carried around the loop are kept in a vector as well, one
+/// partial sum per lane, and added up once the loop exits.
+///
+/// Loads and stores may only be reordered if they cannot overlap. Accesses
+/// through pointers whose target is not known are checked at run time: the
+/// preheader computes the range of addresses each of them covers, and if
+/// two of them overlap the main loop is skipped, leaving every iteration to
+/// the remainder loop.
+class Vectorization final : public backend::MirOptimizePass {
+ public:
+  std::string pass_name() const override { return "Vectorization"; }
+  void optimize_mir(mir::inst::MirPackage &mir,
+                    std::map<std::string, std::any> &extra_data_repo) override;
+
+ private:
+  void optimize_func(mir::inst::MirFunction &func,
+                     std::map<std::string, std::any> &extra_data_repo);
+};
+
+}  // namespace optimization::vectorization
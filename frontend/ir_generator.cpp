@@ -5,7 +5,8 @@ using namespace front::irGenerator;
 int front::irGenerator::TopLocalSmallArrayLength = 100;
 std::vector<string> front::irGenerator::externalFuncName = {
     "getint",    "getch",    "getarray", "putint", "putch",  "putarray", "putf",
-    "starttime", "stoptime", "malloc",   "calloc", "memset", "free"};
+    "starttime", "stoptime", "malloc",   "calloc", "memset", "memcpy",
+    "free"};
 
 void irGenerator::outputInstructions(
     std::ostream &out, mir::inst::MirPackage &package,
@@ -148,6 +149,13 @@ void irGenerator::ir_begin_of_program() {
                          {SharedTyPtr(new PtrTy(SharedTyPtr(new IntTy()))),
                           SharedTyPtr(new IntTy()), SharedTyPtr(new IntTy())},
                          true));
+    } else if (funcName == "memcpy") {
+      type = shared_ptr<FunctionTy>(
+          new FunctionTy(SharedTyPtr(new VoidTy()),
+                         {SharedTyPtr(new PtrTy(SharedTyPtr(new IntTy()))),
+                          SharedTyPtr(new PtrTy(SharedTyPtr(new IntTy()))),
+                          SharedTyPtr(new IntTy())},
+                         true));
     } else if (funcName == "free") {
       type = shared_ptr<FunctionTy>(new FunctionTy(
           SharedTyPtr(new VoidTy()),
@@ -189,6 +197,12 @@ void irGenerator::ir_begin_of_program() {
           SharedTyPtr(new PtrTy(SharedTyPtr(new IntTy()))), true, false);
       func->variables[2] = Variable(SharedTyPtr(new IntTy()), true, false);
       func->variables[3] = Variable(SharedTyPtr(new IntTy()), true, false);
+    } else if (funcName == "memcpy") {
+      func->variables[1] = Variable(
+          SharedTyPtr(new PtrTy(SharedTyPtr(new IntTy()))), true, false);
+      func->variables[2] = Variable(
+          SharedTyPtr(new PtrTy(SharedTyPtr(new IntTy()))), true, false);
+      func->variables[3] = Variable(SharedTyPtr(new IntTy()), true, false);
     } else if (funcName == "free") {
       func->variables[1] =
           Variable(SharedTyPtr(new PtrTy(SharedTyPtr(new IntTy))), true, false);
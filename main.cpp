@@ -1,6 +1,7 @@
 #include <fstream>
 #include <iostream>
 #include <memory>
+#include <optional>
 #include <sstream>
 #include <stdexcept>
 
@@ -20,20 +21,35 @@
 #include "backend/optimization/const_merge.hpp"
 #include "backend/optimization/const_propagation.hpp"
 #include "backend/optimization/cycle.hpp"
+#include "backend/optimization/dse.hpp"
 #include "backend/optimization/excess_reg_delete.hpp"
 #include "backend/optimization/exit_ahead.hpp"
 #include "backend/optimization/func_array_global.hpp"
 #include "backend/optimization/global_expression_move.hpp"
 #include "backend/optimization/global_var_to_local.hpp"
 #include "backend/optimization/graph_color.hpp"
+#include "backend/optimization/gvn.hpp"
 #include "backend/optimization/inline.hpp"
+#include "backend/optimization/licm.hpp"
+#include "backend/optimization/load_elimination.hpp"
+#include "backend/optimization/loop_idiom.hpp"
+#include "backend/optimization/loop_interchange.hpp"
+#include "backend/optimization/loop_rotation.hpp"
 #include "backend/optimization/loop_unrolling.hpp"
+#include "backend/optimization/loop_unswitching.hpp"
 #include "backend/optimization/memvar_propagation.hpp"
 #include "backend/optimization/mla.hpp"
+#include "backend/optimization/pre.hpp"
 #include "backend/optimization/ref_count.hpp"
 #include "backend/optimization/remove_dead_code.hpp"
 #include "backend/optimization/remove_temp_var.hpp"
+#include "backend/optimization/scalar_promotion.hpp"
+#include "backend/optimization/sccp.hpp"
+#include "backend/optimization/specialization.hpp"
+#include "backend/optimization/strength_reduction.hpp"
+#include "backend/optimization/tail_recursion.hpp"
 #include "backend/optimization/value_shift_collapse.hpp"
+#include "backend/optimization/vectorization.hpp"
 #include "backend/optimization/var_mir_fold.hpp"
 #include "frontend/ir_generator.hpp"
 #include "frontend/optim_mir.hpp"
@@ -44,6 +60,7 @@
 #include "include/aixlog.hpp"
 #include "include/argparse/argparse.hpp"
 #include "mir/mir.hpp"
+#include "mir/serialize.hpp"
 #include "opt.hpp"
 #include "prelude/fake_mir_generate.hpp"
 
@@ -58,6 +75,7 @@ const bool debug = false;
 Options global_options;
 string read_input(std::string&);
 Options parse_options(int argc, const char** argv);
+void generate_code(mir::inst::MirPackage& package, Options& options);
 
 extern std::string file_header;
 
@@ -70,14 +88,18 @@ void add_passes(backend::Backend& backend) {
   backend.add_pass(std::make_unique<optimization::var_mir_fold::VarMirFold>());
   backend.add_pass(
       std::make_unique<optimization::remove_dead_code::Remove_Dead_Code>());
+  backend.add_pass(
+      std::make_unique<optimization::tail_recursion::Tail_Recursion>());
   backend.add_pass(std::make_unique<optimization::inlineFunc::Inline_Func>());
+  backend.add_pass(
+      std::make_unique<optimization::specialization::Specialization>());
   backend.add_pass(std::make_unique<optimization::mergeBlocks::Merge_Block>());
   // inside block only and remove tmp vars
   backend.add_pass(
       std::make_unique<optimization::common_expr_del::Common_Expr_Del>());
 
-  backend.add_pass(
-      std::make_unique<optimization::global_expr_move::Global_Expr_Mov>());
+  backend.add_pass(std::make_unique<optimization::gvn::GVN>());
+  backend.add_pass(std::make_unique<optimization::pre::PRE>());
 
   // delete common exprs new created and replace not phi vars
   backend.add_pass(
@@ -85,29 +107,28 @@ void add_passes(backend::Backend& backend) {
   backend.add_pass(
       std::make_unique<optimization::remove_dead_code::Remove_Dead_Code>());
 
-  backend.add_pass(std::make_unique<
-                   optimization::memvar_propagation::Memory_Var_Propagation>());
-  backend.add_pass(std::make_unique<optimization::const_merge::Merge_Const>());
-  backend.add_pass(std::make_unique<
-                   optimization::memvar_propagation::Memory_Var_Propagation>());
   backend.add_pass(
-      std::make_unique<optimization::const_propagation::Const_Propagation>());
+      std::make_unique<optimization::load_elimination::Load_Elimination>());
+  backend.add_pass(std::make_unique<optimization::dse::DSE>());
+  backend.add_pass(std::make_unique<optimization::sccp::SCCP>());
   // backend.add_pass(
   //     std::make_unique<optimization::remove_dead_code::Remove_Dead_Code>());
   backend.add_pass(
       std::make_unique<optimization::loop_expand::Const_Loop_Expand>());
-  // backend.add_pass(
-  //     std::make_unique<optimization::loop_unrolling::Loop_Unrolling>());
+  backend.add_pass(
+      std::make_unique<optimization::loop_unswitching::Loop_Unswitching>());
+  backend.add_pass(std::make_unique<optimization::mergeBlocks::Merge_Block>());
+  backend.add_pass(
+      std::make_unique<optimization::loop_interchange::Loop_Interchange>());
+  backend.add_pass(std::make_unique<optimization::loop_idiom::Loop_Idiom>());
+  backend.add_pass(
+      std::make_unique<optimization::loop_unrolling::Loop_Unrolling>());
   // backend.add_pass(
   //     std::make_unique<optimization::remove_dead_code::Remove_Dead_Code>());
   // backend.add_pass(
   //     std::make_unique<optimization::common_expr_del::Common_Expr_Del>());
   backend.add_pass(std::make_unique<optimization::mergeBlocks::Merge_Block>());
-  backend.add_pass(
-      std::make_unique<optimization::const_propagation::Const_Propagation>());
-  backend.add_pass(std::make_unique<optimization::const_merge::Merge_Const>());
-  backend.add_pass(
-      std::make_unique<optimization::const_propagation::Const_Propagation>());
+  backend.add_pass(std::make_unique<optimization::sccp::SCCP>());
   backend.add_pass(
       std::make_unique<optimization::remove_dead_code::Remove_Dead_Code>());
   backend.add_pass(
@@ -115,27 +136,34 @@ void add_passes(backend::Backend& backend) {
 
   backend.add_pass(std::make_unique<
                    optimization::memvar_propagation::Memory_Var_Propagation>());
-  backend.add_pass(
-      std::make_unique<optimization::const_propagation::Const_Propagation>());
-  backend.add_pass(std::make_unique<optimization::const_merge::Merge_Const>());
-  backend.add_pass(
-      std::make_unique<optimization::const_propagation::Const_Propagation>());
+  backend.add_pass(std::make_unique<optimization::sccp::SCCP>());
   backend.add_pass(std::make_unique<optimization::cast_inst::Cast_Inst>());
   backend.add_pass(
       std::make_unique<
           optimization::memvar_propagation::Memory_Var_Propagation>(true));
   backend.add_pass(
       std::make_unique<optimization::common_expr_del::Common_Expr_Del>(true));
+  backend.add_pass(std::make_unique<optimization::gvn::GVN>());
   backend.add_pass(
-      std::make_unique<optimization::global_expr_move::Global_Expr_Mov>(true));
+      std::make_unique<optimization::load_elimination::Load_Elimination>());
+  backend.add_pass(std::make_unique<optimization::dse::DSE>());
+  backend.add_pass(std::make_unique<optimization::licm::LICM>());
+  backend.add_pass(
+      std::make_unique<optimization::scalar_promotion::Scalar_Promotion>());
   backend.add_pass(
       std::make_unique<optimization::remove_dead_code::Remove_Dead_Code>());
+  backend.add_pass(std::make_unique<
+                   optimization::strength_reduction::Strength_Reduction>());
   backend.add_pass(
       std::make_unique<
           optimization::algebraic_simplification::AlgebraicSimplification>());
   backend.add_pass(std::make_unique<
                    optimization::value_shift_collapse::ValueShiftCollapse>());
   backend.add_pass(std::make_unique<optimization::mla::MlaPass>());
+  backend.add_pass(
+      std::make_unique<optimization::vectorization::Vectorization>());
+  backend.add_pass(
+      std::make_unique<optimization::loop_rotation::Loop_Rotation>());
   backend.add_pass(std::make_unique<backend::codegen::BasicBlkRearrange>());
   backend.add_pass(std::make_unique<
                    optimization::complex_dce::ComplexDeadCodeElimination>());
@@ -152,7 +180,8 @@ void add_passes(backend::Backend& backend) {
   //                  optimization::global_var_to_local::Global_Var_to_Local>());
   backend.add_pass(std::make_unique<optimization::ref_count::Ref_Count>());
   backend.add_pass(
-      std::make_unique<optimization::graph_color::Graph_Color>(7, true));
+      std::make_unique<optimization::graph_color::Graph_Color>(
+          optimization::REGISTER_BUDGET, true));
 
   // ARM Passes
   backend.add_pass(std::make_unique<backend::codegen::MathOptimization>());
@@ -177,6 +206,19 @@ int main(int argc, const char** argv) {
     add_passes(backend);
     backend.show_passes(std::cout);
     return 0;
+  } else if (options.load_mir) {
+    // Skip the frontend and pick up a previously dumped MIR package
+    LOG(INFO) << "loading MIR from " << options.in_file << std::endl;
+    std::optional<mir::inst::MirPackage> package;
+    try {
+      package.emplace(mir::serial::load_package(options.in_file));
+    } catch (const std::runtime_error& err) {
+      std::cerr << "cannot load MIR from " << options.in_file << ": "
+                << err.what() << std::endl;
+      return 1;
+    }
+    generate_code(*package, options);
+    return 0;
   } else {
     // Run.
     // ==== Frontend ====
@@ -226,22 +268,26 @@ int main(int argc, const char** argv) {
 
     // ==== Backend ====
 
-    backend::Backend backend(package, options);
-    add_passes(backend);
-    auto code = backend.generate_code();
-    if (options.verbose) {
-      LOG(TRACE) << "CODE:" << std::endl;
-      std::cout << code;
-    }
-
-    LOG(INFO) << "writing to output file: " << options.out_file;
-
-    ofstream output_file(options.out_file);
-    output_file << file_header << std::endl << code << std::endl;
+    generate_code(package, options);
     return 0;
   }
 }
 
+void generate_code(mir::inst::MirPackage& package, Options& options) {
+  backend::Backend backend(package, options);
+  add_passes(backend);
+  auto code = backend.generate_code();
+  if (options.verbose) {
+    LOG(TRACE) << "CODE:" << std::endl;
+    std::cout << code;
+  }
+
+  LOG(INFO) << "writing to output file: " << options.out_file;
+
+  ofstream output_file(options.out_file);
+  output_file << file_header << std::endl << code << std::endl;
+}
+
 string read_input(std::string& input_filename) {
   ifstream input;
   input.open(input_filename);
@@ -271,6 +317,23 @@ Options parse_options(int argc, const char** argv) {
       .implicit_value(true);
   parser.add_argument("-r", "--run-pass").help("Only run pass");
   parser.add_argument("-s", "--skip-pass").help("Skip pass");
+  parser.add_argument("--load-mir")
+      .help("Input is a MIR dump (binary or text) instead of SysY source")
+      .implicit_value(true)
+      .default_value(false);
+  parser.add_argument("--resume-mir-at")
+      .help("With --load-mir, skip MIR passes before this index");
+  parser.add_argument("--dump-mir").help("Dump MIR to this file");
+  parser.add_argument("--dump-mir-at")
+      .help("Dump MIR right before this MIR pass index (default: after all)");
+  parser.add_argument("--dump-mir-text")
+      .help("Dump MIR as text instead of binary")
+      .implicit_value(true)
+      .default_value(false);
+  parser.add_argument("--pass-stats")
+      .help("Print what each MIR pass did to stderr")
+      .implicit_value(true)
+      .default_value(false);
   parser.add_argument("-S", "--asm")
       .help("Emit assembly code (no effect)")
       .implicit_value(true)
@@ -312,6 +375,23 @@ Options parse_options(int argc, const char** argv) {
   options.show_code_after_each_pass = parser.get<bool>("--pass-diff");
   options.dry_run = parser.get<bool>("--dry-run");
 
+  options.load_mir = parser.get<bool>("--load-mir");
+  options.resume_mir_at = 0;
+  if (parser.present("--resume-mir-at")) {
+    options.resume_mir_at =
+        std::stoul(parser.get<std::string>("--resume-mir-at"));
+  }
+  if (parser.present("--dump-mir")) {
+    options.dump_mir = parser.get<std::string>("--dump-mir");
+  }
+  options.dump_mir_at = SIZE_MAX;
+  if (parser.present("--dump-mir-at")) {
+    options.dump_mir_at =
+        std::stoul(parser.get<std::string>("--dump-mir-at"));
+  }
+  options.dump_mir_text = parser.get<bool>("--dump-mir-text");
+  options.show_pass_statistics = parser.get<bool>("--pass-stats");
+
   if (parser.present("--run-pass")) {
     auto out = parser.get<std::string>("--run-pass");
     std::set<std::string> run_pass;
@@ -0,0 +1,262 @@
+#include "def_use.hpp"
+
+#include <cassert>
+#include <stdexcept>
+
+namespace mir::inst {
+
+DefUseChain& MirFunction::def_use() {
+  // A moved-from chain still refers to the old function object
+  if (!def_use_chain || &def_use_chain->function() != this) {
+    def_use_chain = std::make_shared<DefUseChain>(*this);
+  }
+  return *def_use_chain;
+}
+
+DefUseChain::DefUseChain(MirFunction& func) : func(func) { rebuild(); }
+
+void DefUseChain::rebuild() {
+  insts.clear();
+  blk_insts.clear();
+  jump_uses.clear();
+  defs.clear();
+  uses.clear();
+  jump_users.clear();
+  for (auto& blkpair : func.basic_blks) {
+    for (auto& inst : blkpair.second.inst) {
+      add_inst(blkpair.first, inst.get());
+    }
+    add_jump(blkpair.second);
+  }
+}
+
+void DefUseChain::add_inst(mir::types::LabelId blk, Inst* inst) {
+  InstInfo info;
+  info.blk = blk;
+  if (inst->inst_kind() != InstKind::Store) {
+    info.def = inst->dest;
+    defs[inst->dest].insert(inst);
+  }
+  for (auto var : inst->useVars()) {
+    info.uses.push_back(var);
+    uses[var].insert(inst);
+  }
+  blk_insts[blk].insert(inst);
+  insts.insert_or_assign(inst, std::move(info));
+}
+
+void DefUseChain::remove_inst(Inst* inst) {
+  auto it = insts.find(inst);
+  if (it == insts.end()) return;
+  auto& info = it->second;
+  if (info.def.has_value()) {
+    auto d = defs.find(info.def.value());
+    if (d != defs.end()) {
+      d->second.erase(inst);
+      if (d->second.empty()) defs.erase(d);
+    }
+  }
+  for (auto var : info.uses) {
+    auto u = uses.find(var);
+    if (u != uses.end()) {
+      u->second.erase(inst);
+      if (u->second.empty()) uses.erase(u);
+    }
+  }
+  auto b = blk_insts.find(info.blk);
+  if (b != blk_insts.end()) b->second.erase(inst);
+  insts.erase(it);
+}
+
+void DefUseChain::add_jump(BasicBlk& blk) {
+  if (blk.jump.cond_or_ret.has_value()) {
+    auto var = blk.jump.cond_or_ret.value();
+    jump_uses.insert_or_assign(blk.id, var);
+    jump_users[var].insert(blk.id);
+  }
+}
+
+void DefUseChain::remove_jump(mir::types::LabelId blk) {
+  auto it = jump_uses.find(blk);
+  if (it == jump_uses.end()) return;
+  auto u = jump_users.find(it->second);
+  if (u != jump_users.end()) {
+    u->second.erase(blk);
+    if (u->second.empty()) jump_users.erase(u);
+  }
+  jump_uses.erase(it);
+}
+
+Inst* DefUseChain::def_of(VarId var) const {
+  auto it = defs.find(var);
+  if (it == defs.end() || it->second.size() != 1) return nullptr;
+  return *it->second.begin();
+}
+
+std::optional<mir::types::LabelId> DefUseChain::def_block(VarId var) const {
+  auto def = def_of(var);
+  if (!def) return {};
+  return block_of(def);
+}
+
+size_t DefUseChain::def_count(VarId var) const {
+  auto it = defs.find(var);
+  return it == defs.end() ? 0 : it->second.size();
+}
+
+std::vector<UseSite> DefUseChain::uses_of(VarId var) const {
+  std::vector<UseSite> sites;
+  if (auto it = uses.find(var); it != uses.end()) {
+    for (auto inst : it->second) {
+      sites.push_back({insts.at(inst).blk, inst});
+    }
+  }
+  if (auto it = jump_users.find(var); it != jump_users.end()) {
+    for (auto blk : it->second) {
+      sites.push_back({blk, nullptr});
+    }
+  }
+  return sites;
+}
+
+size_t DefUseChain::use_count(VarId var) const {
+  size_t count = 0;
+  if (auto it = uses.find(var); it != uses.end()) count += it->second.size();
+  if (auto it = jump_users.find(var); it != jump_users.end())
+    count += it->second.size();
+  return count;
+}
+
+std::optional<mir::types::LabelId> DefUseChain::block_of(Inst* inst) const {
+  auto it = insts.find(inst);
+  if (it == insts.end()) return {};
+  return it->second.blk;
+}
+
+void DefUseChain::refresh(Inst* inst) {
+  auto it = insts.find(inst);
+  assert(it != insts.end());
+  auto blk = it->second.blk;
+  remove_inst(inst);
+  add_inst(blk, inst);
+}
+
+void DefUseChain::refresh_jump(BasicBlk& blk) {
+  remove_jump(blk.id);
+  add_jump(blk);
+}
+
+void DefUseChain::forget_block(mir::types::LabelId blk) {
+  auto it = blk_insts.find(blk);
+  if (it != blk_insts.end()) {
+    // remove_inst edits the set we are iterating on
+    auto stale = std::move(it->second);
+    for (auto inst : stale) remove_inst(inst);
+    blk_insts.erase(blk);
+  }
+  remove_jump(blk);
+}
+
+void DefUseChain::rescan_block(BasicBlk& blk) {
+  forget_block(blk.id);
+  for (auto& inst : blk.inst) {
+    add_inst(blk.id, inst.get());
+  }
+  add_jump(blk);
+}
+
+DefUseChain::InstIter DefUseChain::insert_inst(BasicBlk& blk, InstIter pos,
+                                               std::unique_ptr<Inst> inst) {
+  add_inst(blk.id, inst.get());
+  return blk.inst.insert(pos, std::move(inst));
+}
+
+DefUseChain::InstIter DefUseChain::erase_inst(BasicBlk& blk, InstIter pos) {
+  remove_inst(pos->get());
+  return blk.inst.erase(pos);
+}
+
+Inst* DefUseChain::replace_inst(BasicBlk& blk, InstIter pos,
+                                std::unique_ptr<Inst> inst) {
+  remove_inst(pos->get());
+  add_inst(blk.id, inst.get());
+  *pos = std::move(inst);
+  return pos->get();
+}
+
+Inst* DefUseChain::replace_inst(Inst* old, std::unique_ptr<Inst> inst) {
+  auto& slot = slot_of(old);
+  auto blk = insts.at(old).blk;
+  remove_inst(old);
+  add_inst(blk, inst.get());
+  slot = std::move(inst);
+  return slot.get();
+}
+
+std::unique_ptr<Inst>& DefUseChain::slot_of(Inst* inst) {
+  auto& blk = func.basic_blks.at(insts.at(inst).blk);
+  for (auto& slot : blk.inst) {
+    if (slot.get() == inst) return slot;
+  }
+  assert(false && "instruction is not in the block recorded by the index");
+  throw std::logic_error("def-use index is out of date");
+}
+
+void DefUseChain::replace_value(Inst* inst, Value& slot, VarId to) {
+  slot.replace_with_varid(to);
+  refresh(inst);
+}
+
+void DefUseChain::replace_value(Inst* inst, Value& slot, int32_t to) {
+  slot.replace_with_imm(to);
+  refresh(inst);
+}
+
+size_t DefUseChain::replace_all_uses(VarId from, VarId to) {
+  if (from == to) return 0;
+  size_t count = 0;
+  if (auto it = uses.find(from); it != uses.end()) {
+    // refresh() edits uses[from], so walk a copy
+    std::vector<Inst*> users(it->second.begin(), it->second.end());
+    for (auto inst : users) {
+      if (inst->inst_kind() == InstKind::Phi) continue;
+      inst->replace(from, to);
+      refresh(inst);
+      count++;
+    }
+  }
+  if (auto it = jump_users.find(from); it != jump_users.end()) {
+    std::vector<mir::types::LabelId> blks(it->second.begin(),
+                                          it->second.end());
+    for (auto blk : blks) {
+      auto& bb = func.basic_blks.at(blk);
+      bb.jump.replace(from, to);
+      refresh_jump(bb);
+      count++;
+    }
+  }
+  return count;
+}
+
+size_t DefUseChain::replace_all_uses(VarId from, int32_t to) {
+  size_t count = 0;
+  if (auto it = uses.find(from); it != uses.end()) {
+    std::vector<Inst*> users(it->second.begin(), it->second.end());
+    for (auto inst : users) {
+      bool changed = false;
+      for_each_value(*inst, [&](Value& val) {
+        if (auto var = val.get_if<VarId>(); var && *var == from) {
+          val.replace_with_imm(to);
+          changed = true;
+        }
+      });
+      if (changed) {
+        refresh(inst);
+        count++;
+      }
+    }
+  }
+  return count;
+}
+
+}  // namespace mir::inst
@@ -0,0 +1,145 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "mir.hpp"
+
+namespace mir::inst {
+
+/// A use of some variable: either an instruction inside `blk`, or (when
+/// `inst` is null) the jump instruction at the end of `blk`.
+struct UseSite {
+  mir::types::LabelId blk;
+  Inst* inst;
+
+  bool is_jump() const { return inst == nullptr; }
+};
+
+/// Def-use index of a single function.
+///
+/// Instructions are keyed by address, so moving the owning `unique_ptr`
+/// around inside a block (or into another block) does not invalidate the
+/// index. Every entry also remembers which variables it defined and used when
+/// it was last scanned, so stale entries can be dropped without touching the
+/// (possibly already freed) instruction.
+///
+/// The index is kept up to date by the mutation helpers below. Passes that
+/// edit `BasicBlk::inst` directly must call `rescan_block` / `refresh`
+/// afterwards, or `MirFunction::invalidate_def_use` if they changed too much.
+class DefUseChain {
+ public:
+  DefUseChain(MirFunction& func);
+
+  /// Throw away everything and scan the whole function again
+  void rebuild();
+  MirFunction& function() const { return func; }
+
+  // ==== Queries ====
+
+  /// The unique instruction defining `var`, or null if `var` is a parameter,
+  /// a global, or is defined more than once (e.g. after phi unrolling).
+  Inst* def_of(VarId var) const;
+  std::optional<mir::types::LabelId> def_block(VarId var) const;
+  size_t def_count(VarId var) const;
+  std::vector<UseSite> uses_of(VarId var) const;
+  size_t use_count(VarId var) const;
+  bool has_uses(VarId var) const { return use_count(var) != 0; }
+  /// The block `inst` lives in, if it is known to the index
+  std::optional<mir::types::LabelId> block_of(Inst* inst) const;
+
+  // ==== Keeping the index in sync ====
+
+  /// Re-read operands of `inst` after it was modified in place
+  void refresh(Inst* inst);
+  /// Re-read `blk.jump` after it was modified in place
+  void refresh_jump(BasicBlk& blk);
+  /// Drop every entry of `blk` and scan it again; use after a pass rewrote
+  /// the instruction list of the block wholesale
+  void rescan_block(BasicBlk& blk);
+  /// Drop every entry of the block, e.g. right before erasing it
+  void forget_block(mir::types::LabelId blk);
+
+  // ==== Mutation helpers ====
+
+  using InstIter = std::vector<std::unique_ptr<Inst>>::iterator;
+
+  InstIter insert_inst(BasicBlk& blk, InstIter pos, std::unique_ptr<Inst> inst);
+  InstIter erase_inst(BasicBlk& blk, InstIter pos);
+  /// Replace `*pos` by `inst`, returns the new instruction
+  Inst* replace_inst(BasicBlk& blk, InstIter pos, std::unique_ptr<Inst> inst);
+  /// Replace `old` (wherever it is) by `inst`, returns the new instruction
+  Inst* replace_inst(Inst* old, std::unique_ptr<Inst> inst);
+  /// Finds the owning slot of `inst`; linear in the size of its block
+  std::unique_ptr<Inst>& slot_of(Inst* inst);
+
+  /// `Value::replace_with_varid` on an operand of `inst`
+  void replace_value(Inst* inst, Value& slot, VarId to);
+  /// `Value::replace_with_imm` on an operand of `inst`
+  void replace_value(Inst* inst, Value& slot, int32_t to);
+
+  /// Rewrite every use of `from` into `to`. Only instructions that actually
+  /// use `from` are visited. Phi operands are left alone, consistent with
+  /// `PhiInst::replace`. Returns the number of rewritten use sites.
+  size_t replace_all_uses(VarId from, VarId to);
+  /// Rewrite every `Value` operand holding `from` into the immediate `to`.
+  /// Operands that can only hold a variable (pointer bases, store targets,
+  /// phi operands, jump conditions) keep using `from`.
+  size_t replace_all_uses(VarId from, int32_t to);
+
+ private:
+  struct InstInfo {
+    mir::types::LabelId blk;
+    std::optional<VarId> def;
+    std::vector<VarId> uses;
+  };
+
+  void add_inst(mir::types::LabelId blk, Inst* inst);
+  void remove_inst(Inst* inst);
+  void add_jump(BasicBlk& blk);
+  void remove_jump(mir::types::LabelId blk);
+
+  MirFunction& func;
+  std::unordered_map<Inst*, InstInfo> insts;
+  std::unordered_map<mir::types::LabelId, std::unordered_set<Inst*>>
+      blk_insts;
+  std::unordered_map<mir::types::LabelId, VarId> jump_uses;
+  std::unordered_map<VarId, std::unordered_set<Inst*>> defs;
+  std::unordered_map<VarId, std::unordered_set<Inst*>> uses;
+  std::unordered_map<VarId, std::unordered_set<mir::types::LabelId>>
+      jump_users;
+};
+
+/// Calls `f(Value&)` for every `Value` operand of `inst`
+template <typename F>
+void for_each_value(Inst& inst, F f) {
+  if (auto x = dynamic_cast<AssignInst*>(&inst)) {
+    f(x->src);
+  } else if (auto x = dynamic_cast<OpInst*>(&inst)) {
+    f(x->lhs);
+    f(x->rhs);
+  } else if (auto x = dynamic_cast<OpAccInst*>(&inst)) {
+    f(x->lhs);
+    f(x->rhs);
+  } else if (auto x = dynamic_cast<CallInst*>(&inst)) {
+    for (auto& v : x->params) f(v);
+  } else if (auto x = dynamic_cast<LoadInst*>(&inst)) {
+    f(x->src);
+  } else if (auto x = dynamic_cast<LoadOffsetInst*>(&inst)) {
+    f(x->src);
+    f(x->offset);
+  } else if (auto x = dynamic_cast<StoreInst*>(&inst)) {
+    f(x->val);
+  } else if (auto x = dynamic_cast<StoreOffsetInst*>(&inst)) {
+    f(x->val);
+    f(x->offset);
+  } else if (auto x = dynamic_cast<PtrOffsetInst*>(&inst)) {
+    f(x->offset);
+  }
+}
+
+}  // namespace mir::inst
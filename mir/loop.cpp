@@ -0,0 +1,561 @@
+#include "loop.hpp"
+
+#include <algorithm>
+#include <set>
+#include <unordered_set>
+
+namespace mir::inst {
+
+using types::LabelId;
+
+namespace {
+
+const uint32_t UNDEFINED = UINT32_MAX;
+
+const std::vector<LabelId> NO_BLOCKS;
+
+template <typename T>
+void sort_unique(std::vector<T>& v) {
+  std::sort(v.begin(), v.end());
+  v.erase(std::unique(v.begin(), v.end()), v.end());
+}
+
+/// `!(a op b)` as `a op' b`
+std::optional<Op> negate_cmp(Op op) {
+  switch (op) {
+    case Op::Lt:
+      return Op::Gte;
+    case Op::Lte:
+      return Op::Gt;
+    case Op::Gt:
+      return Op::Lte;
+    case Op::Gte:
+      return Op::Lt;
+    case Op::Eq:
+      return Op::Neq;
+    case Op::Neq:
+      return Op::Eq;
+    default:
+      return {};
+  }
+}
+
+/// Number of `k >= 1` up to and including the first one for which
+/// `a + (k - 1) * s cmp b` fails
+std::optional<int64_t> count_tests(int64_t a, int64_t s, Op cmp, int64_t b) {
+  int64_t n;
+  switch (cmp) {
+    case Op::Lt:
+      if (a >= b) return 1;
+      if (s <= 0) return {};
+      n = (b - a + s - 1) / s;
+      break;
+    case Op::Lte:
+      if (a > b) return 1;
+      if (s <= 0) return {};
+      n = (b - a) / s + 1;
+      break;
+    case Op::Gt:
+      if (a <= b) return 1;
+      if (s >= 0) return {};
+      n = (a - b - s - 1) / -s;
+      break;
+    case Op::Gte:
+      if (a < b) return 1;
+      if (s >= 0) return {};
+      n = (a - b) / -s + 1;
+      break;
+    case Op::Neq:
+      if ((b - a) % s != 0 || (b - a) / s < 0) return {};
+      n = (b - a) / s;
+      break;
+    default:
+      return {};
+  }
+  // The last value compared must not have wrapped around
+  auto last = a + n * s;
+  if (last < INT32_MIN || last > INT32_MAX) return {};
+  return n + 1;
+}
+
+}  // namespace
+
+Op swap_cmp(Op op) {
+  switch (op) {
+    case Op::Lt:
+      return Op::Gt;
+    case Op::Lte:
+      return Op::Gte;
+    case Op::Gt:
+      return Op::Lt;
+    case Op::Gte:
+      return Op::Lte;
+    default:
+      return op;
+  }
+}
+
+std::vector<LabelId> successors(const BasicBlk& blk) {
+  switch (blk.jump.kind) {
+    case JumpInstructionKind::Br:
+      return {blk.jump.bb_true};
+    case JumpInstructionKind::BrCond:
+      return {blk.jump.bb_true, blk.jump.bb_false};
+    default:
+      return {};
+  }
+}
+
+// ==== DominatorTree ====
+
+DominatorTree::DominatorTree(const MirFunction& func) {
+  // Postorder by an explicit-stack DFS; unrolled code can nest deeply
+  if (func.basic_blks.empty()) return;
+  std::unordered_map<LabelId, std::vector<LabelId>> all_succs;
+  for (auto& [id, blk] : func.basic_blks) {
+    auto& succs = all_succs[id];
+    for (auto s : successors(blk)) {
+      if (func.basic_blks.count(s)) succs.push_back(s);
+    }
+  }
+  std::vector<LabelId> postorder;
+  std::unordered_set<LabelId> visited;
+  std::vector<std::pair<LabelId, size_t>> stack;
+  auto entry = func.basic_blks.begin()->first;
+  visited.insert(entry);
+  stack.push_back({entry, 0});
+  while (!stack.empty()) {
+    auto& [blk, next] = stack.back();
+    auto& succs = all_succs.at(blk);
+    if (next < succs.size()) {
+      auto s = succs[next++];
+      if (visited.insert(s).second) stack.push_back({s, 0});
+    } else {
+      postorder.push_back(blk);
+      stack.pop_back();
+    }
+  }
+  rpo.assign(postorder.rbegin(), postorder.rend());
+  auto n = rpo.size();
+  for (uint32_t i = 0; i < n; i++) index.insert({rpo[i], i});
+
+  succ_list.resize(n);
+  pred_list.resize(n);
+  for (uint32_t i = 0; i < n; i++) {
+    succ_list[i] = all_succs.at(rpo[i]);
+    for (auto s : succ_list[i]) pred_list[index.at(s)].push_back(rpo[i]);
+  }
+
+  idoms.assign(n, UNDEFINED);
+  idoms[0] = 0;
+  auto intersect = [&](uint32_t a, uint32_t b) {
+    while (a != b) {
+      while (a > b) a = idoms[a];
+      while (b > a) b = idoms[b];
+    }
+    return a;
+  };
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (uint32_t i = 1; i < n; i++) {
+      auto new_idom = UNDEFINED;
+      for (auto p : pred_list[i]) {
+        auto pi = index.at(p);
+        if (idoms[pi] == UNDEFINED) continue;
+        new_idom = new_idom == UNDEFINED ? pi : intersect(pi, new_idom);
+      }
+      if (new_idom != idoms[i]) {
+        idoms[i] = new_idom;
+        changed = true;
+      }
+    }
+  }
+
+  kids.resize(n);
+  for (uint32_t i = 1; i < n; i++) kids[idoms[i]].push_back(rpo[i]);
+
+  pre.resize(n);
+  post.resize(n);
+  uint32_t counter = 0;
+  std::vector<std::pair<uint32_t, size_t>> tree_stack = {{0, 0}};
+  pre[0] = counter++;
+  while (!tree_stack.empty()) {
+    auto& [node, next] = tree_stack.back();
+    if (next < kids[node].size()) {
+      auto kid = index.at(kids[node][next++]);
+      pre[kid] = counter++;
+      tree_stack.push_back({kid, 0});
+    } else {
+      post[node] = counter - 1;
+      tree_stack.pop_back();
+    }
+  }
+}
+
+std::optional<LabelId> DominatorTree::idom(LabelId blk) const {
+  auto it = index.find(blk);
+  if (it == index.end() || it->second == 0) return {};
+  return rpo[idoms[it->second]];
+}
+
+const std::vector<LabelId>& DominatorTree::children(LabelId blk) const {
+  auto it = index.find(blk);
+  return it == index.end() ? NO_BLOCKS : kids[it->second];
+}
+
+bool DominatorTree::dominates(LabelId a, LabelId b) const {
+  auto ia = index.find(a);
+  auto ib = index.find(b);
+  if (ia == index.end() || ib == index.end()) return false;
+  auto pb = pre[ib->second];
+  return pre[ia->second] <= pb && pb <= post[ia->second];
+}
+
+const std::vector<LabelId>& DominatorTree::succs(LabelId blk) const {
+  auto it = index.find(blk);
+  return it == index.end() ? NO_BLOCKS : succ_list[it->second];
+}
+
+const std::vector<LabelId>& DominatorTree::preds(LabelId blk) const {
+  auto it = index.find(blk);
+  return it == index.end() ? NO_BLOCKS : pred_list[it->second];
+}
+
+// ==== Loop ====
+
+bool Loop::contains(LabelId blk) const {
+  return std::binary_search(blocks.begin(), blocks.end(), blk);
+}
+
+std::vector<LabelId> Loop::exiting_blocks() const {
+  std::vector<LabelId> res;
+  for (auto& e : exits) res.push_back(e.first);
+  sort_unique(res);
+  return res;
+}
+
+std::vector<LabelId> Loop::exit_blocks() const {
+  std::vector<LabelId> res;
+  for (auto& e : exits) res.push_back(e.second);
+  sort_unique(res);
+  return res;
+}
+
+// ==== LoopForest ====
+
+LoopForest::LoopForest(const MirFunction& func)
+    : dom(func), signature(cfg_signature(func)) {
+  find_loops();
+  find_irreducible_regions();
+  link_loops(func);
+}
+
+void LoopForest::find_loops() {
+  for (auto header : dom.reverse_postorder()) {
+    Loop loop;
+    loop.back_edges = 0;
+    for (auto p : dom.preds(header)) {
+      if (!dom.dominates(header, p)) continue;
+      loop.latches.push_back(p);
+      loop.back_edges++;
+    }
+    if (loop.latches.empty()) continue;
+    sort_unique(loop.latches);
+
+    loop.header = header;
+    std::unordered_set<LabelId> body = {header};
+    std::vector<LabelId> worklist;
+    for (auto l : loop.latches) {
+      if (body.insert(l).second) worklist.push_back(l);
+    }
+    while (!worklist.empty()) {
+      auto blk = worklist.back();
+      worklist.pop_back();
+      for (auto p : dom.preds(blk)) {
+        if (body.insert(p).second) worklist.push_back(p);
+      }
+    }
+    loop.blocks.assign(body.begin(), body.end());
+    std::sort(loop.blocks.begin(), loop.blocks.end());
+    loop_list.push_back(std::move(loop));
+  }
+}
+
+void LoopForest::find_irreducible_regions() {
+  // Tarjan's algorithm on the CFG without back edges. Any cycle left is
+  // entered at more than one block. The DFS keeps an explicit stack of
+  // (block, next successor) like the dominator tree's.
+  std::unordered_map<LabelId, uint32_t> order;
+  std::unordered_map<LabelId, uint32_t> low;
+  std::unordered_set<LabelId> on_stack;
+  std::vector<LabelId> stack;
+  std::vector<std::pair<LabelId, size_t>> dfs;
+  uint32_t regions = 0;
+
+  auto enter = [&](LabelId blk) {
+    auto n = order.size();
+    order[blk] = n;
+    low[blk] = n;
+    stack.push_back(blk);
+    on_stack.insert(blk);
+    dfs.push_back({blk, 0});
+  };
+  for (auto root : dom.reverse_postorder()) {
+    if (order.count(root)) continue;
+    enter(root);
+    while (!dfs.empty()) {
+      auto [blk, next] = dfs.back();
+      auto& succs = dom.succs(blk);
+      if (next < succs.size()) {
+        dfs.back().second++;
+        auto s = succs[next];
+        if (dom.dominates(s, blk)) continue;
+        if (!order.count(s)) {
+          enter(s);
+        } else if (on_stack.count(s)) {
+          low[blk] = std::min(low[blk], order[s]);
+        }
+        continue;
+      }
+      dfs.pop_back();
+      if (!dfs.empty()) {
+        auto parent = dfs.back().first;
+        low[parent] = std::min(low[parent], low[blk]);
+      }
+      if (low[blk] != order[blk]) continue;
+      std::vector<LabelId> scc;
+      LabelId top;
+      do {
+        top = stack.back();
+        stack.pop_back();
+        on_stack.erase(top);
+        scc.push_back(top);
+      } while (top != blk);
+      if (scc.size() > 1) {
+        for (auto b : scc) irreducible.insert({b, regions});
+        regions++;
+      }
+    }
+  }
+}
+
+void LoopForest::link_loops(const MirFunction& func) {
+  // A natural loop containing the header of another one contains all of it,
+  // so visiting larger loops first finds every parent before its children
+  std::stable_sort(loop_list.begin(), loop_list.end(),
+                   [](const Loop& a, const Loop& b) {
+                     return a.blocks.size() > b.blocks.size();
+                   });
+  for (uint32_t i = 0; i < loop_list.size(); i++) {
+    auto& loop = loop_list[i];
+    loop.index = i;
+    loop.has_irreducible = false;
+    auto parent = innermost.find(loop.header);
+    if (parent != innermost.end()) {
+      loop.parent = parent->second;
+      loop.depth = loop_list[parent->second].depth + 1;
+      loop_list[parent->second].children.push_back(i);
+    } else {
+      loop.depth = 1;
+    }
+    header_loop.insert({loop.header, i});
+    for (auto b : loop.blocks) innermost[b] = i;
+
+    for (auto b : loop.blocks) {
+      for (auto s : dom.succs(b)) {
+        if (!loop.contains(s)) loop.exits.push_back({b, s});
+      }
+    }
+    sort_unique(loop.exits);
+    for (auto p : dom.preds(loop.header)) {
+      if (!loop.contains(p)) loop.entering.push_back(p);
+    }
+    sort_unique(loop.entering);
+
+    if (loop.entering.size() != 1) continue;
+    auto entering = loop.entering[0];
+    auto& entering_succs = dom.succs(entering);
+    if (std::all_of(entering_succs.begin(), entering_succs.end(),
+                    [&](LabelId s) { return s == loop.header; })) {
+      loop.preheader = entering;
+    }
+    auto exit_blocks = loop.exit_blocks();
+    auto& jump = func.basic_blks.at(entering).jump;
+    if (exit_blocks.size() == 1 && jump.kind == JumpInstructionKind::BrCond &&
+        std::set<LabelId>{jump.bb_true, jump.bb_false} ==
+            std::set<LabelId>{loop.header, exit_blocks[0]}) {
+      loop.guard = entering;
+    }
+  }
+
+  for (auto& [blk, region] : irreducible) {
+    auto it = innermost.find(blk);
+    if (it == innermost.end()) continue;
+    for (std::optional<uint32_t> l = it->second; l; l = loop_list[*l].parent) {
+      loop_list[*l].has_irreducible = true;
+    }
+  }
+}
+
+const Loop* LoopForest::loop_of(LabelId blk) const {
+  auto it = innermost.find(blk);
+  return it == innermost.end() ? nullptr : &loop_list[it->second];
+}
+
+const Loop* LoopForest::loop_with_header(LabelId blk) const {
+  auto it = header_loop.find(blk);
+  return it == header_loop.end() ? nullptr : &loop_list[it->second];
+}
+
+uint32_t LoopForest::depth(LabelId blk) const {
+  auto loop = loop_of(blk);
+  return (loop ? loop->depth : 0) + in_irreducible_region(blk);
+}
+
+bool LoopForest::in_irreducible_region(LabelId blk) const {
+  return irreducible.count(blk);
+}
+
+bool LoopForest::is_cycle_edge(LabelId from, LabelId to) const {
+  if (!dom.is_reachable(from)) return false;
+  if (dom.dominates(to, from)) return true;
+  auto a = irreducible.find(from);
+  auto b = irreducible.find(to);
+  return a != irreducible.end() && b != irreducible.end() &&
+         a->second == b->second;
+}
+
+std::vector<int64_t> LoopForest::cfg_signature(const MirFunction& func) {
+  std::vector<int64_t> sig;
+  sig.reserve(func.basic_blks.size() * 4);
+  for (auto& [id, blk] : func.basic_blks) {
+    sig.push_back(id);
+    sig.push_back((int64_t)blk.jump.kind);
+    sig.push_back(blk.jump.bb_true);
+    sig.push_back(blk.jump.bb_false);
+  }
+  return sig;
+}
+
+bool LoopForest::is_up_to_date(const MirFunction& func) const {
+  return cfg_signature(func) == signature;
+}
+
+std::optional<TripCount> LoopForest::trip_count(const Loop& loop,
+                                                const MirFunction& func) const {
+  if (loop.latches.size() != 1 || loop.has_irreducible) return {};
+  auto exiting = loop.exiting_blocks();
+  if (exiting.size() != 1) return {};
+  auto exiting_id = exiting[0];
+  if (!dom.dominates(exiting_id, loop.latches[0])) return {};
+  auto& exiting_blk = func.basic_blks.at(exiting_id);
+  auto& jump = exiting_blk.jump;
+  if (jump.kind != JumpInstructionKind::BrCond) return {};
+
+  // Definitions, with null for variables defined more than once
+  std::unordered_map<VarId, std::pair<LabelId, const Inst*>> defs;
+  for (auto& [id, blk] : func.basic_blks) {
+    for (auto& inst : blk.inst) {
+      if (dynamic_cast<const StoreInst*>(inst.get()) ||
+          dynamic_cast<const StoreOffsetInst*>(inst.get()))
+        continue;
+      auto [it, inserted] = defs.insert({inst->dest, {id, inst.get()}});
+      if (!inserted) it->second.second = nullptr;
+    }
+  }
+  // The value of `v` as seen from inside the loop, if it never changes there
+  auto invariant = [&](const Value& v) -> std::optional<Value> {
+    if (v.is_immediate()) return v;
+    if (v.has_shift()) return {};
+    auto var = std::get<VarId>(v);
+    auto def = defs.find(var);
+    // Parameters and globals
+    if (def == defs.end()) return v;
+    auto [blk, inst] = def->second;
+    if (!inst || loop.contains(blk)) return {};
+    auto assign = dynamic_cast<const AssignInst*>(inst);
+    if (assign && assign->src.is_immediate()) return assign->src;
+    return v;
+  };
+  auto plain_var = [](const Value& v) -> std::optional<VarId> {
+    if (v.is_immediate() || v.has_shift()) return {};
+    return std::get<VarId>(v);
+  };
+
+  auto cond = defs.find(jump.cond_or_ret.value());
+  if (cond == defs.end() || !cond->second.second) return {};
+  auto cmp_inst = dynamic_cast<const OpInst*>(cond->second.second);
+  if (!cmp_inst) return {};
+  // Only comparisons; `while (n - i)` branches on a difference
+  auto cmp = negate_cmp(cmp_inst->op);
+  if (!cmp) return {};
+  if (loop.contains(jump.bb_true)) cmp = cmp_inst->op;
+  if (*cmp == Op::Eq) return {};
+
+  auto& header = func.basic_blks.at(loop.header);
+  for (auto& inst : header.inst) {
+    auto phi = dynamic_cast<const PhiInst*>(inst.get());
+    if (!phi || phi->vars.size() != 2) continue;
+
+    TripCount res;
+    res.iv = phi->dest;
+    std::optional<VarId> init;
+    for (auto v : phi->vars) {
+      auto def = defs.find(v);
+      if (def != defs.end() && loop.contains(def->second.first)) {
+        if (!def->second.second) break;
+        res.next = v;
+      } else {
+        init = v;
+      }
+    }
+    if (!init || res.next == VarId()) continue;
+
+    auto step = dynamic_cast<const OpInst*>(defs.at(res.next).second);
+    if (!step) continue;
+    auto lhs = plain_var(step->lhs);
+    if (step->op == Op::Add && step->rhs.is_immediate() && lhs == res.iv) {
+      res.step = std::get<int32_t>(step->rhs);
+    } else if (step->op == Op::Add && step->lhs.is_immediate() &&
+               plain_var(step->rhs) == res.iv) {
+      res.step = std::get<int32_t>(step->lhs);
+    } else if (step->op == Op::Sub && step->rhs.is_immediate() &&
+               lhs == res.iv && std::get<int32_t>(step->rhs) != INT32_MIN) {
+      res.step = -std::get<int32_t>(step->rhs);
+    } else {
+      continue;
+    }
+    if (res.step == 0) continue;
+
+    std::optional<Value> bound;
+    auto tested = plain_var(cmp_inst->lhs);
+    res.cmp = *cmp;
+    if (tested == res.iv || tested == res.next) {
+      bound = invariant(cmp_inst->rhs);
+    } else {
+      tested = plain_var(cmp_inst->rhs);
+      if (tested != res.iv && tested != res.next) continue;
+      bound = invariant(cmp_inst->lhs);
+      res.cmp = swap_cmp(*cmp);
+    }
+    if (!bound) continue;
+    res.bound = *bound;
+    res.tests_next = tested == res.next;
+    res.init = invariant(*init).value_or(*init);
+    res.exiting = exiting_id;
+
+    if (res.init.is_immediate() && res.bound.is_immediate()) {
+      int64_t init_val = std::get<int32_t>(res.init);
+      auto first = init_val + (res.tests_next ? res.step : 0);
+      if (first >= INT32_MIN && first <= INT32_MAX) {
+        res.count = count_tests(first, res.step, res.cmp,
+                                std::get<int32_t>(res.bound));
+      }
+    }
+    return res;
+  }
+  return {};
+}
+
+}  // namespace mir::inst
@@ -0,0 +1,167 @@
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <unordered_map>
+#include <vector>
+
+#include "mir.hpp"
+
+namespace mir::inst {
+
+/// Successors of `blk` in jump order (`bb_true` first). A conditional branch
+/// with both targets equal yields that target twice.
+std::vector<types::LabelId> successors(const BasicBlk& blk);
+
+/// Dominator tree of the blocks reachable from the entry block (the first
+/// block of `basic_blks`), computed with the iterative algorithm of Cooper,
+/// Harvey and Kennedy over a reverse postorder.
+///
+/// Unreachable blocks are not part of the tree; no query fails on them, but
+/// they dominate nothing and are dominated by nothing. Functions without
+/// blocks (extern ones) get an empty tree.
+class DominatorTree {
+ public:
+  DominatorTree(const MirFunction& func);
+
+  types::LabelId entry() const { return rpo.at(0); }
+  bool is_reachable(types::LabelId blk) const { return index.count(blk); }
+  /// Reachable blocks in reverse postorder
+  const std::vector<types::LabelId>& reverse_postorder() const { return rpo; }
+  /// Immediate dominator of `blk`; none for the entry and unreachable blocks
+  std::optional<types::LabelId> idom(types::LabelId blk) const;
+  const std::vector<types::LabelId>& children(types::LabelId blk) const;
+  /// Whether every path from the entry to `b` passes `a`. Constant time.
+  bool dominates(types::LabelId a, types::LabelId b) const;
+
+  /// CFG edges between reachable blocks
+  const std::vector<types::LabelId>& succs(types::LabelId blk) const;
+  const std::vector<types::LabelId>& preds(types::LabelId blk) const;
+
+ private:
+  std::vector<types::LabelId> rpo;
+  std::unordered_map<types::LabelId, uint32_t> index;
+  // Indexed by position in `rpo`
+  std::vector<uint32_t> idoms;
+  std::vector<std::vector<types::LabelId>> kids;
+  std::vector<std::vector<types::LabelId>> succ_list;
+  std::vector<std::vector<types::LabelId>> pred_list;
+  // Preorder interval of each subtree of the dominator tree
+  std::vector<uint32_t> pre;
+  std::vector<uint32_t> post;
+};
+
+/// A natural loop: the header plus every block reaching one of its latches
+/// without passing the header. Loops sharing a header are merged.
+struct Loop {
+  /// Position in `LoopForest::loops()`
+  uint32_t index;
+  types::LabelId header;
+  /// Sorted, including the header
+  std::vector<types::LabelId> blocks;
+  /// Sources of the back edges, sorted
+  std::vector<types::LabelId> latches;
+  /// Number of back edges into the header, counting both edges of a
+  /// conditional branch whose targets are both the header
+  uint32_t back_edges;
+  /// Edges `(inside, outside)` leaving the loop
+  std::vector<std::pair<types::LabelId, types::LabelId>> exits;
+  /// Predecessors of the header outside the loop, sorted
+  std::vector<types::LabelId> entering;
+  /// The only entering block, if the header is its only successor
+  std::optional<types::LabelId> preheader;
+  /// The only entering block, if it ends in a conditional branch to the
+  /// header and to the only exit target of the loop. This is the shape
+  /// rotated `while` loops take.
+  std::optional<types::LabelId> guard;
+  std::optional<uint32_t> parent;
+  std::vector<uint32_t> children;
+  /// 1 for outermost loops
+  uint32_t depth;
+  /// Some block of the loop belongs to an irreducible region
+  bool has_irreducible;
+
+  bool contains(types::LabelId blk) const;
+  std::vector<types::LabelId> exiting_blocks() const;
+  std::vector<types::LabelId> exit_blocks() const;
+};
+
+/// Counted form of a loop. `iv` is a header phi starting at `init` that moves
+/// by `step` once per iteration, ending up in `next`. The loop keeps running
+/// while `(tests_next ? next : iv) cmp bound` holds at `exiting`, the only
+/// block leaving it.
+struct TripCount {
+  VarId iv;
+  VarId next;
+  /// An immediate if the incoming value is a known constant
+  Value init = 0;
+  int32_t step;
+  types::LabelId exiting;
+  bool tests_next;
+  /// One of `Lt`, `Lte`, `Gt`, `Gte`, `Neq`
+  Op cmp;
+  /// Loop invariant; an immediate if it is a known constant
+  Value bound = 0;
+  /// How many times the exit test runs once the loop is entered, if `init`
+  /// and `bound` are constants and `iv` stays inside the `i32` range
+  std::optional<int64_t> count;
+};
+
+/// `a op b` as `b op' a`, for comparisons
+Op swap_cmp(Op op);
+
+/// Loop nesting forest of a function, built on its `DominatorTree`.
+///
+/// Irreducible regions (cycles not headed by a dominating block) are not
+/// turned into loops. Their blocks are flagged instead, count as one extra
+/// level of nesting for `depth`, and mark every enclosing loop with
+/// `has_irreducible` so transforms can skip them.
+///
+/// Blocks are referred to by id, so the forest is invalidated by any change
+/// to the CFG; `is_up_to_date` tells whether that happened. Instructions may
+/// change freely, except that `trip_count` looks at them when it is called.
+class LoopForest {
+ public:
+  LoopForest(const MirFunction& func);
+
+  const DominatorTree& dom_tree() const { return dom; }
+  /// Outer loops come before the loops nested in them
+  const std::vector<Loop>& loops() const { return loop_list; }
+  /// Innermost loop containing `blk`, if any
+  const Loop* loop_of(types::LabelId blk) const;
+  const Loop* loop_with_header(types::LabelId blk) const;
+  /// Number of loops containing `blk`, plus one inside an irreducible region
+  uint32_t depth(types::LabelId blk) const;
+  bool in_irreducible_region(types::LabelId blk) const;
+  bool has_irreducible() const { return !irreducible.empty(); }
+  /// Whether `from -> to` closes a cycle: a back edge of a loop, or an edge
+  /// inside an irreducible region
+  bool is_cycle_edge(types::LabelId from, types::LabelId to) const;
+
+  /// Whether the CFG of `func` is still the one this forest was built from
+  bool is_up_to_date(const MirFunction& func) const;
+
+  /// Recognizes `loop` as a counted loop. Needs a single latch, a single
+  /// exiting block dominating it and an exit test comparing an induction
+  /// variable stepped by a constant against a loop invariant.
+  std::optional<TripCount> trip_count(const Loop& loop,
+                                      const MirFunction& func) const;
+
+ private:
+  void find_loops();
+  void find_irreducible_regions();
+  void link_loops(const MirFunction& func);
+
+  static std::vector<int64_t> cfg_signature(const MirFunction& func);
+
+  DominatorTree dom;
+  std::vector<Loop> loop_list;
+  std::unordered_map<types::LabelId, uint32_t> innermost;
+  std::unordered_map<types::LabelId, uint32_t> header_loop;
+  // Block -> id of the irreducible region (strongly connected component) it
+  // belongs to
+  std::unordered_map<types::LabelId, uint32_t> irreducible;
+  std::vector<int64_t> signature;
+};
+
+}  // namespace mir::inst
@@ -1,5 +1,6 @@
 #include "mir.hpp"
 
+#include <iomanip>
 #include <iostream>
 #include <memory>
 #include <typeinfo>
@@ -81,13 +82,21 @@ void display_op(std::ostream& o, OpAcc val) {
 }
 
 void Variable::display(std::ostream& o) const {
-  o << *ty;
+  // Variables read but never defined have no type
+  if (ty) {
+    o << *ty;
+  } else {
+    o << "untyped";
+  }
   if (is_memory_var) {
     o << " memory (" << *(type()) << ")";
   }
   if (is_temp_var) {
     o << " temp";
   }
+  if (is_phi_var) {
+    o << " phi";
+  }
   o << ", priority: " << priority;
 }
 
@@ -179,11 +188,12 @@ void JumpInstruction::display(std::ostream& o) const {
       break;
 
     case JumpInstructionKind::Br:
-      o << "br " << bb_true;
-      break;
-
     case JumpInstructionKind::BrCond:
-      o << "br " << cond_or_ret.value() << ", " << bb_true << ", " << bb_false;
+      if (kind == JumpInstructionKind::Br)
+        o << "br " << bb_true;
+      else
+        o << "br " << cond_or_ret.value() << ", " << bb_true << ", "
+          << bb_false;
       if (jump_kind == JumpKind::Branch)
         o << " if_branch";
       else if (jump_kind == JumpKind::Loop)
@@ -234,7 +244,16 @@ void MirFunction::display(std::ostream& o) const {
       if (i != params.begin()) o << ", ";
       o << **i;
     }
-    o << ") -> " << *return_ty << ";" << std::endl;
+    o << ") -> " << *return_ty;
+    if (variables.empty()) {
+      o << ";" << std::endl;
+    } else {
+      o << " {" << std::endl;
+      for (auto& i : variables) {
+        o << "\t" << VarId(i.first) << ": " << i.second << std::endl;
+      }
+      o << "}" << std::endl;
+    }
   } else {
     o << "fn " << name << "(";
     for (auto i = params.begin(); i != params.end(); i++) {
@@ -263,8 +282,28 @@ size_t MirFunction::variable_table_size() const {
 }
 
 void MirPackage::display(std::ostream& o) const {
-  for (auto& f : functions) {
-    o << f.second << std::endl;
+  for (auto& [name, val] : global_values) {
+    o << "global @" << name << ": ";
+    if (auto x = std::get_if<uint32_t>(&val)) {
+      o << "word " << *x;
+    } else if (auto x = std::get_if<std::vector<uint32_t>>(&val)) {
+      o << "words [";
+      for (size_t i = 0; i < x->size(); i++) {
+        if (i != 0) o << ", ";
+        o << (*x)[i];
+      }
+      o << "]";
+      if (val.len) o << " len " << val.len.value();
+    } else if (auto x = std::get_if<std::string>(&val)) {
+      o << (val.ty == arm::ConstType::AsciZ ? "asciz " : "label ")
+        << std::quoted(*x);
+    }
+    o << std::endl;
+  }
+  if (!global_values.empty()) o << std::endl;
+  for (auto& [name, f] : functions) {
+    if (name != f.name) o << "[" << name << "] ";
+    o << f << std::endl;
   }
 }
 
@@ -295,6 +334,12 @@ void ArrayTy::display(std::ostream& o) const {
   o << " x " << len << "]";
 }
 
+void VectorTy::display(std::ostream& o) const {
+  o << "<";
+  item->display(o);
+  o << " x " << len << ">";
+}
+
 void FunctionTy::display(std::ostream& o) const {
   o << "Fn(";
   for (auto i = params.begin(); i != params.end(); i++) {
@@ -314,6 +359,10 @@ std::shared_ptr<ArrayTy> new_array_ty(SharedTyPtr item, int len) {
   return std::make_shared<ArrayTy>(item, len);
 }
 
+std::shared_ptr<VectorTy> new_vector_ty(SharedTyPtr item, int len) {
+  return std::make_shared<VectorTy>(item, len);
+}
+
 std::shared_ptr<PtrTy> new_ptr_ty(SharedTyPtr item) {
   return std::make_shared<PtrTy>(item);
 }
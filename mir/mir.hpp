@@ -592,6 +592,8 @@ class BasicBlk : public prelude::Displayable {
   BasicBlk(BasicBlk&&) = default;
 };
 
+class DefUseChain;
+
 class MirFunction : public prelude::Displayable {
  public:
   std::string name;
@@ -605,9 +607,17 @@ class MirFunction : public prelude::Displayable {
   virtual void display(std::ostream& o) const;
   size_t variable_table_size() const;
 
+  /// Def-use index of this function, built on first use (see def_use.hpp)
+  DefUseChain& def_use();
+  /// Drop the def-use index; the next `def_use()` call rebuilds it
+  void invalidate_def_use() { def_use_chain.reset(); }
+
   MirFunction(const MirFunction& other) = delete;
   MirFunction(MirFunction&& other) = default;
   MirFunction& operator=(MirFunction&& other) = default;
+
+ private:
+  std::shared_ptr<DefUseChain> def_use_chain;
 };
 
 class MirPackage : public prelude::Displayable {
@@ -0,0 +1,444 @@
+#include <cctype>
+#include <iomanip>
+#include <optional>
+#include <sstream>
+#include <stdexcept>
+#include <string_view>
+
+#include "serialize.hpp"
+
+namespace mir::serial {
+using namespace mir::inst;
+using namespace mir::types;
+
+namespace {
+
+/// Line-oriented parser for the output of `MirPackage::display`
+class TextParser {
+ public:
+  TextParser(std::istream& i) : in(i) {}
+
+  MirPackage parse() {
+    MirPackage package;
+    while (next_line()) {
+      if (line.empty()) continue;
+      // Functions registered under a name other than their own
+      std::optional<std::string> key;
+      if (eat("[")) {
+        auto close = line.find(']', pos);
+        if (close == std::string::npos) fail("expected ']'");
+        key = line.substr(pos, close - pos);
+        pos = close;
+        expect("] ");
+      }
+      if (!key && eat("global @")) {
+        global(package);
+      } else if (eat("extern fn ")) {
+        auto f = function_header(true);
+        if (eat(" {")) {
+          end_of_line();
+          function_body(f);
+        } else {
+          expect(";");
+          end_of_line();
+        }
+        auto name = key.value_or(f.name);
+        package.functions.insert({name, std::move(f)});
+      } else if (eat("fn ")) {
+        auto f = function_header(false);
+        expect(" {");
+        end_of_line();
+        function_body(f);
+        auto name = key.value_or(f.name);
+        package.functions.insert({name, std::move(f)});
+      } else {
+        fail("expected a global or a function");
+      }
+    }
+    return package;
+  }
+
+ private:
+  // ==== Cursor helpers ====
+
+  bool next_line() {
+    if (!std::getline(in, line)) return false;
+    if (!line.empty() && line.back() == '\r') line.pop_back();
+    line_no++;
+    pos = 0;
+    return true;
+  }
+
+  [[noreturn]] void fail(const std::string& what) {
+    std::stringstream msg;
+    msg << "MIR parse error at line " << line_no << ", column " << pos + 1
+        << ": " << what;
+    throw std::runtime_error(msg.str());
+  }
+
+  std::string_view rest() const {
+    return std::string_view(line).substr(std::min(pos, line.size()));
+  }
+  bool at_end() const { return pos >= line.size(); }
+  char peek() const { return at_end() ? '\0' : line[pos]; }
+  bool starts_with(std::string_view s) const {
+    return rest().substr(0, s.size()) == s;
+  }
+  bool eat(std::string_view s) {
+    if (!starts_with(s)) return false;
+    pos += s.size();
+    return true;
+  }
+  void expect(std::string_view s) {
+    if (!eat(s)) fail("expected '" + std::string(s) + "'");
+  }
+  void end_of_line() {
+    if (!at_end()) fail("unexpected trailing text");
+  }
+
+  int64_t integer() {
+    auto start = pos;
+    if (peek() == '-') pos++;
+    while (std::isdigit(peek())) pos++;
+    if (pos == start || line[pos - 1] == '-') fail("expected an integer");
+    return std::stoll(line.substr(start, pos - start));
+  }
+
+  /// Reads up to (not including) the next space, or the end of line
+  std::string word() {
+    auto start = pos;
+    while (!at_end() && peek() != ' ') pos++;
+    return line.substr(start, pos - start);
+  }
+
+  std::string quoted() {
+    std::istringstream s{std::string(rest())};
+    std::string str;
+    if (!(s >> std::quoted(str))) fail("expected a quoted string");
+    pos += s.eof() ? rest().size() : (size_t)s.tellg();
+    return str;
+  }
+
+  // ==== Grammar ====
+
+  VarId var() {
+    if (eat("$")) return VarId(integer());
+    // `PRETTIFY_MIR_VAR` prints ids from 65536 on as `%n`
+    if (eat("%")) return VarId(integer() + 65536);
+    fail("expected a variable");
+  }
+
+  Value value() {
+    if (eat("(")) {
+      auto v = var();
+      expect(", ");
+      arm::RegisterShiftKind shift;
+      auto name = word();
+      if (name == "LSL") {
+        shift = arm::RegisterShiftKind::Lsl;
+      } else if (name == "LSR") {
+        shift = arm::RegisterShiftKind::Lsr;
+      } else if (name == "ASR") {
+        shift = arm::RegisterShiftKind::Asr;
+      } else if (name == "ROR") {
+        shift = arm::RegisterShiftKind::Ror;
+      } else if (name == "RRX") {
+        shift = arm::RegisterShiftKind::Rrx;
+      } else {
+        fail("unknown shift '" + name + "'");
+      }
+      expect(" ");
+      auto amount = integer();
+      expect(")");
+      return Value(v, shift, amount);
+    }
+    if (peek() == '$' || peek() == '%') return Value(var());
+    return Value((int32_t)integer());
+  }
+
+  SharedTyPtr ty() {
+    SharedTyPtr t;
+    if (eat("i32")) {
+      t = new_int_ty();
+    } else if (eat("void")) {
+      t = new_void_ty();
+    } else if (eat("...Rest")) {
+      t = std::make_shared<RestParamTy>();
+    } else if (eat("[")) {
+      auto item = ty();
+      expect(" x ");
+      auto len = integer();
+      expect("]");
+      t = new_array_ty(item, len);
+    } else if (eat("<")) {
+      auto item = ty();
+      expect(" x ");
+      auto len = integer();
+      expect(">");
+      t = new_vector_ty(item, len);
+    } else if (eat("Fn(")) {
+      auto params = ty_list();
+      expect(" -> ");
+      t = std::make_shared<FunctionTy>(ty(), std::move(params));
+    } else {
+      fail("expected a type");
+    }
+    while (eat("*")) t = new_ptr_ty(t);
+    return t;
+  }
+
+  /// Comma-separated types up to and including the closing paren
+  std::vector<SharedTyPtr> ty_list() {
+    std::vector<SharedTyPtr> tys;
+    if (eat(")")) return tys;
+    do {
+      tys.push_back(ty());
+    } while (eat(", "));
+    expect(")");
+    return tys;
+  }
+
+  MirFunction function_header(bool is_extern) {
+    auto open = line.find('(', pos);
+    if (open == std::string::npos) fail("expected '('");
+    auto name = line.substr(pos, open - pos);
+    pos = open + 1;
+    auto params = ty_list();
+    expect(" -> ");
+    auto ret = ty();
+    return MirFunction(
+        name, std::make_shared<FunctionTy>(ret, std::move(params), is_extern));
+  }
+
+  void function_body(MirFunction& f) {
+    BasicBlk* bb = nullptr;
+    while (next_line()) {
+      if (eat("}")) {
+        end_of_line();
+        if (bb) fail("basic block without a jump");
+        return;
+      }
+      if (eat("bb")) {
+        if (bb) fail("basic block without a jump");
+        LabelId id = integer();
+        expect(":");
+        auto [it, inserted] = f.basic_blks.insert({id, BasicBlk(id)});
+        if (!inserted) fail("duplicate basic block");
+        bb = &it->second;
+        if (eat("    // preceding: ")) {
+          while (!at_end()) {
+            bb->preceding.insert(integer());
+            if (!eat(", ")) break;
+          }
+        }
+        end_of_line();
+        continue;
+      }
+      expect("\t");
+      if (!bb) {
+        variable(f);
+      } else if (jump(bb->jump)) {
+        bb = nullptr;
+      } else {
+        bb->inst.push_back(inst());
+      }
+      end_of_line();
+    }
+    fail("unexpected end of file inside a function");
+  }
+
+  void variable(MirFunction& f) {
+    auto id = var();
+    expect(": ");
+    Variable v(eat("untyped") ? nullptr : ty());
+    if (eat(" memory (")) {
+      ty();
+      expect(")");
+      v.is_memory_var = true;
+    }
+    if (eat(" temp")) v.is_temp_var = true;
+    if (eat(" phi")) v.is_phi_var = true;
+    expect(", priority: ");
+    v.priority = integer();
+    f.variables.insert({id, std::move(v)});
+  }
+
+  /// Parses the jump closing a block, if this line is one
+  JumpKind jump_kind() {
+    if (eat(" if_branch")) return JumpKind::Branch;
+    if (eat(" loop")) return JumpKind::Loop;
+    return JumpKind::Undefined;
+  }
+
+  bool jump(JumpInstruction& j) {
+    if (eat("br ")) {
+      if (peek() == '$' || peek() == '%') {
+        auto cond = var();
+        expect(", ");
+        auto bb_true = integer();
+        expect(", ");
+        auto bb_false = integer();
+        j = JumpInstruction(JumpInstructionKind::BrCond, bb_true, bb_false,
+                            cond, jump_kind());
+      } else {
+        auto bb_true = integer();
+        j = JumpInstruction(JumpInstructionKind::Br, bb_true, -1, {},
+                            jump_kind());
+      }
+    } else if (eat("ret ")) {
+      if (eat("void")) {
+        j = JumpInstruction(JumpInstructionKind::Return);
+      } else {
+        j = JumpInstruction(JumpInstructionKind::Return, -1, -1, var());
+      }
+    } else if (eat("unreachable!")) {
+      j = JumpInstruction(JumpInstructionKind::Unreachable);
+    } else if (eat("undefined_jump!")) {
+      j = JumpInstruction(JumpInstructionKind::Undefined);
+    } else {
+      return false;
+    }
+    return true;
+  }
+
+  std::unique_ptr<Inst> inst() {
+    if (eat("store ")) {
+      auto val = value();
+      expect(" to ");
+      if (eat("[ ")) {
+        auto dest = var();
+        expect(" , ");
+        auto offset = value();
+        expect(" ]");
+        return std::make_unique<StoreOffsetInst>(val, dest, offset);
+      }
+      return std::make_unique<StoreInst>(val, var());
+    }
+
+    auto dest = var();
+    expect(" = ");
+    if (is_call()) {
+      auto open = line.find('(', pos);
+      auto func = line.substr(pos, open - pos);
+      pos = open + 1;
+      std::vector<Value> params;
+      if (!eat(")")) {
+        do {
+          params.push_back(value());
+        } while (eat(", "));
+        expect(")");
+      }
+      return std::make_unique<CallInst>(dest, func, std::move(params));
+    }
+    if (eat("load [ ")) {
+      auto src = value();
+      expect(" , ");
+      auto offset = value();
+      expect(" ]");
+      return std::make_unique<LoadOffsetInst>(src, dest, offset);
+    }
+    if (eat("load ")) return std::make_unique<LoadInst>(value(), dest);
+    if (eat("offset ")) {
+      auto ptr = var();
+      expect(" by ");
+      return std::make_unique<PtrOffsetInst>(dest, ptr, value());
+    }
+    if (eat("phi [")) {
+      std::vector<VarId> vars;
+      if (!eat("]")) {
+        do {
+          vars.push_back(var());
+        } while (eat(", "));
+        expect("]");
+      }
+      return std::make_unique<PhiInst>(dest, std::move(vars));
+    }
+    if (eat("&@")) {
+      auto name = std::string(rest());
+      pos = line.size();
+      return std::make_unique<RefInst>(dest, name);
+    }
+    if (eat("&")) return std::make_unique<RefInst>(dest, var());
+    for (auto [name, op] : {std::pair{"MulAdd ", OpAcc::MulAdd},
+                            std::pair{"MulShAdd ", OpAcc::MulShAdd}}) {
+      if (eat(name)) {
+        auto lhs = value();
+        expect(", ");
+        auto rhs = value();
+        expect(", ");
+        return std::make_unique<OpAccInst>(dest, lhs, rhs, var(), op);
+      }
+    }
+
+    auto lhs = value();
+    if (at_end()) return std::make_unique<AssignInst>(dest, lhs);
+    expect(" ");
+    auto op = binary_op(word());
+    expect(" ");
+    return std::make_unique<OpInst>(dest, lhs, value(), op);
+  }
+
+  /// Calls are the only instructions starting with `name(`
+  bool is_call() const {
+    if (at_end() || !(std::isalpha(peek()) || peek() == '_')) return false;
+    auto open = line.find('(', pos);
+    auto space = line.find(' ', pos);
+    return open != std::string::npos && open < space;
+  }
+
+  Op binary_op(const std::string& tok) {
+    static const std::pair<const char*, Op> ops[] = {
+        {"+", Op::Add},   {"-", Op::Sub},   {"*", Op::Mul},
+        {"/", Op::Div},   {"%", Op::Rem},   {"MulSh", Op::MulSh},
+        {">", Op::Gt},    {"<", Op::Lt},    {">=", Op::Gte},
+        {"<=", Op::Lte},  {"==", Op::Eq},   {"!=", Op::Neq},
+        {"&", Op::And},   {"|", Op::Or},    {"^", Op::Xor},
+        {"!", Op::Not},   {"<<", Op::Shl},  {">>>", Op::Shr},
+        {">>", Op::ShrA},
+    };
+    for (auto& [name, op] : ops) {
+      if (tok == name) return op;
+    }
+    fail("unknown operator '" + tok + "'");
+  }
+
+  void global(MirPackage& package) {
+    auto colon = line.find(": ", pos);
+    if (colon == std::string::npos) fail("expected ':'");
+    auto name = line.substr(pos, colon - pos);
+    pos = colon + 2;
+    arm::ConstValue val;
+    if (eat("word ")) {
+      val = arm::ConstValue((uint32_t)integer());
+    } else if (eat("words [")) {
+      std::vector<uint32_t> words;
+      if (!eat("]")) {
+        do {
+          words.push_back(integer());
+        } while (eat(", "));
+        expect("]");
+      }
+      val = arm::ConstValue(std::move(words));
+      if (eat(" len ")) val.len = integer();
+    } else if (eat("asciz ")) {
+      val = arm::ConstValue(quoted(), arm::ConstType::AsciZ);
+    } else if (eat("label ")) {
+      val = arm::ConstValue(quoted(), arm::ConstType::Word);
+    } else {
+      fail("unknown global value kind");
+    }
+    end_of_line();
+    package.global_values.insert({name, val});
+  }
+
+  std::istream& in;
+  std::string line;
+  size_t pos = 0;
+  int line_no = 0;
+};
+
+}  // namespace
+
+MirPackage read_text(std::istream& i) { return TextParser(i).parse(); }
+
+}  // namespace mir::serial
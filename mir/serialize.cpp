@@ -0,0 +1,507 @@
+#include "serialize.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+namespace mir::serial {
+using namespace mir::inst;
+using namespace mir::types;
+
+namespace {
+
+/// Instruction tags of the binary format. `InstKind` is not enough, since
+/// e.g. `LoadInst` and `LoadOffsetInst` share a kind.
+enum class InstTag : uint8_t {
+  Assign,
+  Op,
+  OpAcc,
+  Call,
+  Ref,
+  Load,
+  LoadOffset,
+  Store,
+  StoreOffset,
+  PtrOffset,
+  Phi,
+};
+
+enum class ConstTag : uint8_t { Word, Words, String };
+
+/// Written in place of a `TyKind` for variables without a type, which the
+/// frontend leaves on variables it reads but never defines
+const uint8_t NO_TY_TAG = 0xff;
+
+class Writer {
+ public:
+  Writer(std::ostream& o) : o(o) {}
+
+  void u8(uint8_t v) { o.put(v); }
+  void u32(uint32_t v) {
+    char buf[4] = {char(v), char(v >> 8), char(v >> 16), char(v >> 24)};
+    o.write(buf, 4);
+  }
+  void i32(int32_t v) { u32(v); }
+  void str(const std::string& s) {
+    u32(s.size());
+    o.write(s.data(), s.size());
+  }
+
+  void ty(const SharedTyPtr& t) {
+    if (!t) {
+      u8(NO_TY_TAG);
+      return;
+    }
+    u8((uint8_t)t->kind());
+    switch (t->kind()) {
+      case TyKind::Int:
+      case TyKind::Void:
+      case TyKind::RestParam:
+        break;
+      case TyKind::Array: {
+        auto x = std::static_pointer_cast<ArrayTy>(t);
+        ty(x->item);
+        i32(x->len);
+      } break;
+      case TyKind::Vector: {
+        auto x = std::static_pointer_cast<VectorTy>(t);
+        ty(x->item);
+        i32(x->len);
+      } break;
+      case TyKind::Ptr:
+        ty(std::static_pointer_cast<PtrTy>(t)->item);
+        break;
+      case TyKind::Fn:
+        fn_ty(*std::static_pointer_cast<FunctionTy>(t));
+        break;
+    }
+  }
+
+  void fn_ty(const FunctionTy& t) {
+    ty(t.ret);
+    u32(t.params.size());
+    for (auto& p : t.params) ty(p);
+    u8(t.is_extern);
+  }
+
+  void value(const Value& v) {
+    if (auto x = std::get_if<int32_t>(&v)) {
+      u8(0);
+      i32(*x);
+    } else {
+      u8(1);
+      u32(std::get<VarId>(v).id);
+    }
+    u8((uint8_t)v.shift);
+    u8(v.shift_amount);
+  }
+
+  void inst(Inst& i) {
+    if (auto x = dynamic_cast<AssignInst*>(&i)) {
+      u8((uint8_t)InstTag::Assign);
+      u32(x->dest);
+      value(x->src);
+    } else if (auto x = dynamic_cast<OpInst*>(&i)) {
+      u8((uint8_t)InstTag::Op);
+      u32(x->dest);
+      value(x->lhs);
+      value(x->rhs);
+      u8((uint8_t)x->op);
+    } else if (auto x = dynamic_cast<OpAccInst*>(&i)) {
+      u8((uint8_t)InstTag::OpAcc);
+      u32(x->dest);
+      value(x->lhs);
+      value(x->rhs);
+      u32(x->acc);
+      u8((uint8_t)x->op);
+    } else if (auto x = dynamic_cast<CallInst*>(&i)) {
+      u8((uint8_t)InstTag::Call);
+      u32(x->dest);
+      str(x->func);
+      u32(x->params.size());
+      for (auto& p : x->params) value(p);
+    } else if (auto x = dynamic_cast<RefInst*>(&i)) {
+      u8((uint8_t)InstTag::Ref);
+      u32(x->dest);
+      if (auto var = std::get_if<VarId>(&x->val)) {
+        u8(0);
+        u32(*var);
+      } else {
+        u8(1);
+        str(std::get<std::string>(x->val));
+      }
+    } else if (auto x = dynamic_cast<LoadInst*>(&i)) {
+      u8((uint8_t)InstTag::Load);
+      u32(x->dest);
+      value(x->src);
+    } else if (auto x = dynamic_cast<LoadOffsetInst*>(&i)) {
+      u8((uint8_t)InstTag::LoadOffset);
+      u32(x->dest);
+      value(x->src);
+      value(x->offset);
+    } else if (auto x = dynamic_cast<StoreInst*>(&i)) {
+      u8((uint8_t)InstTag::Store);
+      u32(x->dest);
+      value(x->val);
+    } else if (auto x = dynamic_cast<StoreOffsetInst*>(&i)) {
+      u8((uint8_t)InstTag::StoreOffset);
+      u32(x->dest);
+      value(x->val);
+      value(x->offset);
+    } else if (auto x = dynamic_cast<PtrOffsetInst*>(&i)) {
+      u8((uint8_t)InstTag::PtrOffset);
+      u32(x->dest);
+      u32(x->ptr);
+      value(x->offset);
+    } else if (auto x = dynamic_cast<PhiInst*>(&i)) {
+      u8((uint8_t)InstTag::Phi);
+      u32(x->dest);
+      u32(x->ori_var);
+      u32(x->vars.size());
+      for (auto v : x->vars) u32(v);
+    } else {
+      throw std::logic_error("unknown MIR instruction");
+    }
+  }
+
+  void jump(const JumpInstruction& j) {
+    u8((uint8_t)j.kind);
+    i32(j.bb_true);
+    i32(j.bb_false);
+    u8(j.cond_or_ret.has_value());
+    u32(j.cond_or_ret.has_value() ? j.cond_or_ret->id : 0);
+    u8((uint8_t)j.jump_kind);
+  }
+
+  void function(const MirFunction& f) {
+    str(f.name);
+    fn_ty(*f.type);
+    u32(f.variables.size());
+    for (auto& [id, var] : f.variables) {
+      u32(id);
+      ty(var.ty);
+      u8(var.is_memory_var | var.is_temp_var << 1 | var.is_phi_var << 2);
+      i32(var.priority);
+    }
+    u32(f.basic_blks.size());
+    for (auto& [id, bb] : f.basic_blks) {
+      i32(id);
+      u32(bb.preceding.size());
+      for (auto p : bb.preceding) i32(p);
+      u32(bb.inst.size());
+      for (auto& i : bb.inst) inst(*i);
+      jump(bb.jump);
+    }
+  }
+
+  void const_value(const arm::ConstValue& c) {
+    if (auto x = std::get_if<uint32_t>(&c)) {
+      u8((uint8_t)ConstTag::Word);
+      u32(*x);
+    } else if (auto x = std::get_if<std::vector<uint32_t>>(&c)) {
+      u8((uint8_t)ConstTag::Words);
+      u32(x->size());
+      for (auto w : *x) u32(w);
+    } else {
+      u8((uint8_t)ConstTag::String);
+      str(std::get<std::string>(c));
+    }
+    u8((uint8_t)c.ty);
+    u8(c.len.has_value());
+    i32(c.len.value_or(0));
+  }
+
+ private:
+  std::ostream& o;
+};
+
+class Reader {
+ public:
+  Reader(const uint8_t* data, size_t len) : p(data), end(data + len) {}
+
+  uint8_t u8() {
+    need(1);
+    return *p++;
+  }
+  uint32_t u32() {
+    need(4);
+    uint32_t v = p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+    p += 4;
+    return v;
+  }
+  int32_t i32() { return u32(); }
+  bool boolean() { return u8() != 0; }
+  std::string str() {
+    auto len = u32();
+    need(len);
+    std::string s((const char*)p, len);
+    p += len;
+    return s;
+  }
+  /// Element count of a sequence whose elements take at least one byte each
+  uint32_t count() {
+    auto n = u32();
+    need(n);
+    return n;
+  }
+  bool at_end() const { return p == end; }
+
+  SharedTyPtr ty() {
+    auto tag = u8();
+    if (tag == NO_TY_TAG) return nullptr;
+    auto kind = (TyKind)tag;
+    switch (kind) {
+      case TyKind::Int:
+        return new_int_ty();
+      case TyKind::Void:
+        return new_void_ty();
+      case TyKind::RestParam:
+        return std::make_shared<RestParamTy>();
+      case TyKind::Array: {
+        auto item = ty();
+        return new_array_ty(item, i32());
+      }
+      case TyKind::Vector: {
+        auto item = ty();
+        return new_vector_ty(item, i32());
+      }
+      case TyKind::Ptr:
+        return new_ptr_ty(ty());
+      case TyKind::Fn:
+        return fn_ty();
+    }
+    throw std::runtime_error("invalid type tag in MIR file");
+  }
+
+  std::shared_ptr<FunctionTy> fn_ty() {
+    auto ret = ty();
+    std::vector<SharedTyPtr> params;
+    for (auto n = count(); n > 0; n--) params.push_back(ty());
+    auto is_extern = boolean();
+    return std::make_shared<FunctionTy>(ret, std::move(params), is_extern);
+  }
+
+  Value value() {
+    auto is_var = boolean();
+    auto payload = u32();
+    auto shift = (arm::RegisterShiftKind)u8();
+    auto shift_amount = u8();
+    std::variant<int32_t, VarId> val = (int32_t)payload;
+    if (is_var) val = VarId(payload);
+    return Value(val, shift, shift_amount);
+  }
+
+  std::unique_ptr<Inst> inst() {
+    auto tag = (InstTag)u8();
+    VarId dest = u32();
+    switch (tag) {
+      case InstTag::Assign:
+        return std::make_unique<AssignInst>(dest, value());
+      case InstTag::Op: {
+        auto lhs = value();
+        auto rhs = value();
+        return std::make_unique<OpInst>(dest, lhs, rhs, (Op)u8());
+      }
+      case InstTag::OpAcc: {
+        auto lhs = value();
+        auto rhs = value();
+        VarId acc = u32();
+        return std::make_unique<OpAccInst>(dest, lhs, rhs, acc, (OpAcc)u8());
+      }
+      case InstTag::Call: {
+        auto func = str();
+        std::vector<Value> params;
+        for (auto n = count(); n > 0; n--) params.push_back(value());
+        return std::make_unique<CallInst>(dest, func, std::move(params));
+      }
+      case InstTag::Ref:
+        if (boolean()) return std::make_unique<RefInst>(dest, str());
+        return std::make_unique<RefInst>(dest, VarId(u32()));
+      case InstTag::Load:
+        return std::make_unique<LoadInst>(value(), dest);
+      case InstTag::LoadOffset: {
+        auto src = value();
+        return std::make_unique<LoadOffsetInst>(src, dest, value());
+      }
+      case InstTag::Store:
+        return std::make_unique<StoreInst>(value(), dest);
+      case InstTag::StoreOffset: {
+        auto val = value();
+        return std::make_unique<StoreOffsetInst>(val, dest, value());
+      }
+      case InstTag::PtrOffset: {
+        VarId ptr = u32();
+        return std::make_unique<PtrOffsetInst>(dest, ptr, value());
+      }
+      case InstTag::Phi: {
+        VarId ori_var = u32();
+        std::vector<VarId> vars;
+        for (auto n = count(); n > 0; n--) vars.push_back(u32());
+        auto phi = std::make_unique<PhiInst>(dest, std::move(vars));
+        phi->ori_var = ori_var;
+        return phi;
+      }
+    }
+    throw std::runtime_error("invalid instruction tag in MIR file");
+  }
+
+  JumpInstruction jump() {
+    auto kind = (JumpInstructionKind)u8();
+    auto bb_true = i32();
+    auto bb_false = i32();
+    auto has_cond = boolean();
+    VarId cond = u32();
+    auto jump_kind = (JumpKind)u8();
+    return JumpInstruction(kind, bb_true, bb_false,
+                           has_cond ? std::optional(cond) : std::nullopt,
+                           jump_kind);
+  }
+
+  MirFunction function() {
+    auto name = str();
+    MirFunction f(name, fn_ty());
+    for (auto n = count(); n > 0; n--) {
+      auto id = u32();
+      auto var_ty = ty();
+      auto flags = u8();
+      Variable var(var_ty, flags & 1, flags & 2, flags & 4);
+      var.priority = i32();
+      f.variables.insert({id, std::move(var)});
+    }
+    for (auto n = count(); n > 0; n--) {
+      BasicBlk bb(i32());
+      for (auto m = count(); m > 0; m--) bb.preceding.insert(i32());
+      for (auto m = count(); m > 0; m--) bb.inst.push_back(inst());
+      bb.jump = jump();
+      auto id = bb.id;
+      f.basic_blks.insert({id, std::move(bb)});
+    }
+    return f;
+  }
+
+  arm::ConstValue const_value() {
+    arm::ConstValue c;
+    auto tag = (ConstTag)u8();
+    if (tag == ConstTag::Word) {
+      c = arm::ConstValue(u32());
+    } else if (tag == ConstTag::Words) {
+      std::vector<uint32_t> words;
+      for (auto n = count(); n > 0; n--) words.push_back(u32());
+      c = arm::ConstValue(std::move(words));
+    } else if (tag == ConstTag::String) {
+      c = arm::ConstValue(str());
+    } else {
+      throw std::runtime_error("invalid constant tag in MIR file");
+    }
+    c.ty = (arm::ConstType)u8();
+    auto has_len = boolean();
+    auto len = i32();
+    if (has_len) c.len = len;
+    return c;
+  }
+
+ private:
+  void need(size_t n) {
+    if ((size_t)(end - p) < n) throw std::runtime_error("truncated MIR file");
+  }
+
+  const uint8_t* p;
+  const uint8_t* end;
+};
+
+}  // namespace
+
+void write_binary(const MirPackage& package, std::ostream& o) {
+  Writer w(o);
+  o.write(MIR_BINARY_MAGIC, sizeof(MIR_BINARY_MAGIC));
+  w.u32(MIR_BINARY_VERSION);
+  w.u32(package.global_values.size());
+  for (auto& [name, val] : package.global_values) {
+    w.str(name);
+    w.const_value(val);
+  }
+  w.u32(package.functions.size());
+  for (auto& [name, f] : package.functions) {
+    // Not always `f.name`: the frontend registers some library functions
+    // under their SysY name too
+    w.str(name);
+    w.function(f);
+  }
+}
+
+MirPackage read_binary(const uint8_t* data, size_t len) {
+  if (len < sizeof(MIR_BINARY_MAGIC) ||
+      std::memcmp(data, MIR_BINARY_MAGIC, sizeof(MIR_BINARY_MAGIC)) != 0) {
+    throw std::runtime_error("not a binary MIR file");
+  }
+  Reader r(data + sizeof(MIR_BINARY_MAGIC), len - sizeof(MIR_BINARY_MAGIC));
+  if (r.u32() != MIR_BINARY_VERSION) {
+    throw std::runtime_error("unsupported binary MIR version");
+  }
+  MirPackage package;
+  for (auto n = r.count(); n > 0; n--) {
+    auto name = r.str();
+    package.global_values.insert({name, r.const_value()});
+  }
+  for (auto n = r.count(); n > 0; n--) {
+    auto name = r.str();
+    package.functions.insert({name, r.function()});
+  }
+  if (!r.at_end()) throw std::runtime_error("trailing data in MIR file");
+  return package;
+}
+
+void write_text(const MirPackage& package, std::ostream& o) {
+  package.display(o);
+}
+
+void save_package(const MirPackage& package, const std::string& path,
+                  bool text) {
+  std::ofstream o(path, std::ios::binary);
+  if (!o) throw std::runtime_error("cannot open " + path + " for writing");
+  if (text) {
+    write_text(package, o);
+  } else {
+    write_binary(package, o);
+  }
+}
+
+MirPackage load_package(const std::string& path) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) throw std::runtime_error("cannot open " + path);
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    throw std::runtime_error("cannot stat " + path);
+  }
+  size_t len = st.st_size;
+  void* data = MAP_FAILED;
+  if (len >= sizeof(MIR_BINARY_MAGIC)) {
+    data = mmap(nullptr, len, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  close(fd);
+
+  if (data != MAP_FAILED &&
+      std::memcmp(data, MIR_BINARY_MAGIC, sizeof(MIR_BINARY_MAGIC)) == 0) {
+    try {
+      auto package = read_binary((const uint8_t*)data, len);
+      munmap(data, len);
+      return package;
+    } catch (...) {
+      munmap(data, len);
+      throw;
+    }
+  }
+  if (data != MAP_FAILED) munmap(data, len);
+
+  std::ifstream i(path);
+  return read_text(i);
+}
+
+}  // namespace mir::serial
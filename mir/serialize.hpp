@@ -0,0 +1,45 @@
+#pragma once
+
+#include <cstdint>
+#include <istream>
+#include <ostream>
+#include <string>
+
+#include "mir.hpp"
+
+/// Reading and writing whole `MirPackage`s, so the backend can be run on MIR
+/// dumped by an earlier compiler invocation.
+///
+/// Two formats are supported:
+///
+/// - Binary: a flat little-endian encoding starting with `MIR_BINARY_MAGIC`.
+///   Every field has a fixed width and strings are length-prefixed, so a file
+///   can be decoded straight out of an `mmap`ed buffer.
+/// - Text: exactly what `MirPackage::display` prints.
+///
+/// Neither format carries backend `extra_data`; passes producing it must be
+/// rerun after loading.
+namespace mir::serial {
+
+const char MIR_BINARY_MAGIC[4] = {'M', 'I', 'R', 'B'};
+const uint32_t MIR_BINARY_VERSION = 1;
+
+void write_binary(const inst::MirPackage& package, std::ostream& o);
+/// Decodes a binary package from `[data, data + len)`. Throws
+/// `std::runtime_error` on malformed input.
+inst::MirPackage read_binary(const uint8_t* data, size_t len);
+
+/// Same as `package.display(o)`
+void write_text(const inst::MirPackage& package, std::ostream& o);
+/// Parses the output of `MirPackage::display`. Throws `std::runtime_error`
+/// with the offending line number on malformed input.
+inst::MirPackage read_text(std::istream& i);
+
+/// Writes `package` to `path`, in text form if `text` is set
+void save_package(const inst::MirPackage& package, const std::string& path,
+                  bool text);
+/// Loads a package from `path`, detecting the format by its magic number.
+/// Binary files are mapped into memory instead of being read.
+inst::MirPackage load_package(const std::string& path);
+
+}  // namespace mir::serial
@@ -164,6 +164,9 @@ std::shared_ptr<VoidTy> new_void_ty();
 /// Create a new ArrayTy behind shared pointer
 std::shared_ptr<ArrayTy> new_array_ty(SharedTyPtr item, int len);
 
+/// Create a new VectorTy behind shared pointer
+std::shared_ptr<VectorTy> new_vector_ty(SharedTyPtr item, int len);
+
 /// Create a new PtrTy behind shared pointer
 std::shared_ptr<PtrTy> new_ptr_ty(SharedTyPtr item);
 
@@ -0,0 +1,612 @@
+#include "value_range.hpp"
+
+#include <algorithm>
+
+namespace mir::inst {
+
+using types::LabelId;
+
+namespace {
+
+const uint32_t SIGN = 0x80000000u;
+/// Times a phi may grow before it widens to the whole range
+const int WIDEN_AFTER = 2;
+/// Rounds after which the analysis gives up and knows nothing
+const int MAX_ROUNDS = 64;
+
+// Comparisons as sets of the relations `<`, `==` and `>` they accept
+const uint32_t LESS = 1;
+const uint32_t EQUAL = 2;
+const uint32_t GREATER = 4;
+
+std::optional<uint32_t> relations(Op op) {
+  switch (op) {
+    case Op::Lt:
+      return LESS;
+    case Op::Lte:
+      return LESS | EQUAL;
+    case Op::Gt:
+      return GREATER;
+    case Op::Gte:
+      return GREATER | EQUAL;
+    case Op::Eq:
+      return EQUAL;
+    case Op::Neq:
+      return LESS | GREATER;
+    default:
+      return {};
+  }
+}
+
+/// The relations of `b` to `a`, given those of `a` to `b`
+uint32_t swapped(uint32_t rel) {
+  return (rel & EQUAL) | (rel & LESS ? GREATER : 0) |
+         (rel & GREATER ? LESS : 0);
+}
+
+bool same_value(const Value& a, const Value& b) {
+  if (a.is_immediate() || b.is_immediate()) {
+    return a.is_immediate() && b.is_immediate() &&
+           std::get<int32_t>(a) == std::get<int32_t>(b);
+  }
+  if (std::get<VarId>(a) != std::get<VarId>(b)) return false;
+  if (!a.has_shift() || !b.has_shift()) return !a.has_shift() && !b.has_shift();
+  return a.shift == b.shift && a.shift_amount == b.shift_amount;
+}
+
+/// Bits up to the highest set bit of `x`
+uint32_t mask_upto(uint32_t x) {
+  if (x == 0) return 0;
+  auto width = 32 - __builtin_clz(x);
+  return width == 32 ? UINT32_MAX : (1u << width) - 1;
+}
+
+/// Low bits known in both `a` and `b`, as a mask
+uint32_t known_low_bits(const ValueInfo& a, const ValueInfo& b) {
+  auto unknown = ~(a.zeros | a.ones) | ~(b.zeros | b.ones);
+  if (unknown == 0) return UINT32_MAX;
+  auto n = __builtin_ctz(unknown);
+  return n == 0 ? 0 : (1u << n) - 1;
+}
+
+/// Low bits of a result whose low bits are `value` wherever `mask` is set
+ValueInfo low_bits(uint32_t value, uint32_t mask) {
+  return ValueInfo::bits(~value & mask, value & mask);
+}
+
+/// Brings the range and the bits of `v` in line with each other; none if
+/// they contradict
+std::optional<ValueInfo> tidy(ValueInfo v) {
+  if (v.lo > v.hi || (v.zeros & v.ones)) return {};
+  if (v.lo == v.hi) {
+    v.zeros |= ~uint32_t(v.lo);
+    v.ones |= uint32_t(v.lo);
+  } else if (v.lo >= 0) {
+    v.zeros |= ~mask_upto(v.hi);
+  } else if (v.hi < 0) {
+    v.ones |= ~mask_upto(~uint32_t(v.lo));
+  }
+  if (v.zeros & v.ones) return {};
+  // The smallest value sets the sign bit if it can, the largest clears it
+  auto least = int32_t(v.ones | (~v.zeros & SIGN));
+  auto most = int32_t((~v.zeros & ~SIGN) | (v.ones & SIGN));
+  v.lo = std::max(v.lo, least);
+  v.hi = std::min(v.hi, most);
+  if (v.lo > v.hi) return {};
+  return v;
+}
+
+ValueInfo shift_left(const ValueInfo& a, uint32_t k) {
+  if (k == 0) return a;
+  if (k >= 32) return ValueInfo::of(0);
+  auto res = ValueInfo::bits((a.zeros << k) | ((1u << k) - 1), a.ones << k);
+  return res.meet(
+      ValueInfo::range(int64_t(a.lo) * (1ll << k), int64_t(a.hi) * (1ll << k)));
+}
+
+ValueInfo shift_right(const ValueInfo& a, uint32_t k) {
+  if (k == 0) return a;
+  if (k >= 32) return ValueInfo::of(0);
+  auto res = ValueInfo::bits((a.zeros >> k) | ~(UINT32_MAX >> k), a.ones >> k);
+  if (!a.non_negative()) return res;
+  return res.meet(ValueInfo::range(a.lo >> k, a.hi >> k));
+}
+
+ValueInfo shift_right_arith(const ValueInfo& a, uint32_t k) {
+  k = std::min(k, 31u);
+  auto res = ValueInfo::bits(uint32_t(int32_t(a.zeros) >> k),
+                             uint32_t(int32_t(a.ones) >> k));
+  return res.meet(ValueInfo::range(a.lo >> k, a.hi >> k));
+}
+
+ValueInfo apply_shift(const Value& val, const ValueInfo& a) {
+  if (!val.has_shift()) return a;
+  switch (val.shift) {
+    case arm::RegisterShiftKind::Lsl:
+      return shift_left(a, val.shift_amount);
+    case arm::RegisterShiftKind::Lsr:
+      return shift_right(a, val.shift_amount);
+    case arm::RegisterShiftKind::Asr:
+      return shift_right_arith(a, val.shift_amount);
+    default:
+      return ValueInfo();
+  }
+}
+
+/// The smallest and largest of `lo * hi` over the corners of two ranges
+std::pair<int64_t, int64_t> product_bounds(const ValueInfo& a,
+                                           const ValueInfo& b) {
+  int64_t corners[] = {int64_t(a.lo) * b.lo, int64_t(a.lo) * b.hi,
+                       int64_t(a.hi) * b.lo, int64_t(a.hi) * b.hi};
+  return {*std::min_element(std::begin(corners), std::end(corners)),
+          *std::max_element(std::begin(corners), std::end(corners))};
+}
+
+/// Relations `a` may have to `b`
+uint32_t possible_relations(const ValueInfo& a, const ValueInfo& b) {
+  uint32_t rel = 0;
+  if (a.lo < b.hi) rel |= LESS;
+  if (a.hi > b.lo) rel |= GREATER;
+  if (a.lo <= b.hi && b.lo <= a.hi &&
+      !((a.ones & b.zeros) | (a.zeros & b.ones))) {
+    rel |= EQUAL;
+  }
+  return rel;
+}
+
+ValueInfo widen(const ValueInfo& old, const ValueInfo& grown) {
+  auto res = old.join(grown);
+  if (res.lo < old.lo) res.lo = INT32_MIN;
+  if (res.hi > old.hi) res.hi = INT32_MAX;
+  return tidy(res).value_or(ValueInfo());
+}
+
+}  // namespace
+
+// ==== ValueInfo ====
+
+ValueInfo ValueInfo::of(int32_t value) {
+  ValueInfo res;
+  res.lo = res.hi = value;
+  res.zeros = ~uint32_t(value);
+  res.ones = uint32_t(value);
+  return res;
+}
+
+ValueInfo ValueInfo::range(int64_t lo, int64_t hi) {
+  if (lo < INT32_MIN || hi > INT32_MAX || lo > hi) return ValueInfo();
+  ValueInfo res;
+  res.lo = lo;
+  res.hi = hi;
+  return tidy(res).value_or(ValueInfo());
+}
+
+ValueInfo ValueInfo::bits(uint32_t zeros, uint32_t ones) {
+  ValueInfo res;
+  res.zeros = zeros;
+  res.ones = ones;
+  return tidy(res).value_or(ValueInfo());
+}
+
+bool ValueInfo::is_full() const {
+  return lo == INT32_MIN && hi == INT32_MAX && zeros == 0 && ones == 0;
+}
+
+std::optional<int32_t> ValueInfo::constant() const {
+  if (lo != hi) return {};
+  return lo;
+}
+
+uint32_t ValueInfo::known_trailing_zeros() const {
+  return zeros == UINT32_MAX ? 32 : __builtin_ctz(~zeros);
+}
+
+ValueInfo ValueInfo::join(const ValueInfo& other) const {
+  ValueInfo res;
+  res.lo = std::min(lo, other.lo);
+  res.hi = std::max(hi, other.hi);
+  res.zeros = zeros & other.zeros;
+  res.ones = ones & other.ones;
+  return tidy(res).value_or(ValueInfo());
+}
+
+ValueInfo ValueInfo::meet(const ValueInfo& other) const {
+  ValueInfo res;
+  res.lo = std::max(lo, other.lo);
+  res.hi = std::min(hi, other.hi);
+  res.zeros = zeros | other.zeros;
+  res.ones = ones | other.ones;
+  return tidy(res).value_or(*this);
+}
+
+bool ValueInfo::operator==(const ValueInfo& other) const {
+  return lo == other.lo && hi == other.hi && zeros == other.zeros &&
+         ones == other.ones;
+}
+
+// ==== ValueRanges ====
+
+ValueRanges::ValueRanges(MirFunction& func) : func(func), forest(func) {
+  for (auto& [id, blk] : func.basic_blks) {
+    for (uint32_t i = 0; i < blk.inst.size(); i++) {
+      auto inst = blk.inst[i].get();
+      if (dynamic_cast<StoreInst*>(inst) ||
+          dynamic_cast<StoreOffsetInst*>(inst)) {
+        continue;
+      }
+      auto [it, inserted] = defs.insert({inst->dest, inst});
+      if (!inserted) it->second = nullptr;
+      def_blocks[inst->dest] = id;
+      positions[inst->dest] = i;
+    }
+  }
+
+  auto& dom = forest.dom_tree();
+  for (auto id : dom.reverse_postorder()) {
+    auto& list = facts[id];
+    auto& preds = dom.preds(id);
+    if (preds.size() == 1) {
+      list = facts.at(preds[0]);
+      auto edge = edge_facts(preds[0], id);
+      list.insert(list.end(), edge.begin(), edge.end());
+    } else if (auto idom = dom.idom(id)) {
+      list = facts.at(*idom);
+    }
+  }
+
+  solve();
+  clamp_induction_variables();
+  if (!clamps.empty()) solve();
+}
+
+ValueInfo ValueRanges::info(const Value& val) const {
+  if (auto imm = std::get_if<int32_t>(&val)) return ValueInfo::of(*imm);
+  auto it = values.find(std::get<VarId>(val));
+  if (it == values.end()) return ValueInfo();
+  return apply_shift(val, it->second);
+}
+
+ValueInfo ValueRanges::info_at(const Value& val, LabelId blk) const {
+  auto it = facts.find(blk);
+  if (it == facts.end()) return info(val);
+  return refine(val, it->second);
+}
+
+std::optional<bool> ValueRanges::compare(Op op, const Value& lhs,
+                                         const Value& rhs, LabelId blk) const {
+  static const std::vector<Fact> none;
+  auto it = facts.find(blk);
+  return decide(op, lhs, rhs, it == facts.end() ? none : it->second);
+}
+
+void ValueRanges::solve() {
+  values.clear();
+  std::unordered_map<VarId, int> updates;
+  auto& rpo = forest.dom_tree().reverse_postorder();
+  for (int round = 0;; round++) {
+    if (round == MAX_ROUNDS) {
+      values.clear();
+      return;
+    }
+    bool changed = false;
+    for (auto id : rpo) {
+      for (auto& inst : func.basic_blks.at(id).inst) {
+        auto var = inst->dest;
+        if (!tracked(var) || defs.at(var) != inst.get()) continue;
+        auto res = evaluate(*inst, id);
+        if (!res) continue;
+        auto it = values.find(var);
+        if (it != values.end() && inst->inst_kind() == InstKind::Phi) {
+          res = ++updates[var] > WIDEN_AFTER ? widen(it->second, *res)
+                                             : it->second.join(*res);
+        }
+        auto clamp = clamps.find(var);
+        if (clamp != clamps.end()) res = res->meet(clamp->second);
+        if (it != values.end() && it->second == *res) continue;
+        values[var] = *res;
+        changed = true;
+      }
+    }
+    if (!changed) return;
+  }
+}
+
+void ValueRanges::clamp_induction_variables() {
+  for (auto& loop : forest.loops()) {
+    auto trip = forest.trip_count(loop, func);
+    if (!trip || !tracked(trip->iv)) continue;
+    auto init = info(trip->init);
+    if (loop.entering.size() == 1) {
+      auto list = facts[loop.entering[0]];
+      auto edge = edge_facts(loop.entering[0], loop.header);
+      list.insert(list.end(), edge.begin(), edge.end());
+      init = refine(trip->init, list);
+    }
+    auto bound = info_at(trip->bound, trip->exiting);
+    int64_t step = trip->step;
+    auto cmp = trip->cmp;
+    if (cmp == Op::Neq && step == 1 && init.hi <= bound.lo) cmp = Op::Lt;
+    if (cmp == Op::Neq && step == -1 && init.lo >= bound.hi) cmp = Op::Gt;
+
+    // The values `iv` takes are `init` and the steps from the values that
+    // passed the exit test, as long as no step wraps around
+    ValueInfo clamp;
+    if (step > 0 && (cmp == Op::Lt || cmp == Op::Lte)) {
+      int64_t passing = int64_t(bound.hi) - (cmp == Op::Lt);
+      int64_t hi = trip->tests_next ? std::max<int64_t>(init.hi, passing)
+                                    : passing + step;
+      if ((trip->tests_next ? hi : passing) + step > INT32_MAX) continue;
+      clamp = ValueInfo::range(init.lo, std::max<int64_t>(init.hi, hi));
+    } else if (step < 0 && (cmp == Op::Gt || cmp == Op::Gte)) {
+      int64_t passing = int64_t(bound.lo) + (cmp == Op::Gt);
+      int64_t lo = trip->tests_next ? std::min<int64_t>(init.lo, passing)
+                                    : passing + step;
+      if ((trip->tests_next ? lo : passing) + step < INT32_MIN) continue;
+      clamp = ValueInfo::range(std::min<int64_t>(init.lo, lo), init.hi);
+    }
+    if (!clamp.is_full()) clamps[trip->iv] = clamp;
+  }
+}
+
+std::optional<ValueInfo> ValueRanges::evaluate(Inst& inst, LabelId blk) const {
+  if (auto x = dynamic_cast<PhiInst*>(&inst)) return evaluate_phi(*x, blk);
+  if (auto x = dynamic_cast<AssignInst*>(&inst)) return info_at(x->src, blk);
+  auto x = dynamic_cast<OpInst*>(&inst);
+  if (!x) return ValueInfo();
+
+  if (relations(x->op)) {
+    if (auto res = compare(x->op, x->lhs, x->rhs, blk)) {
+      return ValueInfo::of(*res);
+    }
+    return ValueInfo::range(0, 1);
+  }
+  auto a = info_at(x->lhs, blk);
+  auto b = info_at(x->rhs, blk);
+  auto amount = b.constant();
+  switch (x->op) {
+    case Op::Add: {
+      auto low = known_low_bits(a, b);
+      return low_bits(a.ones + b.ones, low)
+          .meet(ValueInfo::range(int64_t(a.lo) + b.lo, int64_t(a.hi) + b.hi));
+    }
+    case Op::Sub: {
+      auto low = known_low_bits(a, b);
+      return low_bits(a.ones - b.ones, low)
+          .meet(ValueInfo::range(int64_t(a.lo) - b.hi, int64_t(a.hi) - b.lo));
+    }
+    case Op::Mul: {
+      auto tz = std::min(a.known_trailing_zeros() + b.known_trailing_zeros(),
+                         32u);
+      auto res = low_bits(a.ones * b.ones, known_low_bits(a, b))
+                     .meet(ValueInfo::bits(
+                         tz == 32 ? UINT32_MAX : (1u << tz) - 1, 0));
+      auto [lo, hi] = product_bounds(a, b);
+      return res.meet(ValueInfo::range(lo, hi));
+    }
+    case Op::MulSh: {
+      auto [lo, hi] = product_bounds(a, b);
+      return ValueInfo::range(lo >> 32, hi >> 32);
+    }
+    case Op::Div: {
+      if (amount && *amount != 0) {
+        int64_t c = *amount;
+        auto lo = a.lo / c, hi = a.hi / c;
+        return ValueInfo::range(std::min(lo, hi), std::max(lo, hi));
+      }
+      if (a.non_negative() && b.lo > 0) {
+        return ValueInfo::range(a.lo / b.hi, a.hi / b.lo);
+      }
+      return ValueInfo();
+    }
+    case Op::Rem: {
+      if (b.lo <= 0 && b.hi >= 0) return ValueInfo();
+      // `|a % b| < |b|`, and the result takes the sign of `a`
+      auto m = std::max(std::abs(int64_t(b.lo)), std::abs(int64_t(b.hi))) - 1;
+      if (a.non_negative()) {
+        if (b.lo > 0 && a.hi < b.lo) return a;
+        return ValueInfo::range(0, std::min<int64_t>(a.hi, m));
+      }
+      if (a.hi <= 0) return ValueInfo::range(std::max<int64_t>(a.lo, -m), 0);
+      return ValueInfo::range(-m, m);
+    }
+    case Op::And: {
+      auto res = ValueInfo::bits(a.zeros | b.zeros, a.ones & b.ones);
+      if (a.non_negative()) res = res.meet(ValueInfo::range(0, a.hi));
+      if (b.non_negative()) res = res.meet(ValueInfo::range(0, b.hi));
+      return res;
+    }
+    case Op::Or:
+      return ValueInfo::bits(a.zeros & b.zeros, a.ones | b.ones);
+    case Op::Xor:
+      return ValueInfo::bits((a.zeros & b.zeros) | (a.ones & b.ones),
+                             (a.zeros & b.ones) | (a.ones & b.zeros));
+    case Op::Not:
+      return ValueInfo::bits(a.ones, a.zeros)
+          .meet(ValueInfo::range(~a.hi, ~a.lo));
+    case Op::Shl:
+      if (!amount || *amount < 0 || *amount >= 32) return ValueInfo();
+      return shift_left(a, *amount);
+    case Op::Shr:
+      if (!amount || *amount < 0 || *amount >= 32) return ValueInfo();
+      return shift_right(a, *amount);
+    case Op::ShrA:
+      if (!amount || *amount < 0 || *amount >= 32) return ValueInfo();
+      return shift_right_arith(a, *amount);
+    default:
+      return ValueInfo();
+  }
+}
+
+std::optional<ValueInfo> ValueRanges::evaluate_phi(PhiInst& phi,
+                                                   LabelId blk) const {
+  auto& dom = forest.dom_tree();
+  std::optional<ValueInfo> res;
+  auto add = [&](const ValueInfo& v) { res = res ? res->join(v) : v; };
+  // Operands with no value yet come in by edges not known to run
+  auto ready = [&](VarId var) { return !tracked(var) || values.count(var); };
+
+  for (auto var : phi.vars) {
+    auto def = defs.find(var);
+    if (def != defs.end() && !def->second) return ValueInfo();
+  }
+  for (auto pred : dom.preds(blk)) {
+    // The value coming in from `pred` is the operand defined last on the way
+    // there, which is the one defined in the nearest dominator of `pred`
+    std::optional<VarId> incoming;
+    for (std::optional<LabelId> at = pred; at && !incoming;
+         at = dom.idom(*at)) {
+      for (auto var : phi.vars) {
+        auto def = def_blocks.find(var);
+        if (def == def_blocks.end() || def->second != *at) continue;
+        if (!incoming || positions.at(var) > positions.at(*incoming)) {
+          incoming = var;
+        }
+      }
+    }
+    if (!incoming) {
+      for (auto var : phi.vars) {
+        if (ready(var)) add(info(var));
+      }
+      continue;
+    }
+    if (!ready(*incoming)) continue;
+    auto list = facts.at(pred);
+    auto edge = edge_facts(pred, blk);
+    list.insert(list.end(), edge.begin(), edge.end());
+    add(refine(*incoming, list));
+  }
+  return res;
+}
+
+ValueInfo ValueRanges::refine(const Value& val,
+                              const std::vector<Fact>& facts) const {
+  if (val.is_immediate()) return info(val);
+  auto var = std::get<VarId>(val);
+  auto res = info(var);
+  for (auto& fact : facts) {
+    if (fact.cond == var) {
+      res = fact.holds ? res.meet(ValueInfo::range(res.lo == 0 ? 1 : res.lo,
+                                                   res.hi == 0 ? -1 : res.hi))
+                       : res.meet(ValueInfo::of(0));
+      continue;
+    }
+    auto cmp = comparison(fact.cond);
+    if (!cmp) continue;
+    auto rel = *relations(cmp->op);
+    if (!fact.holds) rel ^= LESS | EQUAL | GREATER;
+    // Either side may be `var` itself, or `var` plus a constant as left by
+    // unrolled and rotated loops
+    for (int side = 0; side < 2; side++) {
+      auto offset = offset_from(side ? cmp->rhs : cmp->lhs, var);
+      if (!offset) continue;
+      int64_t c = *offset;
+      if (int64_t(res.lo) + c < INT32_MIN || int64_t(res.hi) + c > INT32_MAX) {
+        continue;
+      }
+      auto side_rel = side ? swapped(rel) : rel;
+
+      // The tested side lies in the union of the parts of the range allowed
+      // by `side_rel`
+      auto b = info(side ? cmp->lhs : cmp->rhs);
+      int64_t lo = INT64_MAX, hi = INT64_MIN;
+      if ((side_rel & LESS) && b.hi > INT32_MIN) {
+        lo = INT32_MIN;
+        hi = std::max<int64_t>(hi, int64_t(b.hi) - 1);
+      }
+      if (side_rel & EQUAL) {
+        lo = std::min<int64_t>(lo, b.lo);
+        hi = std::max<int64_t>(hi, b.hi);
+      }
+      if ((side_rel & GREATER) && b.lo < INT32_MAX) {
+        lo = std::min<int64_t>(lo, int64_t(b.lo) + 1);
+        hi = INT32_MAX;
+      }
+      if (lo > hi) continue;
+      if (side_rel == EQUAL && c == 0) {
+        res = res.meet(b);
+      } else if (side_rel == (LESS | GREATER) && b.constant()) {
+        if (res.lo + c == *b.constant()) lo = res.lo + c + 1;
+        if (res.hi + c == *b.constant()) hi = res.hi + c - 1;
+      }
+      res = res.meet(ValueInfo::range(std::max<int64_t>(lo - c, INT32_MIN),
+                                      std::min<int64_t>(hi - c, INT32_MAX)));
+    }
+  }
+  return apply_shift(val, res);
+}
+
+std::optional<bool> ValueRanges::decide(Op op, const Value& lhs,
+                                        const Value& rhs,
+                                        const std::vector<Fact>& facts) const {
+  auto want = relations(op);
+  if (!want) return {};
+  auto rel = possible_relations(refine(lhs, facts), refine(rhs, facts));
+  // The same comparison made on the way here
+  for (auto& fact : facts) {
+    auto cmp = comparison(fact.cond);
+    if (!cmp) continue;
+    auto known = *relations(cmp->op);
+    if (!fact.holds) known ^= LESS | EQUAL | GREATER;
+    if (same_value(cmp->lhs, lhs) && same_value(cmp->rhs, rhs)) {
+      rel &= known;
+    } else if (same_value(cmp->lhs, rhs) && same_value(cmp->rhs, lhs)) {
+      rel &= swapped(known);
+    }
+  }
+  if (rel == 0) return {};
+  if ((rel & *want) == rel) return true;
+  if ((rel & *want) == 0) return false;
+  return {};
+}
+
+std::vector<ValueRanges::Fact> ValueRanges::edge_facts(LabelId from,
+                                                       LabelId to) const {
+  auto& jump = func.basic_blks.at(from).jump;
+  if (jump.kind != JumpInstructionKind::BrCond ||
+      jump.bb_true == jump.bb_false || !jump.cond_or_ret) {
+    return {};
+  }
+  return {{*jump.cond_or_ret, to == jump.bb_true}};
+}
+
+bool ValueRanges::tracked(VarId var) const {
+  auto def = defs.find(var);
+  if (def == defs.end() || !def->second) return false;
+  auto it = func.variables.find(var.id);
+  return it != func.variables.end() && it->second.ty &&
+         it->second.ty->kind() == types::TyKind::Int;
+}
+
+std::optional<int64_t> ValueRanges::offset_from(const Value& val,
+                                                VarId var) const {
+  if (val.is_immediate() || val.has_shift()) return {};
+  auto tested = std::get<VarId>(val);
+  if (tested == var) return 0;
+  auto def = defs.find(tested);
+  if (def == defs.end() || !def->second) return {};
+  auto x = dynamic_cast<const OpInst*>(def->second);
+  if (!x) return {};
+  auto is_var = [&](const Value& v) {
+    return !v.is_immediate() && !v.has_shift() && std::get<VarId>(v) == var;
+  };
+  if (x->op == Op::Add && is_var(x->lhs) && x->rhs.is_immediate()) {
+    return std::get<int32_t>(x->rhs);
+  }
+  if (x->op == Op::Add && x->lhs.is_immediate() && is_var(x->rhs)) {
+    return std::get<int32_t>(x->lhs);
+  }
+  if (x->op == Op::Sub && is_var(x->lhs) && x->rhs.is_immediate()) {
+    return -int64_t(std::get<int32_t>(x->rhs));
+  }
+  return {};
+}
+
+const OpInst* ValueRanges::comparison(VarId cond) const {
+  auto def = defs.find(cond);
+  if (def == defs.end() || !def->second) return nullptr;
+  auto x = dynamic_cast<const OpInst*>(def->second);
+  if (!x || !relations(x->op)) return nullptr;
+  return x;
+}
+
+}  // namespace mir::inst
@@ -0,0 +1,114 @@
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <unordered_map>
+#include <vector>
+
+#include "loop.hpp"
+#include "mir.hpp"
+
+namespace mir::inst {
+
+/// What is known about a 32-bit value: a signed range it lies in, and the
+/// bits it is known to have cleared or set. Both halves are kept consistent
+/// with each other, so either can be read on its own.
+struct ValueInfo {
+  int32_t lo = INT32_MIN;
+  int32_t hi = INT32_MAX;
+  /// Bits known to be 0
+  uint32_t zeros = 0;
+  /// Bits known to be 1
+  uint32_t ones = 0;
+
+  static ValueInfo of(int32_t value);
+  /// `[lo, hi]`, or anything if it leaves the `i32` range
+  static ValueInfo range(int64_t lo, int64_t hi);
+  static ValueInfo bits(uint32_t zeros, uint32_t ones);
+
+  bool is_full() const;
+  bool non_negative() const { return lo >= 0; }
+  std::optional<int32_t> constant() const;
+  /// Trailing bits known to be 0
+  uint32_t known_trailing_zeros() const;
+
+  /// Anything either of them may hold
+  ValueInfo join(const ValueInfo& other) const;
+  /// Only what both of them may hold. `*this` if they contradict each
+  /// other, which happens only on paths that never run.
+  ValueInfo meet(const ValueInfo& other) const;
+
+  bool operator==(const ValueInfo& other) const;
+  bool operator!=(const ValueInfo& other) const { return !(*this == other); }
+};
+
+/// Value ranges and known bits of the integer variables of a function.
+///
+/// Ranges are propagated forward over the SSA graph, in reverse postorder
+/// until nothing changes; phis at the heads of cycles widen to the whole
+/// `i32` range once they keep growing. Induction variables of counted loops
+/// are then clamped between their initial value and the bound they are
+/// compared against, and everything is propagated once more.
+///
+/// Within a block, a variable also obeys the comparisons guarding it: the
+/// branches on the way there that the block is dominated by, and for phi
+/// operands the branch of the edge they come in by. A comparison `a op b`
+/// narrows both `a` and `b`, and `x` where `a` is `x` plus a constant; a
+/// branch on a plain variable tells whether it is zero.
+///
+/// Variables that are not `int`, are defined more than once, or are
+/// parameters can hold anything. The analysis is a snapshot: it keys on
+/// variables and blocks, so it stays valid as long as the definitions it saw
+/// and the CFG do, and new variables are simply unknown.
+class ValueRanges {
+ public:
+  ValueRanges(MirFunction& func);
+
+  /// What `val`, shift included, holds wherever it is defined
+  ValueInfo info(const Value& val) const;
+  /// What `val` holds in `blk`
+  ValueInfo info_at(const Value& val, types::LabelId blk) const;
+  /// Result of the comparison `lhs op rhs` in `blk`, if it is known
+  std::optional<bool> compare(Op op, const Value& lhs, const Value& rhs,
+                              types::LabelId blk) const;
+
+ private:
+  /// A comparison known to come out as `holds`
+  struct Fact {
+    VarId cond;
+    bool holds;
+  };
+
+  void solve();
+  void clamp_induction_variables();
+  /// None while nothing is known to reach it
+  std::optional<ValueInfo> evaluate(Inst& inst, types::LabelId blk) const;
+  std::optional<ValueInfo> evaluate_phi(PhiInst& phi,
+                                        types::LabelId blk) const;
+  /// What `val` holds given `facts`
+  ValueInfo refine(const Value& val, const std::vector<Fact>& facts) const;
+  std::optional<bool> decide(Op op, const Value& lhs, const Value& rhs,
+                             const std::vector<Fact>& facts) const;
+  /// What the branch ending `from` tells on its way to `to`
+  std::vector<Fact> edge_facts(types::LabelId from, types::LabelId to) const;
+  bool tracked(VarId var) const;
+  /// `c` if `val` is `var + c`
+  std::optional<int64_t> offset_from(const Value& val, VarId var) const;
+  const OpInst* comparison(VarId cond) const;
+
+  MirFunction& func;
+  LoopForest forest;
+  std::unordered_map<VarId, ValueInfo> values;
+  /// Ranges of induction variables, from the loops they count
+  std::unordered_map<VarId, ValueInfo> clamps;
+  /// Facts holding throughout each block
+  std::unordered_map<types::LabelId, std::vector<Fact>> facts;
+  /// Block defining each variable with a single definition
+  std::unordered_map<VarId, types::LabelId> def_blocks;
+  /// Position of each definition in its block
+  std::unordered_map<VarId, uint32_t> positions;
+  /// Definitions, with null for variables defined more than once
+  std::unordered_map<VarId, Inst*> defs;
+};
+
+}  // namespace mir::inst
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <optional>
 #include <set>
 #include <string>
 #include <vector>
@@ -13,6 +14,17 @@ struct Options {
   bool dry_run;
   std::optional<std::set<std::string>> run_pass;
   std::set<std::string> skip_pass;
+
+  /// `in_file` is a MIR dump instead of SysY source
+  bool load_mir;
+  /// Skip MIR passes before this index; used with `load_mir`
+  size_t resume_mir_at;
+  /// Write MIR here right before MIR pass number `dump_mir_at` runs
+  std::optional<std::string> dump_mir;
+  size_t dump_mir_at;
+  bool dump_mir_text;
+  /// Print what the MIR passes did once they are done
+  bool show_pass_statistics;
 };
 
 extern Options global_options;